@@ -0,0 +1,94 @@
+; Application processor startup. INIT-SIPI-SIPI starts each AP in real mode
+; at SMP_TRAMPOLINE_ADDR, where smp_init() copies this code. It goes straight
+; to long mode on the kernel's page tables and jumps to ap_main() with the
+; parameters smp_init() left in smp_trampoline_params.
+
+bits 16
+
+%define SMP_TRAMPOLINE_ADDR 0x8000
+; Where a label ends up once the trampoline has been copied into place
+%define TRAMPOLINE(label) (SMP_TRAMPOLINE_ADDR + (label) - smp_trampoline_start)
+
+section .text
+global smp_trampoline_start, smp_trampoline_end, smp_trampoline_params
+
+smp_trampoline_start:
+    cli
+    cld
+    xor ax, ax
+    mov ds, ax
+    mov es, ax
+    mov ss, ax
+
+    o32 lgdt [TRAMPOLINE(trampoline_gdtr)]
+
+    mov eax, cr0
+    or eax, 1
+    mov cr0, eax
+
+    jmp dword 0x18:TRAMPOLINE(trampoline_32)
+
+bits 32
+trampoline_32:
+    mov ax, 0x20
+    mov ds, ax
+    mov es, ax
+    mov ss, ax
+
+    ; Same CR4 as the boot CPU, which includes PAE and the SSE enables
+    mov eax, [TRAMPOLINE(trampoline_cr4)]
+    mov cr4, eax
+
+    mov eax, [TRAMPOLINE(trampoline_cr3)]
+    mov cr3, eax
+
+    ; Long mode, plus NX and SYSCALL if the boot CPU has them on
+    mov ecx, 0xC0000080
+    mov eax, [TRAMPOLINE(trampoline_efer)]
+    xor edx, edx
+    wrmsr
+
+    ; Turns paging on, which activates long mode
+    mov eax, [TRAMPOLINE(trampoline_cr0)]
+    mov cr0, eax
+
+    jmp 0x08:TRAMPOLINE(trampoline_64)
+
+bits 64
+trampoline_64:
+    mov ax, 0x10
+    mov ds, ax
+    mov es, ax
+    mov ss, ax
+    xor ax, ax
+    mov fs, ax
+    mov gs, ax
+
+    mov rsp, [TRAMPOLINE(trampoline_stack)]
+    mov rdi, [TRAMPOLINE(trampoline_cpu)]
+    mov rax, [TRAMPOLINE(trampoline_entry)]
+    push 0 ; fake return address, so the stack is aligned like after a call
+    jmp rax
+
+align 16
+trampoline_gdt:
+    dq 0
+    dq 0x00AF9A000000FFFF ; 0x08: 64-bit code, matches the kernel's GDT
+    dq 0x00CF92000000FFFF ; 0x10: data
+    dq 0x00CF9A000000FFFF ; 0x18: 32-bit code
+    dq 0x00CF92000000FFFF ; 0x20: 32-bit data
+trampoline_gdtr:
+    dw trampoline_gdtr - trampoline_gdt - 1
+    dd TRAMPOLINE(trampoline_gdt)
+
+; Filled in by smp_init() for each AP, see smp_trampoline_params_t
+align 8
+smp_trampoline_params:
+trampoline_cr3: dd 0
+trampoline_cr4: dd 0
+trampoline_cr0: dd 0
+trampoline_efer: dd 0
+trampoline_stack: dq 0
+trampoline_entry: dq 0
+trampoline_cpu: dq 0
+smp_trampoline_end:
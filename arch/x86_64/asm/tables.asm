@@ -1,6 +1,10 @@
 bits 64
 default rel
 
+; Offsets into percpu_t, see percpu.h. GS points at it while in the kernel.
+%define PERCPU_USER_RSP 0x10
+%define PERCPU_SYSCALL_STACK_TOP 0x18
+
 section .text
 global load_gdt, load_tss, load_idt, load_gdt_initial
 
@@ -10,8 +14,7 @@ load_gdt_initial:
     mov ax, 0x10
     mov ds, ax
     mov es, ax
-    mov fs, ax
-    mov gs, ax
+    ; FS and GS are left alone, loading them would clear the GS base
     mov ss, ax
     ret
 
@@ -24,8 +27,8 @@ load_idt:
     ret
 
 load_tss:
-    ; TSS is the 3rd entry in the GDT (0-indexed)
-    mov rax, 0x18
+    ; rdi holds the TSS selector, 0x18 on the boot CPU
+    mov rax, rdi
     ltr ax      ; Load TSS
     ret
 
@@ -99,6 +102,15 @@ ISR_NOERRCODE 31
     push r15
 %endmacro
 
+; Switch to the kernel's GS base if the interrupted code was in user mode.
+; %1 is where the saved CS sits relative to RSP.
+%macro SWAPGS_IF_USER 1
+    test qword [rsp + %1], 3
+    jz %%kernel
+    swapgs
+%%kernel:
+%endmacro
+
 %macro popa64 0
     pop r15
     pop r14
@@ -119,16 +131,17 @@ ISR_NOERRCODE 31
 
 extern fault_handler
 isr_common_stub:
+    SWAPGS_IF_USER 24
     pusha64
-    fxsave [xmm_regs]
     mov rdi, rsp ; Give the C function the address of the registers
     mov rsi, 0 ; Clear the register
     mov rsi, cr2 ; Get address of fault, if there was a page fault
     call fault_handler
-    fxrstor [xmm_regs]
     popa64
     ; Jump over the error code and the interrupt number
     add rsp, 0x10
+    ; and back to the user's GS base if that's where we're returning to
+    SWAPGS_IF_USER 8
     iretq
 
 
@@ -158,18 +171,25 @@ IRQ 13
 IRQ 14
 IRQ 15
 
+; The LAPIC raises this when an interrupt goes away before it is delivered.
+; It must not be acknowledged, so just return.
+global spurious_irq
+spurious_irq:
+    iretq
+
 extern irq_handler
 
 irq_common_stub:
+    SWAPGS_IF_USER 24
     pusha64
-    fxsave [xmm_regs]
     mov rdi, rsp ; Give the C function the address of the registers
     mov rsi, 0 ; We don't need to pass anything in cr2
     call irq_handler
-    fxrstor [xmm_regs]
     popa64
     ; Jump over the error code and the interrupt number
     add rsp, 0x10
+    ; the handler may have switched processes, so check the CS we return to
+    SWAPGS_IF_USER 8
     iretq
 
 
@@ -203,11 +223,13 @@ irq_common_stub:
 global syscall_handler_asm
 extern syscall_handler
 syscall_handler_asm:
-    cli ; Disable interrupts
+    cli ; FMASK clears IF too, syscall_handler turns it back on once we're set up
+    swapgs ; GS now points at this CPU's percpu_t
 
-    ; Save the old RSP
-    mov qword [syscall_old_rsp], rsp
-    mov rsp, syscall_stack_top
+    ; Save the old RSP and move onto the process' own kernel stack,
+    ; schedule() keeps PERCPU_SYSCALL_STACK_TOP pointing at it
+    mov qword [gs:PERCPU_USER_RSP], rsp
+    mov rsp, qword [gs:PERCPU_SYSCALL_STACK_TOP]
 
     ; Should be fine to do actual syscall now!
     ; We need to follow the C struct layout for the registers so we can use
@@ -215,14 +237,13 @@ syscall_handler_asm:
 
     ; We have to push dummy values for the registers that are not used, SS and CS, notably
     push 0 ; SS
-    push qword [syscall_old_rsp]
+    push qword [gs:PERCPU_USER_RSP]
     pushfq
     push 0 ; CS
     push 0 ; RIP
     push 0 ; Error code
     push 0 ; int_no
     pusha64
-    fxsave [xmm_regs]
 
     ; Give one argument, the address of the registers
     mov rdi, rsp
@@ -233,15 +254,26 @@ after_syscall:
     mov rsp, rax ; return value is new regs pointer
 
     ; Pop the registers (rax in the regs_t struct has been set to the return value)
-    fxrstor [xmm_regs]
+    ; FPU and SSE state is left to fpu.c
     popa64
 
-    mov rsp, qword [syscall_old_rsp]
+    mov rsp, qword [gs:PERCPU_USER_RSP]
+    swapgs
 
     ; Return from the syscall
     o64 sysret
 
 
+; Leave the kernel through an interrupt frame built somewhere other than
+; by an interrupt, rdi points at the regs_t
+global interrupt_return
+interrupt_return:
+    mov rsp, rdi
+    popa64
+    add rsp, 0x10
+    SWAPGS_IF_USER 8
+    iretq
+
 global jump_to_usermode
 jump_to_usermode:
     cli
@@ -252,6 +284,8 @@ jump_to_usermode:
     mov ax, 0x2B
     mov ds, ax
     mov es, ax
+    ; put the kernel's GS base away before loading GS clears it
+    swapgs
     mov fs, ax
     mov gs, ax
     ; SS is handled by iret
@@ -286,20 +320,3 @@ read_rip:
     ret
 
 
-
-
-section .data
-global syscall_stack
-global syscall_stack_top
-; Small temporary stack for syscalls to get to C code
-syscall_stack:
-    times 4096 db 0
-syscall_stack_top:
-
-global syscall_old_rsp
-syscall_old_rsp: dq 0
-
-global xmm_regs
-align 16
-xmm_regs:
-    times 512 db 0
\ No newline at end of file
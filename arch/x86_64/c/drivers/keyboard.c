@@ -22,6 +22,9 @@
 #include <keyboard.h>
 #include <serial.h>
 #include <tty.h>
+#include <process.h>
+#include <waitqueue.h>
+#include <softirq.h>
 
 volatile uint8_t keypress_buffer_size = 0;
 
@@ -33,6 +36,9 @@ uint64_t allocated_keypress_buffer_size = 0;
 
 device_t kbd_device = {0};
 
+// Woken when a key is added to the buffer
+wait_queue_t keyboard_wait = WAIT_QUEUE_INIT(keyboard_wait);
+
 const char kbdcodes[128] =
     {
         0, 27, '1', '2', '3', '4', '5', '6', '7', '8',    /* 9 */
@@ -147,6 +153,7 @@ void keyboard_addchar(char c) {
 
     keypress_buffer[keypress_buffer_size] = c;
     keypress_buffer_size++;
+    wait_queue_wake(&keyboard_wait);
 
     tty_addchar_internal(c);
 }
@@ -192,12 +199,8 @@ void keyboard_addcode(uint8_t scancode) {
 char keyboard_popchar(bool blocking)
 {
     if (blocking) {
-        while (keypress_buffer_size == 0)
-        {
-            // wait for a keypress
-            ASM_ENABLE_INTERRUPTS;
-        }
-        ASM_DISABLE_INTERRUPTS;
+        // sleep until the keyboard IRQ adds something
+        wait_event(&keyboard_wait, keypress_buffer_size != 0);
     } else {
         if (keypress_buffer_size == 0) {
             return 0;
@@ -220,11 +223,15 @@ char keyboard_popchar(bool blocking)
     return c;
 }
 
-// keyboard (hardware keyboard, uninitialized PS2 at the moment)
-void keyboard_interrupt_handler(regs_t *r)
+// Scancodes from the IRQ handler waiting for keyboard_softirq(). Only the
+// handler writes head and only the softirq writes tail.
+#define SCANCODE_RING_SIZE 64
+volatile uint8_t scancode_ring[SCANCODE_RING_SIZE];
+volatile uint32_t scancode_head = 0;
+volatile uint32_t scancode_tail = 0;
+
+static void keyboard_scancode(uint8_t scancode)
 {
-    UNUSED(r);
-    uint8_t scancode = inb(0x60);
     if (scancode & 0x80)
     {
         // key released
@@ -250,6 +257,29 @@ void keyboard_interrupt_handler(regs_t *r)
     }
 }
 
+// Turns the queued scancodes into characters, which can allocate and echo
+static void keyboard_softirq()
+{
+    while (scancode_tail != scancode_head)
+    {
+        keyboard_scancode(scancode_ring[scancode_tail % SCANCODE_RING_SIZE]);
+        scancode_tail++;
+    }
+}
+
+// keyboard (hardware keyboard, uninitialized PS2 at the moment)
+void keyboard_interrupt_handler(regs_t *r)
+{
+    UNUSED(r);
+    uint8_t scancode = inb(0x60);
+    if (scancode_head - scancode_tail < SCANCODE_RING_SIZE)
+    {
+        scancode_ring[scancode_head % SCANCODE_RING_SIZE] = scancode;
+        scancode_head++;
+    }
+    softirq_raise(SOFTIRQ_KEYBOARD);
+}
+
 uint8_t keyboard_getcode()
 {
     if (keypress_buffer_size > 0)
@@ -276,7 +306,6 @@ size_t kbd_device_read(void *ptr, size_t nmemb, size_t count, void *unused1, voi
 {
     UNUSED(unused1);
     UNUSED(unused2);
-    UNUSED(flags);
 
     size_t size = nmemb * count;
 
@@ -284,37 +313,35 @@ size_t kbd_device_read(void *ptr, size_t nmemb, size_t count, void *unused1, voi
     
     // todo: works, but bad. need to fix this
     // that will probably come with the proper tty implementation
-    char code = keyboard_popchar(false);
     while (true) {
-        if (code != 0) {
-            if (code == '\b') {
-                if (written > 0) {
-                    written--;
-                    *(char *)(ptr + written) = 0;
-                } else {
-                    // we just output the backspace, assuming that the other side will handle it
-                    *(char *)(ptr + written) = code;
-                    written++;
-                }
-                kprintf("\b \b");
+        char code = keyboard_popchar(!(flags & O_NONBLOCK));
+        if (code == 0) {
+            // nothing buffered and we aren't allowed to wait
+            if (written == 0) {
+                return -EAGAIN;
+            }
+            return written;
+        }
+
+        if (code == '\b') {
+            if (written > 0) {
+                written--;
+                *(char *)(ptr + written) = 0;
             } else {
+                // we just output the backspace, assuming that the other side will handle it
                 *(char *)(ptr + written) = code;
                 written++;
-                kprintf("%c", code);
-                if (written >= size || code == '\n') {
-                    return written;
-                }
+            }
+            kprintf("\b \b");
+        } else {
+            *(char *)(ptr + written) = code;
+            written++;
+            kprintf("%c", code);
+            if (written >= size || code == '\n') {
+                return written;
             }
         }
-        code = keyboard_popchar(false);
     }
-
-    // may be a better idea to make this blocking? depends. will see what comes of this
-    if (written == 0) {
-        return -EAGAIN;
-    }
-
-    return written;
 }
 
 pointer_int_t keyboard_open(char *path, uint64_t flags, void *device_passed) {
@@ -351,6 +378,7 @@ int kbd_stat(void *file_entry, void *buf, void *device_passed) {
 
 void keyboard_install()
 {
+    softirq_register(SOFTIRQ_KEYBOARD, keyboard_softirq);
     register_interrupt_handler(1, keyboard_interrupt_handler);
 
     //init buffer/vars
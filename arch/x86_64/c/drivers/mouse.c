@@ -6,6 +6,7 @@
 #include <system.h>
 #include <tables.h>
 #include <unused.h>
+#include <workqueue.h>
 
 #define PS2_GET_COMPAQ_STATUS 0x20
 #define PS2_SET_COMPAQ_STATUS 0x60
@@ -50,21 +51,68 @@ uint8_t mouse_receive() {
     return inb(MOUSE_PORT_DATA);
 }
 
+// Packets from the IRQ handler waiting for mouse_decode(). Only the handler
+// writes mouse_head and only the work item writes mouse_tail.
+#define MOUSE_RING_SIZE 16
+volatile uint8_t mouse_ring[MOUSE_RING_SIZE][3];
+volatile uint32_t mouse_head = 0;
+volatile uint32_t mouse_tail = 0;
+
+// The packet being assembled, one byte per IRQ
+uint8_t mouse_packet[3];
+uint8_t mouse_cycle = 0;
+
+// Pointer state, accumulated from every packet
+int32_t mouse_x = 0;
+int32_t mouse_y = 0;
+uint8_t mouse_buttons = 0;
+
+void mouse_decode(work_t *work) {
+    UNUSED(work);
+
+    while (mouse_tail != mouse_head) {
+        volatile uint8_t *bytes = mouse_ring[mouse_tail % MOUSE_RING_SIZE];
+
+        // bits 6 and 7 mean the movement overflowed, so it's meaningless
+        if (!(bytes[0] & 0xC0)) {
+            // the 9th bit of each movement is in the first byte
+            int32_t dx = bytes[1] - ((bytes[0] << 4) & 0x100);
+            int32_t dy = bytes[2] - ((bytes[0] << 3) & 0x100);
+            mouse_x += dx;
+            mouse_y += dy;
+            mouse_buttons = bytes[0] & 0x7;
+
+            // kprintf("Mouse movement: x=%d, y=%d\n", dx, dy);
+        }
+        mouse_tail++;
+    }
+}
+
+work_t mouse_work = WORK_INIT(mouse_work, mouse_decode);
+
 void mouse_handler(regs_t *r) {
     UNUSED(r);
-    
-    // Read the mouse data
-    uint8_t bytes[3];
-    for (int i = 0; i < 3; i++) {
-        bytes[i] = mouse_receive();
+
+    // the IRQ means a byte is waiting, so there's nothing to poll for
+    uint8_t byte = inb(MOUSE_PORT_DATA);
+
+    // the first byte always has bit 3 set, resynchronise on anything else
+    if (mouse_cycle == 0 && !(byte & 0x8)) {
+        return;
     }
-    // check if either bit 3 is unset (not valid) or bits 6 and 7 are set (weird)
-    if (!(bytes[0] & 0x8) || (bytes[0] & 0xC0)) {
+    mouse_packet[mouse_cycle++] = byte;
+    if (mouse_cycle < 3) {
         return;
     }
+    mouse_cycle = 0;
 
-    // Print the mouse data
-    // kprintf("Mouse movement: x=%d, y=%d\n", (int8_t)bytes[1], (int8_t)bytes[2]);
+    if (mouse_head - mouse_tail < MOUSE_RING_SIZE) {
+        for (int i = 0; i < 3; i++) {
+            mouse_ring[mouse_head % MOUSE_RING_SIZE][i] = mouse_packet[i];
+        }
+        mouse_head++;
+    }
+    schedule_work(&mouse_work);
 }
 
 void mouse_init() {
@@ -0,0 +1,212 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include <acpi.h>
+#include <system.h>
+#include <memory.h>
+#include <string.h>
+#include <serial.h>
+
+madt_info_t madt_info;
+
+acpi_rsdp_t acpi_rsdp;
+bool acpi_rsdp_found = false;
+
+static bool acpi_checksum(const void *data, size_t length)
+{
+    uint8_t sum = 0;
+    for (size_t i = 0; i < length; i++)
+    {
+        sum += ((const uint8_t *)data)[i];
+    }
+    return sum == 0;
+}
+
+/**
+ * Record the RSDP handed over by the bootloader. Multiboot only gives a
+ * copy, so it's copied again before the boot information is reclaimed.
+ *
+ * @param rsdp The RSDP copy from the multiboot ACPI tag
+ * @param size Size of the copy
+ */
+void acpi_set_rsdp(const void *rsdp, size_t size)
+{
+    if (size > sizeof(acpi_rsdp))
+    {
+        size = sizeof(acpi_rsdp);
+    }
+
+    // prefer the ACPI 2.0 copy if both tags are present
+    if (acpi_rsdp_found && acpi_rsdp.revision >= 2 && size < sizeof(acpi_rsdp))
+    {
+        return;
+    }
+
+    memset(&acpi_rsdp, 0, sizeof(acpi_rsdp));
+    memcpy(&acpi_rsdp, rsdp, size);
+    acpi_rsdp_found = true;
+}
+
+// Look for the RSDP in the BIOS areas, for when the bootloader didn't pass it
+static bool acpi_scan_rsdp()
+{
+    uint64_t ebda = (uint64_t)*(uint16_t *)(VIRT_MEM_OFFSET + 0x40E) << 4;
+    uint64_t ranges[2][2] = { { ebda, ebda + 0x400 }, { 0xE0000, 0x100000 } };
+
+    for (int r = 0; r < 2; r++)
+    {
+        if (ranges[r][0] == 0)
+        {
+            continue;
+        }
+
+        for (uint64_t addr = ranges[r][0]; addr < ranges[r][1]; addr += 16)
+        {
+            acpi_rsdp_t *candidate = (acpi_rsdp_t *)(addr + VIRT_MEM_OFFSET);
+            if (strncmp(candidate->signature, ACPI_RSDP_SIGNATURE, 8) == 0 && acpi_checksum(candidate, 20))
+            {
+                acpi_set_rsdp(candidate, candidate->revision >= 2 ? sizeof(acpi_rsdp_t) : 20);
+                return true;
+            }
+        }
+    }
+
+    return false;
+}
+
+// Map a whole table, given where its header is. ACPI tables can be
+// anywhere in physical memory, so they go through the MMIO window.
+static acpi_header_t *acpi_map_table(uint64_t phys)
+{
+    acpi_header_t *header = (acpi_header_t *)kmap_mmio(phys, sizeof(acpi_header_t));
+    return (acpi_header_t *)kmap_mmio(phys, header->length);
+}
+
+/**
+ * Find an ACPI table through the RSDT or XSDT.
+ *
+ * @param signature The table's four character signature
+ *
+ * @return The mapped table, or NULL if it doesn't exist or is corrupt
+ */
+acpi_header_t *acpi_find_table(const char *signature)
+{
+    if (!acpi_rsdp_found)
+    {
+        return NULL;
+    }
+
+    bool xsdt = acpi_rsdp.revision >= 2 && acpi_rsdp.xsdt_address != 0;
+    acpi_header_t *root = acpi_map_table(xsdt ? acpi_rsdp.xsdt_address : acpi_rsdp.rsdt_address);
+    if (!acpi_checksum(root, root->length))
+    {
+        serial_printf("ACPI: bad root table checksum\n");
+        return NULL;
+    }
+
+    size_t entry_size = xsdt ? 8 : 4;
+    size_t count = (root->length - sizeof(acpi_header_t)) / entry_size;
+    uint8_t *entries = (uint8_t *)root + sizeof(acpi_header_t);
+
+    for (size_t i = 0; i < count; i++)
+    {
+        uint64_t phys = xsdt ? *(uint64_t *)(entries + i * 8) : *(uint32_t *)(entries + i * 4);
+        acpi_header_t *header = (acpi_header_t *)kmap_mmio(phys, sizeof(acpi_header_t));
+        if (strncmp(header->signature, signature, 4) != 0)
+        {
+            continue;
+        }
+
+        acpi_header_t *table = acpi_map_table(phys);
+        if (!acpi_checksum(table, table->length))
+        {
+            serial_printf("ACPI: bad %s checksum\n", signature);
+            return NULL;
+        }
+        return table;
+    }
+
+    return NULL;
+}
+
+static void madt_parse(acpi_madt_t *madt)
+{
+    madt_info.lapic_address = madt->lapic_address;
+
+    uint8_t *entry = madt->entries;
+    uint8_t *end = (uint8_t *)madt + madt->header.length;
+    while (entry + sizeof(madt_entry_t) <= end && ((madt_entry_t *)entry)->length != 0)
+    {
+        switch (((madt_entry_t *)entry)->type)
+        {
+            case MADT_TYPE_LAPIC:
+            {
+                madt_lapic_t *lapic = (madt_lapic_t *)entry;
+                if ((lapic->flags & (MADT_LAPIC_ENABLED | MADT_LAPIC_ONLINE_CAPABLE)) && madt_info.cpu_count < SMP_MAX_CPUS)
+                {
+                    madt_info.apic_ids[madt_info.cpu_count++] = lapic->apic_id;
+                }
+                break;
+            }
+            case MADT_TYPE_IOAPIC:
+            {
+                // only the first IOAPIC is used, it holds the ISA interrupts
+                madt_ioapic_t *ioapic = (madt_ioapic_t *)entry;
+                if (madt_info.ioapic_address == 0)
+                {
+                    madt_info.ioapic_address = ioapic->address;
+                    madt_info.ioapic_gsi_base = ioapic->gsi_base;
+                }
+                break;
+            }
+            case MADT_TYPE_OVERRIDE:
+            {
+                madt_override_t *override = (madt_override_t *)entry;
+                if (override->bus == 0 && override->source < 16)
+                {
+                    madt_info.irq_overrides[override->source].gsi = override->gsi;
+                    madt_info.irq_overrides[override->source].flags = override->flags;
+                }
+                break;
+            }
+            case MADT_TYPE_LAPIC_ADDRESS:
+                madt_info.lapic_address = ((madt_lapic_address_t *)entry)->address;
+                break;
+            default:
+                break;
+        }
+
+        entry += ((madt_entry_t *)entry)->length;
+    }
+}
+
+/**
+ * Find the MADT and record the CPUs, IOAPIC and interrupt overrides in it.
+ * Without ACPI, madt_info describes a single CPU and no IOAPIC.
+ */
+void acpi_init()
+{
+    memset(&madt_info, 0, sizeof(madt_info));
+    for (int i = 0; i < 16; i++)
+    {
+        madt_info.irq_overrides[i].gsi = i;
+    }
+
+    if (!acpi_rsdp_found && !acpi_scan_rsdp())
+    {
+        serial_printf("ACPI: no RSDP found\n");
+        return;
+    }
+
+    acpi_madt_t *madt = (acpi_madt_t *)acpi_find_table(ACPI_MADT_SIGNATURE);
+    if (madt == NULL)
+    {
+        serial_printf("ACPI: no MADT found\n");
+        return;
+    }
+
+    madt_parse(madt);
+
+    serial_printf("ACPI: revision %d, %d CPUs, IOAPIC at 0x%lx\n", acpi_rsdp.revision, madt_info.cpu_count, madt_info.ioapic_address);
+}
@@ -0,0 +1,215 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include <apic.h>
+#include <acpi.h>
+#include <system.h>
+#include <io.h>
+#include <memory.h>
+#include <serial.h>
+
+volatile uint32_t *lapic = NULL;
+
+bool ioapic_enabled = false;
+volatile uint32_t *ioapic = NULL;
+uint32_t ioapic_gsi_base = 0;
+uint32_t ioapic_entries = 0;
+
+bool lapic_present()
+{
+    uint32_t a, b, c, d;
+    ASM_CPUID(1, a, b, c, d);
+    (void)a; (void)b; (void)c;
+    return d & (1 << 9);
+}
+
+/**
+ * Enable the calling CPU's local APIC. The registers are at the same address
+ * on every CPU, so they're only mapped the first time.
+ */
+void lapic_enable()
+{
+    uint32_t low, high;
+    ASM_RDMSR_ADC(low, high, LAPIC_BASE_MSR);
+    if (!(low & LAPIC_BASE_ENABLE))
+    {
+        low |= LAPIC_BASE_ENABLE;
+        ASM_WRMSR_ADC(low, high, LAPIC_BASE_MSR);
+    }
+
+    if (lapic == NULL)
+    {
+        uint64_t phys = ((uint64_t)high << 32 | low) & 0xFFFFFFFFFF000;
+        lapic = (volatile uint32_t *)kmap_mmio(phys, 0x1000);
+    }
+
+    lapic_write(LAPIC_REG_SVR, LAPIC_SVR_ENABLE | LAPIC_SPURIOUS_VECTOR);
+}
+
+uint32_t lapic_id()
+{
+    return lapic_read(LAPIC_REG_ID) >> 24;
+}
+
+void lapic_eoi()
+{
+    if (lapic != NULL)
+    {
+        lapic_write(LAPIC_REG_EOI, 0);
+    }
+}
+
+/**
+ * Send an inter-processor interrupt and wait for the LAPIC to accept it.
+ *
+ * @param apic_id The target CPU's APIC ID
+ * @param command The low ICR word: delivery mode, level and vector
+ */
+void lapic_send_ipi(uint32_t apic_id, uint32_t command)
+{
+    lapic_write(LAPIC_REG_ICR_HIGH, apic_id << 24);
+    lapic_write(LAPIC_REG_ICR_LOW, command);
+    while (lapic_read(LAPIC_REG_ICR_LOW) & LAPIC_ICR_PENDING);
+}
+
+static uint32_t ioapic_read(uint32_t reg)
+{
+    ioapic[IOAPIC_REG_SELECT / 4] = reg;
+    return ioapic[IOAPIC_REG_WINDOW / 4];
+}
+
+static void ioapic_write(uint32_t reg, uint32_t value)
+{
+    ioapic[IOAPIC_REG_SELECT / 4] = reg;
+    ioapic[IOAPIC_REG_WINDOW / 4] = value;
+}
+
+static void ioapic_set_entry(uint32_t gsi, uint64_t entry)
+{
+    uint32_t index = gsi - ioapic_gsi_base;
+    ioapic_write(IOAPIC_REG_REDIRECT + index * 2, entry & 0xFFFFFFFF);
+    ioapic_write(IOAPIC_REG_REDIRECT + index * 2 + 1, entry >> 32);
+}
+
+static uint64_t ioapic_get_entry(uint32_t gsi)
+{
+    uint32_t index = gsi - ioapic_gsi_base;
+    return ioapic_read(IOAPIC_REG_REDIRECT + index * 2) | (uint64_t)ioapic_read(IOAPIC_REG_REDIRECT + index * 2 + 1) << 32;
+}
+
+/**
+ * Bring up the boot CPU's local APIC and, if ACPI describes one, switch
+ * legacy interrupts over from the 8259 to the IOAPIC. The 8259 stays
+ * remapped but fully masked, so a stray interrupt from it can't land on an
+ * exception vector.
+ */
+void apic_init()
+{
+    if (!lapic_present())
+    {
+        serial_printf("APIC: no local APIC, staying on the 8259\n");
+        return;
+    }
+
+    lapic_enable();
+
+    if (madt_info.ioapic_address == 0)
+    {
+        serial_printf("APIC: no IOAPIC in the MADT, staying on the 8259\n");
+        return;
+    }
+
+    ioapic = (volatile uint32_t *)kmap_mmio(madt_info.ioapic_address, 0x1000);
+    ioapic_gsi_base = madt_info.ioapic_gsi_base;
+    ioapic_entries = ((ioapic_read(IOAPIC_REG_VERSION) >> 16) & 0xFF) + 1;
+
+    // only the legacy lines routed below are left unmasked
+    for (uint32_t i = 0; i < ioapic_entries; i++)
+    {
+        ioapic_set_entry(ioapic_gsi_base + i, IOAPIC_MASKED);
+    }
+
+    uint32_t bsp = lapic_id();
+    for (uint8_t irq = 0; irq < IRQ_LEGACY_COUNT; irq++)
+    {
+        if (irq == 2)
+        {
+            // the 8259 cascade, its GSI usually carries IRQ 0 instead
+            continue;
+        }
+
+        uint32_t gsi = madt_info.irq_overrides[irq].gsi;
+        if (gsi < ioapic_gsi_base || gsi >= ioapic_gsi_base + ioapic_entries)
+        {
+            continue;
+        }
+
+        // ISA interrupts are edge triggered and active high unless overridden
+        uint64_t entry = (IRQ_BASE_VECTOR + irq) | ((uint64_t)bsp << 56);
+        uint16_t flags = madt_info.irq_overrides[irq].flags;
+        if ((flags & MADT_POLARITY_MASK) == MADT_POLARITY_LOW)
+        {
+            entry |= IOAPIC_ACTIVE_LOW;
+        }
+        if ((flags & MADT_TRIGGER_MASK) == MADT_TRIGGER_LEVEL)
+        {
+            entry |= IOAPIC_LEVEL;
+        }
+        ioapic_set_entry(gsi, entry);
+    }
+
+    outb(0x21, 0xFF);
+    outb(0xA1, 0xFF);
+    ioapic_enabled = true;
+
+    serial_printf("APIC: IOAPIC at 0x%lx with %d inputs, legacy IRQs routed to APIC %d\n", madt_info.ioapic_address, ioapic_entries, bsp);
+}
+
+/**
+ * Acknowledge a legacy interrupt, at the IOAPIC's local APIC or the 8259
+ * depending on which one delivered it.
+ *
+ * @param vector The vector that was raised
+ */
+void irq_eoi(uint8_t vector)
+{
+    if (ioapic_enabled)
+    {
+        lapic_eoi();
+        return;
+    }
+
+    if (vector >= IRQ_BASE_VECTOR + 8)
+    {
+        outb(0xA0, 0x20);
+    }
+    outb(0x20, 0x20);
+}
+
+/**
+ * Mask or unmask a legacy interrupt line.
+ *
+ * @param irq The ISA IRQ number, 0-15
+ * @param masked Whether the line should be masked
+ */
+void irq_set_mask(uint8_t irq, bool masked)
+{
+    if (irq >= IRQ_LEGACY_COUNT)
+    {
+        return;
+    }
+
+    if (ioapic_enabled)
+    {
+        uint32_t gsi = madt_info.irq_overrides[irq].gsi;
+        uint64_t entry = ioapic_get_entry(gsi);
+        entry = masked ? entry | IOAPIC_MASKED : entry & ~(uint64_t)IOAPIC_MASKED;
+        ioapic_set_entry(gsi, entry);
+        return;
+    }
+
+    uint16_t port = irq < 8 ? 0x21 : 0xA1;
+    uint8_t bit = 1 << (irq % 8);
+    outb(port, masked ? inb(port) | bit : inb(port) & ~bit);
+}
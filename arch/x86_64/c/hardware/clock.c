@@ -0,0 +1,617 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include <clock.h>
+#include <timer.h>
+#include <system.h>
+#include <io.h>
+#include <process.h>
+#include <filesystem.h>
+#include <serial.h>
+#include <sys/errno.h>
+#include <lib/container.h>
+#include <lock.h>
+
+uint64_t tsc_khz = 0;
+// TSC value at boot, monotonic time counts from here
+uint64_t tsc_base = 0;
+// nanoseconds per TSC cycle, as a 32.32 fixed point number
+uint64_t tsc_mult = 0;
+
+// CLOCK_REALTIME minus CLOCK_MONOTONIC, set from the RTC at boot
+uint64_t realtime_offset = 0;
+
+// Guards tsc_base, tsc_mult and realtime_offset, which are read together
+seqlock_t clock_lock = SEQLOCK_INIT("clock");
+
+static inline uint64_t rdtsc()
+{
+    uint32_t low, high;
+    ASM_RDTSC(low, high);
+    return (uint64_t)high << 32 | low;
+}
+
+/**
+ * Nanoseconds since boot. Uses the TSC if it was calibrated, otherwise
+ * falls back to counting timer ticks.
+ *
+ * @return The current monotonic time in nanoseconds
+ */
+uint64_t clock_monotonic_ns()
+{
+    uint64_t base, mult;
+    uint32_t seq;
+    do
+    {
+        seq = read_seqbegin(&clock_lock);
+        base = tsc_base;
+        mult = tsc_mult;
+    } while (read_seqretry(&clock_lock, seq));
+
+    if (mult == 0)
+    {
+        return timer_ticks * (NSEC_PER_SEC / timer_hz);
+    }
+
+    return (uint64_t)(((unsigned __int128)(rdtsc() - base) * mult) >> 32);
+}
+
+uint64_t clock_realtime_ns()
+{
+    uint64_t offset;
+    uint32_t seq;
+    do
+    {
+        seq = read_seqbegin(&clock_lock);
+        offset = realtime_offset;
+    } while (read_seqretry(&clock_lock, seq));
+
+    return clock_monotonic_ns() + offset;
+}
+
+/**
+ * Measure the TSC frequency against the PIT.
+ *
+ * @return TSC cycles per millisecond, 0 if the TSC can't be used
+ */
+static uint64_t tsc_calibrate()
+{
+    const uint32_t calibrate_ms = 10;
+
+    uint32_t a, b, c, d;
+    ASM_CPUID(1, a, b, c, d);
+    if (!(d & (1 << 4)))
+    {
+        return 0;
+    }
+
+    ASM_CPUID(0x80000000, a, b, c, d);
+    if (a >= 0x80000007)
+    {
+        ASM_CPUID(0x80000007, a, b, c, d);
+        if (!(d & (1 << 8)))
+        {
+            // still usable, but it may drift if the CPU changes frequency
+            serial_printf("Clock: TSC is not invariant\n");
+        }
+    }
+
+    pit_wait_start(calibrate_ms);
+    uint64_t start = rdtsc();
+    while (!pit_wait_done());
+    uint64_t end = rdtsc();
+
+    return (end - start) / calibrate_ms;
+}
+
+static uint8_t cmos_read(uint8_t reg)
+{
+    outb(CMOS_ADDRESS, reg);
+    return inb(CMOS_DATA);
+}
+
+static uint8_t bcd_to_binary(uint8_t value)
+{
+    return (value & 0x0F) + (value >> 4) * 10;
+}
+
+// Days between 1970-01-01 and the given date in the proleptic Gregorian calendar
+static int64_t days_from_civil(int64_t year, uint32_t month, uint32_t day)
+{
+    year -= month <= 2;
+    int64_t era = (year >= 0 ? year : year - 399) / 400;
+    uint32_t year_of_era = year - era * 400;
+    uint32_t day_of_year = (153 * (month > 2 ? month - 3 : month + 9) + 2) / 5 + day - 1;
+    uint32_t day_of_era = year_of_era * 365 + year_of_era / 4 - year_of_era / 100 + day_of_year;
+    return era * 146097 + day_of_era - 719468;
+}
+
+/**
+ * Read the wall clock time from the CMOS RTC. The RTC is assumed to be in UTC.
+ *
+ * @return Seconds since the epoch
+ */
+static uint64_t rtc_read()
+{
+    uint8_t regs[6], last[6];
+    const uint8_t indices[6] = { RTC_SECONDS, RTC_MINUTES, RTC_HOURS, RTC_DAY, RTC_MONTH, RTC_YEAR };
+
+    // read until two reads in a row agree, so an update can't tear it
+    bool stable = false;
+    while (!stable)
+    {
+        while (cmos_read(RTC_STATUS_A) & RTC_UPDATE_IN_PROGRESS);
+        for (int i = 0; i < 6; i++)
+        {
+            regs[i] = cmos_read(indices[i]);
+        }
+
+        while (cmos_read(RTC_STATUS_A) & RTC_UPDATE_IN_PROGRESS);
+        stable = true;
+        for (int i = 0; i < 6; i++)
+        {
+            last[i] = cmos_read(indices[i]);
+            stable = stable && last[i] == regs[i];
+        }
+    }
+
+    uint8_t status = cmos_read(RTC_STATUS_B);
+    bool pm = regs[2] & RTC_PM;
+    regs[2] &= ~RTC_PM;
+
+    if (!(status & RTC_BINARY))
+    {
+        for (int i = 0; i < 6; i++)
+        {
+            regs[i] = bcd_to_binary(regs[i]);
+        }
+    }
+
+    uint32_t hour = regs[2];
+    if (!(status & RTC_24_HOUR))
+    {
+        hour = (hour % 12) + (pm ? 12 : 0);
+    }
+
+    // no century register without ACPI, assume 1970-2069
+    int64_t year = regs[5] + (regs[5] < 70 ? 2000 : 1900);
+
+    int64_t days = days_from_civil(year, regs[4], regs[3]);
+    return days * 86400 + hour * 3600 + regs[1] * 60 + regs[0];
+}
+
+/**
+ * Spin for at least the given time, for device setup that has to wait with
+ * interrupts off.
+ *
+ * @param us How long to wait in microseconds
+ */
+void clock_delay_us(uint64_t us)
+{
+    if (tsc_mult == 0)
+    {
+        // ticks don't advance with interrupts off, count on the PIT instead
+        for (uint64_t ms = 0; ms < (us + 999) / 1000; ms++)
+        {
+            pit_wait_start(1);
+            while (!pit_wait_done());
+        }
+        return;
+    }
+
+    uint64_t end = clock_monotonic_ns() + us * NSEC_PER_USEC;
+    while (clock_monotonic_ns() < end)
+    {
+        asm volatile("pause");
+    }
+}
+
+void clock_init()
+{
+    uint64_t flags;
+
+    tsc_khz = tsc_calibrate();
+    if (tsc_khz != 0)
+    {
+        write_seqlock_irqsave(&clock_lock, flags);
+        tsc_mult = ((uint64_t)1000000 << 32) / tsc_khz;
+        tsc_base = rdtsc();
+        write_sequnlock_irqrestore(&clock_lock, flags);
+    }
+
+    uint64_t epoch = rtc_read();
+    uint64_t offset = epoch * NSEC_PER_SEC - clock_monotonic_ns();
+    write_seqlock_irqsave(&clock_lock, flags);
+    realtime_offset = offset;
+    write_sequnlock_irqrestore(&clock_lock, flags);
+
+    serial_printf("Clock: TSC at %d kHz, RTC time %d\n", tsc_khz, epoch);
+}
+
+static void timeout_fire(ktimer_t *timer)
+{
+    timeout_t *timeout = container_of(timer, timeout_t, timer);
+    timeout->expired = true;
+    process_wake((process_t *)timeout->process);
+}
+
+/**
+ * Arm a timeout for the current process. It must be cancelled with
+ * timeout_cancel() before the timeout_t goes out of scope.
+ *
+ * @param timeout The timeout to arm
+ * @param ns How long from now it should expire, rounded up to whole ticks
+ */
+void timeout_start(timeout_t *timeout, uint64_t ns)
+{
+    ktimer_init(&timeout->timer, timeout_fire);
+    timeout->process = (struct process *)current_process;
+    timeout->expired = false;
+    ktimer_add(&timeout->timer, timer_ticks + timer_ns_to_ticks(ns));
+}
+
+void timeout_cancel(timeout_t *timeout)
+{
+    ktimer_cancel(&timeout->timer);
+}
+
+/**
+ * Block the current process until the monotonic clock reaches a deadline.
+ *
+ * @param deadline Monotonic time to wake at, in nanoseconds
+ *
+ * @return 0 once the deadline has passed
+ *      -EINTR if a signal arrived first
+ */
+int clock_sleep_until(uint64_t deadline)
+{
+    timeout_t timeout;
+
+    int status = 0;
+    while (true)
+    {
+        // blocked before checking, so a signal arriving in between wakes us
+        process_prepare_block();
+
+        uint64_t now = clock_monotonic_ns();
+        if (now >= deadline)
+        {
+            break;
+        }
+        if (signal_pending((process_t *)current_process))
+        {
+            status = -EINTR;
+            break;
+        }
+
+        // ticks and the TSC don't line up, so this can wake a little early
+        timeout_start(&timeout, deadline - now);
+        process_block();
+        timeout_cancel(&timeout);
+    }
+    process_cancel_block();
+
+    return status;
+}
+
+static int timespec_to_ns(const struct timespec *ts, uint64_t *ns)
+{
+    if (ts->tv_sec < 0 || ts->tv_nsec < 0 || (uint64_t)ts->tv_nsec >= NSEC_PER_SEC)
+    {
+        return -EINVAL;
+    }
+
+    *ns = (uint64_t)ts->tv_sec * NSEC_PER_SEC + ts->tv_nsec;
+    return 0;
+}
+
+static void ns_to_timespec(uint64_t ns, struct timespec *ts)
+{
+    ts->tv_sec = ns / NSEC_PER_SEC;
+    ts->tv_nsec = ns % NSEC_PER_SEC;
+}
+
+/**
+ * Read a clock.
+ *
+ * @param clock CLOCK_REALTIME or CLOCK_MONOTONIC
+ * @param tp Where to store the time
+ *
+ * @return 0 if successful
+ *      -EINVAL if the clock is unknown
+ *      -EFAULT if tp is NULL
+ */
+int kclock_gettime(clockid_t clock, struct timespec *tp)
+{
+    if (tp == NULL)
+    {
+        return -EFAULT;
+    }
+
+    switch (clock)
+    {
+        case CLOCK_REALTIME:
+            ns_to_timespec(clock_realtime_ns(), tp);
+            return 0;
+        case CLOCK_MONOTONIC:
+            ns_to_timespec(clock_monotonic_ns(), tp);
+            return 0;
+        default:
+            return -EINVAL;
+    }
+}
+
+int kclock_getres(clockid_t clock, struct timespec *res)
+{
+    if (clock != CLOCK_REALTIME && clock != CLOCK_MONOTONIC)
+    {
+        return -EINVAL;
+    }
+
+    if (res != NULL)
+    {
+        ns_to_timespec(tsc_mult ? 1 : NSEC_PER_SEC / timer_hz, res);
+    }
+
+    return 0;
+}
+
+/**
+ * Get the wall clock time.
+ *
+ * @param tv Where to store the time, may be NULL
+ * @param tz Obsolete, always filled with zeroes if given
+ *
+ * @return 0
+ */
+int kgettimeofday(struct timeval *tv, void *tz)
+{
+    if (tv != NULL)
+    {
+        uint64_t now = clock_realtime_ns();
+        tv->tv_sec = now / NSEC_PER_SEC;
+        tv->tv_usec = (now % NSEC_PER_SEC) / NSEC_PER_USEC;
+    }
+
+    if (tz != NULL)
+    {
+        // struct timezone is two ints
+        ((int *)tz)[0] = 0;
+        ((int *)tz)[1] = 0;
+    }
+
+    return 0;
+}
+
+/**
+ * Sleep for at least the requested time.
+ *
+ * @param req How long to sleep
+ * @param rem If interrupted, how much of the sleep was left
+ *
+ * @return 0 if the whole time was slept
+ *      -EINTR if a signal interrupted the sleep
+ *      -EINVAL if req is out of range
+ *      -EFAULT if req is NULL
+ */
+int knanosleep(const struct timespec *req, struct timespec *rem)
+{
+    if (req == NULL)
+    {
+        return -EFAULT;
+    }
+
+    uint64_t ns;
+    int status = timespec_to_ns(req, &ns);
+    if (status < 0)
+    {
+        return status;
+    }
+
+    uint64_t deadline = clock_monotonic_ns() + ns;
+    status = clock_sleep_until(deadline);
+
+    if (status == -EINTR && rem != NULL)
+    {
+        uint64_t now = clock_monotonic_ns();
+        ns_to_timespec(deadline > now ? deadline - now : 0, rem);
+    }
+
+    return status;
+}
+
+// The ITIMER_REAL timer went off, runs from the timer IRQ
+static void itimer_real_fire(ktimer_t *timer)
+{
+    process_t *process = container_of(timer, process_t, itimer_real);
+
+    if (process->itimer_real_interval != 0)
+    {
+        ktimer_add(timer, timer->expires + process->itimer_real_interval);
+    }
+
+    process_kill(process->pid, SIGALRM);
+}
+
+void itimer_init(struct process *process)
+{
+    ktimer_init(&process->itimer_real, itimer_real_fire);
+    process->itimer_real_interval = 0;
+    process->itimer_virtual = 0;
+    process->itimer_virtual_interval = 0;
+    process->itimer_prof = 0;
+    process->itimer_prof_interval = 0;
+}
+
+// Count down one of the CPU time itimers, signalling when it runs out
+static void itimer_count(process_t *process, uint64_t *value, uint64_t interval, int signal)
+{
+    if (*value == 0 || --*value != 0)
+    {
+        return;
+    }
+
+    *value = interval;
+    process_kill(process->pid, signal);
+}
+
+/**
+ * Charge a timer tick to the CPU time itimers of the running process.
+ *
+ * @param process The process that was running when the tick came in
+ */
+void itimer_account(struct process *process)
+{
+    if (!process->in_syscall)
+    {
+        itimer_count(process, &process->itimer_virtual, process->itimer_virtual_interval, SIGVTALRM);
+    }
+    itimer_count(process, &process->itimer_prof, process->itimer_prof_interval, SIGPROF);
+}
+
+static uint64_t timeval_to_ticks(const struct timeval *tv)
+{
+    uint64_t ns = (uint64_t)tv->tv_sec * NSEC_PER_SEC + (uint64_t)tv->tv_usec * NSEC_PER_USEC;
+    return timer_ns_to_ticks(ns);
+}
+
+static void ticks_to_timeval(uint64_t ticks, struct timeval *tv)
+{
+    uint64_t us = ticks * 1000000 / timer_hz;
+    tv->tv_sec = us / 1000000;
+    tv->tv_usec = us % 1000000;
+}
+
+static bool timeval_valid(const struct timeval *tv)
+{
+    return tv->tv_sec >= 0 && tv->tv_usec >= 0 && tv->tv_usec < 1000000;
+}
+
+/**
+ * Read an interval timer of the current process.
+ *
+ * @param which ITIMER_REAL, ITIMER_VIRTUAL or ITIMER_PROF
+ * @param value Where to store the time left and the reload interval
+ *
+ * @return 0 if successful
+ *      -EINVAL if which is unknown
+ *      -EFAULT if value is NULL
+ */
+int kgetitimer(int which, struct itimerval *value)
+{
+    if (value == NULL)
+    {
+        return -EFAULT;
+    }
+
+    process_t *process = (process_t *)current_process;
+    uint64_t left, interval;
+    switch (which)
+    {
+        case ITIMER_REAL:
+            left = ktimer_pending(&process->itimer_real) && process->itimer_real.expires > timer_ticks ? process->itimer_real.expires - timer_ticks : 0;
+            interval = process->itimer_real_interval;
+            break;
+        case ITIMER_VIRTUAL:
+            left = process->itimer_virtual;
+            interval = process->itimer_virtual_interval;
+            break;
+        case ITIMER_PROF:
+            left = process->itimer_prof;
+            interval = process->itimer_prof_interval;
+            break;
+        default:
+            return -EINVAL;
+    }
+
+    ticks_to_timeval(left, &value->it_value);
+    ticks_to_timeval(interval, &value->it_interval);
+    return 0;
+}
+
+/**
+ * Set an interval timer of the current process. ITIMER_REAL counts wall
+ * time and sends SIGALRM, ITIMER_VIRTUAL counts time in user mode and sends
+ * SIGVTALRM, ITIMER_PROF counts all CPU time and sends SIGPROF.
+ *
+ * @param which The timer to set
+ * @param value Time until the first expiry (0 disarms) and the reload interval
+ * @param old_value If not NULL, receives the previous setting
+ *
+ * @return 0 if successful
+ *      -EINVAL if which is unknown or value is out of range
+ *      -EFAULT if value is NULL
+ */
+int ksetitimer(int which, const struct itimerval *value, struct itimerval *old_value)
+{
+    if (value == NULL)
+    {
+        return -EFAULT;
+    }
+
+    if (!timeval_valid(&value->it_value) || !timeval_valid(&value->it_interval))
+    {
+        return -EINVAL;
+    }
+
+    if (old_value != NULL)
+    {
+        int status = kgetitimer(which, old_value);
+        if (status < 0)
+        {
+            return status;
+        }
+    }
+
+    process_t *process = (process_t *)current_process;
+    uint64_t first = timeval_to_ticks(&value->it_value);
+    uint64_t interval = timeval_to_ticks(&value->it_interval);
+
+    switch (which)
+    {
+        case ITIMER_REAL:
+            ktimer_cancel(&process->itimer_real);
+            process->itimer_real_interval = interval;
+            if (first != 0)
+            {
+                ktimer_add(&process->itimer_real, timer_ticks + first);
+            }
+            return 0;
+        case ITIMER_VIRTUAL:
+            process->itimer_virtual = first;
+            process->itimer_virtual_interval = interval;
+            return 0;
+        case ITIMER_PROF:
+            process->itimer_prof = first;
+            process->itimer_prof_interval = interval;
+            return 0;
+        default:
+            return -EINVAL;
+    }
+}
+
+/**
+ * Send SIGALRM to the current process after a number of seconds, replacing
+ * any earlier alarm. Shares its timer with ITIMER_REAL.
+ *
+ * @param seconds Seconds until the alarm, 0 cancels it
+ *
+ * @return Seconds that were left on the previous alarm, 0 if there was none
+ */
+unsigned int kalarm(unsigned int seconds)
+{
+    struct itimerval value = { 0 };
+    struct itimerval old;
+    value.it_value.tv_sec = seconds;
+
+    ksetitimer(ITIMER_REAL, &value, &old);
+
+    // round to the nearest second, but never report a pending alarm as 0
+    unsigned int left = old.it_value.tv_sec + (old.it_value.tv_usec >= 500000);
+    if (left == 0 && old.it_value.tv_usec != 0)
+    {
+        left = 1;
+    }
+    return left;
+}
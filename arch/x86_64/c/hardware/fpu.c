@@ -0,0 +1,298 @@
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <fpu.h>
+#include <system.h>
+#include <memory.h>
+#include <string.h>
+#include <process.h>
+#include <serial.h>
+#include <errors.h>
+#include <smp.h>
+
+/*
+ * FPU, SSE and AVX registers are switched lazily. The kernel is built with
+ * -mgeneral-regs-only, so only user code touches them. schedule() sets
+ * CR0.TS for anything but the process whose state is still live in this
+ * CPU's registers, and the first FPU instruction after that traps to
+ * fpu_trap(), which loads the process' state. A process that used the FPU
+ * during its slice is saved when it's switched out.
+ */
+
+uint64_t fpu_xfeatures = 0;
+uint32_t fpu_state_size = 512;
+bool fpu_xsaveopt = false;
+
+#define FPU_DEFAULT_FCW 0x37F
+#define FPU_DEFAULT_MXCSR 0x1F80
+
+// MXCSR bits the CPU accepts, which FXRSTOR and XRSTOR fault on otherwise.
+// Without DAZ unless FXSAVE reports the CPU has it.
+static uint32_t fpu_mxcsr_mask = 0xFFBF;
+
+static inline void fpu_set_ts()
+{
+    uint64_t cr0;
+    ASM_GET_CR0(cr0);
+    ASM_SET_CR0(cr0 | CR0_TS);
+}
+
+static inline bool fpu_ts_set()
+{
+    uint64_t cr0;
+    ASM_GET_CR0(cr0);
+    return cr0 & CR0_TS;
+}
+
+static void fpu_save(void *state)
+{
+    if (fpu_xsaveopt)
+    {
+        asm volatile("xsaveopt64 (%0)" :: "r"(state), "a"((uint32_t)fpu_xfeatures), "d"((uint32_t)(fpu_xfeatures >> 32)) : "memory");
+    }
+    else if (fpu_xfeatures)
+    {
+        asm volatile("xsave64 (%0)" :: "r"(state), "a"((uint32_t)fpu_xfeatures), "d"((uint32_t)(fpu_xfeatures >> 32)) : "memory");
+    }
+    else
+    {
+        asm volatile("fxsave64 (%0)" :: "r"(state) : "memory");
+    }
+}
+
+static void fpu_restore(void *state)
+{
+    if (fpu_xfeatures)
+    {
+        asm volatile("xrstor64 (%0)" :: "r"(state), "a"((uint32_t)fpu_xfeatures), "d"((uint32_t)(fpu_xfeatures >> 32)) : "memory");
+    }
+    else
+    {
+        asm volatile("fxrstor64 (%0)" :: "r"(state) : "memory");
+    }
+}
+
+/**
+ * Enable the FPU, SSE and, where the CPU has them, XSAVE and AVX on the
+ * calling CPU. The boot CPU works out the save area layout, application
+ * processors reuse it. Leaves CR0.TS set, so the first use traps.
+ */
+void fpu_init()
+{
+    static bool probed = false;
+
+    uint32_t eax, ebx, ecx, edx;
+    ASM_CPUID(1, eax, ebx, ecx, edx);
+
+    uint64_t cr0, cr4;
+    ASM_GET_CR0(cr0);
+    ASM_GET_CR4(cr4);
+    cr0 = (cr0 & ~CR0_EM) | CR0_MP;
+    cr4 |= CR4_OSFXSR | CR4_OSXMMEXCPT;
+    if (ecx & CPUID_1_ECX_XSAVE)
+    {
+        cr4 |= CR4_OSXSAVE;
+    }
+    ASM_SET_CR0(cr0);
+    ASM_SET_CR4(cr4);
+
+    if (!probed)
+    {
+        probed = true;
+        if (ecx & CPUID_1_ECX_XSAVE)
+        {
+            fpu_xfeatures = XCR0_X87 | XCR0_SSE;
+            if (ecx & CPUID_1_ECX_AVX)
+            {
+                fpu_xfeatures |= XCR0_AVX;
+            }
+            ASM_XSETBV(0, fpu_xfeatures);
+
+            // EBX is the size needed for what's enabled in XCR0
+            ASM_CPUID_SUB(0xD, 0, eax, ebx, ecx, edx);
+            fpu_state_size = ebx;
+            ASM_CPUID_SUB(0xD, 1, eax, ebx, ecx, edx);
+            fpu_xsaveopt = eax & CPUID_D_1_EAX_XSAVEOPT;
+        }
+
+        static xmm_regs_t probe __attribute__((aligned(16)));
+        memset(&probe, 0, sizeof(probe));
+        ASM_CLTS;
+        asm volatile("fxsave64 (%0)" :: "r"(&probe) : "memory");
+        if (probe.mxcsr_mask != 0)
+        {
+            fpu_mxcsr_mask = probe.mxcsr_mask;
+        }
+
+        serial_printf("FPU: %s, %s, %d byte save area\n",
+            fpu_xfeatures ? (fpu_xsaveopt ? "XSAVEOPT" : "XSAVE") : "FXSAVE",
+            fpu_xfeatures & XCR0_AVX ? "AVX" : "no AVX",
+            fpu_state_size);
+    }
+    else if (fpu_xfeatures)
+    {
+        ASM_XSETBV(0, fpu_xfeatures);
+    }
+
+    asm volatile("fninit");
+    fpu_set_ts();
+}
+
+/**
+ * Put a save area back to the state a new process starts with.
+ *
+ * @param state The save area
+ */
+void fpu_state_reset(void *state)
+{
+    memset(state, 0, fpu_state_size);
+
+    // the legacy region is laid out like FXSAVE's; an all-zero XSAVE
+    // header means every component is in its initial state, apart from
+    // MXCSR which XRSTOR always loads
+    xmm_regs_t *legacy = (xmm_regs_t *)state;
+    legacy->fcw = FPU_DEFAULT_FCW;
+    legacy->mxcsr = FPU_DEFAULT_MXCSR;
+}
+
+/**
+ * Check that a save area from user memory, like a signal frame's, is safe
+ * to load: FXRSTOR and XRSTOR fault on reserved MXCSR bits, and XRSTOR on
+ * a header naming components that aren't enabled, or in the compacted
+ * format, or with reserved bytes set.
+ *
+ * @param state The save area, fpu_state_size bytes
+ *
+ * @return true if loading it can't fault
+ */
+bool fpu_state_valid(const void *state)
+{
+    const xmm_regs_t *legacy = (const xmm_regs_t *)state;
+    if (legacy->mxcsr & ~fpu_mxcsr_mask)
+    {
+        return false;
+    }
+
+    if (fpu_xfeatures != 0)
+    {
+        // XSTATE_BV, XCOMP_BV, then reserved
+        const uint64_t *header = (const uint64_t *)((const uint8_t *)state + sizeof(xmm_regs_t));
+        if (header[0] & ~fpu_xfeatures)
+        {
+            return false;
+        }
+        for (int i = 1; i < 8; i++)
+        {
+            if (header[i] != 0)
+            {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+/**
+ * @return A save area in the initial state, free with fpu_state_free()
+ */
+void *fpu_state_alloc()
+{
+    uint64_t raw = (uint64_t)kmalloc(fpu_state_size + FPU_STATE_ALIGN + sizeof(void *));
+    uint64_t state = (raw + sizeof(void *) + FPU_STATE_ALIGN - 1) & ~(uint64_t)(FPU_STATE_ALIGN - 1);
+
+    // remember where the allocation started, just below the area
+    ((uint64_t *)state)[-1] = raw;
+
+    fpu_state_reset((void *)state);
+    return (void *)state;
+}
+
+/**
+ * @param state A save area from fpu_state_alloc()
+ */
+void fpu_state_free(void *state)
+{
+    kfree((void *)((uint64_t *)state)[-1]);
+}
+
+/**
+ * Called by schedule() when it changes processes on this CPU. Saves the
+ * outgoing process if it used the FPU, and arranges for the incoming one
+ * to trap on first use unless its state is still in the registers.
+ *
+ * @param prev The process being switched out
+ * @param next The process being switched in
+ */
+void fpu_switch(process_t *prev, process_t *next)
+{
+    cpu_t *cpu = this_cpu();
+
+    if (prev == cpu->fpu_owner && prev->fpu_cpu == cpu->id && !fpu_ts_set())
+    {
+        fpu_save(prev->fpu_state);
+    }
+
+    if (next == cpu->fpu_owner && next->fpu_cpu == cpu->id)
+    {
+        // nothing has touched the registers since it last ran here
+        ASM_CLTS;
+    }
+    else
+    {
+        fpu_set_ts();
+    }
+}
+
+/**
+ * Make sure a process' save area holds its latest state, for copying it.
+ *
+ * @param process The process, which must be running on this CPU
+ */
+void fpu_sync(process_t *process)
+{
+    cpu_t *cpu = this_cpu();
+    if (process == cpu->fpu_owner && process->fpu_cpu == cpu->id && !fpu_ts_set())
+    {
+        fpu_save(process->fpu_state);
+    }
+}
+
+/**
+ * Forget any registers a process has loaded on this CPU, so the next use
+ * reloads its save area. Used when the process exits or execs.
+ *
+ * @param process The process, which must be running on this CPU
+ */
+void fpu_release(process_t *process)
+{
+    cpu_t *cpu = this_cpu();
+    if (cpu->fpu_owner == process)
+    {
+        cpu->fpu_owner = NULL;
+        fpu_set_ts();
+    }
+    process->fpu_cpu = FPU_NO_CPU;
+}
+
+/**
+ * #NM handler. The current process used the FPU with CR0.TS set, so give
+ * it the registers. Whoever had them before was saved when it was switched
+ * out.
+ */
+void fpu_trap()
+{
+    cpu_t *cpu = this_cpu();
+    process_t *process = (process_t *)current_process;
+
+    kassert_msg(process != NULL && process->fpu_state != NULL, "FPU used by the kernel");
+
+    ASM_CLTS;
+    if (cpu->fpu_owner == process && process->fpu_cpu == cpu->id)
+    {
+        return;
+    }
+
+    fpu_restore(process->fpu_state);
+    cpu->fpu_owner = process;
+    process->fpu_cpu = cpu->id;
+}
@@ -0,0 +1,482 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include <heap_profile.h>
+#include <memory.h>
+#include <process.h>
+#include <serial.h>
+#include <string.h>
+#include <trace.h>
+#include <device.h>
+#include <filesystem.h>
+#include <unused.h>
+#include <sys/errno.h>
+
+volatile bool heap_profile_enabled = HEAP_PROFILE_DEFAULT;
+
+// Kept in .bss so that tracking never has to allocate (and recurse into kmalloc)
+heap_profile_alloc_t heap_profile_allocs[HEAP_PROFILE_MAX_ALLOCS];
+heap_profile_site_t heap_profile_sites[HEAP_PROFILE_MAX_SITES];
+uint64_t heap_profile_histogram[HEAP_PROFILE_BUCKETS];
+
+uint64_t heap_profile_tracked = 0;
+uint64_t heap_profile_dropped = 0;
+uint64_t heap_profile_untracked_frees = 0;
+
+// Marks a slot that used to hold an allocation, so probing continues past it
+#define HEAP_PROFILE_TOMBSTONE ((uint64_t)-1)
+
+device_t kheap_device = {0};
+
+static inline uint64_t heap_profile_rdtsc()
+{
+    uint32_t low, high;
+    asm volatile("rdtsc" : "=a"(low), "=d"(high));
+    return ((uint64_t)high << 32) | low;
+}
+
+static inline uint64_t heap_profile_hash(uint64_t value)
+{
+    // Fibonacci hashing, allocations are at least 8-byte granular
+    return (value >> 3) * 0x9E3779B97F4A7C15ULL;
+}
+
+static uint32_t heap_profile_bucket(uint64_t size)
+{
+    uint32_t bucket = 0;
+    size >>= 4;
+    while (size != 0 && bucket < HEAP_PROFILE_BUCKETS - 1) {
+        size >>= 1;
+        bucket++;
+    }
+    return bucket;
+}
+
+static heap_profile_site_t *heap_profile_get_site(uint64_t caller, bool create)
+{
+    uint64_t index = heap_profile_hash(caller) & (HEAP_PROFILE_MAX_SITES - 1);
+    for (uint32_t i = 0; i < HEAP_PROFILE_MAX_SITES; i++) {
+        heap_profile_site_t *site = &heap_profile_sites[(index + i) & (HEAP_PROFILE_MAX_SITES - 1)];
+        if (site->caller == caller) {
+            return site;
+        }
+        if (site->caller == 0) {
+            if (!create) {
+                return NULL;
+            }
+            site->caller = caller;
+            return site;
+        }
+    }
+    return NULL;
+}
+
+void heap_profile_record_alloc(void *ptr, uint64_t size, uint64_t caller)
+{
+    if (ptr == NULL) {
+        return;
+    }
+
+    heap_profile_histogram[heap_profile_bucket(size)]++;
+
+    heap_profile_site_t *site = heap_profile_get_site(caller, true);
+    if (site == NULL) {
+        heap_profile_dropped++;
+        return;
+    }
+
+    uint64_t index = heap_profile_hash((uint64_t)ptr) & (HEAP_PROFILE_MAX_ALLOCS - 1);
+    for (uint32_t i = 0; i < HEAP_PROFILE_MAX_ALLOCS; i++) {
+        heap_profile_alloc_t *alloc = &heap_profile_allocs[(index + i) & (HEAP_PROFILE_MAX_ALLOCS - 1)];
+        if (alloc->ptr == 0 || alloc->ptr == HEAP_PROFILE_TOMBSTONE) {
+            alloc->ptr = (uint64_t)ptr;
+            alloc->size = size;
+            alloc->caller = caller;
+            alloc->timestamp = heap_profile_rdtsc();
+            alloc->owner = (void *)current_process;
+            alloc->pid = current_process ? current_process->pid : 0;
+
+            site->live_bytes += size;
+            site->live_count++;
+            site->total_count++;
+            if (site->live_bytes > site->peak_bytes) {
+                site->peak_bytes = site->live_bytes;
+            }
+            heap_profile_tracked++;
+            return;
+        }
+    }
+
+    heap_profile_dropped++;
+}
+
+void heap_profile_record_free(void *ptr)
+{
+    if (ptr == NULL) {
+        return;
+    }
+
+    uint64_t index = heap_profile_hash((uint64_t)ptr) & (HEAP_PROFILE_MAX_ALLOCS - 1);
+    for (uint32_t i = 0; i < HEAP_PROFILE_MAX_ALLOCS; i++) {
+        heap_profile_alloc_t *alloc = &heap_profile_allocs[(index + i) & (HEAP_PROFILE_MAX_ALLOCS - 1)];
+        if (alloc->ptr == 0) {
+            break;
+        }
+        if (alloc->ptr == (uint64_t)ptr) {
+            heap_profile_site_t *site = heap_profile_get_site(alloc->caller, false);
+            if (site != NULL) {
+                site->live_bytes -= alloc->size;
+                site->live_count--;
+            }
+            alloc->ptr = HEAP_PROFILE_TOMBSTONE;
+            heap_profile_tracked--;
+            return;
+        }
+    }
+
+    // Allocated before tracking was turned on
+    heap_profile_untracked_frees++;
+}
+
+void heap_profile_reset()
+{
+    bool was_enabled = heap_profile_enabled;
+    heap_profile_enabled = false;
+
+    memset(heap_profile_allocs, 0, sizeof(heap_profile_allocs));
+    memset(heap_profile_sites, 0, sizeof(heap_profile_sites));
+    memset(heap_profile_histogram, 0, sizeof(heap_profile_histogram));
+    heap_profile_tracked = 0;
+    heap_profile_dropped = 0;
+    heap_profile_untracked_frees = 0;
+
+    heap_profile_enabled = was_enabled;
+}
+
+void heap_profile_set_enabled(bool enabled)
+{
+    if (enabled && !heap_profile_enabled) {
+        // Stale records from a previous session would show up as leaks
+        heap_profile_reset();
+    }
+    heap_profile_enabled = enabled;
+}
+
+/**
+ * Check whether an allocation has outlived the process that made it.
+ *
+ * @param alloc The allocation record to check
+ *
+ * @return true if the owning process has exited or been reaped
+ */
+static bool heap_profile_is_orphaned(heap_profile_alloc_t *alloc)
+{
+    if (alloc->pid == 0) {
+        // Made by the kernel itself, not attributable to a process
+        return false;
+    }
+
+    process_t *owner = process_find(alloc->pid);
+    return owner == NULL || (void *)owner != alloc->owner || owner->status == TASK_EXITED;
+}
+
+static void emit_uint(heap_profile_emit_t emit, void *ctx, uint64_t value, int base)
+{
+    char buffer[32];
+    uitoa64(value, buffer, base);
+    if (base == 16) {
+        emit("0x", ctx);
+    }
+    emit(buffer, ctx);
+}
+
+static void emit_caller(heap_profile_emit_t emit, void *ctx, uint64_t caller)
+{
+    emit_uint(emit, ctx, caller, 16);
+
+    uint64_t offset;
+    const char *symbol = trace_resolve_symbol(caller, &offset);
+    if (symbol != NULL) {
+        emit(" <", ctx);
+        emit(symbol, ctx);
+        emit("+", ctx);
+        emit_uint(emit, ctx, offset, 16);
+        emit(">", ctx);
+    }
+}
+
+/**
+ * Generate a report of the current heap profile.
+ *
+ * @param emit Called with each piece of the report text, in order
+ * @param ctx Passed through to emit
+ */
+void heap_profile_report(heap_profile_emit_t emit, void *ctx)
+{
+    // Don't profile our own report buffers
+    bool was_enabled = heap_profile_enabled;
+    heap_profile_enabled = false;
+
+    emit("KERNEL HEAP PROFILE\n", ctx);
+    emit("Tracking: ", ctx);
+    emit(was_enabled ? "on" : "off", ctx);
+    emit("\nTracked allocations: ", ctx);
+    emit_uint(emit, ctx, heap_profile_tracked, 10);
+    emit(" (dropped: ", ctx);
+    emit_uint(emit, ctx, heap_profile_dropped, 10);
+    emit(", untracked frees: ", ctx);
+    emit_uint(emit, ctx, heap_profile_untracked_frees, 10);
+    emit(")\n", ctx);
+
+    int64_t free_space = heap_free_space();
+    int64_t largest_free = heap_largest_free_block();
+    emit("Heap free: ", ctx);
+    emit_uint(emit, ctx, free_space, 10);
+    emit(" bytes, largest free block: ", ctx);
+    emit_uint(emit, ctx, largest_free, 10);
+    emit(" bytes, fragmentation: ", ctx);
+    // Fraction of free space not usable by a single allocation, in percent
+    emit_uint(emit, ctx, free_space > 0 ? (uint64_t)(100 - (largest_free * 100) / free_space) : 0, 10);
+    emit("%\n", ctx);
+
+    emit("\nLive bytes by call site:\n", ctx);
+    for (uint32_t i = 0; i < HEAP_PROFILE_MAX_SITES; i++) {
+        heap_profile_site_t *site = &heap_profile_sites[i];
+        if (site->caller == 0 || site->live_count == 0) {
+            continue;
+        }
+        emit("  ", ctx);
+        emit_caller(emit, ctx, site->caller);
+        emit(": ", ctx);
+        emit_uint(emit, ctx, site->live_bytes, 10);
+        emit(" bytes in ", ctx);
+        emit_uint(emit, ctx, site->live_count, 10);
+        emit(" blocks (peak ", ctx);
+        emit_uint(emit, ctx, site->peak_bytes, 10);
+        emit(", total allocs ", ctx);
+        emit_uint(emit, ctx, site->total_count, 10);
+        emit(")\n", ctx);
+    }
+
+    emit("\nAllocation size histogram:\n", ctx);
+    for (uint32_t i = 0; i < HEAP_PROFILE_BUCKETS; i++) {
+        if (heap_profile_histogram[i] == 0) {
+            continue;
+        }
+        emit("  ", ctx);
+        if (i == 0) {
+            emit("< 16", ctx);
+        } else if (i == HEAP_PROFILE_BUCKETS - 1) {
+            emit(">= ", ctx);
+            emit_uint(emit, ctx, 1ULL << (i + 3), 10);
+        } else {
+            emit_uint(emit, ctx, 1ULL << (i + 3), 10);
+            emit("-", ctx);
+            emit_uint(emit, ctx, (1ULL << (i + 4)) - 1, 10);
+        }
+        emit(": ", ctx);
+        emit_uint(emit, ctx, heap_profile_histogram[i], 10);
+        emit("\n", ctx);
+    }
+
+    emit("\nSuspected leaks (owner process gone):\n", ctx);
+    uint64_t now = heap_profile_rdtsc();
+    uint64_t leaks = 0;
+    for (uint32_t i = 0; i < HEAP_PROFILE_MAX_ALLOCS; i++) {
+        heap_profile_alloc_t *alloc = &heap_profile_allocs[i];
+        if (alloc->ptr == 0 || alloc->ptr == HEAP_PROFILE_TOMBSTONE) {
+            continue;
+        }
+        if (!heap_profile_is_orphaned(alloc)) {
+            continue;
+        }
+        emit("  ", ctx);
+        emit_uint(emit, ctx, alloc->ptr, 16);
+        emit(" (", ctx);
+        emit_uint(emit, ctx, alloc->size, 10);
+        emit(" bytes, pid ", ctx);
+        emit_uint(emit, ctx, alloc->pid, 10);
+        emit(", age ", ctx);
+        emit_uint(emit, ctx, now - alloc->timestamp, 10);
+        emit(" cycles) from ", ctx);
+        emit_caller(emit, ctx, alloc->caller);
+        emit("\n", ctx);
+        leaks++;
+    }
+    if (leaks == 0) {
+        emit("  none\n", ctx);
+    }
+
+    heap_profile_enabled = was_enabled;
+}
+
+static void heap_profile_emit_serial(const char *str, void *ctx)
+{
+    UNUSED(ctx);
+    serial_printf("%s", str);
+}
+
+void heap_profile_report_serial()
+{
+    heap_profile_report(heap_profile_emit_serial, NULL);
+}
+
+typedef struct {
+    char *buffer;
+    size_t length;
+    size_t capacity;
+    size_t read_pos;
+    uint64_t dependents;
+} kheap_open_data_t;
+
+static void heap_profile_emit_buffer(const char *str, void *ctx)
+{
+    kheap_open_data_t *data = (kheap_open_data_t *)ctx;
+    size_t len = strlen(str);
+
+    if (data->length + len + 1 > data->capacity) {
+        size_t new_capacity = data->capacity * 2;
+        while (data->length + len + 1 > new_capacity) {
+            new_capacity *= 2;
+        }
+        char *new_buffer = (char *)kmalloc(new_capacity);
+        memcpy(new_buffer, data->buffer, data->length);
+        kfree(data->buffer);
+        data->buffer = new_buffer;
+        data->capacity = new_capacity;
+    }
+
+    memcpy(data->buffer + data->length, str, len);
+    data->length += len;
+    data->buffer[data->length] = '\0';
+}
+
+pointer_int_t kheap_open(const char *path, uint64_t flags, void *device_passed)
+{
+    UNUSED(path);
+    UNUSED(device_passed);
+
+    if (flags & O_DIRECTORY) {
+        return (pointer_int_t){NULL, -ENOTDIR};
+    }
+
+    // Snapshot the report at open time so reads see a consistent view
+    kheap_open_data_t *data = (kheap_open_data_t *)kmalloc(sizeof(kheap_open_data_t));
+    data->capacity = 4096;
+    data->buffer = (char *)kmalloc(data->capacity);
+    data->length = 0;
+    data->read_pos = 0;
+    data->dependents = 1;
+
+    heap_profile_report(heap_profile_emit_buffer, data);
+
+    return (pointer_int_t){data, 0};
+}
+
+size_t kheap_read(void *ptr, size_t size, size_t nmemb, void *filedes_data, void *device_passed, uint64_t flags)
+{
+    UNUSED(device_passed);
+    UNUSED(flags);
+
+    kheap_open_data_t *data = (kheap_open_data_t *)filedes_data;
+    size_t to_read = size * nmemb;
+    if (to_read > data->length - data->read_pos) {
+        to_read = data->length - data->read_pos;
+    }
+
+    memcpy(ptr, data->buffer + data->read_pos, to_read);
+    data->read_pos += to_read;
+
+    return to_read;
+}
+
+size_t kheap_write(const void *ptr, size_t size, size_t nmemb, void *filedes_data, void *device_passed, uint64_t flags)
+{
+    UNUSED(filedes_data);
+    UNUSED(device_passed);
+    UNUSED(flags);
+
+    size_t len = size * nmemb;
+    const char *command = (const char *)ptr;
+
+    if (len >= 2 && strncmp(command, "on", 2) == 0) {
+        heap_profile_set_enabled(true);
+    } else if (len >= 3 && strncmp(command, "off", 3) == 0) {
+        heap_profile_set_enabled(false);
+    } else if (len >= 5 && strncmp(command, "reset", 5) == 0) {
+        heap_profile_reset();
+    } else if (len >= 6 && strncmp(command, "serial", 6) == 0) {
+        heap_profile_report_serial();
+    } else {
+        return -EINVAL;
+    }
+
+    return len;
+}
+
+int kheap_close(void *filedes_data, void *device_passed)
+{
+    UNUSED(device_passed);
+
+    kheap_open_data_t *data = (kheap_open_data_t *)filedes_data;
+    if (data->dependents > 1) {
+        data->dependents--;
+        return 0;
+    }
+
+    kfree(data->buffer);
+    kfree(data);
+    return 0;
+}
+
+void *kheap_dup(void *filedes_data, void *device_passed)
+{
+    UNUSED(device_passed);
+
+    kheap_open_data_t *data = (kheap_open_data_t *)filedes_data;
+    data->dependents++;
+    return data;
+}
+
+int kheap_stat(void *file_entry, void *buf, void *device_passed)
+{
+    UNUSED(device_passed);
+
+    kheap_open_data_t *data = (kheap_open_data_t *)file_entry;
+
+    struct stat *statbuf = (struct stat *)buf;
+    statbuf->st_dev = 0;
+    statbuf->st_ino = 0;
+    statbuf->st_mode = S_IFCHR;
+    statbuf->st_nlink = 1;
+    statbuf->st_uid = 0;
+    statbuf->st_gid = 0;
+    statbuf->st_rdev = 0;
+    statbuf->st_size = data->length;
+
+    return 0;
+}
+
+void heap_profile_init()
+{
+    strcpy(kheap_device.name, "kheap");
+    kheap_device.flags = 0;
+    kheap_device.data = NULL;
+    kheap_device.type = DEVICE_TYPE_KHEAP;
+
+    kheap_device.open = (open_func_t)kheap_open;
+    kheap_device.read = (read_func_t)kheap_read;
+    kheap_device.write = (write_func_t)kheap_write;
+    kheap_device.close = (close_func_t)kheap_close;
+    kheap_device.fcntl = NULL;
+    kheap_device.file_size = NULL;
+    kheap_device.lseek = NULL;
+    kheap_device.ioctl = NULL;
+    kheap_device.dup = (dup_func_t)kheap_dup;
+    kheap_device.clone = (clone_func_t)kheap_dup;
+    kheap_device.stat = (stat_func_t)kheap_stat;
+    kheap_device.select = NULL;
+
+    register_device(&kheap_device);
+}
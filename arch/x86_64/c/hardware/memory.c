@@ -13,12 +13,16 @@
 #include <serial.h>
 #include <sys/mman.h>
 #include <sys/errno.h>
+#include <heap_profile.h>
+#include <preempt.h>
+#include <workqueue.h>
+#include <lock.h>
+#include <exec_cache.h>
 
 heap_header_t *kheap = NULL;
 uint64_t kheap_end = 0;
 
 page_directory_t *kernel_pml4 __attribute__((aligned(4096)));
-page_directory_t *current_pml4;
 
 // preallocated space for things
 page_directory_t *prealloc_pdpt;
@@ -87,16 +91,12 @@ void heap_dump_serial() {
 //     uint64_t phys_addr;
 // } __attribute__((packed)) page_directory_t;
 
-bool map_page_kmalloc(uint64_t virt, uint64_t phys, bool is_kernel, bool is_writeable, page_directory_t *pml4_root)
+// Find the page table covering virt, allocating any missing tables on the way
+static page_table_t *page_table_create(uint64_t virt, bool is_kernel, bool is_writeable, page_directory_t *pml4_root)
 {
     uint64_t pml4_index = (virt >> 39) & 0x1FF;
     uint64_t pdpt_index = (virt >> 30) & 0x1FF;
     uint64_t pd_index = (virt >> 21) & 0x1FF;
-    uint64_t pt_index = (virt >> 12) & 0x1FF;
-
-    if (phys_mem_bitmap != NULL) {
-        kassert_msg(!(phys_mem_bitmap[phys / 0x1000 / 8] & (1 << (phys / 0x1000 % 8))), "Attempted to map already used page!");
-    }
 
     uint64_t phys_mapped;
 
@@ -126,7 +126,17 @@ bool map_page_kmalloc(uint64_t virt, uint64_t phys, bool is_kernel, bool is_writ
         pd->entries[pd_index] = phys_mapped | (is_writeable ? 1<<1 : 0) | (is_kernel ? 0 : 1<<2) | 1;
     }
 
-    page_table_t *pt = (page_table_t *)(pd->virt[pd_index]);
+    return (page_table_t *)(pd->virt[pd_index]);
+}
+
+bool map_page_kmalloc(uint64_t virt, uint64_t phys, bool is_kernel, bool is_writeable, page_directory_t *pml4_root)
+{
+    if (phys_mem_bitmap != NULL) {
+        kassert_msg(!(phys_mem_bitmap[phys / 0x1000 / 8] & (1 << (phys / 0x1000 % 8))), "Attempted to map already used page!");
+    }
+
+    page_table_t *pt = page_table_create(virt, is_kernel, is_writeable, pml4_root);
+    uint64_t pt_index = (virt >> 12) & 0x1FF;
     if (pt->pt_entry[pt_index] != 0)
     {
         return false;
@@ -230,9 +240,11 @@ void free_page(uint64_t virt, page_directory_t *pml4) {
         return;
     }
 
-    uint64_t phys = pt->pt_entry[pt_index] & 0xFFFFFFFFFFFFF000;
-    uint64_t page = phys / 0x1000;
-    phys_mem_bitmap[page / 8] &= ~(1 << (page % 8));
+    if (!(pt->pt_entry[pt_index] & PAGE_TEMPLATE)) {
+        uint64_t phys = pt->pt_entry[pt_index] & 0xFFFFFFFFFFFFF000;
+        uint64_t page = phys / 0x1000;
+        phys_mem_bitmap[page / 8] &= ~(1 << (page % 8));
+    }
     pt->pt_entry[pt_index] = 0;
 }
 
@@ -382,6 +394,12 @@ void memory_init(uint64_t old_kheap_end, uint64_t mmap_tag_addr, uint64_t frameb
         memset(prealloc_pt, 0, sizeof(page_table_t));
     }
 
+    // copy-on-write relies on faults from the kernel's own writes too; the
+    // other CPUs start with this CR0
+    uint64_t cr0;
+    ASM_GET_CR0(cr0);
+    ASM_SET_CR0(cr0 | CR0_WP);
+
     serial_printf("Final state: %d%% of memory used\n", (first_free_page_addr() * 100) / total_memory);
     serial_printf("First free page: 0x%lx\n", first_free_page_addr());
 }
@@ -399,19 +417,19 @@ bool is_in_usable_memory(uint64_t phys_addr)
     return false;
 }
 
-uint64_t first_free_page_addr() {
+// Find the lowest free page frame, false if there's none
+static bool find_free_page(uint64_t *addr) {
     uint64_t *bitmap = (uint64_t *)phys_mem_bitmap;
     uint64_t first_free_bit = 0;
-    bool found = false;
 
-    while (!found) {
+    while (true) {
         while (bitmap[first_free_bit / 64] == 0xFFFFFFFFFFFFFFFF)
         {
             first_free_bit += 64;
         }
 
         if (first_free_bit > total_pages) {
-            kpanic("Out of memory");
+            return false;
         }
 
         // __builtin_ctzll gets the index of the first set bit
@@ -419,15 +437,77 @@ uint64_t first_free_page_addr() {
         first_free_bit += __builtin_ctzll(~bitmap[first_free_bit / 64]);
 
         if (first_free_bit > total_pages) {
-            kpanic("Out of memory");
+            return false;
         }
 
         if (is_in_usable_memory(first_free_bit * 0x1000)) {
             break;
         }
     }
-    
-    return first_free_bit * 0x1000;
+
+    *addr = first_free_bit * 0x1000;
+    return true;
+}
+
+uint64_t first_free_page_addr() {
+    uint64_t addr;
+    // cached executables give their pages back before we give up
+    while (!find_free_page(&addr)) {
+        if (exec_cache_reclaim() == 0) {
+            kpanic("Out of memory");
+        }
+    }
+
+    return addr;
+}
+
+/**
+ * Allocate a page frame that isn't mapped anywhere, for the kernel to hold
+ * on to.
+ *
+ * @return Its physical address
+ */
+uint64_t page_frame_alloc() {
+    uint64_t phys = first_free_page_addr();
+    uint64_t page = phys / 0x1000;
+    phys_mem_bitmap[page / 8] |= 1 << (page % 8);
+    return phys;
+}
+
+/**
+ * Free a page frame from page_frame_alloc().
+ *
+ * @param phys Its physical address
+ */
+void page_frame_free(uint64_t phys) {
+    uint64_t page = phys / 0x1000;
+    phys_mem_bitmap[page / 8] &= ~(1 << (page % 8));
+}
+
+/**
+ * Count the free page frames. Walks the whole bitmap, so it isn't cheap.
+ *
+ * @return How many pages of usable memory are free
+ */
+uint64_t free_page_count() {
+    uint64_t count = 0;
+    for (usable_memory_region_t *region = usable_memory_regions; region != NULL; region = region->next) {
+        uint64_t page = PAGE_ALIGN_UP(region->start) / 0x1000;
+        uint64_t end = region->end / 0x1000;
+        while (page < end && page <= total_pages) {
+            // a word at a time where the region covers all of it
+            if (page % 64 == 0 && page + 64 <= end) {
+                count += 64 - __builtin_popcountll(((uint64_t *)phys_mem_bitmap)[page / 64]);
+                page += 64;
+                continue;
+            }
+            if (!(phys_mem_bitmap[page / 8] & (1 << (page % 8)))) {
+                count++;
+            }
+            page++;
+        }
+    }
+    return count;
 }
 
 /**
@@ -553,8 +633,12 @@ page_directory_t *clone_page_directory(page_directory_t *directory)
                                 if (pt->pt_entry[l] != 0) {
                                     uint64_t new_phys = first_free_page_addr();
 
-                                    // map the new page
-                                    new_pt->pt_entry[l] = new_phys | (pt->pt_entry[l] & 0xFFF);
+                                    // map the new page, a private copy even of a template's page
+                                    uint64_t flags = pt->pt_entry[l] & 0xFFF & ~PAGE_TEMPLATE;
+                                    if (flags & PAGE_COW) {
+                                        flags = (flags & ~PAGE_COW) | 1 << 1;
+                                    }
+                                    new_pt->pt_entry[l] = new_phys | flags;
 
                                     // copy the old page to the new page
                                     memcpy((void *)(new_phys + VIRT_MEM_OFFSET), (void *)((pt->pt_entry[l] & 0xFFFFFFFFFFFFF000) + VIRT_MEM_OFFSET), 0x1000);
@@ -566,6 +650,10 @@ page_directory_t *clone_page_directory(page_directory_t *directory)
                                     phys_mem_bitmap[page / 8] |= 1 << (page % 8);
                                 }
                             }
+
+                            // a page table's worth of copying is up to 2MB,
+                            // let the IRQs' deferred work and others in
+                            cond_resched();
                         } else if (pd->entries[k] & 1) {
                             unimplemented("2MB page cloning");
                         }
@@ -584,6 +672,177 @@ page_directory_t *clone_page_directory(page_directory_t *directory)
     return new_directory;
 }
 
+/**
+ * Map every user page of an address space into a new one, without copying
+ * them: writeable pages are mapped read-only and copied on the first write
+ * to them, see page_cow_break(). The pages still belong to directory,
+ * which mustn't change or be freed while the new one maps them.
+ *
+ * @param directory The address space to share, a process template's
+ *
+ * @return The new address space
+ */
+page_directory_t *share_page_directory(page_directory_t *directory)
+{
+    page_directory_t *new_directory = (page_directory_t *)kmalloc_a(sizeof(page_directory_t));
+    memset(new_directory, 0, sizeof(page_directory_t));
+    new_directory->phys_addr = virt_to_phys((uint64_t)new_directory, kernel_pml4);
+
+    for (uint64_t i = 0; i < 511; i++) {
+        if (directory->virt[i] == 0) {
+            continue;
+        }
+        page_directory_t *pdpt = (page_directory_t *)(directory->virt[i]);
+        page_directory_t *new_pdpt = (page_directory_t *)kmalloc_a(sizeof(page_directory_t));
+        memset(new_pdpt, 0, sizeof(page_directory_t));
+        new_directory->virt[i] = (uint64_t)new_pdpt;
+        new_directory->entries[i] = virt_to_phys((uint64_t)new_pdpt, kernel_pml4) | (directory->entries[i] & 0xFFF);
+        new_directory->is_full[i] = directory->is_full[i];
+
+        for (uint64_t j = 0; j < 512; j++) {
+            if (pdpt->virt[j] == 0) {
+                continue;
+            }
+            page_directory_t *pd = (page_directory_t *)(pdpt->virt[j]);
+            page_directory_t *new_pd = (page_directory_t *)kmalloc_a(sizeof(page_directory_t));
+            memset(new_pd, 0, sizeof(page_directory_t));
+            new_pdpt->virt[j] = (uint64_t)new_pd;
+            new_pdpt->entries[j] = virt_to_phys((uint64_t)new_pd, kernel_pml4) | (pdpt->entries[j] & 0xFFF);
+            new_pdpt->is_full[j] = pdpt->is_full[j];
+
+            for (uint64_t k = 0; k < 512; k++) {
+                if (pd->virt[k] != 0) {
+                    page_table_t *pt = (page_table_t *)(pd->virt[k]);
+                    page_table_t *new_pt = (page_table_t *)kmalloc_a(sizeof(page_table_t));
+                    new_pd->virt[k] = (uint64_t)new_pt;
+                    new_pd->entries[k] = virt_to_phys((uint64_t)new_pt, kernel_pml4) | (pd->entries[k] & 0xFFF);
+                    new_pd->is_full[k] = pd->is_full[k];
+
+                    for (uint64_t l = 0; l < 512; l++) {
+                        uint64_t entry = pt->pt_entry[l];
+                        if (entry != 0) {
+                            entry |= PAGE_TEMPLATE;
+                            if (entry & (1 << 1)) {
+                                entry = (entry & ~(1ULL << 1)) | PAGE_COW;
+                            }
+                        }
+                        new_pt->pt_entry[l] = entry;
+                    }
+                } else if (pd->entries[k] & 1) {
+                    unimplemented("2MB page sharing");
+                }
+            }
+        }
+    }
+
+    // last entry is the kernel space, just copy it
+    new_directory->virt[511] = directory->virt[511];
+    new_directory->entries[511] = directory->entries[511];
+    new_directory->is_full[511] = directory->is_full[511];
+
+    return new_directory;
+}
+
+// Find the page table covering virt, NULL if there's none
+static page_table_t *page_table_find(uint64_t virt, page_directory_t *pml4)
+{
+    uint64_t pml4_index = (virt >> 39) & 0x1FF;
+    uint64_t pdpt_index = (virt >> 30) & 0x1FF;
+    uint64_t pd_index = (virt >> 21) & 0x1FF;
+
+    if (pml4->virt[pml4_index] == 0)
+    {
+        return NULL;
+    }
+    page_directory_t *pdpt = (page_directory_t *)(pml4->virt[pml4_index]);
+    if (pdpt->virt[pdpt_index] == 0)
+    {
+        return NULL;
+    }
+    page_directory_t *pd = (page_directory_t *)(pdpt->virt[pdpt_index]);
+    if (pd->virt[pd_index] == 0)
+    {
+        return NULL;
+    }
+    return (page_table_t *)(pd->virt[pd_index]);
+}
+
+spinlock_t cow_lock = SPINLOCK_INIT("cow");
+
+/**
+ * Handle a write fault on a copy-on-write page: give the address space a
+ * private, writeable copy of it.
+ *
+ * @param virt The faulting address
+ * @param pd The address space it faulted in
+ *
+ * @return true if the write can be retried, false if the page isn't
+ *      copy-on-write, and the fault a real one
+ */
+bool page_cow_break(uint64_t virt, page_directory_t *pd)
+{
+    uint64_t flags;
+    spin_lock_irqsave(&cow_lock, flags);
+
+    page_table_t *pt = page_table_find(virt, pd);
+    uint64_t pt_index = (virt >> 12) & 0x1FF;
+    if (pt == NULL || !(pt->pt_entry[pt_index] & 1))
+    {
+        spin_unlock_irqrestore(&cow_lock, flags);
+        return false;
+    }
+    uint64_t entry = pt->pt_entry[pt_index];
+    if (!(entry & PAGE_COW))
+    {
+        // another thread of the address space got here first, and this
+        // CPU's TLB still had the read-only entry
+        bool writeable = entry & (1 << 1);
+        spin_unlock_irqrestore(&cow_lock, flags);
+        ASM_INVLPG(virt);
+        return writeable;
+    }
+
+    uint64_t new_phys = first_free_page_addr();
+    uint64_t page = new_phys / 0x1000;
+    phys_mem_bitmap[page / 8] |= 1 << (page % 8);
+    memcpy((void *)(new_phys + VIRT_MEM_OFFSET), (void *)((entry & 0x000FFFFFFFFFF000) + VIRT_MEM_OFFSET), 0x1000);
+
+    // going from read-only to writeable, other CPUs' stale entries fault
+    // at worst and end up above
+    pt->pt_entry[pt_index] = new_phys | (entry & (0xFFF | 1ULL << 63) & ~(PAGE_TEMPLATE | PAGE_COW)) | 1 << 1;
+    spin_unlock_irqrestore(&cow_lock, flags);
+
+    ASM_INVLPG(virt);
+    return true;
+}
+
+/**
+ * Map a user page that belongs to something other than the address space,
+ * like a cached executable's prepared contents. It's never freed with the
+ * address space, and a writeable one is mapped copy-on-write, so the owner's
+ * copy never changes.
+ *
+ * @param virt Where to map it
+ * @param phys The page frame
+ * @param is_writeable Whether the process may write to (its copy of) it
+ * @param pml4_root The address space
+ *
+ * @return true if mapped, false if something was mapped there already
+ */
+bool map_page_borrowed(uint64_t virt, uint64_t phys, bool is_writeable, page_directory_t *pml4_root)
+{
+    // the tables stay writeable for the pages around it
+    page_table_t *pt = page_table_create(virt, false, true, pml4_root);
+    uint64_t pt_index = (virt >> 12) & 0x1FF;
+    if (pt->pt_entry[pt_index] != 0)
+    {
+        return false;
+    }
+
+    pt->pt_entry[pt_index] = (phys & 0xFFFFFFFFFFFFF000) | PAGE_TEMPLATE | (is_writeable ? PAGE_COW : 0) | 1 << 2 | 1;
+    return true;
+}
+
 void serial_dump_mappings(page_directory_t *pml4, bool include_kernel) {
     serial_printf("Mappings for PML4 0x%lx\n", pml4);
     for (uint64_t i = 0; i < (include_kernel ? 512 : 511); i++) {
@@ -610,7 +869,9 @@ void serial_dump_mappings(page_directory_t *pml4, bool include_kernel) {
     }    
 }
 
-void free_page_directory(page_directory_t *directory)
+// Free every user page and table of an address space, and the PML4. With
+// preemptible set, gives up the CPU between page tables.
+static void free_page_directory_internal(page_directory_t *directory, bool preemptible)
 {
     for (uint32_t i = 0; i < 511; i++)
     {
@@ -629,7 +890,7 @@ void free_page_directory(page_directory_t *directory)
                             page_table_t *pt = (page_table_t *)(pd->virt[k]);
                             for (uint32_t l = 0; l < 512; l++)
                             {
-                                if (pt->pt_entry[l] != 0)
+                                if (pt->pt_entry[l] != 0 && !(pt->pt_entry[l] & PAGE_TEMPLATE))
                                 {
                                     // mark the page as free
                                     uint64_t phys = pt->pt_entry[l] & 0xFFFFFFFFFFFFF000;
@@ -638,6 +899,11 @@ void free_page_directory(page_directory_t *directory)
                                 }
                             }
                             kfree_a((void *)pt);
+
+                            if (preemptible)
+                            {
+                                cond_resched();
+                            }
                         }
                     }
                     kfree_a((void *)pd);
@@ -649,6 +915,68 @@ void free_page_directory(page_directory_t *directory)
     kfree_a((void *)directory);
 }
 
+void free_page_directory(page_directory_t *directory)
+{
+    free_page_directory_internal(directory, false);
+}
+
+// Address spaces of exited processes, freed by reclaim_page_directories()
+page_directory_t *reclaim_list = NULL;
+spinlock_t reclaim_lock = SPINLOCK_INIT("reclaim");
+workqueue_t *reclaim_wq = NULL;
+
+static void reclaim_page_directories(work_t *work)
+{
+    UNUSED(work);
+
+    uint64_t flags;
+    spin_lock_irqsave(&reclaim_lock, flags);
+    while (reclaim_list != NULL)
+    {
+        page_directory_t *directory = reclaim_list;
+        reclaim_list = directory->reclaim_next;
+        spin_unlock_irqrestore(&reclaim_lock, flags);
+
+        free_page_directory_internal(directory, true);
+
+        spin_lock_irqsave(&reclaim_lock, flags);
+    }
+    spin_unlock_irqrestore(&reclaim_lock, flags);
+}
+
+work_t reclaim_work = WORK_INIT(reclaim_work, reclaim_page_directories);
+
+/**
+ * Free an address space in the background, so an exiting process doesn't
+ * wait for its memory to be walked and freed. The reclaimer thread frees
+ * it a page table at a time, letting other processes run in between.
+ *
+ * @param directory The address space, which must no longer be loaded on any CPU
+ */
+void free_page_directory_deferred(page_directory_t *directory)
+{
+    if (reclaim_wq == NULL)
+    {
+        // no kernel threads yet
+        free_page_directory(directory);
+        return;
+    }
+
+    uint64_t flags;
+    spin_lock_irqsave(&reclaim_lock, flags);
+    directory->reclaim_next = reclaim_list;
+    reclaim_list = directory;
+    spin_unlock_irqrestore(&reclaim_lock, flags);
+
+    queue_work(reclaim_wq, &reclaim_work);
+}
+
+// Start the reclaimer, once kernel threads can run
+void reclaim_init()
+{
+    reclaim_wq = workqueue_create("reclaim");
+}
+
 void switch_page_directory(page_directory_t *directory)
 {
     current_pml4 = directory;
@@ -663,9 +991,13 @@ void free_page_addr(uint64_t virt, page_directory_t *pd)
         return;
     }
     
-    // clear bit in bitmap
-    uint64_t page = phys / 0x1000;
-    phys_mem_bitmap[page / 8] &= ~(1 << (page % 8));
+    // clear bit in bitmap, unless a template owns the page
+    page_table_t *entry_pt = page_table_find(virt, pd);
+    if (entry_pt == NULL || !(entry_pt->pt_entry[(virt >> 12) & 0x1FF] & PAGE_TEMPLATE))
+    {
+        uint64_t page = phys / 0x1000;
+        phys_mem_bitmap[page / 8] &= ~(1 << (page % 8));
+    }
 
     uint64_t pml4_index = (virt >> 39) & 0x1FF;
     uint64_t pdpt_index = (virt >> 30) & 0x1FF;
@@ -835,6 +1167,127 @@ bool is_mapped_user_range(uint64_t start, uint64_t length, page_directory_t *pd)
     return true;
 }
 
+uint64_t kstack_slot_bitmap[KSTACK_MAX_SLOTS / 64];
+uint32_t kstack_next_slot = 0;
+
+/**
+ * Allocate a kernel stack backed directly by physical frames, with unmapped
+ * guard pages below it.
+ *
+ * @param pages The number of pages of usable stack (at most KSTACK_MAX_PAGES)
+ *
+ * @return The lowest usable address of the stack; the top is at
+ *         stack + pages * 0x1000
+ */
+void *kstack_alloc(uint32_t pages)
+{
+    kassert_msg(pages > 0 && pages <= KSTACK_MAX_PAGES, "Invalid kernel stack size: %d pages", pages);
+
+    // Search from just after the last allocation, so recently freed slots
+    // (and their stale TLB entries) aren't immediately reused
+    uint32_t slot = kstack_next_slot;
+    uint32_t searched = 0;
+    while (kstack_slot_bitmap[slot / 64] & (1ULL << (slot % 64)))
+    {
+        slot = (slot + 1) % KSTACK_MAX_SLOTS;
+        if (++searched == KSTACK_MAX_SLOTS)
+        {
+            kpanic("Out of kernel stack slots");
+        }
+    }
+    kstack_slot_bitmap[slot / 64] |= 1ULL << (slot % 64);
+    kstack_next_slot = (slot + 1) % KSTACK_MAX_SLOTS;
+
+    uint64_t top = KSTACK_AREA_START + ((uint64_t)slot + 1) * KSTACK_SLOT_SIZE;
+    uint64_t bottom = top - (uint64_t)pages * 0x1000;
+    for (uint64_t addr = bottom; addr < top; addr += 0x1000)
+    {
+        kassert_msg(map_page_kmalloc(addr, first_free_page_addr(), true, true, kernel_pml4), "Failed to map kernel stack page at 0x%lx", addr);
+    }
+
+    return (void *)bottom;
+}
+
+/**
+ * Free a kernel stack allocated with kstack_alloc.
+ *
+ * @param stack The value returned by kstack_alloc
+ * @param pages The number of pages the stack was allocated with
+ */
+void kstack_free(void *stack, uint32_t pages)
+{
+    uint64_t bottom = (uint64_t)stack;
+    kassert_msg(bottom >= KSTACK_AREA_START, "Freeing kernel stack outside of stack area: 0x%lx", bottom);
+
+    uint64_t top = bottom + (uint64_t)pages * 0x1000;
+    for (uint64_t addr = bottom; addr < top; addr += 0x1000)
+    {
+        free_page(addr, kernel_pml4);
+        ASM_INVLPG(addr);
+    }
+
+    uint32_t slot = (bottom - KSTACK_AREA_START) / KSTACK_SLOT_SIZE;
+    kstack_slot_bitmap[slot / 64] &= ~(1ULL << (slot % 64));
+}
+
+uint64_t mmio_next = MMIO_AREA_START;
+
+/**
+ * Map device memory into kernel space, uncached. The frames aren't RAM, so
+ * they're left alone in the physical memory bitmap. Mappings are permanent.
+ *
+ * @param phys The physical address of the registers, need not be page aligned
+ * @param size The number of bytes to map
+ *
+ * @return The virtual address corresponding to phys
+ */
+void *kmap_mmio(uint64_t phys, uint64_t size)
+{
+    uint64_t offset = phys & 0xFFF;
+    uint64_t pages = PAGE_ALIGN_UP(offset + size) / 0x1000;
+
+    kassert_msg(mmio_next + pages * 0x1000 <= MMIO_AREA_START + MMIO_AREA_SIZE, "Out of MMIO mapping space");
+
+    uint64_t virt = mmio_next;
+    mmio_next += pages * 0x1000;
+
+    for (uint64_t i = 0; i < pages; i++)
+    {
+        page_table_t *pt = page_table_create(virt + i * 0x1000, true, true, kernel_pml4);
+        pt->pt_entry[((virt + i * 0x1000) >> 12) & 0x1FF] = ((phys & 0xFFFFFFFFFFFFF000) + i * 0x1000) | PAGE_PCD | PAGE_PWT | (1<<1) | 1;
+    }
+
+    return (void *)(virt + offset);
+}
+
+/**
+ * Identity map a page of low memory in the kernel's address space, for code
+ * that turns paging on before it can jump to the kernel (the SMP
+ * trampoline). The frame must already be reserved, it isn't marked in the
+ * physical page bitmap.
+ *
+ * @param phys The page to map, below 4GB
+ */
+void kmap_identity(uint64_t phys)
+{
+    page_table_t *pt = page_table_create(phys, true, true, kernel_pml4);
+    pt->pt_entry[(phys >> 12) & 0x1FF] = (phys & 0xFFFFFFFFFFFFF000) | (1<<1) | 1;
+}
+
+/**
+ * Drop every identity mapping made with kmap_identity(), so the low half is
+ * empty again before user address spaces are cloned from the kernel's.
+ */
+void kunmap_identity()
+{
+    kernel_pml4->virt[0] = 0;
+    kernel_pml4->entries[0] = 0;
+
+    uint64_t cr3;
+    ASM_GET_CR3(cr3);
+    ASM_SET_CR3(cr3);
+}
+
 void __attribute__((malloc)) *kmalloc_int(uint64_t size, bool align, uint64_t *phys)
 {
     if (kheap == NULL)
@@ -1020,50 +1473,78 @@ void kfree_int(void *ptr, bool unaligned)
 
 void kfree(void *ptr)
 {
+    HEAP_PROFILE_FREE(ptr);
     kfree_int(ptr, false);
 }
 
 void kfree_a(void *ptr)
 {
+    HEAP_PROFILE_FREE(ptr);
     kfree_int(ptr, true);
 }
 
-void *kmalloc_a(uint64_t size)
+// The allocation wrappers are kept out of line so the profiler sees the real
+// call site as the return address
+void __attribute__((noinline)) *kmalloc_a(uint64_t size)
 {
-    return kmalloc_int(size, true, NULL);
+    void *ptr = kmalloc_int(size, true, NULL);
+    HEAP_PROFILE_ALLOC(ptr, size);
+    return ptr;
 }
 
-void *kmalloc_p(uint64_t size, uint64_t *phys)
+void __attribute__((noinline)) *kmalloc_p(uint64_t size, uint64_t *phys)
 {
-    return kmalloc_int(size, false, phys);
+    void *ptr = kmalloc_int(size, false, phys);
+    HEAP_PROFILE_ALLOC(ptr, size);
+    return ptr;
 }
 
-void *kmalloc_ap(uint64_t size, uint64_t *phys)
+void __attribute__((noinline)) *kmalloc_ap(uint64_t size, uint64_t *phys)
 {
-    return kmalloc_int(size, true, phys);
+    void *ptr = kmalloc_int(size, true, phys);
+    HEAP_PROFILE_ALLOC(ptr, size);
+    return ptr;
 }
 
-void *kmalloc(uint64_t size)
+void __attribute__((noinline)) *kmalloc(uint64_t size)
 {
-    return kmalloc_int(size, false, NULL);
+    void *ptr = kmalloc_int(size, false, NULL);
+    HEAP_PROFILE_ALLOC(ptr, size);
+    return ptr;
 }
 
-void *krealloc(void *ptr, uint64_t size)
+void __attribute__((noinline)) *krealloc(void *ptr, uint64_t size)
 {
     heap_header_t *header = (heap_header_t *)((uint64_t)ptr - sizeof(heap_header_t));
-    void *new_ptr = kmalloc(size);
-    memcpy(new_ptr, ptr, header->length);
+    void *new_ptr = kmalloc_int(size, false, NULL);
+    HEAP_PROFILE_ALLOC(new_ptr, size);
+    memcpy(new_ptr, ptr, header->length < size ? header->length : size);
     kfree(ptr);
     return new_ptr;
 }
 
 
+/**
+ * Change the protection of mapped pages of the current address space.
+ *
+ * @param addr The first page
+ * @param length How many bytes, rounded up to whole pages
+ * @param prot PROT_*
+ *
+ * @return 0 if successful
+ *      -ENOMEM if a page isn't mapped, leaving the ones before it changed
+ */
 int memory_set_protection(void *addr, uint64_t length, uint64_t prot)
 {
     bool is_read = prot & PROT_READ;
     bool is_write = prot & PROT_WRITE;
     bool is_exec = prot & PROT_EXEC;
 
+    // bit 63 is reserved unless EFER.NXE is on, and faults if set
+    uint64_t efer;
+    ASM_RDMSR(0xC0000080, efer);
+    uint64_t no_exec = !is_exec && (efer & (1 << 11)) ? 1ULL << 63 : 0;
+
     uint64_t start = (uint64_t)addr;
     uint64_t end = start + length;
     uint64_t pages = (end - start) / 0x1000;
@@ -1105,9 +1586,15 @@ int memory_set_protection(void *addr, uint64_t length, uint64_t prot)
 
         uint64_t entry = pt->pt_entry[pt_index];
         // bit 63 is execute-disable, bit 1 is writeable, bit 0 is present
-        entry = (entry & 0x7FFFFFFFFFFFFFFC) | (is_exec ? 0 : 1ULL << 63) | (is_write ? 1 << 1 : 0) | (is_read ? 1 : 0);
+        entry = (entry & 0x7FFFFFFFFFFFFFFC & ~PAGE_COW) | no_exec | (is_write ? 1 << 1 : 0) | (is_read ? 1 : 0);
+        if ((entry & PAGE_TEMPLATE) && is_write)
+        {
+            // still the template's, so only writeable through a copy
+            entry = (entry & ~(1ULL << 1)) | PAGE_COW;
+        }
 
         pt->pt_entry[pt_index] = entry;
+        ASM_INVLPG(page);
     }
 
     return 0;
@@ -1126,4 +1613,19 @@ int64_t heap_free_space()
         header = header->next;
     }
     return free_space;
+}
+
+int64_t heap_largest_free_block()
+{
+    heap_header_t *header = kheap;
+    int64_t largest = 0;
+    while (header != NULL)
+    {
+        if (header->free && (int64_t)header->length > largest)
+        {
+            largest = header->length;
+        }
+        header = header->next;
+    }
+    return largest;
 }
\ No newline at end of file
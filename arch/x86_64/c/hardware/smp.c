@@ -0,0 +1,227 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include <smp.h>
+#include <acpi.h>
+#include <apic.h>
+#include <clock.h>
+#include <memory.h>
+#include <string.h>
+#include <serial.h>
+#include <errors.h>
+#include <syscall.h>
+#include <fpu.h>
+
+cpu_t cpus[SMP_MAX_CPUS] = {
+    [0] = {
+        .id = 0,
+        .online = true,
+        .schedulable = true,
+        .tss = &tss,
+        .tss_selector = GDT_BSP_TSS_SELECTOR,
+    },
+};
+uint32_t cpu_count = 1;
+
+// CPU index for each APIC ID
+uint8_t apic_to_cpu[256];
+
+extern uint8_t smp_trampoline_start[];
+extern uint8_t smp_trampoline_end[];
+extern uint8_t smp_trampoline_params[];
+
+// the boot CPU's exit stack, from process.c
+extern char temp_stack[];
+
+_Static_assert(offsetof(percpu_t, self) == PERCPU_SELF, "percpu_t.self moved");
+_Static_assert(offsetof(percpu_t, process) == PERCPU_PROCESS, "percpu_t.process moved");
+_Static_assert(offsetof(percpu_t, user_rsp) == PERCPU_USER_RSP, "percpu_t.user_rsp moved");
+_Static_assert(offsetof(percpu_t, syscall_stack_top) == PERCPU_SYSCALL_STACK_TOP, "percpu_t.syscall_stack_top moved");
+_Static_assert(offsetof(cpu_t, percpu) == 0, "cpu_t must start with its percpu_t");
+
+/**
+ * Point this CPU's GS base at its per-CPU area. KERNEL_GS_BASE holds the
+ * user's GS base, swapgs exchanges the two on every kernel entry and exit.
+ *
+ * @param area The per-CPU area of the calling CPU
+ * @param temp_stack Bottom of the stack exiting processes switch to
+ */
+void percpu_init(percpu_t *area, void *temp_stack)
+{
+    area->self = area;
+    area->temp_stack = temp_stack;
+
+    uint64_t base = (uint64_t)area;
+    ASM_WRMSR_ADC(base, base >> 32, MSR_GS_BASE);
+    ASM_WRMSR_ADC(0, 0, MSR_KERNEL_GS_BASE);
+}
+
+/**
+ * Add up one of the percpu_t.stats counters over every CPU.
+ *
+ * @param offset Offset of the counter in percpu_t, see percpu_stat_sum()
+ *
+ * @return The total
+ */
+uint64_t percpu_stat_total(size_t offset)
+{
+    uint64_t total = 0;
+    for (uint32_t i = 0; i < cpu_count; i++)
+    {
+        total += *(volatile uint64_t *)((uint64_t)&cpus[i].percpu + offset);
+    }
+    return total;
+}
+
+/**
+ * Set up the boot CPU's per-CPU area. This has to run before anything
+ * touches current_process or current_pml4.
+ */
+void smp_init_bsp()
+{
+    percpu_init(&cpus[0].percpu, temp_stack);
+}
+
+/**
+ * Where each AP lands in the kernel, on its own stack with its cpu_t.
+ *
+ * APs don't take processes yet. Entry state, runqueues and need_resched
+ * are per-CPU, but the kernel heap, the page allocator and the process
+ * list still have no locks, and APs have no timer of their own, so an AP
+ * mustn't run anything that could touch them. It parks with interrupts off
+ * and cpu_t.schedulable stays false.
+ *
+ * @param cpu The CPU that was started
+ */
+void __attribute__((noreturn)) ap_main(cpu_t *cpu)
+{
+    tables_init_ap(cpu->tss_selector);
+    percpu_init(&cpu->percpu, cpu->percpu.temp_stack);
+    fpu_init();
+    current_pml4 = kernel_pml4;
+    current_process = cpu->idle;
+    lapic_enable();
+
+    cpu->online = true;
+
+    while (1)
+    {
+        ASM_HLT;
+    }
+}
+
+// Start one AP and wait for it to come up
+static bool smp_boot_ap(cpu_t *cpu, smp_trampoline_params_t *params)
+{
+    params->stack = (uint64_t)cpu->stack + SYSCALL_STACK_SIZE;
+    params->entry = (uint64_t)&ap_main;
+    params->cpu = (uint64_t)cpu;
+
+    // INIT, then two STARTUPs as the MP spec asks for
+    lapic_send_ipi(cpu->apic_id, LAPIC_ICR_INIT | LAPIC_ICR_ASSERT);
+    clock_delay_us(10000);
+
+    for (int i = 0; i < 2 && !cpu->online; i++)
+    {
+        lapic_send_ipi(cpu->apic_id, LAPIC_ICR_STARTUP | (SMP_TRAMPOLINE_ADDR >> 12));
+        clock_delay_us(200);
+    }
+
+    for (uint64_t waited = 0; !cpu->online && waited < SMP_AP_TIMEOUT_US; waited += 100)
+    {
+        clock_delay_us(100);
+    }
+
+    return cpu->online;
+}
+
+// Give up on an AP that didn't report in. INIT holds it in reset, waiting
+// for a STARTUP that never comes, so it can't reach ap_main() late with a
+// cpu_t that's about to be handed to the next AP. Then its resources can go.
+static void smp_abandon_ap(cpu_t *cpu)
+{
+    lapic_send_ipi(cpu->apic_id, LAPIC_ICR_INIT | LAPIC_ICR_ASSERT);
+    clock_delay_us(10000);
+
+    apic_to_cpu[cpu->apic_id] = 0;
+    process_free_idle(cpu->idle);
+    kfree_a(cpu->tss);
+    kstack_free(cpu->percpu.temp_stack, SYSCALL_STACK_SIZE / 0x1000);
+    kstack_free(cpu->stack, SYSCALL_STACK_SIZE / 0x1000);
+    memset(cpu, 0, sizeof(cpu_t));
+}
+
+/**
+ * Start every other CPU listed in the MADT. Each gets a cpu_t with its own
+ * stack, TSS, runqueue and idle process.
+ */
+void smp_init()
+{
+    if (lapic == NULL || madt_info.cpu_count <= 1)
+    {
+        serial_printf("SMP: single CPU\n");
+        return;
+    }
+
+    uint32_t bsp = lapic_id();
+    cpus[0].apic_id = bsp;
+    apic_to_cpu[bsp] = 0;
+
+    uint64_t size = smp_trampoline_end - smp_trampoline_start;
+    kassert_msg(size <= 0x1000, "SMP trampoline is too large");
+    memcpy((void *)(SMP_TRAMPOLINE_ADDR + VIRT_MEM_OFFSET), smp_trampoline_start, size);
+
+    // the trampoline turns paging on before it can jump up to the kernel,
+    // so it has to be mapped where it runs
+    kmap_identity(SMP_TRAMPOLINE_ADDR);
+
+    smp_trampoline_params_t *params = (smp_trampoline_params_t *)(SMP_TRAMPOLINE_ADDR + VIRT_MEM_OFFSET + (smp_trampoline_params - smp_trampoline_start));
+
+    uint64_t cr0, cr3, cr4, efer;
+    ASM_GET_CR0(cr0);
+    ASM_GET_CR3(cr3);
+    ASM_GET_CR4(cr4);
+    ASM_RDMSR(0xC0000080, efer);
+    kassert_msg(cr3 < 0x100000000, "Kernel page tables must be below 4GB for the SMP trampoline");
+
+    params->cr0 = cr0 & ~CR0_TS; // fpu_init() sets it again
+    params->cr3 = cr3;
+    params->cr4 = cr4 & ~(1 << 17); // PCIDE can only be set once in long mode
+    params->efer = efer & ~(1 << 10); // LMA is set by the CPU
+
+    for (uint32_t i = 0; i < madt_info.cpu_count && cpu_count < SMP_MAX_CPUS; i++)
+    {
+        uint32_t apic_id = madt_info.apic_ids[i];
+        if (apic_id == bsp)
+        {
+            continue;
+        }
+
+        cpu_t *cpu = &cpus[cpu_count];
+        cpu->id = cpu_count;
+        cpu->apic_id = apic_id;
+        cpu->online = false;
+        cpu->schedulable = false;
+        cpu->stack = kstack_alloc(SYSCALL_STACK_SIZE / 0x1000);
+        cpu->percpu.temp_stack = kstack_alloc(SYSCALL_STACK_SIZE / 0x1000);
+        cpu->tss = (tss_entry_t *)kmalloc_a(sizeof(tss_entry_t));
+        cpu->tss_selector = tss_install(cpu->id, cpu->tss, (uint64_t)cpu->stack + SYSCALL_STACK_SIZE);
+        cpu->idle = process_create_idle(cpu->id, cpu->stack);
+        runqueue_init(&cpu->runqueue);
+        apic_to_cpu[apic_id] = cpu->id;
+
+        if (!smp_boot_ap(cpu, params))
+        {
+            serial_printf("SMP: CPU with APIC ID %d didn't start\n", apic_id);
+            smp_abandon_ap(cpu);
+            continue;
+        }
+
+        cpu_count++;
+    }
+
+    kunmap_identity();
+
+    serial_printf("SMP: %d CPUs online\n", cpu_count);
+}
@@ -14,6 +14,12 @@
 #include <string.h>
 #include <tables.h>
 #include <pipe.h>
+#include <clock.h>
+#include <softirq.h>
+#include <preempt.h>
+#include <futex.h>
+#include <template.h>
+#include <binfmt.h>
 
 syscall_t syscall_table[512];
 
@@ -59,10 +65,34 @@ uint64_t syscall_fork(regs_t *regs) {
     return (uint64_t)kfork();
 }
 
+uint64_t syscall_clone(regs_t *regs) {
+    return (uint64_t)kclone(regs->rdi, regs->rsi, (pid_t *)regs->rdx, (pid_t *)regs->r10, regs->r8);
+}
+
+uint64_t syscall_arch_prctl(regs_t *regs) {
+    return (uint64_t)karch_prctl(regs->rdi, regs->rsi);
+}
+
+uint64_t syscall_futex(regs_t *regs) {
+    return (uint64_t)kfutex((uint32_t *)regs->rdi, regs->rsi, regs->rdx, (const struct timespec *)regs->r10);
+}
+
+uint64_t syscall_set_tid_address(regs_t *regs) {
+    return (uint64_t)kset_tid_address((uint32_t *)regs->rdi);
+}
+
 uint64_t syscall_execv(regs_t *regs) {
     return (uint64_t)kexecv(regs);
 }
 
+uint64_t syscall_template_register(regs_t *regs) {
+    return (uint64_t)ktemplate_register((const char *)regs->rdi, (template_args_t *)regs->rsi);
+}
+
+uint64_t syscall_template_unregister(regs_t *regs) {
+    return (uint64_t)ktemplate_unregister((const char *)regs->rdi);
+}
+
 uint64_t syscall_wait4(regs_t *regs) {
     void *status = (void *)regs->rsi;
     int options = regs->rdx;
@@ -72,6 +102,14 @@ uint64_t syscall_wait4(regs_t *regs) {
     return (uint64_t)process_wait(pid, status, options, rusage);
 }
 
+uint64_t syscall_getrusage(regs_t *regs) {
+    return (uint64_t)kgetrusage(regs->rdi, (struct rusage *)regs->rsi);
+}
+
+uint64_t syscall_times(regs_t *regs) {
+    return (uint64_t)ktimes((struct tms *)regs->rdi);
+}
+
 uint64_t syscall_lseek(regs_t *regs) {
     return (uint64_t)kflseek(regs->rdi, regs->rsi, regs->rdx);
 }
@@ -85,6 +123,22 @@ uint64_t syscall_brk(regs_t *regs) {
     return (uint64_t)kbrk(regs->rdi);
 }
 
+uint64_t syscall_mmap(regs_t *regs) {
+    return (uint64_t)kmmap(regs->rdi, regs->rsi, regs->rdx, regs->r10, regs->r8, regs->r9);
+}
+
+uint64_t syscall_mprotect(regs_t *regs) {
+    return (uint64_t)kmprotect(regs->rdi, regs->rsi, regs->rdx);
+}
+
+uint64_t syscall_munmap(regs_t *regs) {
+    return (uint64_t)kmunmap(regs->rdi, regs->rsi);
+}
+
+uint64_t syscall_personality(regs_t *regs) {
+    return (uint64_t)kpersonality(regs->rdi);
+}
+
 uint64_t syscall_fstat(regs_t *regs) {
     return (uint64_t)kfstat(regs->rdi, (struct stat *)regs->rsi);
 }
@@ -95,7 +149,7 @@ uint64_t syscall_rt_sigaction(regs_t *regs) {
 
 uint64_t __attribute__((noreturn)) syscall_rt_sigret(regs_t *regs) {
     UNUSED(regs);
-    krt_sigret(regs->rdi); // Custom: rdi contains 0 if this was a regular signal, or 1 if this was an after-syscall signal
+    krt_sigret();
     kpanic("rt_sigret() returned");
 }
 
@@ -115,6 +169,20 @@ uint64_t syscall_getppid(regs_t *regs) {
     return (uint64_t)current_process->ppid;
 }
 
+uint64_t syscall_sched_yield(regs_t *regs) {
+    UNUSED(regs);
+
+    return (uint64_t)process_yield();
+}
+
+uint64_t syscall_getpriority(regs_t *regs) {
+    return (uint64_t)process_getpriority(regs->rdi, regs->rsi);
+}
+
+uint64_t syscall_setpriority(regs_t *regs) {
+    return (uint64_t)process_setpriority(regs->rdi, regs->rsi, regs->rdx);
+}
+
 uint64_t syscall_getpgrp(regs_t *regs) {
     UNUSED(regs);
 
@@ -126,9 +194,31 @@ uint64_t syscall_stat(regs_t *regs) {
 }
 
 uint64_t syscall_timeofday(regs_t *regs) {
-    UNUSED(regs);
+    return (uint64_t)kgettimeofday((struct timeval *)regs->rdi, (void *)regs->rsi);
+}
+
+uint64_t syscall_nanosleep(regs_t *regs) {
+    return (uint64_t)knanosleep((const struct timespec *)regs->rdi, (struct timespec *)regs->rsi);
+}
+
+uint64_t syscall_getitimer(regs_t *regs) {
+    return (uint64_t)kgetitimer(regs->rdi, (struct itimerval *)regs->rsi);
+}
+
+uint64_t syscall_alarm(regs_t *regs) {
+    return (uint64_t)kalarm(regs->rdi);
+}
 
-    return 1713812590; // Arbitrary time (2024-04-22 12:03:10)
+uint64_t syscall_setitimer(regs_t *regs) {
+    return (uint64_t)ksetitimer(regs->rdi, (const struct itimerval *)regs->rsi, (struct itimerval *)regs->rdx);
+}
+
+uint64_t syscall_clock_gettime(regs_t *regs) {
+    return (uint64_t)kclock_gettime(regs->rdi, (struct timespec *)regs->rsi);
+}
+
+uint64_t syscall_clock_getres(regs_t *regs) {
+    return (uint64_t)kclock_getres(regs->rdi, (struct timespec *)regs->rsi);
 }
 
 uint64_t syscall_sigprocmask(regs_t *regs) {
@@ -158,17 +248,31 @@ uint64_t syscall_geteuid(regs_t *regs) {
 }
 
 uint64_t syscall_setpgid(regs_t *regs) {
-    current_process->gid = regs->rdi;
-    return 0;
+    return (uint64_t)ksetpgid(regs->rdi, regs->rsi);
 }
 
 uint64_t syscall_setuid(regs_t *regs) {
-    current_process->uid = regs->rdi;
+    uid_t uid = regs->rdi;
+    // root changes every ID, anyone else may only go back to their real one
+    if (current_process->euid == 0) {
+        current_process->uid = uid;
+    } else if (uid != current_process->uid) {
+        return (uint64_t)-EPERM;
+    }
+    current_process->euid = uid;
+    current_process->fsuid = uid;
     return 0;
 }
 
 uint64_t syscall_setgid(regs_t *regs) {
-    current_process->gid = regs->rdi;
+    gid_t gid = regs->rdi;
+    if (current_process->euid == 0) {
+        current_process->gid = gid;
+    } else if (gid != current_process->gid) {
+        return (uint64_t)-EPERM;
+    }
+    current_process->egid = gid;
+    current_process->fsgid = gid;
     return 0;
 }
 
@@ -208,6 +312,9 @@ void syscall_init() {
     syscall_table[4] = &syscall_stat;
     syscall_table[5] = &syscall_fstat;
     syscall_table[8] = &syscall_lseek;
+    syscall_table[9] = &syscall_mmap;
+    syscall_table[10] = &syscall_mprotect;
+    syscall_table[11] = &syscall_munmap;
     syscall_table[12] = &syscall_brk;
     syscall_table[13] = &syscall_rt_sigaction;
     syscall_table[14] = &syscall_sigprocmask;
@@ -215,8 +322,14 @@ void syscall_init() {
     syscall_table[16] = &syscall_ioctl;
     syscall_table[22] = &syscall_pipe;
     syscall_table[23] = &syscall_select;
+    syscall_table[24] = &syscall_sched_yield;
     syscall_table[33] = &syscall_dup2;
+    syscall_table[35] = &syscall_nanosleep;
+    syscall_table[36] = &syscall_getitimer;
+    syscall_table[37] = &syscall_alarm;
+    syscall_table[38] = &syscall_setitimer;
     syscall_table[39] = &syscall_getpid;
+    syscall_table[56] = &syscall_clone;
     syscall_table[57] = &syscall_fork;
     syscall_table[59] = &syscall_execv;
     syscall_table[60] = &syscall_exit;
@@ -226,6 +339,8 @@ void syscall_init() {
     syscall_table[79] = &syscall_getcwd;
     syscall_table[80] = &syscall_chdir;
     syscall_table[96] = &syscall_timeofday;
+    syscall_table[98] = &syscall_getrusage;
+    syscall_table[100] = &syscall_times;
     syscall_table[102] = &syscall_getuid;
     syscall_table[103] = &syscall_syslog;
     syscall_table[104] = &syscall_getgid;
@@ -235,61 +350,61 @@ void syscall_init() {
     syscall_table[109] = &syscall_setpgid;
     syscall_table[110] = &syscall_getppid;
     syscall_table[111] = &syscall_getpgrp;
+    syscall_table[135] = &syscall_personality;
+    syscall_table[140] = &syscall_getpriority;
+    syscall_table[141] = &syscall_setpriority;
+    syscall_table[158] = &syscall_arch_prctl;
+    syscall_table[202] = &syscall_futex;
     syscall_table[217] = &getdents64;
+    syscall_table[218] = &syscall_set_tid_address;
+    syscall_table[228] = &syscall_clock_gettime;
+    syscall_table[229] = &syscall_clock_getres;
+    // XanaduOS specific
+    syscall_table[SYS_TEMPLATE_REGISTER] = &syscall_template_register;
+    syscall_table[SYS_TEMPLATE_UNREGISTER] = &syscall_template_unregister;
 }
 
 
-extern uint64_t syscall_old_rsp;
-extern uint8_t syscall_stack_top;
-extern uint8_t syscall_stack;
-extern xmm_regs_t xmm_regs;
 uint64_t syscall_handler(regs_t *regs)
 {
-    current_process->syscall_rsp = regs->rsp;
-
-    // Copy current stack to process' syscall stack
-    memcpy(current_process->syscall_stack, (void *)&syscall_stack, SYSCALL_STACK_SIZE);
-
-    // Read and adjust rsp and rbp
-    uint64_t rsp, rbp;
-    ASM_READ_RSP(rsp);
-    ASM_READ_RBP(rbp);
-    uint64_t rsp_from_bottom = rsp - (uint64_t)&syscall_stack;
-    uint64_t rbp_from_bottom = rbp - (uint64_t)&syscall_stack;
+    percpu_stat_inc(syscalls);
 
-    // Move to the copied stack.
-    // This is usually a *very bad* idea, but since the stack has been copied
-    // verbatim, and we don't really have to care about previous base pointer
-    // values here, this should be fine.
-    ASM_WRITE_RSP((uint64_t)current_process->syscall_stack + rsp_from_bottom);
-    ASM_WRITE_RBP((uint64_t)current_process->syscall_stack + rbp_from_bottom);
+    // syscall_handler_asm already switched to current_process->syscall_stack
+    current_process->syscall_rsp = regs->rsp;
 
     current_process->syscall_registers = *regs;
-    current_process->syscall_xmm_registers = xmm_regs;
     if (regs->rsp < VIRT_MEM_OFFSET) {
         current_process->user_rsp = regs->rsp;
     }
 
     if (syscall_table[regs->rax] != NULL) {
         current_process->in_syscall = true;
+        // entered with interrupts off, the IRQ handlers only defer work to
+        // softirqs so the syscall can run with them on, see preempt.h
+        ASM_ENABLE_INTERRUPTS;
         uint64_t raxval = syscall_table[regs->rax]((regs_t *)&(current_process->syscall_registers));
+        ASM_DISABLE_INTERRUPTS;
         current_process->syscall_registers.rax = raxval;
         current_process->in_syscall = false;
     } else {
         serial_printf("Unknown syscall: %d\n", regs->rax);
         regs_dump((regs_t *)&current_process->syscall_registers);
-        union wait status;
-        status.w_T.w_Retcode = 0; // Terminated
-        status.w_T.w_Coredump = false;
-        status.w_T.w_Termsig = SIGSYS;
-        process_exit_abnormal(status);
+        process_exit_signal(SIGSYS);
     }
 
-    syscall_old_rsp = current_process->syscall_rsp;
+    kassert_msg(preempt_count() == 0, "Returning to user mode with preemption disabled");
+
+    // preemption point: run whatever the IRQs during the syscall deferred,
+    // and switch away if the tick or a wakeup asked for it
+    softirq_run();
+    if (need_resched()) {
+        preempt_schedule();
+    }
 
-    check_signals(true);
+    percpu()->user_rsp = current_process->syscall_rsp;
 
-    xmm_regs = current_process->syscall_xmm_registers;
+    // only returns if there's no handler to enter
+    check_signals_after_syscall();
 
     // move the address of the current process registers to rax
     asm volatile("mov %0, %%rax" ::"r"(&current_process->syscall_registers));
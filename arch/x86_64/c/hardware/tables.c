@@ -9,11 +9,13 @@
 #include <display.h>
 #include <system.h>
 #include <memory.h>
+#include <timer.h>
+#include <apic.h>
+#include <softirq.h>
+#include <preempt.h>
+#include <smp.h>
 
-extern void load_tss();
-extern void load_idt(uint64_t idtr);
-
-gdt_entry_t gdt[7]; // 6 entries, TSS has 2 entries
+gdt_entry_t gdt[GDT_ENTRIES]; // each TSS takes 2 entries
 tss_entry_t tss;
 gdt_ptr_t gdtr;
 
@@ -36,6 +38,23 @@ void gdt_set_entry(int index, uint64_t base, uint64_t limit, uint8_t access, uin
 
 char tss_stack[SYSCALL_STACK_SIZE] __attribute__((aligned(16)));
 
+// Point a GDT slot at a TSS
+static void gdt_set_tss(int index, tss_entry_t *tss_location)
+{
+    uint64_t tss_base = (uint64_t)tss_location;
+    uint64_t tss_limit = sizeof(tss_entry_t);
+
+    tss_64_t *tss_entry = (tss_64_t *)&gdt[index];
+    tss_entry->limit_low = tss_limit & 0xFFFF;
+    tss_entry->base_low = tss_base & 0xFFFF;
+    tss_entry->base_middle = (tss_base >> 16) & 0xFF;
+    tss_entry->access = 0xE9;
+    tss_entry->limit_flags = ((tss_limit >> 16) & 0xF) | 0x40;
+    tss_entry->base_high = (tss_base >> 24) & 0xFF;
+    tss_entry->base_upper = (tss_base >> 32) & 0xFFFFFFFF;
+    tss_entry->reserved = 0;
+}
+
 void tss_init()
 {
     memset(&tss, 0, sizeof(tss));
@@ -43,7 +62,7 @@ void tss_init()
 
     tss.rsp0 = (uint64_t)tss_stack + sizeof(tss_stack);
 
-    load_tss();
+    load_tss(GDT_BSP_TSS_SELECTOR);
 }
 
 void tss_set_rsp0(uint64_t rsp0)
@@ -51,6 +70,27 @@ void tss_set_rsp0(uint64_t rsp0)
     tss.rsp0 = rsp0;
 }
 
+/**
+ * Set up the TSS for an application processor and give it a GDT slot. The
+ * CPU itself still has to load it with load_tss().
+ *
+ * @param cpu The CPU's index, must not be 0 (the boot CPU uses tss)
+ * @param tss_location The TSS to use
+ * @param rsp0 The stack to use for interrupts from user mode
+ *
+ * @return The selector to pass to load_tss()
+ */
+uint16_t tss_install(uint32_t cpu, tss_entry_t *tss_location, uint64_t rsp0)
+{
+    memset(tss_location, 0, sizeof(tss_entry_t));
+    tss_location->io_map_base = sizeof(tss_entry_t);
+    tss_location->rsp0 = rsp0;
+
+    int index = GDT_AP_TSS_INDEX + 2 * (cpu - 1);
+    gdt_set_tss(index, tss_location);
+    return index * sizeof(gdt_entry_t);
+}
+
 extern void load_gdt_initial(uint64_t gdtr);
 
 void gdt_init()
@@ -65,18 +105,7 @@ void gdt_init()
     gdt_set_entry(2, 0, 0xFFFFFFFF, 0x92, 0xA0, (gdt_entry_t *)&gdt);
 
     // TSS entry
-    uint64_t tss_base = (uint64_t)&tss;
-    uint64_t tss_limit = sizeof(tss);
-
-    tss_64_t *tss_entry = (tss_64_t *)&gdt[3];
-    tss_entry->limit_low = tss_limit & 0xFFFF;
-    tss_entry->base_low = tss_base & 0xFFFF;
-    tss_entry->base_middle = (tss_base >> 16) & 0xFF;
-    tss_entry->access = 0xE9;
-    tss_entry->limit_flags = ((tss_limit >> 16) & 0xF) | 0x40;
-    tss_entry->base_high = (tss_base >> 24) & 0xFF;
-    tss_entry->base_upper = (tss_base >> 32) & 0xFFFFFFFF;
-    tss_entry->reserved = 0;
+    gdt_set_tss(3, &tss);
 
     // User mode data segment
     gdt_set_entry(5, 0, 0xFFFFFFFF, 0xF2, 0xA0, (gdt_entry_t *)&gdt);
@@ -174,6 +203,8 @@ void idt_init()
     idt_set_entry(46, (uint64_t)&irq14);
     idt_set_entry(47, (uint64_t)&irq15);
 
+    idt_set_entry(LAPIC_SPURIOUS_VECTOR, (uint64_t)&spurious_irq);
+
     memset(&isr_handlers, 0, sizeof(isr_handlers));
 
     load_idt((uint64_t)&idtr);
@@ -181,12 +212,9 @@ void idt_init()
 
 extern void syscall_handler_asm();
 
-void tables_init()
+// Point SYSCALL at syscall_handler_asm, each CPU has its own copy of these MSRs
+static void syscall_msr_init()
 {
-    idt_init();
-    gdt_init();
-    tss_init();
-
     // set up the STAR MSR to point to the correct segments
     ASM_WRMSR_ADC(0, 0x230008, 0xC0000081);
 
@@ -204,6 +232,28 @@ void tables_init()
     ASM_WRMSR_ADC(efer, 0, 0xC0000080);
 }
 
+void tables_init()
+{
+    idt_init();
+    gdt_init();
+    tss_init();
+    syscall_msr_init();
+}
+
+/**
+ * Load the shared GDT and IDT on an application processor, along with its
+ * own TSS and syscall MSRs.
+ *
+ * @param tss_selector The selector from tss_install()
+ */
+void tables_init_ap(uint16_t tss_selector)
+{
+    load_gdt_initial((uint64_t)&gdtr);
+    load_idt((uint64_t)&idtr);
+    load_tss(tss_selector);
+    syscall_msr_init();
+}
+
 const char *exception_messages[] = {
     "Division By Zero",
     "Debug",
@@ -244,12 +294,23 @@ void page_fault_error(regs_t *r, uint64_t faulting_address)
 
     uint32_t flags = r->err_code;
 
+    // a write to a page shared with a process template, by the process or
+    // by the kernel on its behalf
+    if ((flags & 0x3) == 0x3 && faulting_address < VIRT_MEM_OFFSET && page_cow_break(faulting_address, current_pml4))
+    {
+        current_process->minflt++;
+        return;
+    }
+
     // Check whether this is an acceptable fault that we can recover from
-    memregion_t *region = current_process->memory_regions;
+    memregion_t *region = current_process->vm != NULL ? current_process->vm->regions : NULL;
     while (region != NULL) {
         if (faulting_address >= region->start && faulting_address < region->end) {
             // TODO: deal with flags, read-only, noexecute, etc.
-            map_page_kmalloc((uint64_t)faulting_address & 0xFFFFFFFFFFFFF000, first_free_page_addr(), false, true, current_pml4);
+            if (map_page_kmalloc((uint64_t)faulting_address & 0xFFFFFFFFFFFFF000, first_free_page_addr(), false, true, current_pml4)) {
+                process_rss_add((process_t *)current_process, 1);
+            }
+            current_process->minflt++;
 
             serial_printf("Recovered from page fault at 0x%lx\n", faulting_address);
 
@@ -260,25 +321,35 @@ void page_fault_error(regs_t *r, uint64_t faulting_address)
 
     serial_printf("Page fault! (%s%s%s%s%s) at 0x%lx [0x%lx]\n", (flags & 0x1) ? "Present |" : "Not present |", (flags & 0x2) ? "Write |" : "Read |", (flags & 0x4) ? "User |" : "Supervisor |", (flags & 0x8) ? "Reserved bit set |" : "", (flags & 0x10) ? "Instruction fetch" : "", (uint64_t)faulting_address, r->rip);
 
-    serial_traceback(10, (uint64_t *)current_process->interrupt_registers.rbp);
+    serial_traceback(10, (uint64_t *)r->rbp);
 
     if (current_process == NULL)
     {
         kpanic("Page fault in kernel space! (see serial output for details)");
     } else if (current_process->pid == 0) {
         kpanic("Page fault in idle process! (see serial output for details)");
+    } else if (current_process->kthread) {
+        kpanic("Page fault in kernel thread %s! (see serial output for details)", current_process->name);
     }
 
-    signal_t *sig = (signal_t *)kmalloc(sizeof(signal_t));
-    sig->signal_number = SIGSEGV;
-    sig->signal_error = 0;
-    sig->signal_code = SEGV_MAPERR;
-    sig->fault_address = (void *)faulting_address;
-    sig->sender_pid = current_process->pid;
-    serial_printf("Sending SIGSEGV to process %d\n", current_process->pid);
-    signal_process(current_process->pid, sig);
+    // a bad pointer handed to a syscall, there's no user context to run a
+    // handler in; and retrying a faulting instruction without a handler to
+    // fix things up would only fault again
+    process_t *process = (process_t *)current_process;
+    if (!(r->cs & 3) || (process->signal_mask & SIGNAL_BIT(SIGSEGV)) || process_signal_handler(process, SIGSEGV) == SIG_DFL || process_signal_handler(process, SIGSEGV) == SIG_IGN)
+    {
+        serial_printf("Killing process %d with SIGSEGV\n", process->pid);
+        process_exit_signal(SIGSEGV);
+    }
 
-    schedule();
+    serial_printf("Sending SIGSEGV to process %d\n", process->pid);
+    siginfo_t info = {0};
+    info.si_signo = SIGSEGV;
+    info.si_code = SEGV_MAPERR;
+    info.si_pid = process->pid;
+    info.si_addr = (void *)faulting_address;
+    signal_process(process->pid, &info);
+    // fault_handler() delivers it on the way out
 }
 
 void regs_dump(regs_t *regs) {
@@ -339,70 +410,85 @@ void xmm_regs_dump(xmm_regs_t *xmm_regs) {
     }
 }
 
-extern xmm_regs_t xmm_regs;
 void fault_handler(regs_t *regs, uint64_t faulting_address)
 {
-    if (current_process) {
-        current_process->interrupt_registers = *regs;
-        current_process->interrupt_xmm_registers = xmm_regs;
-        if (current_process->interrupt_registers.rsp < VIRT_MEM_OFFSET) {
-            current_process->user_rsp = current_process->interrupt_registers.rsp;
-        }
+    percpu_stat_inc(faults);
+
+    if (current_process && (regs->cs & 3)) {
+        current_process->interrupt_frame = regs;
+        current_process->user_rsp = regs->rsp;
     }
 
-    if (regs->int_no == 14)
+    if (regs->int_no == FPU_NM_VECTOR)
+    {
+        fpu_trap();
+    }
+    else if (regs->int_no == 14)
     {
         page_fault_error(regs, faulting_address);
     }
     else
     {
         regs_dump(regs);
-        xmm_regs_dump(&xmm_regs);
+        if (current_process && current_process->fpu_state)
+        {
+            // the legacy region of the save area is what FXSAVE writes
+            fpu_sync((process_t *)current_process);
+            xmm_regs_dump((xmm_regs_t *)current_process->fpu_state);
+        }
         kpanic("Unhandled exception in process %d: %s (error code: %d) [0x%lx]", current_process ? current_process->pid : -1, exception_messages[regs->int_no], regs->err_code, regs->rip);
     }
 
-    if (current_process != NULL)
+    if (current_process && (regs->cs & 3))
     {
-        *regs = current_process->interrupt_registers;
-        xmm_regs = current_process->interrupt_xmm_registers;
+        check_signals(regs);
     }
 }
 
 void irq_handler(regs_t *regs)
 {
-    if (current_process != NULL)
+    percpu_stat_inc(irqs);
+
+    // the frame stays where the stub pushed it, schedule() switches stacks
+    // rather than copying it
+    if (current_process != NULL && (regs->cs & 3))
     {
-        current_process->interrupt_registers = *regs;
-        current_process->interrupt_xmm_registers = xmm_regs;
-        if (current_process->interrupt_registers.rsp < VIRT_MEM_OFFSET)
-        {
-            current_process->user_rsp = current_process->interrupt_registers.rsp;
-        }
+        current_process->interrupt_frame = regs;
+        current_process->user_rsp = regs->rsp;
     }
 
-    if (regs->int_no - 32 == 0)
+    if (regs->int_no == TIMER_VECTOR)
     {
-        // timer interrupt
-        outb(0x20, 0x20);
-        schedule();
-        return;
+        // acknowledges whichever timer raised it, PIT or LAPIC
+        timer_tick();
     }
-
-    if (isr_handlers[regs->int_no - 32] != 0)
+    else
     {
-        isr_handlers[regs->int_no - 32](regs);
+        if (isr_handlers[regs->int_no - 32] != 0)
+        {
+            isr_handlers[regs->int_no - 32](regs);
+        }
+
+        irq_eoi(regs->int_no);
     }
 
-    if (regs->int_no >= 40)
+    // Interrupted kernel code is only preempted at its own preemption
+    // points, see preempt.h. User code and the idle process can be switched
+    // away from here: the tick ran out the time slice, or a softirq woke
+    // something more important than what was running.
+    if (current_process != NULL && ((regs->cs & 3) || current_process == this_cpu()->idle))
     {
-        outb(0xA0, 0x20);
+        softirq_run();
+        if (need_resched() && preempt_count() == 0)
+        {
+            schedule();
+        }
     }
 
-    outb(0x20, 0x20);
-    if (current_process != NULL)
+    // signals sent by the IRQ, or while this process wasn't running
+    if (current_process != NULL && (regs->cs & 3))
     {
-        *regs = current_process->interrupt_registers;
-        xmm_regs = current_process->interrupt_xmm_registers;
+        check_signals(regs);
     }
 }
 
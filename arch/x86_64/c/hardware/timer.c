@@ -0,0 +1,328 @@
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <timer.h>
+#include <system.h>
+#include <io.h>
+#include <memory.h>
+#include <process.h>
+#include <serial.h>
+#include <errors.h>
+#include <ktimer.h>
+#include <apic.h>
+#include <softirq.h>
+#include <preempt.h>
+
+// Ticks since boot. In tickless idle this is caught up on wakeup rather than
+// counted one interrupt at a time.
+volatile uint64_t timer_ticks = 0;
+uint32_t timer_hz = 0;
+uint32_t timer_quantum_ticks = 1;
+
+uint32_t timer_source = TIMER_SOURCE_PIT;
+// LAPIC timer counts (after the divider) per millisecond, from calibration
+uint64_t lapic_counts_per_ms = 0;
+uint32_t lapic_counts_per_tick = 0;
+
+// Set while the idle process has the timer in one-shot mode
+bool timer_oneshot = false;
+uint32_t timer_oneshot_ticks = 0;
+// Set by timer_tick() when the one-shot expired, for timer_softirq() to re-arm
+volatile bool timer_oneshot_fired = false;
+
+// Timer interrupts taken, and how many of them timer_softirq() has seen
+volatile uint64_t timer_irqs = 0;
+uint64_t timer_irqs_handled = 0;
+
+/**
+ * Start PIT channel 2 counting down, as a reference for calibrating other
+ * clocks. Channel 2's gate is controlled through port 0x61 and its output
+ * can be polled there too, so this works with interrupts off.
+ *
+ * @param ms How long until pit_wait_done() returns true, at most 54
+ */
+void pit_wait_start(uint32_t ms)
+{
+    uint16_t latch = PIT_FREQUENCY * ms / 1000;
+
+    // gate low while programming, speaker off
+    outb(0x61, inb(0x61) & ~0x03);
+
+    // channel 2, lobyte/hibyte, mode 0 (interrupt on terminal count)
+    outb(0x43, 0xB0);
+    outb(0x42, latch & 0xFF);
+    outb(0x42, latch >> 8);
+
+    // counting starts when the gate goes high
+    outb(0x61, (inb(0x61) & ~0x02) | 0x01);
+}
+
+bool pit_wait_done()
+{
+    // OUT2 goes high at terminal count
+    return inb(0x61) & 0x20;
+}
+
+/**
+ * Count how fast the LAPIC timer runs, using the PIT as the reference.
+ *
+ * @return LAPIC timer counts per millisecond
+ */
+static uint64_t lapic_calibrate()
+{
+    const uint32_t calibrate_ms = 10;
+
+    lapic_write(LAPIC_REG_TIMER_DIVIDE, LAPIC_TIMER_DIVIDE_16);
+    lapic_write(LAPIC_REG_LVT_TIMER, LAPIC_LVT_MASKED);
+
+    pit_wait_start(calibrate_ms);
+    lapic_write(LAPIC_REG_TIMER_INIT, 0xFFFFFFFF);
+
+    while (!pit_wait_done());
+
+    uint32_t elapsed = 0xFFFFFFFF - lapic_read(LAPIC_REG_TIMER_CURRENT);
+    lapic_write(LAPIC_REG_TIMER_INIT, 0);
+
+    return elapsed / calibrate_ms;
+}
+
+static void pit_set_periodic(uint32_t hz)
+{
+    uint32_t divisor = PIT_FREQUENCY / hz;
+    if (divisor > 0xFFFF)
+    {
+        divisor = 0xFFFF;
+    }
+    // channel 0, lobyte/hibyte, mode 3 (square wave)
+    outb(0x43, 0x36);
+    outb(0x40, divisor & 0xFF);
+    outb(0x40, divisor >> 8);
+}
+
+static void lapic_set_periodic()
+{
+    lapic_write(LAPIC_REG_TIMER_DIVIDE, LAPIC_TIMER_DIVIDE_16);
+    lapic_write(LAPIC_REG_LVT_TIMER, TIMER_VECTOR | LAPIC_TIMER_PERIODIC);
+    lapic_write(LAPIC_REG_TIMER_INIT, lapic_counts_per_tick);
+}
+
+static void lapic_set_oneshot(uint32_t ticks)
+{
+    lapic_write(LAPIC_REG_LVT_TIMER, TIMER_VECTOR);
+    lapic_write(LAPIC_REG_TIMER_INIT, ticks * lapic_counts_per_tick);
+}
+
+uint64_t timer_ms_to_ticks(uint64_t ms)
+{
+    uint64_t ticks = ms * timer_hz / 1000;
+    return ticks ? ticks : 1;
+}
+
+/**
+ * Convert a duration to ticks, rounding up so timers never fire early.
+ *
+ * @param ns The duration in nanoseconds
+ *
+ * @return The number of ticks, 0 only if ns is 0
+ */
+uint64_t timer_ns_to_ticks(uint64_t ns)
+{
+    uint64_t ns_per_tick = 1000000000ULL / timer_hz;
+    return (ns + ns_per_tick - 1) / ns_per_tick;
+}
+
+/**
+ * Change the tick rate.
+ *
+ * @param hz Ticks per second
+ */
+void timer_set_frequency(uint32_t hz)
+{
+    if (hz == 0)
+    {
+        return;
+    }
+
+    uint64_t flags;
+    ASM_SAVE_FLAGS_CLI(flags);
+
+    uint32_t quantum_ms = timer_hz ? timer_quantum_ticks * 1000 / timer_hz : TIMER_DEFAULT_QUANTUM_MS;
+    timer_hz = hz;
+
+    if (timer_source == TIMER_SOURCE_LAPIC)
+    {
+        lapic_counts_per_tick = lapic_counts_per_ms * 1000 / hz;
+        if (lapic_counts_per_tick == 0)
+        {
+            lapic_counts_per_tick = 1;
+        }
+        if (!timer_oneshot)
+        {
+            lapic_set_periodic();
+        }
+    }
+    else
+    {
+        pit_set_periodic(hz);
+    }
+
+    timer_set_quantum(quantum_ms);
+
+    ASM_RESTORE_FLAGS(flags);
+}
+
+/**
+ * Change the base scheduler time slice. Lower scheduler levels get
+ * multiples of this, see SCHED_TIMESLICE().
+ *
+ * @param ms The slice length in milliseconds, rounded to whole ticks
+ */
+void timer_set_quantum(uint32_t ms)
+{
+    timer_quantum_ticks = timer_ms_to_ticks(ms);
+}
+
+// How many ticks the idle process can sleep through in one go
+static uint32_t timer_idle_ticks()
+{
+    uint64_t ticks = timer_ms_to_ticks(TIMER_IDLE_MAX_MS);
+
+    // wake in time for the first pending timer
+    uint64_t next = ktimer_next_expiry();
+    if (next != KTIMER_NONE)
+    {
+        uint64_t until = next > timer_ticks ? next - timer_ticks : 1;
+        if (until < ticks)
+        {
+            ticks = until;
+        }
+    }
+
+    // the LAPIC counter is only 32 bits wide
+    if (ticks * lapic_counts_per_tick > 0xFFFFFFFF)
+    {
+        ticks = 0xFFFFFFFF / lapic_counts_per_tick;
+    }
+
+    return ticks;
+}
+
+/**
+ * Called on every timer interrupt, acknowledges it and advances the clock.
+ * Timers and scheduler accounting are left to timer_softirq().
+ */
+void timer_tick()
+{
+    if (timer_source == TIMER_SOURCE_LAPIC)
+    {
+        lapic_eoi();
+    }
+    else
+    {
+        irq_eoi(TIMER_VECTOR);
+    }
+
+    if (timer_oneshot)
+    {
+        // slept the whole way through
+        timer_ticks += timer_oneshot_ticks;
+        timer_oneshot_fired = true;
+    }
+    else
+    {
+        timer_ticks++;
+    }
+
+    timer_irqs++;
+    process_account_tick();
+    softirq_raise(SOFTIRQ_TIMER);
+}
+
+// Runs the expired timers and charges the ticks since it last ran to
+// whatever is running now
+static void timer_softirq()
+{
+    ktimer_run(timer_ticks);
+
+    if (timer_oneshot_fired)
+    {
+        timer_oneshot_fired = false;
+        if (timer_oneshot)
+        {
+            // still idle, go round again
+            timer_oneshot_ticks = timer_idle_ticks();
+            lapic_set_oneshot(timer_oneshot_ticks);
+        }
+    }
+
+    while (timer_irqs_handled != timer_irqs)
+    {
+        timer_irqs_handled++;
+        if (current_process != NULL && sched_tick())
+        {
+            set_need_resched();
+        }
+    }
+}
+
+/**
+ * Stop periodic ticks while the idle process runs. The LAPIC is set to fire
+ * once after TIMER_IDLE_MAX_MS instead, and any other interrupt that makes
+ * work runnable ends idle early through timer_idle_exit().
+ */
+void timer_idle_enter()
+{
+    if (timer_source != TIMER_SOURCE_LAPIC || timer_oneshot)
+    {
+        return;
+    }
+
+    timer_oneshot = true;
+    timer_oneshot_ticks = timer_idle_ticks();
+    lapic_set_oneshot(timer_oneshot_ticks);
+}
+
+/**
+ * Go back to periodic ticks, crediting however long the idle process slept.
+ */
+void timer_idle_exit()
+{
+    if (!timer_oneshot)
+    {
+        return;
+    }
+
+    uint32_t initial = timer_oneshot_ticks * lapic_counts_per_tick;
+    uint32_t remaining = lapic_read(LAPIC_REG_TIMER_CURRENT);
+    timer_ticks += (initial - remaining) / lapic_counts_per_tick;
+
+    timer_oneshot = false;
+    lapic_set_periodic();
+}
+
+void timer_init()
+{
+    softirq_register(SOFTIRQ_TIMER, timer_softirq);
+
+    if (lapic != NULL)
+    {
+        lapic_counts_per_ms = lapic_calibrate();
+        if (lapic_counts_per_ms != 0)
+        {
+            timer_source = TIMER_SOURCE_LAPIC;
+
+            // the PIT keeps running, but its IRQ is no longer wanted
+            irq_set_mask(0, true);
+        }
+    }
+
+    timer_set_frequency(TIMER_DEFAULT_HZ);
+    timer_set_quantum(TIMER_DEFAULT_QUANTUM_MS);
+
+    serial_printf("Timer: %s at %d Hz, quantum %d ticks", timer_source == TIMER_SOURCE_LAPIC ? "LAPIC" : "PIT", timer_hz, timer_quantum_ticks);
+    if (timer_source == TIMER_SOURCE_LAPIC)
+    {
+        serial_printf(" (%d counts/ms)", lapic_counts_per_ms);
+    }
+    serial_printf("\n");
+}
@@ -22,6 +22,44 @@ void traceback_init(kernel_info_t *info)
     symbol_count = info->elf_symbol_count;
 }
 
+/**
+ * Resolve an address to the kernel function that contains it.
+ *
+ * @param rip The address to resolve
+ * @param offset Filled with the offset of rip from the start of the function
+ *
+ * @return The function name, or NULL if no symbol table is available or no
+ *      function starts at or before rip
+ */
+const char *trace_resolve_symbol(uint64_t rip, uint64_t *offset)
+{
+    if (string_table == NULL || symbol_table == NULL || symbol_count == 0) {
+        return NULL;
+    }
+
+    // the function that contains the RIP, failing that the closest one
+    // before it, since assembly and padding have no sizes
+    Elf64_Sym *closest = NULL;
+    for (size_t i = 0; i < symbol_count; i++) {
+        Elf64_Sym *symbol = &symbol_table[i];
+        if (ELF64_ST_TYPE(symbol->st_info) != STT_FUNC || symbol->st_value > rip) {
+            continue;
+        }
+        if (rip - symbol->st_value < symbol->st_size) {
+            closest = symbol;
+            break;
+        }
+        if (closest == NULL || symbol->st_value > closest->st_value) {
+            closest = symbol;
+        }
+    }
+    if (closest == NULL) {
+        return NULL;
+    }
+    *offset = rip - closest->st_value;
+    return string_table + closest->st_name;
+}
+
 // Keep track of whether or not traceback failed, just in case something goes
 // seriously wrong in the backend
 bool traceback_failed = false;
@@ -0,0 +1,147 @@
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <binfmt.h>
+#include <elf64.h>
+#include <process.h>
+#include <system.h>
+#include <errors.h>
+#include <serial.h>
+#include <lock.h>
+#include <sys/errno.h>
+
+// Registered formats, tried in registration order. They're only added
+// during boot and never removed, so exec walks the list without a lock.
+static list_node_t binfmt_list = LIST_HEAD_INIT(binfmt_list);
+static spinlock_t binfmt_lock = SPINLOCK_INIT("binfmt");
+
+/**
+ * Register an executable format, tried after those already registered.
+ *
+ * @param format The format, which must stay around
+ */
+void register_binfmt(binfmt_t *format)
+{
+    spin_lock(&binfmt_lock);
+    list_add_tail(&binfmt_list, &format->node);
+    spin_unlock(&binfmt_lock);
+}
+
+/**
+ * Load a program into a new address space with whichever format recognises
+ * it. Ends the auxiliary vector on success.
+ *
+ * @param bprm The exec, with path, fd, st and pml4 set
+ *
+ * @return 0 if successful
+ *      -ENOEXEC if no format recognises it
+ *      -EIO if it can't be read
+ *      or the format's error
+ */
+int64_t binfmt_load(binprm_t *bprm)
+{
+    if (kflseek(bprm->fd, 0, SEEK_SET) < 0)
+    {
+        return -EIO;
+    }
+    int64_t read = kfread(bprm->buf, 1, BINPRM_BUF_SIZE, bprm->fd);
+    if (read < 0)
+    {
+        return -EIO;
+    }
+    bprm->buf_size = read;
+
+    list_node_t *node;
+    list_for_each(node, &binfmt_list)
+    {
+        binfmt_t *format = list_entry(node, binfmt_t, node);
+        int64_t status = format->load(bprm);
+        if (status == -ENOEXEC)
+        {
+            continue;
+        }
+        if (status == 0)
+        {
+            binprm_aux(bprm, AT_NULL, 0);
+        }
+        else
+        {
+            serial_printf("Failed to load %s as %s: %ld\n", bprm->path, format->name, status);
+        }
+        return status;
+    }
+
+    return -ENOEXEC;
+}
+
+/**
+ * Add an entry to the auxiliary vector the new image finds after its
+ * environment.
+ *
+ * @param bprm The exec
+ * @param type AT_*
+ * @param value Its value
+ */
+void binprm_aux(binprm_t *bprm, uint64_t type, uint64_t value)
+{
+    kassert_msg(bprm->auxc < BINPRM_AUXV_MAX, "Auxiliary vector full");
+    bprm->auxv[bprm->auxc * 2] = type;
+    bprm->auxv[bprm->auxc * 2 + 1] = value;
+    bprm->auxc++;
+}
+
+/**
+ * Whether the current process has its addresses randomized.
+ *
+ * @return false if it asked for ADDR_NO_RANDOMIZE
+ */
+bool binfmt_randomize()
+{
+    return !(current_process->personality & ADDR_NO_RANDOMIZE);
+}
+
+/**
+ * Pick how many pages to move something by, so its address can't be
+ * guessed. Mixes the TSC, which is enough to defeat hardcoded addresses
+ * but isn't a cryptographic source.
+ *
+ * @param range The number of choices
+ *
+ * @return A number below range
+ */
+uint64_t binfmt_random_pages(uint64_t range)
+{
+    static uint64_t state = 0;
+
+    uint32_t low, high;
+    ASM_RDTSC(low, high);
+    uint64_t x = __atomic_add_fetch(&state, ((uint64_t)high << 32 | low) | 1, __ATOMIC_RELAXED);
+
+    // splitmix64's finaliser
+    x ^= x >> 30;
+    x *= 0xBF58476D1CE4E5B9ULL;
+    x ^= x >> 27;
+    x *= 0x94D049BB133111EBULL;
+    x ^= x >> 31;
+
+    return range != 0 ? x % range : 0;
+}
+
+/**
+ * personality() syscall: get or set the current process' execution domain
+ * flags. Only ADDR_NO_RANDOMIZE means anything, which takes effect at the
+ * next exec. Kept across exec and inherited by children.
+ *
+ * @param persona The new flags, or PERSONALITY_QUERY to only read them
+ *
+ * @return The previous flags
+ */
+int64_t kpersonality(uint64_t persona)
+{
+    uint32_t old = current_process->personality;
+    if (persona != PERSONALITY_QUERY)
+    {
+        current_process->personality = persona;
+    }
+    return old;
+}
@@ -10,81 +10,52 @@
 #include <unused.h>
 #include <display.h>
 #include <errors.h>
+#include <lock.h>
 
-device_t *xandisk_devices = NULL;
-device_t *keyboard_devices = NULL;
-device_t *framebuffer_devices = NULL;
-device_t *tty_devices = NULL;
+// Every registered device, keyed by DEVICE_KEY(type, id)
+hashtable_t device_table = HASHTABLE_INIT;
+dev_t device_next_id[DEVICE_TYPE_MAX] = {0};
+// Guards device_table and device_next_id
+rwlock_t device_table_lock = RWLOCK_INIT("device_table");
 
 device_t device_device = {0};
 
-void insert_device(device_t *list, device_t *device_to_insert)
+device_t *register_device(device_t *device_to_register)
 {
-    while (list->next != NULL)
+    if (device_to_register->type >= DEVICE_TYPE_MAX)
     {
-        list = list->next;
+        kwarn("Attempted to register device %s with unknown type %u\n", device_to_register->name, device_to_register->type);
+        return device_to_register;
     }
-    list->next = device_to_insert;
-    device_to_insert->next = NULL;
-    device_to_insert->id = list->id + 1;
+
+    // ids are handed out in registration order per device type
+    write_lock(&device_table_lock);
+    device_to_register->id = device_next_id[device_to_register->type]++;
+    device_to_register->table_node.key = DEVICE_KEY(device_to_register->type, device_to_register->id);
+    hashtable_insert(&device_table, &device_to_register->table_node);
+    write_unlock(&device_table_lock);
+
+    return device_to_register;
 }
 
-device_t *register_device(device_t *device_to_register)
+/**
+ * Look up a registered device.
+ *
+ * @param type The device type, one of DEVICE_TYPE_*
+ * @param id The device number within that type
+ *
+ * @return The device, or NULL if there's no such device
+ */
+device_t *device_find(uint32_t type, dev_t id)
 {
-    if (device_to_register->type == DEVICE_TYPE_XANDISK)
-    {
-        device_t *current_device = xandisk_devices;
-        if (current_device == NULL)
-        {
-            xandisk_devices = device_to_register;
-            device_to_register->id = 0;
-        }
-        else
-        {
-            insert_device(current_device, device_to_register);
-        }
-    }
-    else if (device_to_register->type == DEVICE_TYPE_KYBOARD)
-    {
-        device_t *current_device = keyboard_devices;
-        if (current_device == NULL)
-        {
-            keyboard_devices = device_to_register;
-            device_to_register->id = 0;
-        }
-        else
-        {
-            insert_device(current_device, device_to_register);
-        }
-    }
-    else if (device_to_register->type == DEVICE_TYPE_FRMEBUF)
-    {
-        device_t *current_device = framebuffer_devices;
-        if (current_device == NULL)
-        {
-            framebuffer_devices = device_to_register;
-            device_to_register->id = 0;
-        }
-        else
-        {
-            insert_device(current_device, device_to_register);
-        }
-    }
-    else if (device_to_register->type == DEVICE_TYPE_TTY)
+    read_lock(&device_table_lock);
+    hash_node_t *node = hashtable_find(&device_table, DEVICE_KEY(type, id));
+    read_unlock(&device_table_lock);
+    if (node == NULL)
     {
-        device_t *current_device = tty_devices;
-        if (current_device == NULL)
-        {
-            tty_devices = device_to_register;
-            device_to_register->id = 0;
-        }
-        else
-        {
-            insert_device(current_device, device_to_register);
-        }
+        return NULL;
     }
-
-    return device_to_register;
+    return hash_entry(node, device_t, table_node);
 }
 
 typedef struct
@@ -94,31 +65,26 @@ typedef struct
     uint64_t dependents;
 } device_open_data_t;
 
-pointer_int_t device_open_helper(device_t *device_list, char *part, uint32_t first_number, char *path, uint64_t flags) {
+pointer_int_t device_open_helper(uint32_t type, char *part, uint32_t first_number, char *path, uint64_t flags) {
     if (part[first_number] == '\0') {
         return (pointer_int_t){NULL, -ENODEV};
     }
 
     dev_t device_number = atoi(&part[first_number]);
-    device_t *current_device = device_list;
-    if (current_device == NULL) {
+    device_t *device = device_find(type, device_number);
+    if (device == NULL) {
         return (pointer_int_t){NULL, -ENODEV};
     }
-    while (current_device != NULL) {
-        if (current_device->id == device_number) {
-            device_open_data_t *data = (device_open_data_t *)kmalloc(sizeof(device_open_data_t));
-            pointer_int_t open_data = current_device->open(path, flags, current_device);
-            if (open_data.value != 0) {
-                return open_data;
-            }
-            data->data = open_data.pointer;
-            data->device = current_device;
-            data->dependents++;
-            return (pointer_int_t){data, 0};
-        }
-        current_device = current_device->next;
+
+    pointer_int_t open_data = device->open(path, flags, device);
+    if (open_data.value != 0) {
+        return open_data;
     }
-    return (pointer_int_t){NULL, -ENODEV};
+    device_open_data_t *data = (device_open_data_t *)kmalloc(sizeof(device_open_data_t));
+    data->data = open_data.pointer;
+    data->device = device;
+    data->dependents = 1;
+    return (pointer_int_t){data, 0};
 }
 
 pointer_int_t device_open(char *path, uint64_t flags, void *device_passed)
@@ -147,15 +113,15 @@ pointer_int_t device_open(char *path, uint64_t flags, void *device_passed)
         // for now, only checking for "xd" (xandisk) and "so" (simple output)
         if (strncmp(part, "xd", 2) == 0)
         {
-            return device_open_helper(xandisk_devices, part, first_number, path, flags);
+            return device_open_helper(DEVICE_TYPE_XANDISK, part, first_number, path, flags);
         }
         else if (strncmp(part, "kb", 2) == 0)
         {
-            return device_open_helper(keyboard_devices, part, first_number, path, flags);
+            return device_open_helper(DEVICE_TYPE_KYBOARD, part, first_number, path, flags);
         }
         else if (strncmp(part, "fb", 2) == 0)
         {
-            return device_open_helper(framebuffer_devices, part, first_number, path, flags);
+            return device_open_helper(DEVICE_TYPE_FRMEBUF, part, first_number, path, flags);
         }
         else if (strncmp(part, "tty", 3) == 0)
         {
@@ -163,9 +129,39 @@ pointer_int_t device_open(char *path, uint64_t flags, void *device_passed)
             if (part[first_number + 3] == '\0')
             {
                 char tty_part[6] = "/tty0";
-                return device_open_helper(tty_devices, ((char *)&tty_part) + 1, 3, tty_part, flags);
+                return device_open_helper(DEVICE_TYPE_TTY, ((char *)&tty_part) + 1, 3, tty_part, flags);
+            }
+            return device_open_helper(DEVICE_TYPE_TTY, part, first_number, path, flags);
+        }
+        else if (strncmp(part, "kheap", 5) == 0)
+        {
+            // there's only ever one heap profile, so "kheap" is "kheap0"
+            if (part[first_number] == '\0')
+            {
+                char kheap_part[8] = "/kheap0";
+                return device_open_helper(DEVICE_TYPE_KHEAP, ((char *)&kheap_part) + 1, 5, kheap_part, flags);
+            }
+            return device_open_helper(DEVICE_TYPE_KHEAP, part, first_number, path, flags);
+        }
+        else if (strncmp(part, "klock", 5) == 0)
+        {
+            // likewise for lock statistics
+            if (part[first_number] == '\0')
+            {
+                char klock_part[8] = "/klock0";
+                return device_open_helper(DEVICE_TYPE_KLOCK, ((char *)&klock_part) + 1, 5, klock_part, flags);
+            }
+            return device_open_helper(DEVICE_TYPE_KLOCK, part, first_number, path, flags);
+        }
+        else if (strncmp(part, "kexeccache", 10) == 0)
+        {
+            // and the executable cache's
+            if (part[first_number] == '\0')
+            {
+                char kexeccache_part[13] = "/kexeccache0";
+                return device_open_helper(DEVICE_TYPE_EXECCACHE, ((char *)&kexeccache_part) + 1, 10, kexeccache_part, flags);
             }
-            return device_open_helper(tty_devices, part, first_number, path, flags);
+            return device_open_helper(DEVICE_TYPE_EXECCACHE, part, first_number, path, flags);
         }
     }
 
@@ -315,7 +311,6 @@ void init_device_device()
     strcpy(device_device.name, "devices");
     device_device.flags = 0;
     device_device.data = NULL;
-    device_device.next = NULL;
 
     // we need to cast the function pointer to return void *, like a function type taking path, flags, and device_t *, and returning a void *
     device_device.open = (open_func_t)device_open;
@@ -7,49 +7,94 @@
 #include <elf_loader.h>
 #include <errors.h>
 #include <process.h>
+#include <preempt.h>
+#include <binfmt.h>
+#include <exec_cache.h>
+#include <filesystem.h>
+#include <device.h>
+#include <sys/errno.h>
 
-elf_info_t load_elf64(char *elf_file, page_directory_t *elf_pml4) {
-    Elf64_Ehdr *header = (Elf64_Ehdr *)elf_file;
-    uint64_t max_addr = 0;
+// Segments are copied this much at a time, with preemption points in between
+#define ELF_LOAD_CHUNK 0x10000
+
+// Preemption point while the new image's page directory is loaded. Running
+// something else puts back the process' own, so load the new one again.
+static void elf_resched(page_directory_t *elf_pml4) {
+    if (cond_resched()) {
+        switch_page_directory(elf_pml4);
+    }
+}
+
+/**
+ * Check that an ELF header describes an executable this kernel can run.
+ *
+ * @param header The header, at the start of the file
+ *
+ * @return 0 if it can be loaded, otherwise a negative load_elf64() status
+ */
+int elf_check_header(Elf64_Ehdr *header) {
     if (header->e_ident[0] != 0x7F || header->e_ident[1] != 'E' || header->e_ident[2] != 'L' || header->e_ident[3] != 'F') {
         serial_printf("Invalid ELF magic number!\n");
-        return (elf_info_t){0, 0, -1, NULL};
+        return -1;
     }
 
     if (header->e_ident[EI_CLASS] != ELFCLASS64) {
         serial_printf("Invalid ELF class!\n");
-        return (elf_info_t){0, 0, -2, NULL};
+        return -2;
     }
 
     if (header->e_ident[EI_DATA] != ELFDATA2LSB) {
         serial_printf("Invalid ELF data encoding!\n");
-        return (elf_info_t){0, 0, -3, NULL};
+        return -3;
     }
 
     if (header->e_ident[EI_VERSION] != EV_CURRENT) {
         serial_printf("Invalid ELF version!\n");
-        return (elf_info_t){0, 0, -4, NULL};
+        return -4;
     }
 
-    if (header->e_type != ET_EXEC) {
+    if (header->e_type != ET_EXEC && header->e_type != ET_DYN) {
         serial_printf("Invalid ELF type!\n");
-        return (elf_info_t){0, 0, -5, NULL};
+        return -5;
     }
 
     if (header->e_machine != EM_X86_64) {
         serial_printf("Invalid ELF machine!\n");
-        return (elf_info_t){0, 0, -6, NULL};
+        return -6;
     }
 
     if (header->e_version != EV_CURRENT) {
         serial_printf("Invalid ELF version!\n");
-        return (elf_info_t){0, 0, -7, NULL};
+        return -7;
+    }
+
+    return 0;
+}
+
+/**
+ * Load an ELF file's segments into an address space, copying them into
+ * fresh pages.
+ *
+ * @param elf_file The whole file
+ * @param elf_pml4 The address space
+ * @param base Added to every address in the file, 0 unless it's ET_DYN
+ *
+ * @return Where it starts and ends, with status 0 if successful, otherwise
+ *      an elf_check_header() status
+ */
+elf_info_t load_elf64(char *elf_file, page_directory_t *elf_pml4, uint64_t base) {
+    Elf64_Ehdr *header = (Elf64_Ehdr *)elf_file;
+    uint64_t max_addr = 0;
+    int status = elf_check_header(header);
+    if (status != 0) {
+        return (elf_info_t){0, 0, status, NULL, 0};
     }
 
     page_directory_t *old_pml4 = current_pml4;
     switch_page_directory(elf_pml4);
 
     memregion_t *regions = NULL;
+    uint64_t pages = 0;
 
     // Load the program headers
     for (int i = 0; i < header->e_phnum; i++) {
@@ -66,26 +111,33 @@ elf_info_t load_elf64(char *elf_file, page_directory_t *elf_pml4) {
 
             // Map each page
             for (int j = 0; j < num_pages; j++) {
-                map_page_kmalloc(phdr->p_vaddr + j * 0x1000, first_free_page_addr(), false, true, elf_pml4);
+                if (map_page_kmalloc(base + phdr->p_vaddr + j * 0x1000, first_free_page_addr(), false, true, elf_pml4)) {
+                    pages++;
+                }
             }
+            elf_resched(elf_pml4);
 
-            // Copy the segment to the physical memory address
-            memcpy((void *)phdr->p_paddr, (void *)(elf_file + phdr->p_offset), phdr->p_filesz);
+            // Copy the segment to the physical memory address, a piece at a time
+            for (uint64_t done = 0; done < phdr->p_filesz; done += ELF_LOAD_CHUNK) {
+                uint64_t chunk = phdr->p_filesz - done < ELF_LOAD_CHUNK ? phdr->p_filesz - done : ELF_LOAD_CHUNK;
+                memcpy((void *)(base + phdr->p_vaddr + done), (void *)(elf_file + phdr->p_offset + done), chunk);
+                elf_resched(elf_pml4);
+            }
 
             // Zero out the remaining memory if the memory size is larger than the file size
             if (phdr->p_memsz > phdr->p_filesz) {
-                memset((void *)(phdr->p_paddr + phdr->p_filesz), 0, phdr->p_memsz - phdr->p_filesz);
+                memset((void *)(base + phdr->p_vaddr + phdr->p_filesz), 0, phdr->p_memsz - phdr->p_filesz);
             }
 
             // Keep track of the highest address we've loaded
-            if (phdr->p_vaddr + phdr->p_memsz > max_addr) {
-                max_addr = phdr->p_vaddr + phdr->p_memsz;
+            if (base + phdr->p_vaddr + phdr->p_memsz > max_addr) {
+                max_addr = base + phdr->p_vaddr + phdr->p_memsz;
             }
 
             // Add the region to the list
             memregion_t *region = kmalloc(sizeof(memregion_t));
-            region->start = phdr->p_vaddr;
-            region->end = phdr->p_vaddr + phdr->p_memsz;
+            region->start = base + phdr->p_vaddr;
+            region->end = base + phdr->p_vaddr + phdr->p_memsz;
             region->flags = phdr->p_flags & 0x7;
         }
     }
@@ -93,10 +145,233 @@ elf_info_t load_elf64(char *elf_file, page_directory_t *elf_pml4) {
     switch_page_directory(old_pml4);
 
     elf_info_t info;
-    info.entry = header->e_entry;
+    info.entry = base + header->e_entry;
     info.max_addr = max_addr;
     info.status = 0;
     info.regions = regions;
+    info.pages = pages;
 
     return info;
-}
\ No newline at end of file
+}
+
+// Get the cached image of an open ELF file, reading and preparing it on a
+// miss. On success the pointer is the image, holding a reference for the
+// caller, or NULL if the file can only be loaded by load_elf64(), in which
+// case *file_out is its contents, for the caller to free. file_out may be
+// NULL if the caller has no use for them.
+static pointer_int_t elf_image_get(const char *name, int fd, const struct stat *st, char **file_out) {
+    exec_image_t *image = exec_cache_lookup(st);
+    if (image != NULL) {
+        return (pointer_int_t){image, 0};
+    }
+
+    // if the highest bit is set, it's an error
+    if ((uint64_t)st->st_size & 0x8000000000000000 || kflseek(fd, 0, SEEK_SET) < 0) {
+        return (pointer_int_t){NULL, -EIO};
+    }
+    size_t size = st->st_size;
+    char *file = kmalloc(size != 0 ? size : 1);
+    int64_t read = kfread(file, 1, size, fd);
+    if (read < 0) {
+        kfree(file);
+        return (pointer_int_t){NULL, -EIO};
+    }
+
+    image = exec_cache_add(name, file, read, st);
+    if (image == NULL && file_out != NULL) {
+        *file_out = file;
+    } else {
+        kfree(file);
+    }
+    return (pointer_int_t){image, 0};
+}
+
+/**
+ * Find the cached image of an open ELF file, so mmap() can borrow its
+ * prepared pages, adding it to the cache if it isn't there yet. Moves the
+ * file position.
+ *
+ * @param fd The file
+ * @param st Its stat
+ *
+ * @return The image, holding a reference for the caller, or NULL if the
+ *      file isn't an ELF file the cache can hold
+ */
+struct exec_image *elf_image_find(int fd, const struct stat *st) {
+    if (st->st_ino == 0 || kflseek(fd, 0, SEEK_SET) < 0) {
+        return NULL;
+    }
+    Elf64_Ehdr header;
+    if (kfread(&header, 1, sizeof(Elf64_Ehdr), fd) != sizeof(Elf64_Ehdr)) {
+        return NULL;
+    }
+    if (header.e_ident[EI_MAG0] != ELFMAG0 || header.e_ident[EI_MAG1] != ELFMAG1 || header.e_ident[EI_MAG2] != ELFMAG2 || header.e_ident[EI_MAG3] != ELFMAG3) {
+        return NULL;
+    }
+
+    pointer_int_t got = elf_image_get("(mmap)", fd, st, NULL);
+    return got.pointer;
+}
+
+// Auxiliary vector entries every ELF program gets
+static void elf_aux_common(binprm_t *bprm) {
+    binprm_aux(bprm, AT_PAGESZ, 0x1000);
+    binprm_aux(bprm, AT_FLAGS, 0);
+    binprm_aux(bprm, AT_UID, current_process->uid);
+    binprm_aux(bprm, AT_EUID, current_process->euid);
+    binprm_aux(bprm, AT_GID, current_process->gid);
+    binprm_aux(bprm, AT_EGID, current_process->egid);
+}
+
+// Where an ET_DYN program goes
+static uint64_t elf_dyn_base() {
+    return ELF_ET_DYN_BASE + (binfmt_randomize() ? binfmt_random_pages(ELF_ET_DYN_RANDOM_PAGES) * 0x1000 : 0);
+}
+
+// Map a program's dynamic linker at the bottom of the mmap() area, and have
+// the program start there. Its base goes in *base_out.
+static int64_t elf_load_interp(binprm_t *bprm, const char *path, uint64_t *base_out) {
+    int fd = kfopen((char *)path, 0, 0);
+    if (fd < 0) {
+        return -ENOENT;
+    }
+    struct stat st = {0};
+    if (kfstat(fd, &st) < 0) {
+        st.st_ino = 0;
+        st.st_size = file_size_internal((char *)path);
+    }
+    pointer_int_t got = elf_image_get(path, fd, &st, NULL);
+    kfclose(fd);
+    if (got.value != 0) {
+        return got.value;
+    }
+
+    // it can't ask for a dynamic linker itself, and must go anywhere
+    exec_image_t *image = got.pointer;
+    if (image == NULL || image->type != ET_DYN || image->interp != NULL) {
+        exec_image_put(image);
+        return -ELIBBAD;
+    }
+
+    uint64_t base = bprm->mmap_next;
+    if (image->max_addr > USER_MMAP_END - base) {
+        exec_image_put(image);
+        return -ELIBBAD;
+    }
+    elf_info_t info = exec_image_map(image, bprm->pml4, base);
+    exec_image_ref_add(&bprm->images, image);
+    bprm->mmap_next = PAGE_ALIGN_UP(info.max_addr);
+    bprm->entry = info.entry;
+    bprm->pages += info.pages;
+    *base_out = base;
+    return 0;
+}
+
+// Load a program that only load_elf64() copes with. That copies its
+// segments, so there's nothing for a dynamic linker to share either, and
+// one isn't supported.
+static int64_t elf_load_copy(binprm_t *bprm, char *file) {
+    Elf64_Ehdr *header = (Elf64_Ehdr *)file;
+    uint64_t size = bprm->st.st_size;
+    if (size < sizeof(Elf64_Ehdr) || header->e_phentsize < sizeof(Elf64_Phdr) || !elf_in_file(header->e_phoff, (uint64_t)header->e_phnum * header->e_phentsize, size)) {
+        return -ENOEXEC;
+    }
+
+    // the same limits exec_image_create() puts on segments, load_elf64()
+    // trusts them
+    uint64_t base = header->e_type == ET_DYN ? elf_dyn_base() : 0;
+    for (int i = 0; i < header->e_phnum; i++) {
+        Elf64_Phdr *phdr = (Elf64_Phdr *)(file + header->e_phoff + (i * header->e_phentsize));
+        if (phdr->p_type == PT_INTERP) {
+            serial_printf("%s needs a dynamic linker, but its segments share pages\n", bprm->path);
+            return -ENOEXEC;
+        }
+        if (phdr->p_type != PT_LOAD) {
+            continue;
+        }
+        if (phdr->p_filesz > phdr->p_memsz || !elf_in_file(phdr->p_offset, phdr->p_filesz, size) || !elf_in_file(phdr->p_vaddr, phdr->p_memsz, VIRT_MEM_OFFSET - base)) {
+            return -ENOEXEC;
+        }
+    }
+
+    elf_info_t info = load_elf64(file, bprm->pml4, base);
+    if (info.status != 0) {
+        return -ENOEXEC;
+    }
+    bprm->entry = info.entry;
+    bprm->brk = PAGE_ALIGN_UP(info.max_addr);
+    bprm->pages += info.pages;
+
+    binprm_aux(bprm, AT_PHENT, sizeof(Elf64_Phdr));
+    binprm_aux(bprm, AT_PHNUM, header->e_phnum);
+    binprm_aux(bprm, AT_ENTRY, info.entry);
+    elf_aux_common(bprm);
+    return 0;
+}
+
+// Load an ELF executable, ET_EXEC where it asks to go or ET_DYN at a base
+// of its own, along with its dynamic linker if it has PT_INTERP.
+static int64_t elf_binfmt_load(binprm_t *bprm) {
+    Elf64_Ehdr *header = (Elf64_Ehdr *)bprm->buf;
+    if (bprm->buf_size < sizeof(Elf64_Ehdr) || header->e_ident[EI_MAG0] != ELFMAG0 || header->e_ident[EI_MAG1] != ELFMAG1 || header->e_ident[EI_MAG2] != ELFMAG2 || header->e_ident[EI_MAG3] != ELFMAG3) {
+        return -ENOEXEC;
+    }
+    if (elf_check_header(header) != 0) {
+        return -ENOEXEC;
+    }
+
+    // an image run before is mapped from the cache without reading the file
+    char *file = NULL;
+    pointer_int_t got = elf_image_get(bprm->path, bprm->fd, &bprm->st, &file);
+    if (got.value != 0) {
+        return got.value;
+    }
+    exec_image_t *image = got.pointer;
+    if (image == NULL) {
+        int64_t status = elf_load_copy(bprm, file);
+        kfree(file);
+        return status;
+    }
+
+    uint64_t base = image->type == ET_DYN ? elf_dyn_base() : 0;
+    if (image->max_addr > VIRT_MEM_OFFSET - base) {
+        exec_image_put(image);
+        return -ENOEXEC;
+    }
+    elf_info_t info = exec_image_map(image, bprm->pml4, base);
+    bprm->entry = info.entry;
+    bprm->brk = PAGE_ALIGN_UP(info.max_addr);
+    bprm->pages += info.pages;
+
+    binprm_aux(bprm, AT_PHDR, image->phdr_addr != 0 ? base + image->phdr_addr : 0);
+    binprm_aux(bprm, AT_PHENT, sizeof(Elf64_Phdr));
+    binprm_aux(bprm, AT_PHNUM, image->phnum);
+    binprm_aux(bprm, AT_ENTRY, info.entry);
+    elf_aux_common(bprm);
+
+    uint64_t interp_base = 0;
+    int64_t status = 0;
+    if (image->interp != NULL) {
+        status = elf_load_interp(bprm, image->interp, &interp_base);
+        if (status != 0) {
+            serial_printf("Failed to load %s's dynamic linker %s: %ld\n", bprm->path, image->interp, status);
+        }
+    }
+    binprm_aux(bprm, AT_BASE, interp_base);
+    // the address space holds on to the image once it's mapped, or until
+    // exec frees it on failure
+    exec_image_ref_add(&bprm->images, image);
+    return status;
+}
+
+static binfmt_t elf_binfmt = {
+    .name = "elf",
+    .load = elf_binfmt_load,
+};
+
+/**
+ * Register the ELF executable format.
+ */
+void elf_binfmt_init() {
+    register_binfmt(&elf_binfmt);
+}
@@ -0,0 +1,772 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include <exec_cache.h>
+#include <memory.h>
+#include <system.h>
+#include <serial.h>
+#include <string.h>
+#include <device.h>
+#include <lock.h>
+#include <preempt.h>
+#include <unused.h>
+#include <sys/errno.h>
+
+// Cached images, least recently used first
+static list_node_t exec_cache_list = LIST_HEAD_INIT(exec_cache_list);
+// Images whose pages went back under memory pressure, to free once it's
+// safe to call kfree()
+static list_node_t exec_cache_dead = LIST_HEAD_INIT(exec_cache_dead);
+// Guards both lists, exec_cache_pages and every image's refcount
+static spinlock_t exec_cache_lock = SPINLOCK_INIT("exec_cache");
+static uint64_t exec_cache_pages = 0;
+
+static uint64_t exec_cache_hits = 0;
+static uint64_t exec_cache_misses = 0;
+static uint64_t exec_cache_uncacheable = 0;
+static uint64_t exec_cache_evictions = 0;
+static uint64_t exec_cache_reclaimed = 0;
+
+device_t exec_cache_device = {0};
+
+static void exec_image_free(exec_image_t *image)
+{
+    // NULL if it was never prepared
+    if (image->frames != NULL)
+    {
+        for (uint64_t i = 0; i < image->frame_count; i++)
+        {
+            if (image->frames[i] != 0)
+            {
+                page_frame_free(image->frames[i]);
+            }
+        }
+        kfree(image->frames);
+    }
+    if (image->interp != NULL)
+    {
+        kfree(image->interp);
+    }
+    kfree(image->segments);
+    kfree(image->phdrs);
+    kfree(image);
+}
+
+// Free what exec_cache_reclaim() left behind
+static void exec_cache_free_dead()
+{
+    spin_lock(&exec_cache_lock);
+    while (!list_empty(&exec_cache_dead))
+    {
+        exec_image_t *image = list_entry(exec_cache_dead.next, exec_image_t, node);
+        list_remove(&image->node);
+        spin_unlock(&exec_cache_lock);
+        exec_image_free(image);
+        spin_lock(&exec_cache_lock);
+    }
+    spin_unlock(&exec_cache_lock);
+}
+
+/**
+ * Find the cached image of an executable.
+ *
+ * @param st The file's stat
+ *
+ * @return The image, holding a reference for the caller, or NULL if it isn't
+ *      cached
+ */
+exec_image_t *exec_cache_lookup(const struct stat *st)
+{
+    exec_cache_free_dead();
+
+    // without an inode number there's nothing telling files apart
+    if (st->st_ino == 0)
+    {
+        __atomic_fetch_add(&exec_cache_uncacheable, 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+
+    spin_lock(&exec_cache_lock);
+    list_node_t *node;
+    list_for_each(node, &exec_cache_list)
+    {
+        exec_image_t *image = list_entry(node, exec_image_t, node);
+        if (image->dev == st->st_dev && image->ino == st->st_ino && image->size == st->st_size && image->mtime == st->st_mtime)
+        {
+            // now the most recently used
+            list_remove(&image->node);
+            list_add_tail(&exec_cache_list, &image->node);
+            image->refcount++;
+            image->hits++;
+            exec_cache_hits++;
+            spin_unlock(&exec_cache_lock);
+            return image;
+        }
+    }
+    exec_cache_misses++;
+    spin_unlock(&exec_cache_lock);
+    return NULL;
+}
+
+// Parse an executable or shared library's loadable segments and prepare the
+// pages holding file contents. NULL if it isn't valid, or its segments
+// share pages, which only load_elf64() copes with.
+static exec_image_t *exec_image_create(char *file, size_t size)
+{
+    Elf64_Ehdr *header = (Elf64_Ehdr *)file;
+    if (size < sizeof(Elf64_Ehdr) || elf_check_header(header) != 0)
+    {
+        return NULL;
+    }
+    if (header->e_phentsize < sizeof(Elf64_Phdr) || !elf_in_file(header->e_phoff, (uint64_t)header->e_phnum * header->e_phentsize, size))
+    {
+        return NULL;
+    }
+
+    exec_image_t *image = (exec_image_t *)kmalloc(sizeof(exec_image_t));
+    memset(image, 0, sizeof(exec_image_t));
+    list_init(&image->node);
+    image->refcount = 1;
+    image->type = header->e_type;
+    image->entry = header->e_entry;
+    image->phnum = header->e_phnum;
+    image->phdrs = (Elf64_Phdr *)kmalloc(image->phnum * sizeof(Elf64_Phdr));
+    image->segments = (exec_segment_t *)kmalloc(image->phnum * sizeof(exec_segment_t));
+
+    for (uint16_t i = 0; i < image->phnum; i++)
+    {
+        Elf64_Phdr *phdr = &image->phdrs[i];
+        memcpy(phdr, file + header->e_phoff + i * header->e_phentsize, sizeof(Elf64_Phdr));
+        if (phdr->p_type == PT_INTERP)
+        {
+            // a NUL terminated path
+            if (phdr->p_filesz < 2 || phdr->p_filesz > PATH_MAX || !elf_in_file(phdr->p_offset, phdr->p_filesz, size) || file[phdr->p_offset + phdr->p_filesz - 1] != '\0' || image->interp != NULL)
+            {
+                exec_image_free(image);
+                return NULL;
+            }
+            image->interp = (char *)kmalloc(phdr->p_filesz);
+            memcpy(image->interp, file + phdr->p_offset, phdr->p_filesz);
+            continue;
+        }
+        if (phdr->p_type == PT_PHDR)
+        {
+            image->phdr_addr = phdr->p_vaddr;
+            continue;
+        }
+        if (phdr->p_type != PT_LOAD || phdr->p_memsz == 0)
+        {
+            continue;
+        }
+
+        uint64_t end = phdr->p_vaddr + phdr->p_memsz;
+        if (phdr->p_filesz > phdr->p_memsz || !elf_in_file(phdr->p_offset, phdr->p_filesz, size) || end < phdr->p_vaddr || end > VIRT_MEM_OFFSET)
+        {
+            exec_image_free(image);
+            return NULL;
+        }
+
+        exec_segment_t *segment = &image->segments[image->segment_count];
+        segment->start = phdr->p_vaddr & 0xFFFFFFFFFFFFF000;
+        segment->pages = (PAGE_ALIGN_UP(end) - segment->start) / 0x1000;
+        segment->file_pages = phdr->p_filesz != 0 ? (PAGE_ALIGN_UP(phdr->p_vaddr + phdr->p_filesz) - segment->start) / 0x1000 : 0;
+        segment->first_frame = image->frame_count;
+        segment->flags = phdr->p_flags;
+        segment->file_start = phdr->p_offset;
+        segment->file_end = phdr->p_offset + phdr->p_filesz;
+        // ELF asks for this, but only then are the frames pages of the file
+        segment->file_aligned = ((phdr->p_vaddr ^ phdr->p_offset) & 0xFFF) == 0;
+
+        // without PT_PHDR, the headers are wherever the segment holding
+        // them puts them
+        if (image->phdr_addr == 0 && header->e_phoff >= phdr->p_offset && header->e_phoff + (uint64_t)header->e_phnum * sizeof(Elf64_Phdr) <= phdr->p_offset + phdr->p_filesz)
+        {
+            image->phdr_addr = phdr->p_vaddr + (header->e_phoff - phdr->p_offset);
+        }
+
+        for (uint16_t j = 0; j < image->segment_count; j++)
+        {
+            exec_segment_t *other = &image->segments[j];
+            if (segment->start < other->start + other->pages * 0x1000 && other->start < segment->start + segment->pages * 0x1000)
+            {
+                exec_image_free(image);
+                return NULL;
+            }
+        }
+
+        image->segment_count++;
+        image->frame_count += segment->file_pages;
+        if (end > image->max_addr)
+        {
+            image->max_addr = end;
+        }
+    }
+
+    // the file's contents as they'll appear in memory, zeroed around them
+    image->frames = (uint64_t *)kmalloc((image->frame_count != 0 ? image->frame_count : 1) * sizeof(uint64_t));
+    memset(image->frames, 0, (image->frame_count != 0 ? image->frame_count : 1) * sizeof(uint64_t));
+    uint16_t segment_index = 0;
+    for (uint16_t i = 0; i < image->phnum; i++)
+    {
+        Elf64_Phdr *phdr = &image->phdrs[i];
+        if (phdr->p_type != PT_LOAD || phdr->p_memsz == 0)
+        {
+            continue;
+        }
+
+        exec_segment_t *segment = &image->segments[segment_index++];
+        for (uint64_t j = 0; j < segment->file_pages; j++)
+        {
+            uint64_t frame = page_frame_alloc();
+            image->frames[segment->first_frame + j] = frame;
+
+            uint64_t page = segment->start + j * 0x1000;
+            uint64_t from = page > phdr->p_vaddr ? page : phdr->p_vaddr;
+            uint64_t to = page + 0x1000 < phdr->p_vaddr + phdr->p_filesz ? page + 0x1000 : phdr->p_vaddr + phdr->p_filesz;
+            memset((void *)(frame + VIRT_MEM_OFFSET), 0, 0x1000);
+            memcpy((void *)(frame + VIRT_MEM_OFFSET + (from - page)), file + phdr->p_offset + (from - phdr->p_vaddr), to - from);
+
+            if (j % 16 == 15)
+            {
+                cond_resched();
+            }
+        }
+    }
+
+    return image;
+}
+
+// Drop least recently used images nobody is running until there's room for
+// pages more, and enough memory would be free. Called with exec_cache_lock
+// held; the dropped images go on evicted, to free without it.
+static bool exec_cache_make_room(uint64_t pages, uint64_t free_pages, list_node_t *evicted)
+{
+    list_node_t *node, *tmp;
+    list_for_each_safe(node, tmp, &exec_cache_list)
+    {
+        if (exec_cache_pages + pages <= EXEC_CACHE_MAX_PAGES && free_pages >= EXEC_CACHE_RESERVE_PAGES)
+        {
+            return true;
+        }
+
+        exec_image_t *image = list_entry(node, exec_image_t, node);
+        if (image->refcount != 1)
+        {
+            continue;
+        }
+        list_remove(&image->node);
+        list_add_tail(evicted, &image->node);
+        exec_cache_pages -= image->frame_count;
+        exec_cache_evictions++;
+        free_pages += image->frame_count;
+    }
+
+    return exec_cache_pages + pages <= EXEC_CACHE_MAX_PAGES && free_pages >= EXEC_CACHE_RESERVE_PAGES;
+}
+
+/**
+ * Load an executable or shared library into the cache.
+ *
+ * @param name How it was run, for the report
+ * @param file Its contents
+ * @param size Its size
+ * @param st Its stat, which identifies it
+ *
+ * @return The image, holding a reference for the caller, or NULL if it can't
+ *      be cached and must be loaded with load_elf64(). A file without an
+ *      identity, or one that doesn't fit while the cache is full of images
+ *      in use, gets an image that isn't cached.
+ */
+exec_image_t *exec_cache_add(const char *name, char *file, size_t size, const struct stat *st)
+{
+    exec_image_t *image = exec_image_create(file, size);
+    if (image == NULL)
+    {
+        __atomic_fetch_add(&exec_cache_uncacheable, 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+    size_t name_length = strlen(name) < sizeof(image->name) - 1 ? strlen(name) : sizeof(image->name) - 1;
+    memcpy(image->name, name, name_length);
+    image->name[name_length] = '\0';
+    image->dev = st->st_dev;
+    image->ino = st->st_ino;
+    image->size = st->st_size;
+    image->mtime = st->st_mtime;
+
+    // exec_cache_lookup() already counted it as uncacheable
+    if (st->st_ino == 0)
+    {
+        return image;
+    }
+
+    uint64_t free_pages = free_page_count();
+    list_node_t evicted = LIST_HEAD_INIT(evicted);
+    spin_lock(&exec_cache_lock);
+    if (exec_cache_make_room(image->frame_count, free_pages, &evicted))
+    {
+        // one reference for the cache, one for the caller
+        image->refcount = 2;
+        list_add_tail(&exec_cache_list, &image->node);
+        exec_cache_pages += image->frame_count;
+    }
+    spin_unlock(&exec_cache_lock);
+
+    while (!list_empty(&evicted))
+    {
+        exec_image_t *old = list_entry(evicted.next, exec_image_t, node);
+        list_remove(&old->node);
+        serial_printf("Evicting %s from the executable cache\n", old->name);
+        exec_image_put(old);
+    }
+
+    return image;
+}
+
+/**
+ * Map an image into a new address space: the prepared pages borrowed from
+ * it, and fresh zeroed ones for bss.
+ *
+ * @param image The image
+ * @param pml4 The address space
+ * @param base Added to every address in the image, 0 unless it's ET_DYN
+ *
+ * @return What load_elf64() would have returned for the file
+ */
+elf_info_t exec_image_map(exec_image_t *image, page_directory_t *pml4, uint64_t base)
+{
+    uint64_t pages = 0;
+    for (uint16_t i = 0; i < image->segment_count; i++)
+    {
+        exec_segment_t *segment = &image->segments[i];
+        for (uint64_t j = 0; j < segment->pages; j++)
+        {
+            uint64_t virt = base + segment->start + j * 0x1000;
+            if (j < segment->file_pages)
+            {
+                if (map_page_borrowed(virt, image->frames[segment->first_frame + j], segment->flags & PF_W, pml4))
+                {
+                    pages++;
+                }
+                continue;
+            }
+
+            uint64_t phys = first_free_page_addr();
+            if (map_page_kmalloc(virt, phys, false, true, pml4))
+            {
+                memset((void *)(phys + VIRT_MEM_OFFSET), 0, 0x1000);
+                pages++;
+            }
+        }
+    }
+
+    elf_info_t info;
+    info.entry = base + image->entry;
+    info.max_addr = base + image->max_addr;
+    info.status = 0;
+    info.regions = NULL;
+    info.pages = pages;
+    return info;
+}
+
+/**
+ * Find the prepared page holding a page of an image's file, for mapping the
+ * file elsewhere, as a dynamic linker does with shared libraries.
+ *
+ * @param image The image
+ * @param offset Where the page starts in the file, page aligned
+ *
+ * @return The page frame, or 0 if no segment holds all of that page of the
+ *      file, so the frame (zeroed around the segment) wouldn't match it
+ */
+uint64_t exec_image_file_frame(exec_image_t *image, uint64_t offset)
+{
+    for (uint16_t i = 0; i < image->segment_count; i++)
+    {
+        exec_segment_t *segment = &image->segments[i];
+        if (!segment->file_aligned || offset < segment->file_start || offset + 0x1000 > segment->file_end)
+        {
+            continue;
+        }
+        uint64_t index = (offset - (segment->file_start & 0xFFFFFFFFFFFFF000)) / 0x1000;
+        return image->frames[segment->first_frame + index];
+    }
+    return 0;
+}
+
+/**
+ * Record that an address space maps pages of an image, so the image lives
+ * as long as it does.
+ *
+ * @param refs The address space's list of images
+ * @param image The image, whose reference the list takes over
+ */
+void exec_image_ref_add(exec_image_ref_t **refs, exec_image_t *image)
+{
+    for (exec_image_ref_t *ref = *refs; ref != NULL; ref = ref->next)
+    {
+        if (ref->image == image)
+        {
+            exec_image_put(image);
+            return;
+        }
+    }
+
+    exec_image_ref_t *ref = (exec_image_ref_t *)kmalloc(sizeof(exec_image_ref_t));
+    ref->image = image;
+    ref->next = *refs;
+    *refs = ref;
+}
+
+/**
+ * Drop every image in a list, once the address space is gone.
+ *
+ * @param refs The list, may be empty
+ */
+void exec_image_refs_put(exec_image_ref_t *refs)
+{
+    while (refs != NULL)
+    {
+        exec_image_ref_t *next = refs->next;
+        exec_image_put(refs->image);
+        kfree(refs);
+        refs = next;
+    }
+}
+
+/**
+ * Drop a reference to an image, freeing it once it's out of the cache and
+ * no address space maps its pages any more.
+ *
+ * @param image The image, may be NULL
+ */
+void exec_image_put(exec_image_t *image)
+{
+    if (image == NULL)
+    {
+        return;
+    }
+
+    spin_lock(&exec_cache_lock);
+    bool last = --image->refcount == 0;
+    spin_unlock(&exec_cache_lock);
+    if (last)
+    {
+        exec_image_free(image);
+    }
+}
+
+/**
+ * Drop every cached image nobody is running.
+ *
+ * @return How many pages that frees
+ */
+uint64_t exec_cache_drop()
+{
+    list_node_t evicted = LIST_HEAD_INIT(evicted);
+    uint64_t pages = 0;
+
+    spin_lock(&exec_cache_lock);
+    list_node_t *node, *tmp;
+    list_for_each_safe(node, tmp, &exec_cache_list)
+    {
+        exec_image_t *image = list_entry(node, exec_image_t, node);
+        if (image->refcount != 1)
+        {
+            continue;
+        }
+        list_remove(&image->node);
+        list_add_tail(&evicted, &image->node);
+        exec_cache_pages -= image->frame_count;
+        exec_cache_evictions++;
+        pages += image->frame_count;
+    }
+    spin_unlock(&exec_cache_lock);
+
+    while (!list_empty(&evicted))
+    {
+        exec_image_t *image = list_entry(evicted.next, exec_image_t, node);
+        list_remove(&image->node);
+        exec_image_put(image);
+    }
+
+    return pages;
+}
+
+/**
+ * Give back the pages of cached images nobody is running, when there are no
+ * free pages left. Called from the page allocator, so it neither waits for
+ * the cache nor calls the heap; the rest of the images goes later.
+ *
+ * @return How many pages that freed
+ */
+uint64_t exec_cache_reclaim()
+{
+    if (!spin_trylock(&exec_cache_lock))
+    {
+        return 0;
+    }
+
+    uint64_t pages = 0;
+    list_node_t *node, *tmp;
+    list_for_each_safe(node, tmp, &exec_cache_list)
+    {
+        exec_image_t *image = list_entry(node, exec_image_t, node);
+        if (image->refcount != 1)
+        {
+            continue;
+        }
+        for (uint64_t i = 0; i < image->frame_count; i++)
+        {
+            page_frame_free(image->frames[i]);
+            image->frames[i] = 0;
+        }
+        list_remove(&image->node);
+        list_add_tail(&exec_cache_dead, &image->node);
+        exec_cache_pages -= image->frame_count;
+        exec_cache_evictions++;
+        pages += image->frame_count;
+    }
+    exec_cache_reclaimed += pages;
+    spin_unlock(&exec_cache_lock);
+
+    return pages;
+}
+
+static void emit_uint(exec_cache_emit_t emit, void *ctx, uint64_t value)
+{
+    char buffer[32];
+    uitoa64(value, buffer, 10);
+    emit(buffer, ctx);
+}
+
+/**
+ * Write out the cache's hit rate and what it holds, most used first.
+ *
+ * @param emit Called with each piece of the report
+ * @param ctx Passed through to emit
+ */
+void exec_cache_report(exec_cache_emit_t emit, void *ctx)
+{
+    spin_lock(&exec_cache_lock);
+
+    uint64_t lookups = exec_cache_hits + exec_cache_misses;
+    emit("Executable cache\n", ctx);
+    emit("lookups: ", ctx);
+    emit_uint(emit, ctx, lookups);
+    emit(", hits: ", ctx);
+    emit_uint(emit, ctx, exec_cache_hits);
+    emit(" (", ctx);
+    emit_uint(emit, ctx, lookups != 0 ? exec_cache_hits * 100 / lookups : 0);
+    emit("%), misses: ", ctx);
+    emit_uint(emit, ctx, exec_cache_misses);
+    emit(", uncacheable: ", ctx);
+    emit_uint(emit, ctx, exec_cache_uncacheable);
+    emit("\nevictions: ", ctx);
+    emit_uint(emit, ctx, exec_cache_evictions);
+    emit(", pages reclaimed under memory pressure: ", ctx);
+    emit_uint(emit, ctx, exec_cache_reclaimed);
+    emit("\npages: ", ctx);
+    emit_uint(emit, ctx, exec_cache_pages);
+    emit(" of ", ctx);
+    emit_uint(emit, ctx, EXEC_CACHE_MAX_PAGES);
+    emit("\nname: hits, pages, users\n", ctx);
+
+    // most recently used last, so walk backwards
+    for (list_node_t *node = exec_cache_list.prev; node != &exec_cache_list; node = node->prev)
+    {
+        exec_image_t *image = list_entry(node, exec_image_t, node);
+        emit("  ", ctx);
+        emit(image->name, ctx);
+        emit(": ", ctx);
+        emit_uint(emit, ctx, image->hits);
+        emit(", ", ctx);
+        emit_uint(emit, ctx, image->frame_count);
+        emit(", ", ctx);
+        emit_uint(emit, ctx, image->refcount - 1);
+        emit("\n", ctx);
+    }
+
+    spin_unlock(&exec_cache_lock);
+}
+
+static void exec_cache_emit_serial(const char *str, void *ctx)
+{
+    UNUSED(ctx);
+    serial_printf("%s", str);
+}
+
+typedef struct {
+    char *buffer;
+    size_t length;
+    size_t capacity;
+    size_t read_pos;
+    uint64_t dependents;
+} kexeccache_open_data_t;
+
+static void exec_cache_emit_buffer(const char *str, void *ctx)
+{
+    kexeccache_open_data_t *data = (kexeccache_open_data_t *)ctx;
+    size_t len = strlen(str);
+
+    if (data->length + len + 1 > data->capacity)
+    {
+        size_t new_capacity = data->capacity * 2;
+        while (data->length + len + 1 > new_capacity)
+        {
+            new_capacity *= 2;
+        }
+        char *new_buffer = (char *)kmalloc(new_capacity);
+        memcpy(new_buffer, data->buffer, data->length);
+        kfree(data->buffer);
+        data->buffer = new_buffer;
+        data->capacity = new_capacity;
+    }
+
+    memcpy(data->buffer + data->length, str, len);
+    data->length += len;
+    data->buffer[data->length] = '\0';
+}
+
+pointer_int_t kexeccache_open(const char *path, uint64_t flags, void *device_passed)
+{
+    UNUSED(path);
+    UNUSED(device_passed);
+
+    if (flags & O_DIRECTORY)
+    {
+        return (pointer_int_t){NULL, -ENOTDIR};
+    }
+
+    kexeccache_open_data_t *data = (kexeccache_open_data_t *)kmalloc(sizeof(kexeccache_open_data_t));
+    data->capacity = 4096;
+    data->buffer = (char *)kmalloc(data->capacity);
+    data->length = 0;
+    data->read_pos = 0;
+    data->dependents = 1;
+
+    // Snapshot the report at open time so reads see a consistent view
+    exec_cache_report(exec_cache_emit_buffer, data);
+
+    return (pointer_int_t){data, 0};
+}
+
+size_t kexeccache_read(void *ptr, size_t size, size_t nmemb, void *filedes_data, void *device_passed, uint64_t flags)
+{
+    UNUSED(device_passed);
+    UNUSED(flags);
+
+    kexeccache_open_data_t *data = (kexeccache_open_data_t *)filedes_data;
+    size_t to_read = size * nmemb;
+    if (to_read > data->length - data->read_pos)
+    {
+        to_read = data->length - data->read_pos;
+    }
+
+    memcpy(ptr, data->buffer + data->read_pos, to_read);
+    data->read_pos += to_read;
+
+    return to_read;
+}
+
+size_t kexeccache_write(const void *ptr, size_t size, size_t nmemb, void *filedes_data, void *device_passed, uint64_t flags)
+{
+    UNUSED(filedes_data);
+    UNUSED(device_passed);
+    UNUSED(flags);
+
+    size_t len = size * nmemb;
+    const char *command = (const char *)ptr;
+
+    if (len >= 4 && strncmp(command, "drop", 4) == 0)
+    {
+        exec_cache_drop();
+    }
+    else if (len >= 5 && strncmp(command, "reset", 5) == 0)
+    {
+        spin_lock(&exec_cache_lock);
+        exec_cache_hits = 0;
+        exec_cache_misses = 0;
+        exec_cache_uncacheable = 0;
+        exec_cache_evictions = 0;
+        exec_cache_reclaimed = 0;
+        spin_unlock(&exec_cache_lock);
+    }
+    else if (len >= 6 && strncmp(command, "serial", 6) == 0)
+    {
+        exec_cache_report(exec_cache_emit_serial, NULL);
+    }
+    else
+    {
+        return -EINVAL;
+    }
+
+    return len;
+}
+
+int kexeccache_close(void *filedes_data, void *device_passed)
+{
+    UNUSED(device_passed);
+
+    kexeccache_open_data_t *data = (kexeccache_open_data_t *)filedes_data;
+    if (data->dependents > 1)
+    {
+        data->dependents--;
+        return 0;
+    }
+
+    kfree(data->buffer);
+    kfree(data);
+    return 0;
+}
+
+void *kexeccache_dup(void *filedes_data, void *device_passed)
+{
+    UNUSED(device_passed);
+
+    kexeccache_open_data_t *data = (kexeccache_open_data_t *)filedes_data;
+    data->dependents++;
+    return data;
+}
+
+int kexeccache_stat(void *file_entry, void *buf, void *device_passed)
+{
+    UNUSED(device_passed);
+
+    kexeccache_open_data_t *data = (kexeccache_open_data_t *)file_entry;
+
+    struct stat *statbuf = (struct stat *)buf;
+    statbuf->st_dev = 0;
+    statbuf->st_ino = 0;
+    statbuf->st_mode = S_IFCHR;
+    statbuf->st_nlink = 1;
+    statbuf->st_uid = 0;
+    statbuf->st_gid = 0;
+    statbuf->st_rdev = 0;
+    statbuf->st_size = data->length;
+
+    return 0;
+}
+
+void exec_cache_init()
+{
+    strcpy(exec_cache_device.name, "kexeccache");
+    exec_cache_device.flags = 0;
+    exec_cache_device.data = NULL;
+    exec_cache_device.type = DEVICE_TYPE_EXECCACHE;
+
+    exec_cache_device.open = (open_func_t)kexeccache_open;
+    exec_cache_device.read = (read_func_t)kexeccache_read;
+    exec_cache_device.write = (write_func_t)kexeccache_write;
+    exec_cache_device.close = (close_func_t)kexeccache_close;
+    exec_cache_device.fcntl = NULL;
+    exec_cache_device.file_size = NULL;
+    exec_cache_device.lseek = NULL;
+    exec_cache_device.ioctl = NULL;
+    exec_cache_device.dup = (dup_func_t)kexeccache_dup;
+    exec_cache_device.clone = (clone_func_t)kexeccache_dup;
+    exec_cache_device.stat = (stat_func_t)kexeccache_stat;
+    exec_cache_device.select = NULL;
+
+    register_device(&exec_cache_device);
+}
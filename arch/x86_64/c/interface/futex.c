@@ -0,0 +1,227 @@
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <futex.h>
+#include <process.h>
+#include <memory.h>
+#include <clock.h>
+#include <sys/errno.h>
+
+static futex_bucket_t futex_table[FUTEX_HASH_SIZE];
+
+void futex_init()
+{
+    for (int i = 0; i < FUTEX_HASH_SIZE; i++)
+    {
+        spin_lock_init(&futex_table[i].lock, "futex");
+        list_init(&futex_table[i].waiters);
+    }
+}
+
+// Physical address of a futex word in the current address space, faulting
+// it in if needed
+static int futex_key(uint32_t *uaddr, uint64_t *key)
+{
+    if ((uint64_t)uaddr & 3)
+    {
+        return -EINVAL;
+    }
+    if (uaddr == NULL || (uint64_t)uaddr >= VIRT_MEM_OFFSET)
+    {
+        return -EFAULT;
+    }
+
+    // stack and heap pages are only mapped once touched
+    (void)*(volatile uint32_t *)uaddr;
+    // and a copy-on-write page borrowed from a template or the executable
+    // cache would change frames under the first write, which the waker is
+    // likely to make, so take the private copy now. Anything else it leaves
+    // alone.
+    page_cow_break((uint64_t)uaddr, current_process->pml4);
+
+    uint64_t phys = virt_to_phys((uint64_t)uaddr, current_process->pml4);
+    if (phys == (uint64_t)-1)
+    {
+        return -EFAULT;
+    }
+    *key = phys;
+    return 0;
+}
+
+static futex_bucket_t *futex_bucket(uint64_t key)
+{
+    return &futex_table[((key >> 2) * 0x9E3779B97F4A7C15ULL) >> 32 & (FUTEX_HASH_SIZE - 1)];
+}
+
+/**
+ * Sleep on a futex word, if it still holds the value the caller saw.
+ *
+ * @param uaddr The word, 4-byte aligned
+ * @param val What the caller last read from it
+ * @param timeout How long to wait at most, NULL for no limit
+ *
+ * @return 0 once woken by futex_wake()
+ *      -EAGAIN if the word no longer held val
+ *      -ETIMEDOUT if the timeout passed first
+ *      -EINTR if a signal arrived first
+ *      -EINVAL if uaddr isn't aligned or the timeout is malformed
+ *      -EFAULT if uaddr isn't mapped
+ */
+int futex_wait(uint32_t *uaddr, uint32_t val, const struct timespec *timeout)
+{
+    uint64_t deadline = 0;
+    if (timeout != NULL)
+    {
+        if (timeout->tv_sec < 0 || timeout->tv_nsec < 0 || (uint64_t)timeout->tv_nsec >= NSEC_PER_SEC)
+        {
+            return -EINVAL;
+        }
+        deadline = clock_monotonic_ns() + (uint64_t)timeout->tv_sec * NSEC_PER_SEC + timeout->tv_nsec;
+    }
+
+    uint64_t key;
+    int status = futex_key(uaddr, &key);
+    if (status != 0)
+    {
+        return status;
+    }
+
+    futex_bucket_t *bucket = futex_bucket(key);
+    futex_waiter_t waiter;
+    waiter.key = key;
+    waiter.process = (struct process *)current_process;
+
+    // futex_wake() takes the same lock, so a wake after userspace changed
+    // the word can't slip in between this check and queueing
+    uint64_t flags;
+    spin_lock_irqsave(&bucket->lock, flags);
+    if (*(volatile uint32_t *)uaddr != val)
+    {
+        spin_unlock_irqrestore(&bucket->lock, flags);
+        return -EAGAIN;
+    }
+    list_add_tail(&bucket->waiters, &waiter.node);
+    spin_unlock_irqrestore(&bucket->lock, flags);
+
+    timeout_t timer;
+    while (true)
+    {
+        // blocked before checking, so a wake in between isn't lost
+        process_prepare_block();
+
+        if (list_empty(&waiter.node))
+        {
+            break;
+        }
+        if (signal_pending((process_t *)current_process))
+        {
+            status = -EINTR;
+            break;
+        }
+
+        if (timeout != NULL)
+        {
+            uint64_t now = clock_monotonic_ns();
+            if (now >= deadline)
+            {
+                status = -ETIMEDOUT;
+                break;
+            }
+            timeout_start(&timer, deadline - now);
+        }
+        process_block();
+        if (timeout != NULL)
+        {
+            timeout_cancel(&timer);
+        }
+    }
+    process_cancel_block();
+
+    spin_lock_irqsave(&bucket->lock, flags);
+    if (list_empty(&waiter.node))
+    {
+        // woken after all, which a caller must not miss
+        status = 0;
+    }
+    else
+    {
+        list_remove(&waiter.node);
+    }
+    spin_unlock_irqrestore(&bucket->lock, flags);
+
+    return status;
+}
+
+/**
+ * Wake processes sleeping on a futex word, oldest first.
+ *
+ * @param uaddr The word, 4-byte aligned
+ * @param count How many to wake at most
+ *
+ * @return How many were woken
+ *      -EINVAL if uaddr isn't aligned
+ *      -EFAULT if uaddr isn't mapped
+ */
+int futex_wake(uint32_t *uaddr, int count)
+{
+    uint64_t key;
+    int status = futex_key(uaddr, &key);
+    if (status != 0)
+    {
+        return status;
+    }
+
+    futex_bucket_t *bucket = futex_bucket(key);
+    int woken = 0;
+
+    uint64_t flags;
+    spin_lock_irqsave(&bucket->lock, flags);
+    list_node_t *node, *tmp;
+    list_for_each_safe(node, tmp, &bucket->waiters)
+    {
+        if (woken >= count)
+        {
+            break;
+        }
+
+        futex_waiter_t *waiter = list_entry(node, futex_waiter_t, node);
+        if (waiter->key != key)
+        {
+            continue;
+        }
+
+        // once it's off the list the waiter may return and its stack
+        // entry go away, so read the process first
+        process_t *process = (process_t *)waiter->process;
+        list_remove(&waiter->node);
+        process_wake(process);
+        woken++;
+    }
+    spin_unlock_irqrestore(&bucket->lock, flags);
+
+    return woken;
+}
+
+/**
+ * futex() syscall.
+ *
+ * @param uaddr The futex word
+ * @param op FUTEX_WAIT or FUTEX_WAKE, optionally with FUTEX_PRIVATE_FLAG
+ * @param val For FUTEX_WAIT the expected value, for FUTEX_WAKE how many
+ *      to wake
+ * @param timeout For FUTEX_WAIT, a relative timeout or NULL
+ *
+ * @return As futex_wait() or futex_wake(), or -ENOSYS for other operations
+ */
+int64_t kfutex(uint32_t *uaddr, int op, uint32_t val, const struct timespec *timeout)
+{
+    switch (op & FUTEX_CMD_MASK)
+    {
+    case FUTEX_WAIT:
+        return futex_wait(uaddr, val, timeout);
+    case FUTEX_WAKE:
+        return futex_wake(uaddr, (int)val < 0 ? INT32_MAX : (int)val);
+    default:
+        return -ENOSYS;
+    }
+}
@@ -0,0 +1,196 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include <ktimer.h>
+#include <system.h>
+
+list_node_t ktimer_wheel[KTIMER_LEVELS][KTIMER_SLOTS];
+bool ktimer_wheel_ready = false;
+// The next tick the wheel will process
+uint64_t ktimer_clock = 0;
+uint64_t ktimer_count = 0;
+
+static void ktimer_wheel_init()
+{
+    for (int level = 0; level < KTIMER_LEVELS; level++)
+    {
+        for (int slot = 0; slot < KTIMER_SLOTS; slot++)
+        {
+            list_init(&ktimer_wheel[level][slot]);
+        }
+    }
+    ktimer_wheel_ready = true;
+}
+
+void ktimer_init(ktimer_t *timer, ktimer_fn_t function)
+{
+    list_init(&timer->node);
+    timer->expires = 0;
+    timer->function = function;
+}
+
+// Put a timer in the slot for its expiry relative to ktimer_clock
+static void ktimer_enqueue(ktimer_t *timer)
+{
+    uint64_t expires = timer->expires;
+    if (expires < ktimer_clock)
+    {
+        // already due, run on the next tick
+        expires = ktimer_clock;
+    }
+
+    uint64_t delta = expires - ktimer_clock;
+    if (delta > KTIMER_MAX_DELTA)
+    {
+        // goes round the last level, ktimer_run() re-queues it if early
+        delta = KTIMER_MAX_DELTA;
+        expires = ktimer_clock + delta;
+    }
+
+    int level = 0;
+    while (level < KTIMER_LEVELS - 1 && delta >= (1ULL << (KTIMER_LEVEL_BITS * (level + 1))))
+    {
+        level++;
+    }
+
+    uint64_t slot = (expires >> (KTIMER_LEVEL_BITS * level)) & KTIMER_SLOT_MASK;
+    list_add_tail(&ktimer_wheel[level][slot], &timer->node);
+}
+
+/**
+ * Start a timer. It must not already be pending.
+ *
+ * @param timer The timer, set up with ktimer_init()
+ * @param expires The tick (in timer_ticks) to fire on
+ */
+void ktimer_add(ktimer_t *timer, uint64_t expires)
+{
+    if (!ktimer_wheel_ready)
+    {
+        ktimer_wheel_init();
+    }
+
+    timer->expires = expires;
+    ktimer_enqueue(timer);
+    ktimer_count++;
+}
+
+/**
+ * Start a timer, or move it if it's already pending.
+ */
+void ktimer_mod(ktimer_t *timer, uint64_t expires)
+{
+    ktimer_cancel(timer);
+    ktimer_add(timer, expires);
+}
+
+/**
+ * Stop a timer.
+ *
+ * @return true if it was pending, false if it had already fired or was never started
+ */
+bool ktimer_cancel(ktimer_t *timer)
+{
+    if (!ktimer_pending(timer))
+    {
+        return false;
+    }
+
+    list_remove(&timer->node);
+    ktimer_count--;
+    return true;
+}
+
+// Re-sort one slot of a higher level into the levels below
+static void ktimer_cascade(int level, uint64_t slot)
+{
+    list_node_t *head = &ktimer_wheel[level][slot];
+    while (!list_empty(head))
+    {
+        ktimer_t *timer = list_first_entry(head, ktimer_t, node);
+        list_remove(&timer->node);
+        ktimer_enqueue(timer);
+    }
+}
+
+/**
+ * Fire every timer due up to and including now. Called from the timer tick.
+ *
+ * @param now The current tick
+ */
+void ktimer_run(uint64_t now)
+{
+    if (!ktimer_wheel_ready)
+    {
+        ktimer_clock = now + 1;
+        return;
+    }
+
+    while (ktimer_clock <= now)
+    {
+        if (ktimer_count == 0)
+        {
+            // nothing to do, skip over idle stretches in one go
+            ktimer_clock = now + 1;
+            return;
+        }
+
+        uint64_t slot = ktimer_clock & KTIMER_SLOT_MASK;
+
+        // wrapped round a level, so pull the next slot of the one above down
+        for (int level = 1; level < KTIMER_LEVELS; level++)
+        {
+            if (((ktimer_clock >> (KTIMER_LEVEL_BITS * (level - 1))) & KTIMER_SLOT_MASK) != 0)
+            {
+                break;
+            }
+            ktimer_cascade(level, (ktimer_clock >> (KTIMER_LEVEL_BITS * level)) & KTIMER_SLOT_MASK);
+        }
+
+        list_node_t *head = &ktimer_wheel[0][slot];
+        while (!list_empty(head))
+        {
+            ktimer_t *timer = list_first_entry(head, ktimer_t, node);
+            list_remove(&timer->node);
+
+            if (timer->expires > ktimer_clock)
+            {
+                // further out than the wheel reaches, go round again
+                ktimer_enqueue(timer);
+                continue;
+            }
+
+            ktimer_count--;
+            timer->function(timer);
+        }
+
+        ktimer_clock++;
+    }
+}
+
+/**
+ * Find a tick by which the idle process has to be woken to keep timers on
+ * time. May be earlier than the first expiry, but never later.
+ *
+ * @return The tick, KTIMER_NONE if nothing is pending
+ */
+uint64_t ktimer_next_expiry()
+{
+    if (ktimer_count == 0)
+    {
+        return KTIMER_NONE;
+    }
+
+    // timers in level 0 are all due before the next cascade
+    uint64_t cascade = (ktimer_clock | KTIMER_SLOT_MASK) + 1;
+    for (uint64_t tick = ktimer_clock; tick < cascade; tick++)
+    {
+        if (!list_empty(&ktimer_wheel[0][tick & KTIMER_SLOT_MASK]))
+        {
+            return tick;
+        }
+    }
+
+    return cascade;
+}
@@ -0,0 +1,452 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include <lock.h>
+#include <memory.h>
+#include <serial.h>
+#include <string.h>
+#include <device.h>
+#include <filesystem.h>
+#include <unused.h>
+#include <sys/errno.h>
+
+volatile bool lock_stats_enabled = LOCK_STATS_DEFAULT;
+
+// Kept in .bss so that collecting never has to allocate
+lock_class_t lock_classes[LOCK_STATS_MAX_CLASSES];
+uint64_t lock_stats_dropped = 0;
+
+device_t klock_device = {0};
+
+void rwlock_init(rwlock_t *lock, const char *name)
+{
+    lock->state = 0;
+    lock_stats_init_lock(&lock->stats, name);
+}
+
+void read_lock(rwlock_t *lock)
+{
+    preempt_disable();
+    uint64_t wait_start = 0;
+    while (true)
+    {
+        uint32_t state = __atomic_load_n(&lock->state, __ATOMIC_RELAXED);
+        if (!(state & (RWLOCK_WRITER | RWLOCK_WRITER_WAITING)) &&
+            __atomic_compare_exchange_n(&lock->state, &state, state + 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        {
+            break;
+        }
+        if (wait_start == 0)
+        {
+            wait_start = LOCK_WAIT_START();
+        }
+        cpu_relax();
+    }
+
+    // readers overlap, so hold times are only kept for writers
+    if (lock_stats_enabled)
+    {
+        lock_stats_acquired(&lock->stats, wait_start);
+        lock->stats.acquired_at = 0;
+    }
+}
+
+void read_unlock(rwlock_t *lock)
+{
+    __atomic_fetch_sub(&lock->state, 1, __ATOMIC_RELEASE);
+    preempt_enable();
+}
+
+void write_lock(rwlock_t *lock)
+{
+    preempt_disable();
+    uint64_t wait_start = 0;
+    while (true)
+    {
+        uint32_t state = __atomic_load_n(&lock->state, __ATOMIC_RELAXED);
+        if ((state & (RWLOCK_WRITER | RWLOCK_READERS)) == 0)
+        {
+            // takes the lock and clears our waiting bit in one go; another
+            // waiting writer sets it again on its next pass
+            if (__atomic_compare_exchange_n(&lock->state, &state, RWLOCK_WRITER, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            {
+                break;
+            }
+            continue;
+        }
+
+        if (!(state & RWLOCK_WRITER_WAITING))
+        {
+            __atomic_fetch_or(&lock->state, RWLOCK_WRITER_WAITING, __ATOMIC_RELAXED);
+        }
+        if (wait_start == 0)
+        {
+            wait_start = LOCK_WAIT_START();
+        }
+        cpu_relax();
+    }
+    LOCK_STATS_ACQUIRED(&lock->stats, wait_start);
+}
+
+void write_unlock(rwlock_t *lock)
+{
+    LOCK_STATS_RELEASED(&lock->stats);
+    __atomic_fetch_and(&lock->state, ~RWLOCK_WRITER, __ATOMIC_RELEASE);
+    preempt_enable();
+}
+
+static inline uint64_t lock_stats_hash(const char *name)
+{
+    // Fibonacci hashing, names are string literals so compare by address
+    return ((uint64_t)name >> 3) * 0x9E3779B97F4A7C15ULL;
+}
+
+static lock_class_t *lock_stats_class(const char *name)
+{
+    uint64_t index = (lock_stats_hash(name) >> 32) & (LOCK_STATS_MAX_CLASSES - 1);
+    for (uint32_t i = 0; i < LOCK_STATS_MAX_CLASSES; i++)
+    {
+        lock_class_t *class = &lock_classes[(index + i) & (LOCK_STATS_MAX_CLASSES - 1)];
+        const char *current = __atomic_load_n(&class->name, __ATOMIC_ACQUIRE);
+        if (current == name)
+        {
+            return class;
+        }
+        if (current == NULL)
+        {
+            // claim the slot, unless another CPU got there first
+            if (__atomic_compare_exchange_n(&class->name, &current, name, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) || current == name)
+            {
+                return class;
+            }
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Record that a lock was taken. Called through LOCK_STATS_ACQUIRED() while
+ * statistics are on.
+ *
+ * @param stats The lock's statistics
+ * @param wait_start 0 if the lock was free, otherwise from LOCK_WAIT_START()
+ */
+void lock_stats_acquired(lock_stats_t *stats, uint64_t wait_start)
+{
+    uint64_t now = lock_rdtsc();
+    stats->acquired_at = now;
+
+    lock_class_t *class = lock_stats_class(stats->name != NULL ? stats->name : "unnamed");
+    if (class == NULL)
+    {
+        __atomic_fetch_add(&lock_stats_dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    __atomic_fetch_add(&class->acquisitions, 1, __ATOMIC_RELAXED);
+    if (wait_start != 0)
+    {
+        __atomic_fetch_add(&class->contentions, 1, __ATOMIC_RELAXED);
+        // statistics may have been turned on mid-wait, with no start time
+        if (wait_start > 1)
+        {
+            __atomic_fetch_add(&class->wait_cycles, now - wait_start, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+void lock_stats_released(lock_stats_t *stats)
+{
+    if (stats->acquired_at == 0)
+    {
+        // taken before statistics were turned on
+        return;
+    }
+
+    uint64_t held = lock_rdtsc() - stats->acquired_at;
+    stats->acquired_at = 0;
+
+    lock_class_t *class = lock_stats_class(stats->name != NULL ? stats->name : "unnamed");
+    if (class == NULL)
+    {
+        return;
+    }
+
+    __atomic_fetch_add(&class->hold_cycles, held, __ATOMIC_RELAXED);
+    uint64_t max = __atomic_load_n(&class->max_hold_cycles, __ATOMIC_RELAXED);
+    while (held > max && !__atomic_compare_exchange_n(&class->max_hold_cycles, &max, held, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+void lock_stats_reset()
+{
+    bool was_enabled = lock_stats_enabled;
+    lock_stats_enabled = false;
+
+    memset(lock_classes, 0, sizeof(lock_classes));
+    lock_stats_dropped = 0;
+
+    lock_stats_enabled = was_enabled;
+}
+
+void lock_stats_set_enabled(bool enabled)
+{
+    if (enabled && !lock_stats_enabled)
+    {
+        lock_stats_reset();
+    }
+    lock_stats_enabled = enabled;
+}
+
+static void emit_uint(lock_stats_emit_t emit, void *ctx, uint64_t value)
+{
+    char buffer[32];
+    uitoa64(value, buffer, 10);
+    emit(buffer, ctx);
+}
+
+/**
+ * Write out the statistics of every lock name seen, most contended first.
+ *
+ * @param emit Called with each piece of the report
+ * @param ctx Passed through to emit
+ */
+void lock_stats_report(lock_stats_emit_t emit, void *ctx)
+{
+    bool was_enabled = lock_stats_enabled;
+    lock_stats_enabled = false;
+
+    emit("Lock statistics (", ctx);
+    emit(was_enabled ? "on" : "off", ctx);
+    emit(", times in TSC cycles)\n", ctx);
+    emit("name: acquisitions, contended, wait, hold, max hold\n", ctx);
+
+    // selection sort on contention, the table is small
+    bool shown[LOCK_STATS_MAX_CLASSES] = {0};
+    while (true)
+    {
+        lock_class_t *next = NULL;
+        uint32_t next_index = 0;
+        for (uint32_t i = 0; i < LOCK_STATS_MAX_CLASSES; i++)
+        {
+            lock_class_t *class = &lock_classes[i];
+            if (class->name == NULL || shown[i])
+            {
+                continue;
+            }
+            if (next == NULL || class->contentions > next->contentions ||
+                (class->contentions == next->contentions && class->hold_cycles > next->hold_cycles))
+            {
+                next = class;
+                next_index = i;
+            }
+        }
+        if (next == NULL)
+        {
+            break;
+        }
+        shown[next_index] = true;
+
+        emit("  ", ctx);
+        emit(next->name, ctx);
+        emit(": ", ctx);
+        emit_uint(emit, ctx, next->acquisitions);
+        emit(", ", ctx);
+        emit_uint(emit, ctx, next->contentions);
+        emit(", ", ctx);
+        emit_uint(emit, ctx, next->wait_cycles);
+        emit(", ", ctx);
+        emit_uint(emit, ctx, next->hold_cycles);
+        emit(", ", ctx);
+        emit_uint(emit, ctx, next->max_hold_cycles);
+        emit("\n", ctx);
+    }
+
+    if (lock_stats_dropped != 0)
+    {
+        emit("Acquisitions of untracked locks (table full): ", ctx);
+        emit_uint(emit, ctx, lock_stats_dropped);
+        emit("\n", ctx);
+    }
+
+    lock_stats_enabled = was_enabled;
+}
+
+static void lock_stats_emit_serial(const char *str, void *ctx)
+{
+    UNUSED(ctx);
+    serial_printf("%s", str);
+}
+
+typedef struct {
+    char *buffer;
+    size_t length;
+    size_t capacity;
+    size_t read_pos;
+    uint64_t dependents;
+} klock_open_data_t;
+
+static void lock_stats_emit_buffer(const char *str, void *ctx)
+{
+    klock_open_data_t *data = (klock_open_data_t *)ctx;
+    size_t len = strlen(str);
+
+    if (data->length + len + 1 > data->capacity)
+    {
+        size_t new_capacity = data->capacity * 2;
+        while (data->length + len + 1 > new_capacity)
+        {
+            new_capacity *= 2;
+        }
+        char *new_buffer = (char *)kmalloc(new_capacity);
+        memcpy(new_buffer, data->buffer, data->length);
+        kfree(data->buffer);
+        data->buffer = new_buffer;
+        data->capacity = new_capacity;
+    }
+
+    memcpy(data->buffer + data->length, str, len);
+    data->length += len;
+    data->buffer[data->length] = '\0';
+}
+
+pointer_int_t klock_open(const char *path, uint64_t flags, void *device_passed)
+{
+    UNUSED(path);
+    UNUSED(device_passed);
+
+    if (flags & O_DIRECTORY)
+    {
+        return (pointer_int_t){NULL, -ENOTDIR};
+    }
+
+    // Snapshot the report at open time so reads see a consistent view
+    klock_open_data_t *data = (klock_open_data_t *)kmalloc(sizeof(klock_open_data_t));
+    data->capacity = 4096;
+    data->buffer = (char *)kmalloc(data->capacity);
+    data->length = 0;
+    data->read_pos = 0;
+    data->dependents = 1;
+
+    lock_stats_report(lock_stats_emit_buffer, data);
+
+    return (pointer_int_t){data, 0};
+}
+
+size_t klock_read(void *ptr, size_t size, size_t nmemb, void *filedes_data, void *device_passed, uint64_t flags)
+{
+    UNUSED(device_passed);
+    UNUSED(flags);
+
+    klock_open_data_t *data = (klock_open_data_t *)filedes_data;
+    size_t to_read = size * nmemb;
+    if (to_read > data->length - data->read_pos)
+    {
+        to_read = data->length - data->read_pos;
+    }
+
+    memcpy(ptr, data->buffer + data->read_pos, to_read);
+    data->read_pos += to_read;
+
+    return to_read;
+}
+
+size_t klock_write(const void *ptr, size_t size, size_t nmemb, void *filedes_data, void *device_passed, uint64_t flags)
+{
+    UNUSED(filedes_data);
+    UNUSED(device_passed);
+    UNUSED(flags);
+
+    size_t len = size * nmemb;
+    const char *command = (const char *)ptr;
+
+    if (len >= 2 && strncmp(command, "on", 2) == 0)
+    {
+        lock_stats_set_enabled(true);
+    }
+    else if (len >= 3 && strncmp(command, "off", 3) == 0)
+    {
+        lock_stats_set_enabled(false);
+    }
+    else if (len >= 5 && strncmp(command, "reset", 5) == 0)
+    {
+        lock_stats_reset();
+    }
+    else if (len >= 6 && strncmp(command, "serial", 6) == 0)
+    {
+        lock_stats_report(lock_stats_emit_serial, NULL);
+    }
+    else
+    {
+        return -EINVAL;
+    }
+
+    return len;
+}
+
+int klock_close(void *filedes_data, void *device_passed)
+{
+    UNUSED(device_passed);
+
+    klock_open_data_t *data = (klock_open_data_t *)filedes_data;
+    if (data->dependents > 1)
+    {
+        data->dependents--;
+        return 0;
+    }
+
+    kfree(data->buffer);
+    kfree(data);
+    return 0;
+}
+
+void *klock_dup(void *filedes_data, void *device_passed)
+{
+    UNUSED(device_passed);
+
+    klock_open_data_t *data = (klock_open_data_t *)filedes_data;
+    data->dependents++;
+    return data;
+}
+
+int klock_stat(void *file_entry, void *buf, void *device_passed)
+{
+    UNUSED(device_passed);
+
+    klock_open_data_t *data = (klock_open_data_t *)file_entry;
+
+    struct stat *statbuf = (struct stat *)buf;
+    statbuf->st_dev = 0;
+    statbuf->st_ino = 0;
+    statbuf->st_mode = S_IFCHR;
+    statbuf->st_nlink = 1;
+    statbuf->st_uid = 0;
+    statbuf->st_gid = 0;
+    statbuf->st_rdev = 0;
+    statbuf->st_size = data->length;
+
+    return 0;
+}
+
+void lock_stats_init()
+{
+    strcpy(klock_device.name, "klock");
+    klock_device.flags = 0;
+    klock_device.data = NULL;
+    klock_device.type = DEVICE_TYPE_KLOCK;
+
+    klock_device.open = (open_func_t)klock_open;
+    klock_device.read = (read_func_t)klock_read;
+    klock_device.write = (write_func_t)klock_write;
+    klock_device.close = (close_func_t)klock_close;
+    klock_device.fcntl = NULL;
+    klock_device.file_size = NULL;
+    klock_device.lseek = NULL;
+    klock_device.ioctl = NULL;
+    klock_device.dup = (dup_func_t)klock_dup;
+    klock_device.clone = (clone_func_t)klock_dup;
+    klock_device.stat = (stat_func_t)klock_stat;
+    klock_device.select = NULL;
+
+    register_device(&klock_device);
+}
@@ -0,0 +1,248 @@
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <process.h>
+#include <memory.h>
+#include <system.h>
+#include <string.h>
+#include <filesystem.h>
+#include <elf_loader.h>
+#include <exec_cache.h>
+#include <sys/mman.h>
+#include <sys/errno.h>
+
+// Whether [start, start + size) is user memory, in either half of the
+// address space, without wrapping
+static bool mmap_user_range(uint64_t start, uint64_t size)
+{
+    uint64_t end = start + size;
+    if (end < start)
+    {
+        return false;
+    }
+    return end <= USER_MMAP_END || (start >= 0xFFFF800000000000 && end <= VIRT_MEM_OFFSET);
+}
+
+// Unmap whatever is mapped in a page aligned range of the current address
+// space. Returns how many pages that was.
+static uint64_t mmap_unmap_range(address_space_t *vm, uint64_t start, uint64_t pages)
+{
+    uint64_t unmapped = 0;
+    for (uint64_t i = 0; i < pages; i++)
+    {
+        uint64_t virt = start + i * 0x1000;
+        if (virt_to_phys(virt, vm->pml4) == (uint64_t)-1)
+        {
+            continue;
+        }
+        free_page(virt, vm->pml4);
+        ASM_INVLPG(virt);
+        unmapped++;
+    }
+    return unmapped;
+}
+
+// Find room for pages more at vm->mmap_next or above, skipping anything
+// mapped there with MAP_FIXED. Returns 0 if there's none left.
+static uint64_t mmap_find_room(address_space_t *vm, uint64_t pages)
+{
+    uint64_t start = vm->mmap_next;
+    uint64_t i = 0;
+    while (i < pages)
+    {
+        if (start + pages * 0x1000 > USER_MMAP_END)
+        {
+            return 0;
+        }
+        if (virt_to_phys(start + i * 0x1000, vm->pml4) != (uint64_t)-1)
+        {
+            start += (i + 1) * 0x1000;
+            i = 0;
+            continue;
+        }
+        i++;
+    }
+    vm->mmap_next = start + pages * 0x1000;
+    return start;
+}
+
+// Fill a mapped page with a page of a file, zeroed past its end
+static void mmap_read_page(int fd, uint64_t phys, uint64_t offset)
+{
+    memset((void *)(phys + VIRT_MEM_OFFSET), 0, 0x1000);
+    if (kflseek(fd, offset, SEEK_SET) >= 0)
+    {
+        kfread((void *)(phys + VIRT_MEM_OFFSET), 1, 0x1000, fd);
+    }
+}
+
+/**
+ * mmap() syscall: map anonymous memory or a file into the current address
+ * space. Pages are mapped straight away rather than on first touch. A file
+ * the executable cache holds (see exec_cache.h), like a shared library
+ * mapped by a dynamic linker, lends its prepared pages, copy-on-write if
+ * the mapping is writeable; anything else is read into fresh pages.
+ * MAP_SHARED file mappings must be read-only, since writes never reach the
+ * file, and MAP_SHARED anonymous memory is only shared by processes sharing
+ * the address space.
+ *
+ * @param addr Where to map it with MAP_FIXED, otherwise ignored
+ * @param length How many bytes, rounded up to whole pages
+ * @param prot PROT_*
+ * @param flags MAP_SHARED or MAP_PRIVATE, plus MAP_FIXED and MAP_ANONYMOUS
+ * @param fd The file, unless MAP_ANONYMOUS
+ * @param offset Where in the file, page aligned
+ *
+ * @return The address of the mapping
+ *      -EINVAL if the arguments don't make sense
+ *      -EBADF if fd isn't an open file
+ *      -ENODEV if the file can't be mapped writeable and shared
+ *      -ENOMEM if there's no room for it
+ */
+int64_t kmmap(uint64_t addr, uint64_t length, uint64_t prot, uint64_t flags, int64_t fd, int64_t offset)
+{
+    address_space_t *vm = current_process->vm;
+    uint64_t type = flags & MAP_TYPE;
+    bool anonymous = flags & MAP_ANONYMOUS;
+    if (length == 0 || length > USER_MMAP_END || (offset & 0xFFF) || offset < 0 || (type != MAP_SHARED && type != MAP_PRIVATE))
+    {
+        return -EINVAL;
+    }
+    if (type == MAP_SHARED && !anonymous && (prot & PROT_WRITE))
+    {
+        return -ENODEV;
+    }
+
+    uint64_t pages = PAGE_ALIGN_UP(length) / 0x1000;
+    struct stat st = {0};
+    if (!anonymous && kfstat(fd, &st) < 0)
+    {
+        return -EBADF;
+    }
+
+    uint64_t start;
+    if (flags & MAP_FIXED)
+    {
+        if ((addr & 0xFFF) || addr == 0 || !mmap_user_range(addr, pages * 0x1000))
+        {
+            return -EINVAL;
+        }
+        start = addr;
+        process_rss_add((process_t *)current_process, -(int64_t)mmap_unmap_range(vm, start, pages));
+    }
+    else
+    {
+        start = mmap_find_room(vm, pages);
+        if (start == 0)
+        {
+            return -ENOMEM;
+        }
+    }
+
+    // the file position is the caller's, not ours
+    off_t position = anonymous ? 0 : kflseek(fd, 0, SEEK_CUR);
+    exec_image_t *image = anonymous ? NULL : elf_image_find(fd, &st);
+    bool borrowed = false;
+
+    uint64_t mapped = 0;
+    for (uint64_t i = 0; i < pages; i++)
+    {
+        uint64_t virt = start + i * 0x1000;
+        uint64_t file_offset = offset + i * 0x1000;
+        uint64_t frame = image != NULL ? exec_image_file_frame(image, file_offset) : 0;
+        if (frame != 0)
+        {
+            if (map_page_borrowed(virt, frame, prot & PROT_WRITE, vm->pml4))
+            {
+                borrowed = true;
+                mapped++;
+            }
+            continue;
+        }
+
+        uint64_t phys = first_free_page_addr();
+        if (!map_page_kmalloc(virt, phys, false, true, vm->pml4))
+        {
+            continue;
+        }
+        mapped++;
+        if (anonymous || file_offset >= (uint64_t)st.st_size)
+        {
+            memset((void *)(phys + VIRT_MEM_OFFSET), 0, 0x1000);
+        }
+        else
+        {
+            mmap_read_page(fd, phys, file_offset);
+        }
+    }
+    process_rss_add((process_t *)current_process, mapped);
+
+    if (!anonymous && position >= 0)
+    {
+        kflseek(fd, position, SEEK_SET);
+    }
+    if (borrowed)
+    {
+        // the pages stay the image's as long as the address space lasts
+        exec_image_ref_add(&vm->images, image);
+    }
+    else
+    {
+        exec_image_put(image);
+    }
+
+    if (prot != (PROT_READ | PROT_WRITE))
+    {
+        memory_set_protection((void *)start, pages * 0x1000, prot);
+    }
+    return start;
+}
+
+/**
+ * munmap() syscall: unmap pages of the current address space. Pages that
+ * aren't mapped are skipped.
+ *
+ * @param addr The first page
+ * @param length How many bytes, rounded up to whole pages
+ *
+ * @return 0 if successful
+ *      -EINVAL if the range isn't page aligned user memory
+ */
+int64_t kmunmap(uint64_t addr, uint64_t length)
+{
+    uint64_t size = PAGE_ALIGN_UP(length);
+    if ((addr & 0xFFF) || length == 0 || size < length || !mmap_user_range(addr, size))
+    {
+        return -EINVAL;
+    }
+
+    uint64_t unmapped = mmap_unmap_range(current_process->vm, addr, size / 0x1000);
+    process_rss_add((process_t *)current_process, -(int64_t)unmapped);
+    return 0;
+}
+
+/**
+ * mprotect() syscall: change the protection of mapped pages of the current
+ * address space.
+ *
+ * @param addr The first page
+ * @param length How many bytes, rounded up to whole pages
+ * @param prot PROT_*
+ *
+ * @return 0 if successful
+ *      -EINVAL if the range isn't page aligned user memory
+ *      -ENOMEM if part of it isn't mapped
+ */
+int64_t kmprotect(uint64_t addr, uint64_t length, uint64_t prot)
+{
+    uint64_t size = PAGE_ALIGN_UP(length);
+    if ((addr & 0xFFF) || size < length || !mmap_user_range(addr, size) || (prot & ~PROT_ALL))
+    {
+        return -EINVAL;
+    }
+    if (length == 0)
+    {
+        return 0;
+    }
+    return memory_set_protection((void *)addr, size, prot);
+}
@@ -8,6 +8,7 @@
 #include <string.h>
 #include <filesystem.h>
 #include <ramdisk.h>
+#include <acpi.h>
 
 void *ramdisk_addr = 0;
 
@@ -37,6 +38,10 @@ void multiboot_init(kernel_info_t *info) {
                 ramdisk_addr = (void *)(uint64_t)module->mod_start;
             }
             break;
+        case MULTIBOOT_TAG_TYPE_ACPI_OLD:
+        case MULTIBOOT_TAG_TYPE_ACPI_NEW:
+            acpi_set_rsdp(((struct multiboot_tag_old_acpi *)tag)->rsdp, tag->size - sizeof(struct multiboot_tag_old_acpi));
+            break;
         default:
             serial_printf("Unknown multiboot tag: %d\n", tag->type);
             break;
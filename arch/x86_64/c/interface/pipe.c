@@ -9,6 +9,8 @@
 #include <unused.h>
 #include <sys/errno.h>
 #include <system.h>
+#include <process.h>
+#include <waitqueue.h>
 
 device_t pipe_device_in = {0};
 device_t pipe_device_out = {0};
@@ -24,10 +26,17 @@ typedef struct pipe
     uint64_t write_dependents;
     file_descriptor_t *write_fd;
     file_descriptor_t *read_fd;
+    wait_queue_t wait; // woken on every read, write and close
 } pipe_t;
 
+// Wake both ends of a pipe, and anything selecting on it
+static void pipe_wake(pipe_t *pipe)
+{
+    wait_queue_wake(&pipe->wait);
+    select_wake();
+}
+
 size_t pipe_read(void *ptr, size_t size, size_t nmemb, void *filedes_data, void *device_passed, uint64_t flags) {
-    UNUSED(flags);
     UNUSED(device_passed);
 
     // just read the bytes
@@ -36,10 +45,20 @@ size_t pipe_read(void *ptr, size_t size, size_t nmemb, void *filedes_data, void
     size_t read = 0;
     size_t to_read = size * nmemb;
 
+    if (pipe->size == 0 && pipe->write_dependents > 0) {
+        if (flags & O_NONBLOCK) {
+            return -EAGAIN;
+        }
+        // sleep until there's data, or every writer is gone (EOF)
+        if (wait_event_interruptible(&pipe->wait, pipe->size > 0 || pipe->write_dependents == 0) != 0) {
+            return -EINTR;
+        }
+    }
+
     while (read < to_read) {
         if (pipe->size == 0) {
             // pipe is empty
-            return read;
+            break;
         }
 
         // read byte
@@ -52,12 +71,15 @@ size_t pipe_read(void *ptr, size_t size, size_t nmemb, void *filedes_data, void
         read++;
     }
 
+    if (read > 0) {
+        pipe_wake(pipe);
+    }
+
     return read;
 }
 
 size_t pipe_write(const void *ptr, size_t size, size_t nmemb, void *filedes_data, void *device_passed, uint64_t flags)
 {
-    UNUSED(flags);
     UNUSED(device_passed);
 
     // just write the bytes
@@ -68,10 +90,30 @@ size_t pipe_write(const void *ptr, size_t size, size_t nmemb, void *filedes_data
 
     while (written < to_write)
     {
+        if (pipe->read_dependents == 0)
+        {
+            // nobody will ever read this
+            break;
+        }
+
         if (pipe->size == PIPE_SIZE)
         {
-            // pipe is full
-            return written;
+            // pipe is full, let the readers catch up
+            if (flags & O_NONBLOCK)
+            {
+                break;
+            }
+            pipe_wake(pipe);
+            if (wait_event_interruptible(&pipe->wait, pipe->size < PIPE_SIZE || pipe->read_dependents == 0) != 0)
+            {
+                // a signal, report what made it in so far
+                if (written == 0)
+                {
+                    return -EINTR;
+                }
+                break;
+            }
+            continue;
         }
 
         // write byte
@@ -85,7 +127,17 @@ size_t pipe_write(const void *ptr, size_t size, size_t nmemb, void *filedes_data
         written++;
     }
 
-    return written;
+    if (written > 0)
+    {
+        pipe_wake(pipe);
+        return written;
+    }
+
+    if (pipe->read_dependents == 0)
+    {
+        return -EPIPE;
+    }
+    return (flags & O_NONBLOCK) && to_write > 0 ? -EAGAIN : 0;
 }
 
 int pipe_close(void *filedes_data, void *device_passed)
@@ -106,6 +158,11 @@ int pipe_close(void *filedes_data, void *device_passed)
         kfree(pipe->buffer);
         kfree(pipe);
     }
+    else
+    {
+        // the other end may be waiting on this one
+        pipe_wake(pipe);
+    }
 
     return 0;
 }
@@ -151,13 +208,15 @@ int pipe_select(void *filedes_data, void *device_passed, int type)
 
     pipe_t *pipe = (pipe_t *)filedes_data;
 
+    // a pipe with no one on the other end is "ready", the read or write
+    // returns EOF / EPIPE straight away
     if (type == SELECT_READ)
     {
-        return pipe->size > 0;
+        return pipe->size > 0 || pipe->write_dependents == 0;
     }
     else if (type == SELECT_WRITE)
     {
-        return pipe->size < PIPE_SIZE;
+        return pipe->size < PIPE_SIZE || pipe->read_dependents == 0;
     }
 
     return 0;
@@ -194,6 +253,7 @@ int kpipe(int pipefd[2])
     pipe->flags = 0;
     pipe->read_dependents = 1;
     pipe->write_dependents = 1;
+    wait_queue_init(&pipe->wait);
 
     // freed in
     file_descriptor_t *fd1 = (file_descriptor_t *)kmalloc(sizeof(file_descriptor_t));
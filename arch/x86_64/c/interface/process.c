@@ -16,676 +16,2336 @@
 
 #include <display.h>
 #include <serial.h>
-
-process_t *process_list = NULL;
-process_t *queue = NULL;
-process_t *queue_tail = NULL;
-volatile process_t *current_process = NULL;
+#include <timer.h>
+#include <clock.h>
+#include <smp.h>
+#include <softirq.h>
+#include <preempt.h>
+#include <futex.h>
+#include <template.h>
+#include <exec_cache.h>
+#include <binfmt.h>
+
+list_node_t process_list = LIST_HEAD_INIT(process_list);
+uint64_t sched_last_boost = 0;
 
 process_t idle_process;
 
-pid_t first_free_pid()
+// Every live process, keyed by PID
+hashtable_t process_table = HASHTABLE_INIT;
+
+// Guards every process' parent, children, zombies and wait_report
+spinlock_t process_tree_lock = SPINLOCK_INIT("process_tree");
+
+// One bit per PID, set while the PID belongs to a process (including zombies)
+uint64_t pid_bitmap[PID_MAX / 64] = {0};
+// Where the next search starts. Always moving forward means a freed PID isn't
+// handed out again until every other one has been tried, so stale PIDs held
+// by userspace are unlikely to hit a new process.
+pid_t pid_cursor = 0;
+
+/**
+ * Allocate an unused PID.
+ *
+ * @return The PID, or -EAGAIN if every PID is in use
+ */
+pid_t pid_alloc()
 {
-    pid_t pid = 0;
-    if (process_list == NULL)
-    {
-        return pid;
-    }
+    uint32_t word = pid_cursor / 64;
+    // ignore bits below the cursor in the first word
+    uint64_t skip = ((uint64_t)1 << (pid_cursor % 64)) - 1;
 
-    process_t *current = process_list;
-    while (current != NULL)
+    for (uint32_t i = 0; i <= PID_MAX / 64; i++)
     {
-        if (current->pid == pid)
-        {
-            pid++;
-        }
-        else
+        uint64_t free_bits = ~(pid_bitmap[word] | skip);
+        if (free_bits != 0)
         {
+            pid_t pid = word * 64 + __builtin_ctzll(free_bits);
+            pid_bitmap[word] |= (uint64_t)1 << (pid % 64);
+            pid_cursor = (pid + 1) % PID_MAX;
             return pid;
         }
-        current = current->next;
+        skip = 0;
+        word = (word + 1) % (PID_MAX / 64);
     }
 
-    return pid;
+    return -EAGAIN;
 }
 
-void add_process(process_t *process)
+/**
+ * Release a PID for reuse.
+ *
+ * @param pid The PID to release
+ */
+void pid_free(pid_t pid)
 {
-    if (process_list == NULL)
+    if (pid < 0 || pid >= PID_MAX)
     {
-        process_list = process;
         return;
     }
+    pid_bitmap[pid / 64] &= ~((uint64_t)1 << (pid % 64));
+}
 
-    // sort by pid
-    process_t *current = process_list;
-    while (current->next != NULL)
+/**
+ * Look up a process by its PID.
+ *
+ * @param pid The PID to look for
+ *
+ * @return The process, or NULL if no process has that PID
+ */
+process_t *process_find(pid_t pid)
+{
+    hash_node_t *node = hashtable_find(&process_table, (uint64_t)pid);
+    if (node == NULL)
     {
-        current = current->next;
-        if (current->pid > process->pid)
-        {
-            process->next = current->next;
-            current->next = process;
-            return;
-        }
+        return NULL;
     }
-    current->next = process;
+    return hash_entry(node, process_t, pid_node);
+}
 
-    // add to the queue
-    if (queue == NULL)
-    {
-        queue = process;
-        queue_tail = process;
-    }
-    else
+void runqueue_init(runqueue_t *runqueue)
+{
+    for (int i = 0; i < SCHED_LEVELS; i++)
     {
-        queue_tail->queue_next = process;
-        queue_tail = process;
+        list_init(&runqueue->levels[i]);
     }
+    runqueue->bitmap = 0;
+    runqueue->nr_running = 0;
+    ticket_lock_init(&runqueue->lock, "runqueue");
 }
 
-/**
- * Create a new process.
- *
- * @param entry The entry point of the process
- * @param stack_size The size of the stack, or the address of the stack if has_stack is true
- * @param pml4 The page directory for the process
- * @param has_stack Whether the stack is already set up
- */
-process_t *create_process(void *entry, uint64_t stack_size, page_directory_t *pml4, bool has_stack, memregion_t *regions)
+// Append a process to the runqueue for its level, on its CPU. The caller
+// holds that runqueue's lock.
+static void runqueue_enqueue(process_t *process)
 {
-    pid_t pid = first_free_pid();
-
-    process_t *new_process = (process_t *)kmalloc(sizeof(process_t));
-    new_process->pid = pid;
-    new_process->entry = entry;
-    new_process->pml4 = pml4;
-    new_process->status = TASK_INITIAL;
-    new_process->queue_next = NULL;
-    new_process->next = NULL;
-    new_process->tss_stack = kmalloc(SYSCALL_STACK_SIZE);
-    new_process->syscall_stack = kmalloc(SYSCALL_STACK_SIZE);
-    new_process->in_signal_handler = false;
-    new_process->queued_signals = NULL;
-    // clear the signal handlers
-    for (int i = 0; i < SIG_MAX; i++)
+    if (!list_empty(&process->run_node))
     {
-        new_process->signal_handlers[i].signal_handler = NULL;
+        return;
     }
 
-    new_process->file_descriptors = NULL;
-    strcpy((char *)new_process->pwd, "/");
+    runqueue_t *runqueue = &cpus[process->cpu].runqueue;
+    list_add_tail(&runqueue->levels[process->sched_level], &process->run_node);
+    runqueue->bitmap |= 1 << process->sched_level;
+    runqueue->nr_running++;
 
-    new_process->memory_regions = regions;
-
-    if (!has_stack)
+    // the CPU it's queued on switches to it at its next preemption point
+    cpu_t *cpu = &cpus[process->cpu];
+    volatile process_t *running = cpu->percpu.process;
+    if (running == NULL || running == cpu->idle || process->sched_level < running->sched_level)
     {
-        // Set up the stack
-        uint32_t stack_size_pages = stack_size & 0xFFF ? (stack_size >> 12) + 1 : stack_size >> 12;
-        for (uint32_t i = 0; i < stack_size_pages; i++)
-        {
-            uint64_t phys = first_free_page_addr();
-            map_page_kmalloc(VIRT_MEM_OFFSET - ((i + 1) * 0x1000), phys, false, true, pml4);
-        }
-
-        new_process->stack_low = VIRT_MEM_OFFSET - (stack_size_pages * 0x1000);
+        cpu->percpu.need_resched = 1;
+    }
+}
 
-        new_process->rsp = VIRT_MEM_OFFSET;
-        new_process->rbp = VIRT_MEM_OFFSET;
+static void runqueue_push(process_t *process)
+{
+    runqueue_t *runqueue = &cpus[process->cpu].runqueue;
+    uint64_t flags;
+    ticket_lock_irqsave(&runqueue->lock, flags);
+    runqueue_enqueue(process);
+    ticket_unlock_irqrestore(&runqueue->lock, flags);
+}
 
-        // map the region
-        memregion_t *region = kmalloc(sizeof(memregion_t));
-        region->start = VIRT_MEM_OFFSET - MAX_STACK_SIZE;
-        region->end = VIRT_MEM_OFFSET - 1;
-        region->flags = 0x7;
-        region->next = regions;
-        new_process->memory_regions = region;
-    }
-    else
+// Take the first process off the highest non-empty level, with the
+// runqueue's lock held
+static process_t *runqueue_pop(runqueue_t *runqueue)
+{
+    if (runqueue->bitmap == 0)
     {
-        new_process->rsp = stack_size;
-        new_process->rbp = stack_size;
+        return NULL;
     }
 
-    return new_process;
+    uint32_t level = __builtin_ctz(runqueue->bitmap);
+    process_t *process = list_first_entry(&runqueue->levels[level], process_t, run_node);
+    list_remove(&process->run_node);
+    if (list_empty(&runqueue->levels[level]))
+    {
+        runqueue->bitmap &= ~(1 << level);
+    }
+    runqueue->nr_running--;
+    return process;
 }
 
-extern char tss_stack[SYSCALL_STACK_SIZE];
-void process_init()
+// Take a process off its runqueue, with the runqueue's lock held
+static void runqueue_remove(process_t *process)
 {
-    // create the idle process
-    idle_process.pid = 0;
-    idle_process.pml4 = current_pml4;
-    idle_process.entry = NULL;
-    idle_process.next = NULL;
-    idle_process.status = TASK_RUNNING;
-    idle_process.queue_next = NULL;
-    idle_process.tss_stack = tss_stack;
-    idle_process.syscall_stack = kmalloc(SYSCALL_STACK_SIZE);
-    idle_process.queued_signals = NULL;
-    idle_process.in_signal_handler = false;
-    for (int i = 0; i < SIG_MAX; i++)
+    if (list_empty(&process->run_node))
     {
-        idle_process.signal_handlers[i].signal_handler = NULL;
+        return;
     }
 
-    current_process = &idle_process;
-    process_list = &idle_process;
+    runqueue_t *runqueue = &cpus[process->cpu].runqueue;
+    list_remove(&process->run_node);
+    if (list_empty(&runqueue->levels[process->sched_level]))
+    {
+        runqueue->bitmap &= ~(1 << process->sched_level);
+    }
+    runqueue->nr_running--;
 }
 
-void signal_process(pid_t pid, signal_t *signal)
+// Pick a CPU for a new process, whichever has the least queued
+static cpu_t *sched_select_cpu()
 {
-    process_t *current = process_list;
-    while (current != NULL)
+    cpu_t *best = this_cpu();
+    for (uint32_t i = 0; i < cpu_count; i++)
     {
-        if (current->pid == pid)
+        if (cpus[i].schedulable && cpus[i].runqueue.nr_running < best->runqueue.nr_running)
         {
-            break;
+            best = &cpus[i];
         }
-        current = current->next;
     }
-    if (current == NULL)
+    return best;
+}
+
+// Move a process to a new level, requeueing it if it's waiting to run
+static void sched_set_level(process_t *process, uint8_t level)
+{
+    if (process->sched_level == level)
     {
         return;
     }
 
-    signal->next = current->queued_signals;
-    current->queued_signals = signal;
-
-    signal->syscall_stack = NULL;
-    signal->handled = false;
+    runqueue_t *runqueue = &cpus[process->cpu].runqueue;
+    uint64_t flags;
+    ticket_lock_irqsave(&runqueue->lock, flags);
+    bool queued = !list_empty(&process->run_node);
+    runqueue_remove(process);
+    process->sched_level = level;
+    process->timeslice = 0;
+    if (queued)
+    {
+        runqueue_enqueue(process);
+    }
+    ticket_unlock_irqrestore(&runqueue->lock, flags);
 }
 
-int process_kill(pid_t pid, int signal)
+// Put every process back on its base level
+static void sched_boost()
 {
-    if (pid == 0)
+    list_node_t *node;
+    list_for_each(node, &process_list)
     {
-        return -EPERM;
+        process_t *process = list_entry(node, process_t, list_node);
+        if (process != &idle_process)
+        {
+            sched_set_level(process, SCHED_BASE_LEVEL(process->nice));
+        }
     }
-
-    signal_t *signal_info = (signal_t *)kmalloc(sizeof(signal_t));
-    signal_info->signal_number = signal;
-    signal_info->signal_error = 0;
-    signal_info->signal_code = 0;
-    signal_info->sender_pid = current_process->pid;
-    signal_info->sender_uid = 0;
-    signal_info->fault_address = NULL;
-    signal_info->next = NULL;
-
-    signal_process(pid, signal_info);
-
-    return 0;
 }
 
-int ksigprocmask(int how, const sigset_t *set, sigset_t *oldset)
+/**
+ * Account a timer tick to the current process.
+ *
+ * @return true if the current process should be switched out
+ */
+bool sched_tick()
 {
-    UNUSED(how);
-
-    if (oldset != NULL)
+    if (timer_ticks - sched_last_boost >= timer_ms_to_ticks(SCHED_BOOST_MS))
     {
-        *oldset = current_process->signal_mask;
+        sched_last_boost = timer_ticks;
+        sched_boost();
     }
 
-    if (set != NULL)
+    runqueue_t *runqueue = &this_cpu()->runqueue;
+    if (current_process == this_cpu()->idle)
     {
-        current_process->signal_mask = *set;
+        return runqueue->bitmap != 0;
     }
 
-    // how is used to modify the signal mask, but we don't support that yet
+    itimer_account((process_t *)current_process);
 
-    return 0;
+    if (current_process->timeslice > 0)
+    {
+        current_process->timeslice--;
+    }
+    if (current_process->timeslice == 0)
+    {
+        // used its whole slice, so it's probably CPU bound
+        if (current_process->sched_level < SCHED_LEVELS - 1)
+        {
+            current_process->sched_level++;
+        }
+        return true;
+    }
+
+    // something more important became runnable
+    return need_resched() || (runqueue->bitmap != 0 && (uint32_t)__builtin_ctz(runqueue->bitmap) < current_process->sched_level);
 }
 
-extern uint64_t syscall_old_rsp;
-extern void run_signal(uint64_t rsp, void *handler, int signal, signal_t *signal_info, void *context);
-void check_signals(bool is_after_syscall) {
-    if (current_process->queued_signals) {
-        if (!current_process->queued_signals->handled) {
-            // Check for special signals
-            if (current_process->queued_signals->signal_number == SIGKILL) {
-                union wait status;
-                status.w_T.w_Retcode = 0;
-                status.w_T.w_Coredump = false;
-                status.w_T.w_Termsig = SIGKILL;
-                process_exit_abnormal(status);
-            }
+void add_process(process_t *process)
+{
+    process->pid_node.key = (uint64_t)process->pid;
+    hashtable_insert(&process_table, &process->pid_node);
+    list_add_tail(&process_list, &process->list_node);
 
-            if (!current_process->signal_handlers[current_process->queued_signals->signal_number].signal_handler ||
-                !is_mapped_user((uint64_t)current_process->signal_handlers[current_process->queued_signals->signal_number].signal_handler, current_process->pml4)) {
-                    
-                // should we ignore this?
-                int signo = current_process->queued_signals->signal_number;
-                if (signo == SIGCHLD || signo == SIGURG || signo == SIGWINCH) {
-                    signal_t *signal = current_process->queued_signals;
-                    current_process->queued_signals = signal->next;
-                    kfree(signal);
-                    return;
-                }
-
-                // no, we shouldn't
-                union wait status;
-                status.w_T.w_Retcode = 0;
-                status.w_T.w_Coredump = false;
-                status.w_T.w_Termsig = signo;
-                process_exit_abnormal(status);
-            }
+    if (process->parent != NULL)
+    {
+        spin_lock(&process_tree_lock);
+        list_add_tail(&process->parent->children, &process->sibling);
+        spin_unlock(&process_tree_lock);
+    }
 
-            signal_t *signal = current_process->queued_signals;
+    process->cpu = sched_select_cpu()->id;
+    runqueue_push(process);
+}
 
-            signal->interrupt_registers = current_process->interrupt_registers;
-            signal->syscall_registers = current_process->syscall_registers;
+/**
+ * Mark the current process as about to sleep. From here on, process_wake()
+ * makes it runnable again, so check what's being waited for after calling
+ * this and only then process_block().
+ */
+void process_prepare_block()
+{
+    // a full barrier, so the condition is read after the status is visible
+    // to wakers on other CPUs
+    __atomic_store_n(&current_process->status, TASK_BLOCKED, __ATOMIC_SEQ_CST);
+}
 
-            signal->syscall_stack = (void *)kmalloc(SYSCALL_STACK_SIZE);
-            memcpy(signal->syscall_stack, current_process->syscall_stack, SYSCALL_STACK_SIZE);
-            signal->syscall_rsp = current_process->syscall_rsp;
+/**
+ * Stay awake after process_prepare_block(), once the condition came true.
+ */
+void process_cancel_block()
+{
+    current_process->status = TASK_RUNNING;
+}
 
-            signal->handled = true;
+/**
+ * Sleep until process_wake() is called on the current process, unless it
+ * already has been since process_prepare_block(). Use through wait_event()
+ * rather than directly, so wakeups aren't missed.
+ */
+void process_block()
+{
+    uint64_t flags;
+    ASM_SAVE_FLAGS_CLI(flags);
 
-            current_process->in_signal_handler = true;
+    if (current_process->status == TASK_BLOCKED)
+    {
+        // gave up the CPU early, so it's probably interactive
+        if (current_process->sched_level > SCHED_BASE_LEVEL(current_process->nice))
+        {
+            current_process->sched_level--;
+            current_process->timeslice = 0;
+        }
 
-            signal->was_in_syscall = current_process->in_syscall;
+        schedule();
+    }
 
-            uint64_t rsp = is_after_syscall ? syscall_old_rsp : (current_process->interrupt_registers.rsp >= VIRT_MEM_OFFSET ? current_process->user_rsp : current_process->interrupt_registers.rsp);
+    ASM_RESTORE_FLAGS(flags);
+}
 
-            if (virt_to_phys(rsp, current_pml4) == (uint64_t)-1) {
-                union wait status;
-                status.w_T.w_Retcode = 0;
-                status.w_T.w_Coredump = false;
-                status.w_T.w_Termsig = SIGSEGV;
-                process_exit_abnormal(status);
-            }
+/**
+ * Make a blocked process runnable again. Does nothing if it isn't blocked.
+ *
+ * @param process The process to wake
+ */
+void process_wake(process_t *process)
+{
+    // schedule() checks the status under the same lock, so it either sees
+    // the process woken or has queued it as blocked by the time we look
+    runqueue_t *runqueue = &cpus[process->cpu].runqueue;
+    uint64_t flags;
+    ticket_lock_irqsave(&runqueue->lock, flags);
+    if (process->status == TASK_BLOCKED)
+    {
+        process->status = TASK_RUNNING;
+        runqueue_enqueue(process);
+    }
+    ticket_unlock_irqrestore(&runqueue->lock, flags);
+}
 
-            run_signal(rsp, current_process->signal_handlers[signal->signal_number].signal_handler, signal->signal_number, signal, NULL);
-        }
+// Make a stopped process runnable again, returning whether it was stopped
+static bool process_resume(process_t *process)
+{
+    runqueue_t *runqueue = &cpus[process->cpu].runqueue;
+    uint64_t flags;
+    ticket_lock_irqsave(&runqueue->lock, flags);
+    bool stopped = process->status == TASK_STOPPED;
+    if (stopped)
+    {
+        process->status = TASK_RUNNING;
+        runqueue_enqueue(process);
     }
+    ticket_unlock_irqrestore(&runqueue->lock, flags);
+    return stopped;
 }
 
-extern tss_entry_t tss;
-extern xmm_regs_t xmm_regs;
-void schedule()
+// Wake a process' parent if it's in wait4(), and work out the SIGCHLD to
+// send it. Stops and continues don't signal a parent that asked not to
+// with SA_NOCLDSTOP, and exits send the child's exit_signal instead. Called
+// with process_tree_lock held; the caller sends the signal with
+// signal_process() once it has dropped the lock, which sending SIGCONT
+// takes again.
+//
+// Returns the PID to signal, or 0 for none.
+static pid_t process_notify_parent(process_t *child, int code, siginfo_t *info)
 {
-    ASM_DISABLE_INTERRUPTS; // In case we aren't called from an interrupt
+    process_t *parent = child->parent;
+    if (parent == NULL)
+    {
+        return 0;
+    }
 
-    // Save the current process's rsp and rbp
-    ASM_READ_RSP(current_process->rsp);
-    ASM_READ_RBP(current_process->rbp);
+    int signum = SIGCHLD;
+    bool send = true;
+    if (code == CLD_STOPPED || code == CLD_CONTINUED)
+    {
+        send = parent->sighand == NULL || !(parent->sighand->actions[SIGCHLD].sa_flags & SA_NOCLDSTOP);
+    }
+    else
+    {
+        signum = child->exit_signal;
+        send = signum != 0;
+    }
 
-    if (queue != NULL) {
+    wait_queue_wake(&parent->child_wait);
 
-        process_t *new_process = queue;
-        queue = queue->queue_next;
-        // add the current process back to the queue
-        if (current_process->status != TASK_EXITED && current_process->status != TASK_WAITING)
-        {
-            if (queue == NULL)
-            {
-                queue = (process_t *)current_process;
-            }
-            else
-            {
-                queue_tail->queue_next = (process_t *)current_process;
-                queue_tail = (process_t *)current_process;
-            }
-        }
-        current_process = new_process;
-        current_process->queue_next = NULL;
+    if (parent == &idle_process || !send)
+    {
+        return 0;
+    }
+    memset(info, 0, sizeof(siginfo_t));
+    info->si_signo = signum;
+    info->si_code = code;
+    info->si_pid = child->pid;
+    info->si_uid = child->uid;
+    return parent->pid;
+}
 
-        tss.rsp0 = (uint64_t)current_process->tss_stack + SYSCALL_STACK_SIZE;
+// Stop the current process for a stop signal, until SIGCONT or SIGKILL
+static void process_stop(int signum)
+{
+    process_t *process = (process_t *)current_process;
+
+    runqueue_t *runqueue = &cpus[process->cpu].runqueue;
+    uint64_t flags;
+    ticket_lock_irqsave(&runqueue->lock, flags);
+    process->status = TASK_STOPPED;
+    ticket_unlock_irqrestore(&runqueue->lock, flags);
+
+    spin_lock(&process_tree_lock);
+    process->stop_signal = signum;
+    process->wait_report = WAIT_REPORT_STOPPED;
+    siginfo_t info;
+    pid_t notify = process_notify_parent(process, CLD_STOPPED, &info);
+    spin_unlock(&process_tree_lock);
+    if (notify != 0)
+    {
+        signal_process(notify, &info);
+    }
 
-        ASM_SET_CR3(current_process->pml4->phys_addr);
-        current_pml4 = current_process->pml4;
+    while (process->status == TASK_STOPPED)
+    {
+        preempt_schedule();
     }
+}
 
-    check_signals(false);
+/**
+ * Give up the rest of the current time slice to other processes on the same
+ * or a higher level.
+ *
+ * @return 0
+ */
+int process_yield()
+{
+    schedule();
+    return 0;
+}
 
-    if (current_process->status == TASK_INITIAL)
+// Resolve the target of getpriority() / setpriority()
+static process_t *priority_target(int which, int who)
+{
+    if (which != PRIO_PROCESS)
     {
-        current_process->status = TASK_RUNNING;
-
-        // jump to the new process
-        jump_to_usermode((uint64_t)current_process->entry, current_process->rsp, 0, NULL, NULL);
+        return NULL;
     }
-    else if (current_process->status == TASK_RUNNING)
+    if (who == 0)
     {
-        // switch to the new process's stack ( see below comment )
-        ASM_WRITE_RSP(current_process->rsp);
-        ASM_WRITE_RBP(current_process->rbp);
-
-        // *should* just pop and return to the assembly handler, not
-        // touching variables or registers. Leaving this be until I can
-        // either confirm this works and is limited as such per specifcation,
-        // or find a better way to do it.
+        return (process_t *)current_process;
+    }
+    return process_find(who);
+}
 
-        return;
+/**
+ * Get the nice value of a process.
+ *
+ * @param which Only PRIO_PROCESS is supported
+ * @param who The PID, or 0 for the current process
+ *
+ * @return 20 - nice (always positive, as the raw syscall does), or a negative error
+ */
+int process_getpriority(int which, int who)
+{
+    if (which != PRIO_PROCESS && which != PRIO_PGRP && which != PRIO_USER)
+    {
+        return -EINVAL;
     }
-    else if (current_process->status == TASK_FORKED)
+
+    process_t *process = priority_target(which, who);
+    if (process == NULL)
     {
-        current_process->status = TASK_RUNNING;
+        return which == PRIO_PROCESS ? -ESRCH : -EINVAL;
+    }
+    return 20 - process->nice;
+}
 
-        // zero out rax
-        current_process->syscall_registers.rax = 0;
+/**
+ * Set the nice value of a process. Out of range values are clamped.
+ *
+ * @param which Only PRIO_PROCESS is supported
+ * @param who The PID, or 0 for the current process
+ * @param prio The new nice value
+ *
+ * @return 0, or a negative error
+ */
+int process_setpriority(int which, int who, int prio)
+{
+    if (which != PRIO_PROCESS && which != PRIO_PGRP && which != PRIO_USER)
+    {
+        return -EINVAL;
+    }
 
-        syscall_old_rsp = current_process->syscall_rsp;
+    process_t *process = priority_target(which, who);
+    if (process == NULL)
+    {
+        return which == PRIO_PROCESS ? -ESRCH : -EINVAL;
+    }
+    if (process == &idle_process)
+    {
+        return -EPERM;
+    }
 
-        xmm_regs = current_process->syscall_xmm_registers;
+    if (prio < NICE_MIN)
+    {
+        prio = NICE_MIN;
+    }
+    else if (prio > NICE_MAX)
+    {
+        prio = NICE_MAX;
+    }
 
-        // move the address of the current process registers to rax
-        asm volatile("mov %0, %%rax" ::"r"(&(current_process->syscall_registers)));
-        // jump to after_syscall
-        asm volatile("jmp after_syscall");
+    process->nice = prio;
+    if (process->sched_level < SCHED_BASE_LEVEL(process->nice))
+    {
+        sched_set_level(process, SCHED_BASE_LEVEL(process->nice));
+    }
+    else if (process == current_process)
+    {
+        // may have been made less important than something waiting
+        set_need_resched();
     }
 
-    kpanic("Process %d in undefined state! [%d]", current_process->pid, current_process->status);
+    return 0;
 }
 
-char temp_stack[SYSCALL_STACK_SIZE];
-
-int64_t krt_sigaction(int signum, const struct sigaction *act, struct sigaction *oldact)
+/**
+ * setpgid() syscall: move a process into a process group, which wait4() and
+ * kill() with a negative PID address.
+ *
+ * @param pid The current process or one of its children, 0 for the current
+ *      process
+ * @param pgid The group, 0 for one named after pid
+ *
+ * @return 0 if successful
+ *      -EINVAL if pgid is negative
+ *      -ESRCH if pid is neither the caller nor one of its children
+ */
+int64_t ksetpgid(pid_t pid, pid_t pgid)
 {
-    UNUSED(oldact);
-
-    if (signum >= SIG_MAX)
+    if (pgid < 0)
     {
         return -EINVAL;
     }
 
-    if (oldact != NULL)
+    process_t *process = pid == 0 ? (process_t *)current_process : process_find(pid);
+    spin_lock(&process_tree_lock);
+    if (process == NULL || (process != current_process && process->parent != current_process))
     {
-        *oldact = current_process->signal_handlers[signum];
+        spin_unlock(&process_tree_lock);
+        return -ESRCH;
     }
+    process->pgid = pgid != 0 ? pgid : process->pid;
+    spin_unlock(&process_tree_lock);
+    return 0;
+}
 
-    if (act != NULL)
+/**
+ * Called by whatever runs right after a switch_to(). The process switched
+ * away from is now entirely saved, so another CPU may pick it up.
+ */
+static void sched_finish_switch()
+{
+    cpu_t *cpu = this_cpu();
+    if (cpu->switched_from != NULL)
     {
-        current_process->signal_handlers[signum] = *act;
+        __atomic_store_n(&cpu->switched_from->on_cpu, false, __ATOMIC_RELEASE);
+        cpu->switched_from = NULL;
     }
-
-    return 0;
 }
 
-void krt_sigret() {
-    // switch to the sigret stack temporarily
-    ASM_WRITE_RSP((uint64_t)temp_stack + SYSCALL_STACK_SIZE);
+/**
+ * Where a process that has never run starts, on its own kernel stack.
+ * switch_to() returns here through the frame process_init_context() built.
+ */
+static void __attribute__((noreturn)) process_start()
+{
+    sched_finish_switch();
 
-    current_process->in_signal_handler = false;
+    if (current_process->kthread)
+    {
+        current_process->status = TASK_RUNNING;
 
-    signal_t *signal = current_process->queued_signals;
+        // switch_to() comes from schedule() with interrupts disabled
+        ASM_ENABLE_INTERRUPTS;
 
-    memcpy(current_process->syscall_stack, signal->syscall_stack, SYSCALL_STACK_SIZE);
-    kfree(signal->syscall_stack);
+        kthread_fn_t fn = (kthread_fn_t)current_process->entry;
+        process_exit(fn(current_process->kthread_arg));
+    }
+    else if (current_process->status == TASK_FORKED)
+    {
+        current_process->status = TASK_RUNNING;
 
-    current_process->syscall_rsp = signal->syscall_rsp;
-    current_process->interrupt_registers = signal->interrupt_registers;
-    current_process->syscall_registers = signal->syscall_registers;
+        // zero out rax
+        current_process->syscall_registers.rax = 0;
 
-    bool was_in_syscall = signal->was_in_syscall;
+        if (current_process->set_child_tid != NULL)
+        {
+            *current_process->set_child_tid = current_process->pid;
+            current_process->set_child_tid = NULL;
+        }
 
-    signal_t *next = signal->next;
-    kfree(signal);
-    current_process->queued_signals = next;
+        percpu()->user_rsp = current_process->syscall_rsp;
 
-    if (!was_in_syscall) {
-        schedule();
-    } else {
-        syscall_old_rsp = current_process->syscall_rsp;
+        // move the address of the current process registers to rax
+        asm volatile("mov %0, %%rax" ::"r"(&(current_process->syscall_registers)));
+        // jump to after_syscall
+        asm volatile("jmp after_syscall");
+    }
+    else if (current_process->status == TASK_INITIAL)
+    {
+        current_process->status = TASK_RUNNING;
+
+        // jump to the new process
+        jump_to_usermode((uint64_t)current_process->entry, current_process->rsp, 0, NULL, NULL);
+    }
+
+    kpanic("Process %d in undefined state! [%d]", current_process->pid, current_process->status);
+}
+
+// Build the frame switch_to() pops for a process that has never run, at
+// the top of its interrupt stack. Nothing else is on it until it runs.
+static void process_init_context(process_t *process)
+{
+    uint64_t *sp = (uint64_t *)((uint64_t)process->tss_stack + SYSCALL_STACK_SIZE);
+    *--sp = 0; // alignment, as if process_start had been called
+    *--sp = (uint64_t)&process_start;
+    for (int i = 0; i < 6; i++)
+    {
+        *--sp = 0; // rbx, rbp, r12-r15
+    }
+    process->kernel_rsp = (uint64_t)sp;
+}
+
+// Zero a new process' resource accounting
+static void process_usage_reset(process_t *process)
+{
+    process->runtime_ns = 0;
+    process->switched_in_at = 0;
+    process->user_ticks = 0;
+    process->system_ticks = 0;
+    process->nvcsw = 0;
+    process->nivcsw = 0;
+    process->minflt = 0;
+    process->rss_pages = 0;
+    process->maxrss_pages = 0;
+    memset(&process->children_usage, 0, sizeof(process_usage_t));
+}
+
+/**
+ * Create an address space.
+ *
+ * @param pml4 Its page tables
+ * @param regions Where page faults may map fresh pages, taken over by it
+ *
+ * @return The address space, holding one reference
+ */
+address_space_t *address_space_create(page_directory_t *pml4, memregion_t *regions)
+{
+    address_space_t *vm = (address_space_t *)kmalloc(sizeof(address_space_t));
+    vm->refcount = 1;
+    vm->pml4 = pml4;
+    vm->regions = regions;
+    vm->brk = 0;
+    vm->stack_low = VIRT_MEM_OFFSET;
+    vm->template = NULL;
+    vm->images = NULL;
+    vm->mmap_next = USER_MMAP_BASE;
+    return vm;
+}
+
+/**
+ * Take another reference to an address space.
+ *
+ * @param vm The address space
+ *
+ * @return The same address space
+ */
+address_space_t *address_space_get(address_space_t *vm)
+{
+    __atomic_add_fetch(&vm->refcount, 1, __ATOMIC_RELAXED);
+    return vm;
+}
+
+/**
+ * Drop a reference to an address space, freeing it when the last reference
+ * goes. It mustn't be the loaded one by then.
+ *
+ * @param vm The address space
+ * @param deferred Free the page tables in the background rather than now
+ */
+void address_space_put(address_space_t *vm, bool deferred)
+{
+    if (vm == NULL || __atomic_sub_fetch(&vm->refcount, 1, __ATOMIC_ACQ_REL) != 0)
+    {
+        return;
+    }
+
+    while (vm->regions != NULL)
+    {
+        memregion_t *next = vm->regions->next;
+        kfree(vm->regions);
+        vm->regions = next;
+    }
+    if (deferred)
+    {
+        free_page_directory_deferred(vm->pml4);
+    }
+    else
+    {
+        free_page_directory(vm->pml4);
+    }
+    template_put(vm->template);
+    exec_image_refs_put(vm->images);
+    kfree(vm);
+}
+
+/**
+ * Copy a list of memory regions.
+ *
+ * @param regions The regions
+ *
+ * @return The copy, in the same order
+ */
+memregion_t *memregions_clone(memregion_t *regions)
+{
+    memregion_t *new_regions = NULL;
+    memregion_t **tail = &new_regions;
+    for (memregion_t *region = regions; region != NULL; region = region->next)
+    {
+        memregion_t *new_region = kmalloc(sizeof(memregion_t));
+        new_region->start = region->start;
+        new_region->end = region->end;
+        new_region->flags = region->flags;
+        new_region->next = NULL;
+        *tail = new_region;
+        tail = &new_region->next;
+    }
+    return new_regions;
+}
+
+/**
+ * Copy a table of signal dispositions.
+ *
+ * @param from The table to copy, or NULL for every signal at its default
+ *
+ * @return The new table, holding one reference
+ */
+sighand_t *sighand_create(sighand_t *from)
+{
+    sighand_t *sighand = (sighand_t *)kmalloc(sizeof(sighand_t));
+    if (from != NULL)
+    {
+        memcpy(sighand->actions, from->actions, sizeof(sighand->actions));
+    }
+    else
+    {
+        memset(sighand->actions, 0, sizeof(sighand->actions));
+    }
+    sighand->refcount = 1;
+    return sighand;
+}
+
+void sighand_put(sighand_t *sighand)
+{
+    if (sighand != NULL && __atomic_sub_fetch(&sighand->refcount, 1, __ATOMIC_ACQ_REL) == 0)
+    {
+        kfree(sighand);
+    }
+}
+
+// Where the user stack may grow to, ahead of the rest of the regions
+static memregion_t *stack_region(memregion_t *next)
+{
+    memregion_t *region = kmalloc(sizeof(memregion_t));
+    region->start = VIRT_MEM_OFFSET - MAX_STACK_SIZE;
+    region->end = VIRT_MEM_OFFSET - 1;
+    region->flags = 0x7;
+    region->next = next;
+    return region;
+}
+
+// Drop an exited process from the PID table and process list, and free it
+static void process_free(process_t *zombie)
+{
+    pid_t pid = zombie->pid;
+    hashtable_remove(&process_table, &zombie->pid_node);
+    list_remove(&zombie->list_node);
+    kfree(zombie);
+    pid_free(pid);
+}
+
+// Free an exited process nobody will wait for, once it's off its CPU. Its
+// usage isn't charged to anyone, as it never reached a wait4().
+static void process_autoreap(work_t *work)
+{
+    process_t *zombie = container_of(work, process_t, reap_work);
+    while (zombie->on_cpu)
+    {
+        cpu_relax();
+    }
+    process_free(zombie);
+}
+
+/**
+ * Create a new process.
+ *
+ * @param entry The entry point of the process
+ * @param stack_size The size of the stack, or the address of the stack if has_stack is true
+ * @param vm The address space for the process, whose reference it takes over
+ * @param has_stack Whether the stack is already set up
+ *
+ * @return The new process, or NULL if there are no free PIDs
+ */
+process_t *create_process(void *entry, uint64_t stack_size, address_space_t *vm, bool has_stack)
+{
+    pid_t pid = pid_alloc();
+    if (pid < 0)
+    {
+        return NULL;
+    }
+
+    process_t *new_process = (process_t *)kmalloc(sizeof(process_t));
+    new_process->pid = pid;
+    new_process->entry = entry;
+    new_process->vm = vm;
+    new_process->pml4 = vm->pml4;
+    new_process->status = TASK_INITIAL;
+    new_process->kthread = false;
+    new_process->kthread_arg = NULL;
+    new_process->name = NULL;
+    new_process->parent = (process_t *)current_process;
+    new_process->pgid = current_process->pgid;
+    new_process->uid = current_process->uid;
+    new_process->euid = current_process->euid;
+    new_process->fsuid = current_process->fsuid;
+    new_process->gid = current_process->gid;
+    new_process->egid = current_process->egid;
+    new_process->fsgid = current_process->fsgid;
+    new_process->nice = current_process->nice;
+    new_process->sched_level = SCHED_BASE_LEVEL(new_process->nice);
+    new_process->timeslice = 0;
+    list_init(&new_process->run_node);
+    new_process->on_cpu = false;
+    itimer_init(new_process);
+    new_process->ppid = current_process->pid;
+    list_init(&new_process->children);
+    list_init(&new_process->sibling);
+    list_init(&new_process->zombies);
+    list_init(&new_process->zombie_node);
+    work_init(&new_process->reap_work, process_autoreap);
+    wait_queue_init(&new_process->child_wait);
+    new_process->wait_report = WAIT_REPORT_NONE;
+    new_process->stop_signal = 0;
+    new_process->exit_signal = SIGCHLD;
+    process_usage_reset(new_process);
+    new_process->tss_stack = kstack_alloc(SYSCALL_STACK_SIZE / 0x1000);
+    new_process->syscall_stack = kstack_alloc(SYSCALL_STACK_SIZE / 0x1000);
+    new_process->fpu_state = fpu_state_alloc();
+    new_process->fpu_cpu = FPU_NO_CPU;
+    new_process->interrupt_frame = NULL;
+    process_init_context(new_process);
+    new_process->sighand = NULL;
+    new_process->signal_mask = 0;
+    new_process->pending_signals = 0;
+    new_process->fs_base = 0;
+    new_process->personality = current_process->personality;
+    new_process->set_child_tid = NULL;
+    new_process->clear_child_tid = NULL;
+
+    new_process->files = file_table_create(NULL);
+    new_process->pwd = path_ref_create("/");
+
+    if (!has_stack)
+    {
+        // Set up the stack
+        uint32_t stack_size_pages = stack_size & 0xFFF ? (stack_size >> 12) + 1 : stack_size >> 12;
+        for (uint32_t i = 0; i < stack_size_pages; i++)
+        {
+            uint64_t phys = first_free_page_addr();
+            if (map_page_kmalloc(VIRT_MEM_OFFSET - ((i + 1) * 0x1000), phys, false, true, vm->pml4))
+            {
+                process_rss_add(new_process, 1);
+            }
+        }
+
+        vm->stack_low = VIRT_MEM_OFFSET - (stack_size_pages * 0x1000);
+
+        new_process->rsp = VIRT_MEM_OFFSET;
+        new_process->rbp = VIRT_MEM_OFFSET;
+
+        // map the region
+        vm->regions = stack_region(vm->regions);
+    }
+    else
+    {
+        new_process->rsp = stack_size;
+        new_process->rbp = stack_size;
+    }
+
+    return new_process;
+}
+
+// Fill in an idle process. Idle processes are never queued; schedule()
+// falls back to its CPU's one when nothing else can run.
+static void idle_setup(process_t *idle, uint32_t cpu, void *stack)
+{
+    idle->pid = 0;
+    idle->pml4 = kernel_pml4;
+    idle->vm = NULL;
+    idle->entry = NULL;
+    idle->kthread = false;
+    idle->kthread_arg = NULL;
+    idle->name = "idle";
+    idle->parent = NULL;
+    idle->ppid = 0;
+    idle->pgid = 0;
+    // root, which everything started at boot inherits
+    idle->uid = 0;
+    idle->euid = 0;
+    idle->fsuid = 0;
+    idle->gid = 0;
+    idle->egid = 0;
+    idle->fsgid = 0;
+    list_init(&idle->children);
+    list_init(&idle->sibling);
+    list_init(&idle->zombies);
+    list_init(&idle->zombie_node);
+    wait_queue_init(&idle->child_wait);
+    idle->wait_report = WAIT_REPORT_NONE;
+    process_usage_reset(idle);
+    idle->status = TASK_RUNNING;
+    idle->nice = NICE_MAX;
+    idle->sched_level = SCHED_LEVELS - 1;
+    idle->timeslice = 0;
+    list_init(&idle->run_node);
+    idle->cpu = cpu;
+    idle->on_cpu = true;
+    itimer_init(idle);
+    idle->tss_stack = stack;
+    idle->syscall_stack = kstack_alloc(SYSCALL_STACK_SIZE / 0x1000);
+    idle->fpu_state = NULL; // the kernel doesn't use the FPU
+    idle->fpu_cpu = FPU_NO_CPU;
+    idle->interrupt_frame = NULL;
+    idle->sighand = NULL;
+    idle->signal_mask = 0;
+    idle->pending_signals = 0;
+    idle->fs_base = 0;
+    idle->personality = 0;
+    idle->set_child_tid = NULL;
+    idle->clear_child_tid = NULL;
+    idle->files = file_table_create(NULL);
+}
+
+/**
+ * Create the idle process for an application processor. Unlike the boot
+ * CPU's, it isn't in the PID table; PID 0 always finds the boot CPU's.
+ *
+ * @param cpu The CPU's index
+ * @param stack The CPU's kernel stack
+ *
+ * @return The idle process
+ */
+process_t *process_create_idle(uint32_t cpu, void *stack)
+{
+    process_t *idle = (process_t *)kmalloc(sizeof(process_t));
+    idle_setup(idle, cpu, stack);
+    idle->pwd = path_ref_get(idle_process.pwd);
+    return idle;
+}
+
+/**
+ * Free the idle process of an application processor that never started.
+ * The stack passed to process_create_idle() is the caller's to free.
+ *
+ * @param idle The idle process, which must never have run
+ */
+void process_free_idle(process_t *idle)
+{
+    kstack_free(idle->syscall_stack, SYSCALL_STACK_SIZE / 0x1000);
+    file_table_put(idle->files);
+    path_ref_put(idle->pwd);
+    kfree(idle);
+}
+
+/**
+ * Start a kernel thread. It's scheduled like any other process but runs
+ * only kernel code, in the kernel's address space, and like a syscall it
+ * isn't preempted: it runs until it blocks, calls cond_resched() or
+ * returns. Signals aren't delivered to it. It's a child of the idle
+ * process, so kernel threads are meant to run until shutdown.
+ *
+ * @param fn The thread's body, called with interrupts enabled
+ * @param arg Passed to fn
+ * @param name For logging, must outlive the thread
+ * @param nice Scheduling priority, as for setpriority()
+ *
+ * @return The thread, already queued to run, or NULL if there are no free PIDs
+ */
+process_t *kthread_create(kthread_fn_t fn, void *arg, const char *name, int8_t nice)
+{
+    pid_t pid = pid_alloc();
+    if (pid < 0)
+    {
+        return NULL;
+    }
+
+    process_t *thread = (process_t *)kmalloc(sizeof(process_t));
+    memset(thread, 0, sizeof(process_t));
+    thread->pid = pid;
+    thread->entry = (void *)fn;
+    thread->kthread = true;
+    thread->kthread_arg = arg;
+    thread->name = name;
+    thread->pml4 = kernel_pml4;
+    thread->vm = NULL;
+    thread->status = TASK_INITIAL;
+    thread->parent = &idle_process;
+    thread->ppid = idle_process.pid;
+    thread->nice = nice;
+    thread->sched_level = SCHED_BASE_LEVEL(nice);
+    thread->timeslice = 0;
+    list_init(&thread->run_node);
+    thread->on_cpu = false;
+    itimer_init(thread);
+    list_init(&thread->children);
+    list_init(&thread->sibling);
+    list_init(&thread->zombies);
+    list_init(&thread->zombie_node);
+    work_init(&thread->reap_work, process_autoreap);
+    wait_queue_init(&thread->child_wait);
+    thread->tss_stack = kstack_alloc(SYSCALL_STACK_SIZE / 0x1000);
+    thread->syscall_stack = kstack_alloc(SYSCALL_STACK_SIZE / 0x1000);
+    thread->fpu_state = NULL; // the kernel doesn't use the FPU
+    thread->fpu_cpu = FPU_NO_CPU;
+    thread->interrupt_frame = NULL;
+    process_init_context(thread);
+    thread->files = file_table_create(NULL);
+    thread->pwd = path_ref_get(idle_process.pwd);
+
+    serial_printf("Starting kernel thread %s as process %d\n", name, pid);
+    add_process(thread);
+    return thread;
+}
+
+extern char tss_stack[SYSCALL_STACK_SIZE];
+void process_init()
+{
+    // create the idle process
+    idle_setup(&idle_process, 0, tss_stack);
+    idle_process.pml4 = current_pml4;
+    idle_process.pwd = path_ref_create("/");
+
+    runqueue_init(&cpus[0].runqueue);
+    cpus[0].idle = &idle_process;
+
+    current_process = &idle_process;
+    pid_bitmap[0] |= 1;
+    pid_cursor = 1;
+    idle_process.pid_node.key = 0;
+    hashtable_insert(&process_table, &idle_process.pid_node);
+    list_add_tail(&process_list, &idle_process.list_node);
+}
+
+// Whether doing nothing is a signal's default action
+static bool signal_default_ignored(int signum)
+{
+    return signum == SIGCHLD || signum == SIGURG || signum == SIGWINCH || signum == SIGCONT;
+}
+
+// Whether stopping is a signal's default action
+static bool signal_default_stops(int signum)
+{
+    return signum == SIGSTOP || signum == SIGTSTP || signum == SIGTTIN || signum == SIGTTOU;
+}
+
+// Whether a signal would be thrown away on delivery anyway. Blocked ones
+// are kept, a handler may be installed by the time they're unblocked.
+static bool signal_ignored(process_t *process, int signum)
+{
+    if (process->signal_mask & SIGNAL_BIT(signum))
+    {
+        return false;
+    }
+
+    void *handler = process_signal_handler(process, signum);
+    return handler == SIG_IGN || (handler == SIG_DFL && signal_default_ignored(signum));
+}
+
+/**
+ * Send a signal to a process. Doesn't allocate, so it's safe from IRQ
+ * handlers.
+ *
+ * @param pid The process
+ * @param info The signal, copied
+ */
+void signal_process(pid_t pid, const siginfo_t *info)
+{
+    process_t *process = process_find(pid);
+    int signum = info->si_signo;
+    if (process == NULL || process->kthread || signum <= 0 || signum >= SIG_MAX)
+    {
+        return;
+    }
+
+    // a stopped process only runs again for these
+    if (signum == SIGCONT || signum == SIGKILL)
+    {
+        if (process_resume(process) && signum == SIGCONT)
+        {
+            spin_lock(&process_tree_lock);
+            process->wait_report = WAIT_REPORT_CONTINUED;
+            siginfo_t parent_info;
+            pid_t notify = process_notify_parent(process, CLD_CONTINUED, &parent_info);
+            spin_unlock(&process_tree_lock);
+            if (notify != 0)
+            {
+                signal_process(notify, &parent_info);
+            }
+        }
+    }
+
+    // a continue cancels pending stops and the other way round
+    if (signum == SIGCONT)
+    {
+        __atomic_fetch_and(&process->pending_signals, ~(SIGNAL_BIT(SIGSTOP) | SIGNAL_BIT(SIGTSTP) | SIGNAL_BIT(SIGTTIN) | SIGNAL_BIT(SIGTTOU)), __ATOMIC_RELAXED);
+    }
+    else if (signal_default_stops(signum))
+    {
+        __atomic_fetch_and(&process->pending_signals, ~SIGNAL_BIT(SIGCONT), __ATOMIC_RELAXED);
+    }
+
+    if (signal_ignored(process, signum))
+    {
+        return;
+    }
+
+    process->signal_info[signum] = *info;
+    __atomic_fetch_or(&process->pending_signals, SIGNAL_BIT(signum), __ATOMIC_RELEASE);
+
+    // let it notice, interruptible sleeps give up when this happens
+    if (signal_pending(process))
+    {
+        process_wake(process);
+    }
+}
+
+int process_kill(pid_t pid, int signal)
+{
+    if (pid == 0)
+    {
+        return -EPERM;
+    }
+
+    if (signal < 0 || signal >= SIG_MAX)
+    {
+        return -EINVAL;
+    }
+
+    process_t *target = process_find(pid);
+    if (target == NULL)
+    {
+        return -ESRCH;
+    }
+    if (target->kthread)
+    {
+        return -EPERM;
+    }
+
+    // signal 0 only checks the process exists
+    if (signal != SIGNULL)
+    {
+        siginfo_t info = {0};
+        info.si_signo = signal;
+        info.si_pid = current_process->pid;
+        info.si_uid = current_process->uid;
+        signal_process(pid, &info);
+    }
+
+    return 0;
+}
+
+/**
+ * Change the current process' blocked signals. SIGKILL and SIGSTOP can't be
+ * blocked and are left out of the mask.
+ *
+ * @param how SIG_BLOCK, SIG_UNBLOCK or SIG_SETMASK
+ * @param set The signals to block, unblock or set, NULL to only read the mask
+ * @param oldset Set to the previous mask, may be NULL
+ *
+ * @return 0 if successful, -EINVAL for an unknown how
+ */
+int ksigprocmask(int how, const sigset_t *set, sigset_t *oldset)
+{
+    sigset_t old = current_process->signal_mask;
+
+    if (set != NULL)
+    {
+        sigset_t mask;
+        switch (how)
+        {
+        case SIG_BLOCK:
+            mask = old | *set;
+            break;
+        case SIG_UNBLOCK:
+            mask = old & ~*set;
+            break;
+        case SIG_SETMASK:
+            mask = *set;
+            break;
+        default:
+            return -EINVAL;
+        }
+        // anything this unblocks is delivered on the way out of the syscall
+        current_process->signal_mask = mask & ~SIGNAL_UNBLOCKABLE;
+    }
+
+    if (oldset != NULL)
+    {
+        *oldset = old;
+    }
+
+    return 0;
+}
+
+/**
+ * Get the handler a process has installed for a signal.
+ *
+ * @param process The process to check
+ * @param signum The signal number
+ *
+ * @return The handler, SIG_IGN, or SIG_DFL if the signal has its default
+ *      disposition
+ */
+void *process_signal_handler(process_t *process, int signum)
+{
+    if (process->sighand == NULL || signum < 0 || signum >= SIG_MAX)
+    {
+        return SIG_DFL;
+    }
+    return (void *)process->sighand->actions[signum].signal_handler;
+}
+
+/**
+ * Terminate the current process as killed by a signal.
+ *
+ * @param signum The signal
+ */
+void process_exit_signal(int signum)
+{
+    union wait status;
+    status.w_T.w_Retcode = 0;
+    status.w_T.w_Coredump = false;
+    status.w_T.w_Termsig = signum;
+    process_exit_abnormal(status);
+    kpanic("Process exited but process_exit_abnormal() returned");
+}
+
+// Take the current process' next deliverable signal off its pending set,
+// SIGKILL ahead of the rest and otherwise the lowest numbered
+static int signal_dequeue(process_t *process, siginfo_t *info)
+{
+    sigset_t deliverable = process->pending_signals & ~process->signal_mask;
+    if (deliverable == 0)
+    {
+        return 0;
+    }
 
-        xmm_regs = current_process->syscall_xmm_registers;
+    int signum = (deliverable & SIGNAL_BIT(SIGKILL)) ? SIGKILL : __builtin_ctzl(deliverable);
+    *info = process->signal_info[signum];
+    __atomic_fetch_and(&process->pending_signals, ~SIGNAL_BIT(signum), __ATOMIC_ACQUIRE);
+    return signum;
+}
 
-        // move the address of the current process registers to rax
-        asm volatile("mov %0, %%rax" ::"r"(&(current_process->syscall_registers)));
+// mov eax, 15 (rt_sigreturn); syscall
+static const uint8_t signal_trampoline[] = { 0xB8, 0x0F, 0x00, 0x00, 0x00, 0x0F, 0x05 };
 
-        // jump to after_syscall
-        asm volatile("jmp after_syscall");
+// Below the interrupted stack pointer, which the System V ABI lets leaf
+// functions use without moving it
+#define SIGNAL_RED_ZONE 128
+
+// Push a frame for a handler on the user stack and point regs at the
+// handler, so returning to user mode through regs calls it
+static void signal_setup_frame(process_t *process, regs_t *regs, int signum, void *handler, const siginfo_t *info)
+{
+    uint64_t fpu_state = (regs->rsp - SIGNAL_RED_ZONE - fpu_state_size) & ~(uint64_t)(FPU_STATE_ALIGN - 1);
+    uint64_t sp = fpu_state - sizeof(signal_frame_t);
+    // aligned as if the handler had been called
+    sp = (sp & ~0xFULL) - sizeof(uint64_t);
+    if (regs->rsp >= VIRT_MEM_OFFSET || sp >= VIRT_MEM_OFFSET || !is_mapped_user((uint64_t)handler, process->pml4))
+    {
+        process_exit_signal(SIGSEGV);
+    }
+
+    // faults in stack pages as needed, or kills the process if the stack
+    // can't take it
+    signal_frame_t *frame = (signal_frame_t *)sp;
+    frame->return_address = (uint64_t)frame->trampoline;
+    frame->info = *info;
+    frame->context.registers = *regs;
+    frame->context.mask = process->signal_mask;
+    frame->context.fpu_state = (void *)fpu_state;
+    memcpy(frame->trampoline, signal_trampoline, sizeof(signal_trampoline));
+    fpu_sync(process);
+    memcpy((void *)fpu_state, process->fpu_state, fpu_state_size);
+
+    // the handler runs with its signal blocked, plus whatever it asked for
+    process->signal_mask |= (process->sighand->actions[signum].sa_mask | SIGNAL_BIT(signum)) & ~SIGNAL_UNBLOCKABLE;
+
+    regs->rip = (uint64_t)handler;
+    regs->rsp = sp;
+    regs->rdi = signum;
+    regs->rsi = (uint64_t)&frame->info;
+    regs->rdx = (uint64_t)&frame->context;
+    regs->rax = 0;
+    regs->rflags &= ~(RFLAGS_TF | RFLAGS_DF);
+}
+
+/**
+ * Act on the current process' pending signals on its way back to user
+ * mode: run default actions until one kills or stops it, or set up a
+ * handler's frame, so the return enters the handler. Delivers at most one
+ * handler; any others go when it returns through rt_sigreturn().
+ *
+ * @param regs The user context being returned to, through iretq
+ */
+void check_signals(regs_t *regs)
+{
+    process_t *process = (process_t *)current_process;
+
+    siginfo_t info;
+    int signum;
+    while ((signum = signal_dequeue(process, &info)) != 0)
+    {
+        if (signum == SIGKILL)
+        {
+            process_exit_signal(SIGKILL);
+        }
+
+        void *handler = process_signal_handler(process, signum);
+        if (handler == SIG_IGN)
+        {
+            continue;
+        }
+        if (handler == SIG_DFL)
+        {
+            if (signal_default_stops(signum))
+            {
+                process_stop(signum);
+            }
+            else if (!signal_default_ignored(signum))
+            {
+                process_exit_signal(signum);
+            }
+            continue;
+        }
+
+        signal_setup_frame(process, regs, signum, handler, &info);
+        return;
+    }
+}
+
+/**
+ * Deliver the current process' signals at the end of a syscall. Returns if
+ * none are pending; otherwise it leaves for user mode through iretq, as
+ * only an interrupt frame can enter a handler and later restore every
+ * register.
+ */
+void check_signals_after_syscall()
+{
+    process_t *process = (process_t *)current_process;
+    if (!signal_pending(process))
+    {
+        return;
+    }
+
+    // the interrupt stack is unused during a syscall
+    regs_t *frame = (regs_t *)((uint64_t)process->tss_stack + SYSCALL_STACK_SIZE - sizeof(regs_t));
+    *frame = process->syscall_registers;
+    // where sysret would have gone
+    frame->rip = process->syscall_registers.rcx;
+    frame->rflags = process->syscall_registers.r11;
+    frame->rsp = process->syscall_rsp;
+    frame->cs = USER_CODE_SELECTOR;
+    frame->ss = USER_DATA_SELECTOR;
+    frame->int_no = 0;
+    frame->err_code = 0;
+    process->interrupt_frame = frame;
+
+    check_signals(frame);
+
+    ASM_DISABLE_INTERRUPTS;
+    interrupt_return(frame);
+}
+
+/**
+ * Switch to the next process without delivering signals, for preemption
+ * points inside the kernel. The caller's own return path checks signals.
+ */
+void preempt_schedule()
+{
+    ASM_DISABLE_INTERRUPTS; // In case we aren't called from an interrupt
+
+    clear_need_resched();
+
+    process_t *prev = (process_t *)current_process;
+    cpu_t *cpu = this_cpu();
+
+    // the status is checked under the lock process_wake() takes, so a
+    // wakeup racing with going to sleep is never lost
+    ticket_lock(&cpu->runqueue.lock);
+    bool runnable = prev != cpu->idle && prev->status != TASK_EXITED && prev->status != TASK_WAITING && prev->status != TASK_BLOCKED && prev->status != TASK_STOPPED;
+    if (runnable)
+    {
+        // goes behind anything else on its level
+        runqueue_enqueue(prev);
+    }
+
+    process_t *new_process = runqueue_pop(&cpu->runqueue);
+    ticket_unlock(&cpu->runqueue.lock);
+
+    if (new_process == NULL)
+    {
+        // nothing runnable, let the idle process halt until an interrupt
+        new_process = cpu->idle;
+    }
+
+    if (new_process->timeslice == 0)
+    {
+        new_process->timeslice = SCHED_TIMESLICE(new_process->sched_level) * timer_quantum_ticks;
+    }
+
+    // no need for periodic ticks while there's nothing to preempt
+    if (new_process == cpu->idle && prev != cpu->idle)
+    {
+        timer_idle_enter();
+    }
+    else if (new_process != cpu->idle && prev == cpu->idle)
+    {
+        timer_idle_exit();
+    }
+
+    if (new_process != prev) {
+        percpu_stat_inc(context_switches);
+
+        uint64_t now = clock_monotonic_ns();
+        prev->runtime_ns += now - prev->switched_in_at;
+        new_process->switched_in_at = now;
+        if (runnable)
+        {
+            prev->nivcsw++;
+        }
+        else
+        {
+            prev->nvcsw++;
+        }
+
+        fpu_switch(prev, new_process);
+        current_process = new_process;
+
+        cpu->tss->rsp0 = (uint64_t)new_process->tss_stack + SYSCALL_STACK_SIZE;
+        cpu->percpu.syscall_stack_top = (uint64_t)new_process->syscall_stack + SYSCALL_STACK_SIZE;
+
+        // threads sharing an address space switch without a TLB flush
+        if (new_process->pml4 != current_pml4)
+        {
+            ASM_SET_CR3(new_process->pml4->phys_addr);
+        }
+        current_pml4 = new_process->pml4;
+
+        if (new_process->fs_base != prev->fs_base)
+        {
+            ASM_WRMSR_ADC(new_process->fs_base, new_process->fs_base >> 32, MSR_FS_BASE);
+        }
+
+        new_process->on_cpu = true;
+        cpu->switched_from = prev;
+
+        // Returns when prev is picked again, on whichever CPU that is. Any
+        // interrupt frame prev was in stays on its stack until then.
+        switch_to(&prev->kernel_rsp, new_process->kernel_rsp);
+
+        sched_finish_switch();
+    }
+}
+
+// Signals are delivered on the way back to user mode, see check_signals()
+void schedule()
+{
+    preempt_schedule();
+}
+
+/**
+ * Preemption point for long loops in syscalls. Runs pending softirqs and
+ * gives up the CPU if something more important wants it. Does nothing if
+ * interrupts or preemption are disabled, or outside a process.
+ *
+ * @return true if other processes ran, so per-CPU state such as the
+ *      loaded page directory has been changed back to the process' own
+ */
+bool cond_resched()
+{
+    process_t *process = (process_t *)current_process;
+    if (process == NULL || process == this_cpu()->idle || preempt_count() != 0)
+    {
+        return false;
+    }
+
+    uint64_t flags;
+    ASM_SAVE_FLAGS_CLI(flags);
+
+    bool switched = false;
+    if (flags & RFLAGS_IF)
+    {
+        softirq_run();
+        if (need_resched())
+        {
+            preempt_schedule();
+            switched = true;
+        }
+    }
+
+    ASM_RESTORE_FLAGS(flags);
+    return switched;
+}
+
+// Stack the boot CPU switches to while an exiting process frees its own
+char temp_stack[SYSCALL_STACK_SIZE];
+
+// Tell whoever is joining an exiting thread that it's gone, see kclone()
+static void process_clear_child_tid()
+{
+    uint32_t *tid = current_process->clear_child_tid;
+    current_process->clear_child_tid = NULL;
+    if (tid != NULL && is_mapped_user_range((uint64_t)tid, sizeof(uint32_t), current_process->pml4))
+    {
+        *tid = 0;
+        futex_wake(tid, 1);
+    }
+}
+
+// Give up the exiting process' address space, and its files and signal
+// handlers. The address space is freed in the background once no other
+// process shares it, so exiting takes the same time however much memory
+// the process had.
+static void process_release()
+{
+    process_clear_child_tid();
+
+    // close files, so pipe readers and writers see the other end go away
+    file_table_put(current_process->files);
+    current_process->files = NULL;
+
+    sighand_put(current_process->sighand);
+    current_process->sighand = NULL;
+
+    // kernel threads run in the kernel's
+    switch_page_directory(kernel_pml4);
+    address_space_put(current_process->vm, true);
+    current_process->vm = NULL;
+    current_process->pml4 = kernel_pml4;
+}
+
+int64_t krt_sigaction(int signum, const struct sigaction *act, struct sigaction *oldact)
+{
+    UNUSED(oldact);
+
+    if (signum <= 0 || signum >= SIG_MAX || (act != NULL && (SIGNAL_BIT(signum) & SIGNAL_UNBLOCKABLE)))
+    {
+        return -EINVAL;
+    }
+
+    if (oldact != NULL)
+    {
+        if (current_process->sighand == NULL)
+        {
+            memset(oldact, 0, sizeof(struct sigaction));
+        }
+        else
+        {
+            *oldact = current_process->sighand->actions[signum];
+        }
+    }
+
+    if (act != NULL)
+    {
+        if (current_process->sighand == NULL)
+        {
+            // First non-default handler, allocate the table
+            current_process->sighand = sighand_create(NULL);
+        }
+        current_process->sighand->actions[signum] = *act;
+    }
+
+    return 0;
+}
+
+/**
+ * rt_sigreturn() syscall, made by a handler returning into its frame's
+ * trampoline. Restores what the signal interrupted, registers and mask,
+ * from the frame, and returns to it through iretq.
+ */
+void krt_sigret()
+{
+    process_t *process = (process_t *)current_process;
+
+    // the handler's ret popped the return address off the frame
+    signal_frame_t *frame = (signal_frame_t *)(process->syscall_rsp - sizeof(uint64_t));
+    if ((uint64_t)frame >= VIRT_MEM_OFFSET - sizeof(signal_frame_t))
+    {
+        process_exit_signal(SIGSEGV);
+    }
+
+    // the interrupt stack is unused during a syscall
+    regs_t *regs = (regs_t *)((uint64_t)process->tss_stack + SYSCALL_STACK_SIZE - sizeof(regs_t));
+    *regs = frame->context.registers;
+
+    // the frame is user memory, so don't trust it with anything that
+    // would get the iretq to leave user mode
+    regs->cs = USER_CODE_SELECTOR;
+    regs->ss = USER_DATA_SELECTOR;
+    regs->int_no = 0;
+    regs->err_code = 0;
+    regs->rflags = (regs->rflags & RFLAGS_USER) | RFLAGS_IF | 2;
+    if (regs->rip >> 47 != 0 || regs->rsp >> 47 != 0)
+    {
+        process_exit_signal(SIGSEGV);
+    }
+
+    // the registers may hold the handler's, so they're reloaded from the
+    // save area on next use; a bad one would fault in the kernel
+    uint64_t fpu_state = (uint64_t)frame->context.fpu_state;
+    if (fpu_state != 0 && ((fpu_state & (FPU_STATE_ALIGN - 1)) || fpu_state >= VIRT_MEM_OFFSET - fpu_state_size))
+    {
+        process_exit_signal(SIGSEGV);
+    }
+    fpu_release(process);
+    if (fpu_state == 0)
+    {
+        fpu_state_reset(process->fpu_state);
+    }
+    else
+    {
+        memcpy(process->fpu_state, (void *)fpu_state, fpu_state_size);
+        if (!fpu_state_valid(process->fpu_state))
+        {
+            fpu_state_reset(process->fpu_state);
+            process_exit_signal(SIGSEGV);
+        }
+    }
+
+    process->signal_mask = frame->context.mask & ~SIGNAL_UNBLOCKABLE;
+    process->in_syscall = false;
+    process->interrupt_frame = regs;
+
+    // the old mask may let through signals that came in during the handler
+    check_signals(regs);
+
+    ASM_DISABLE_INTERRUPTS;
+    interrupt_return(regs);
+}
+
+// Whether a parent has said it won't wait for its children, by ignoring
+// SIGCHLD or setting SA_NOCLDWAIT. The idle process never waits either.
+static bool process_parent_autoreaps(process_t *parent)
+{
+    if (parent == &idle_process)
+    {
+        return true;
+    }
+    if (parent->sighand == NULL)
+    {
+        return false;
+    }
+    struct sigaction *action = &parent->sighand->actions[SIGCHLD];
+    return action->signal_handler == SIG_IGN || (action->sa_flags & SA_NOCLDWAIT);
+}
+
+/**
+ * Hand the exiting process' children to init, and queue it for its parent
+ * to reap. Its own zombies go to init too, which reaps them like any other.
+ *
+ * @param code CLD_EXITED or CLD_KILLED, for the parent's SIGCHLD
+ */
+static void process_exit_notify(int code)
+{
+    process_t *process = (process_t *)current_process;
+    process_t *init = process_find(INIT_PID);
+    if (init == NULL || init == process)
+    {
+        init = &idle_process;
+    }
+
+    siginfo_t info;
+    pid_t notify = 0;
+    spin_lock(&process_tree_lock);
+
+    bool had_zombies = !list_empty(&process->zombies);
+    list_node_t *node, *tmp;
+    list_for_each_safe(node, tmp, &process->children)
+    {
+        process_t *child = list_entry(node, process_t, sibling);
+        list_remove(&child->sibling);
+        child->parent = init;
+        child->ppid = init->pid;
+        list_add_tail(&init->children, &child->sibling);
+    }
+    while (!list_empty(&process->zombies))
+    {
+        process_t *zombie = list_first_entry(&process->zombies, process_t, zombie_node);
+        list_remove(&zombie->zombie_node);
+        list_add_tail(&init->zombies, &zombie->zombie_node);
+    }
+    if (had_zombies)
+    {
+        wait_queue_wake(&init->child_wait);
+    }
+
+    if (process->parent != NULL)
+    {
+        if (process_parent_autoreaps(process->parent))
+        {
+            // gone as soon as it's off this CPU; a parent blocked in
+            // wait4() finds one child fewer
+            list_remove(&process->sibling);
+            schedule_work(&process->reap_work);
+        }
+        else
+        {
+            list_add_tail(&process->parent->zombies, &process->zombie_node);
+        }
+        notify = process_notify_parent(process, code, &info);
+    }
+
+    spin_unlock(&process_tree_lock);
+
+    // with the lock dropped, as the exit signal may be SIGCONT
+    if (notify != 0)
+    {
+        signal_process(notify, &info);
     }
 }
 
 void process_exit(int status)
 {
     // switch to the temporary stack
-    ASM_WRITE_RSP((uint64_t)temp_stack + SYSCALL_STACK_SIZE);
+    ASM_WRITE_RSP((uint64_t)percpu()->temp_stack + SYSCALL_STACK_SIZE);
 
     current_process->status = TASK_EXITED;
+    ktimer_cancel(&((process_t *)current_process)->itimer_real);
 
-    // free the process's memory
-    switch_page_directory(kernel_pml4);
-    free_page_directory(current_process->pml4);
+    process_release();
 
     // Update the exit status and waiters
     current_process->exit_status.w_T.w_Retcode = status;
     current_process->exit_status.w_T.w_Coredump = 0;
     current_process->exit_status.w_T.w_Termsig = 0;
 
-    // free the signals
-    signal_t *current_signal = current_process->queued_signals;
-    while (current_signal != NULL)
+    path_ref_put(current_process->pwd);
+    current_process->pwd = NULL;
+
+    kstack_free(current_process->syscall_stack, SYSCALL_STACK_SIZE / 0x1000);
+    kstack_free(current_process->tss_stack, SYSCALL_STACK_SIZE / 0x1000);
+    fpu_release((process_t *)current_process);
+    if (current_process->fpu_state != NULL)
+    {
+        fpu_state_free(current_process->fpu_state);
+        current_process->fpu_state = NULL;
+    }
+
+    process_exit_notify(CLD_EXITED);
+
+    schedule();
+}
+
+void process_exit_abnormal(union wait status)
+{
+    // switch to the temporary stack
+    ASM_WRITE_RSP((uint64_t)percpu()->temp_stack + SYSCALL_STACK_SIZE);
+    
+    current_process->status = TASK_EXITED;
+    ktimer_cancel(&((process_t *)current_process)->itimer_real);
+
+    serial_printf("Process %d exited abnormally with status %d\n", current_process->pid, status.w_T.w_Termsig);
+
+    process_release();
+
+    // Update the exit status and waiters
+    current_process->exit_status = status;
+    current_process->status = TASK_EXITED;
+
+    path_ref_put(current_process->pwd);
+    current_process->pwd = NULL;
+
+    kstack_free(current_process->syscall_stack, SYSCALL_STACK_SIZE / 0x1000);
+    kstack_free(current_process->tss_stack, SYSCALL_STACK_SIZE / 0x1000);
+    fpu_release((process_t *)current_process);
+    if (current_process->fpu_state != NULL)
+    {
+        fpu_state_free(current_process->fpu_state);
+        current_process->fpu_state = NULL;
+    }
+
+    process_exit_notify(status.w_T.w_Termsig == 0 ? CLD_EXITED : CLD_KILLED);
+
+    schedule();
+}
+
+// Whether a child is one wait4(pid) asks about
+static bool wait_matches(process_t *child, pid_t pid)
+{
+    if (pid > 0)
+    {
+        return child->pid == pid;
+    }
+    if (pid == 0)
+    {
+        return child->pgid == current_process->pgid;
+    }
+    if (pid < -1)
+    {
+        return child->pgid == (gid_t)-pid;
+    }
+    return true;
+}
+
+/**
+ * Find a child wait4() can report on: the one that exited first, or with
+ * WUNTRACED or WCONTINUED one that stopped or continued.
+ *
+ * @param pid Which children to look at, as for wait4()
+ * @param options WUNTRACED and WCONTINUED
+ * @param report Set to the status to return
+ * @param zombie Set to the child if it exited, so the caller reaps it
+ *
+ * @return The child's PID, 0 if no child is ready yet, or -ECHILD if there are no such children
+ */
+static int64_t wait_collect(pid_t pid, int options, union wait *report, process_t **zombie)
+{
+    process_t *parent = (process_t *)current_process;
+    *zombie = NULL;
+
+    spin_lock(&process_tree_lock);
+
+    list_node_t *node;
+    list_for_each(node, &parent->zombies)
     {
-        signal_t *next = current_signal->next;
-        if (current_signal->syscall_stack != NULL)
+        process_t *child = list_entry(node, process_t, zombie_node);
+        if (wait_matches(child, pid))
         {
-            kfree(current_signal->syscall_stack);
+            list_remove(&child->zombie_node);
+            list_remove(&child->sibling);
+            *report = child->exit_status;
+            *zombie = child;
+            spin_unlock(&process_tree_lock);
+            return child->pid;
         }
-        kfree(current_signal);
-        current_signal = next;
     }
 
-    kfree(current_process->syscall_stack);
-    kfree(current_process->tss_stack);
+    bool any = false;
+    list_for_each(node, &parent->children)
+    {
+        process_t *child = list_entry(node, process_t, sibling);
+        if (!wait_matches(child, pid))
+        {
+            continue;
+        }
+        any = true;
+
+        if ((options & WUNTRACED) && child->wait_report == WAIT_REPORT_STOPPED)
+        {
+            child->wait_report = WAIT_REPORT_NONE;
+            report->w_stopval = WSTOPPED;
+            report->w_stopsig = child->stop_signal;
+            spin_unlock(&process_tree_lock);
+            return child->pid;
+        }
+        if ((options & WCONTINUED) && child->wait_report == WAIT_REPORT_CONTINUED)
+        {
+            child->wait_report = WAIT_REPORT_NONE;
+            // 0xFFFF, as Linux reports it
+            report->w_stopval = 0xFF;
+            report->w_stopsig = 0xFF;
+            spin_unlock(&process_tree_lock);
+            return child->pid;
+        }
+    }
 
-    IRQ0;
+    spin_unlock(&process_tree_lock);
+    return any ? 0 : -ECHILD;
 }
 
-void process_exit_abnormal(union wait status)
+// Add a reaped child's usage, and that of everything it reaped, to a total
+static void process_usage_add(process_usage_t *total, process_t *child)
 {
-    // switch to the temporary stack
-    ASM_WRITE_RSP((uint64_t)temp_stack + SYSCALL_STACK_SIZE);
-    
-    current_process->status = TASK_EXITED;
-
-    serial_printf("Process %d exited abnormally with status %d\n", current_process->pid, status.w_T.w_Termsig);
-
-    // free the process's memory
-    switch_page_directory(kernel_pml4);
-    free_page_directory(current_process->pml4);
-
-    // Update the exit status and waiters
-    current_process->exit_status = status;
-    current_process->status = TASK_EXITED;
+    process_usage_t usage;
+    process_get_usage(child, &usage);
 
-    // free the signals
-    signal_t *current_signal = current_process->queued_signals;
-    while (current_signal != NULL)
+    const process_usage_t *sources[2] = {&usage, &child->children_usage};
+    for (int i = 0; i < 2; i++)
     {
-        signal_t *next = current_signal->next;
-        if (current_signal->syscall_stack != NULL)
+        total->utime_ns += sources[i]->utime_ns;
+        total->stime_ns += sources[i]->stime_ns;
+        total->nvcsw += sources[i]->nvcsw;
+        total->nivcsw += sources[i]->nivcsw;
+        total->minflt += sources[i]->minflt;
+        // the largest, not the sum
+        if (sources[i]->maxrss_pages > total->maxrss_pages)
         {
-            kfree(current_signal->syscall_stack);
+            total->maxrss_pages = sources[i]->maxrss_pages;
         }
-        kfree(current_signal);
-        current_signal = next;
     }
+}
 
-    kfree(current_process->syscall_stack);
-    kfree(current_process->tss_stack);
-
-    IRQ0;
+static void usage_to_rusage(const process_usage_t *usage, struct rusage *rusage)
+{
+    memset(rusage, 0, sizeof(struct rusage));
+    rusage->ru_utime.tv_sec = usage->utime_ns / NSEC_PER_SEC;
+    rusage->ru_utime.tv_usec = (usage->utime_ns % NSEC_PER_SEC) / NSEC_PER_USEC;
+    rusage->ru_stime.tv_sec = usage->stime_ns / NSEC_PER_SEC;
+    rusage->ru_stime.tv_usec = (usage->stime_ns % NSEC_PER_SEC) / NSEC_PER_USEC;
+    rusage->ru_maxrss = usage->maxrss_pages * 4;
+    rusage->ru_minflt = usage->minflt;
+    rusage->ru_nvcsw = usage->nvcsw;
+    rusage->ru_nivcsw = usage->nivcsw;
 }
 
-int64_t process_wait(pid_t pid, void *status, int options, void *rusage)
+// Free what's left of a child wait_collect() took off its parent, and
+// charge its usage to the parent
+static void process_reap(process_t *zombie)
 {
-    UNUSED(options);
-    UNUSED(rusage);
+    // the CPU it exited on may not have finished switching away from it
+    while (zombie->on_cpu)
+    {
+        cpu_relax();
+    }
 
-    int *status_int = (int *)status;
+    process_usage_add(&((process_t *)current_process)->children_usage, zombie);
+    process_free(zombie);
+}
+
+/**
+ * Wait for a child to exit, or with WUNTRACED or WCONTINUED to stop or
+ * continue. Children are reported in the order they exited.
+ *
+ * @param pid The child, -1 for any, 0 for any in the caller's process
+ *      group, or below -1 for any in the group -pid
+ * @param status Set to the child's wait status, may be NULL
+ * @param options WNOHANG, WUNTRACED and WCONTINUED
+ * @param rusage Set to what an exited child and the children it reaped
+ *      used, may be NULL
+ *
+ * @return The child's PID, 0 with WNOHANG if no child is ready, -ECHILD if
+ *      there are no such children, -EINTR if a signal arrived first or
+ *      -EINVAL for unknown options
+ */
+int64_t process_wait(pid_t pid, void *status, int options, struct rusage *rusage)
+{
+    if (options & ~(WNOHANG | WUNTRACED | WCONTINUED))
+    {
+        return -EINVAL;
+    }
 
-    // if it wants to wait on itself, return an error
-    if (pid == current_process->pid)
+    union wait report = {0};
+    process_t *zombie = NULL;
+    int64_t result;
+    if (options & WNOHANG)
     {
-        serial_printf("Attempted to wait on self\n");
-        *status_int = 0;
-        return -ECHILD;
+        result = wait_collect(pid, options, &report, &zombie);
     }
-    
-    process_t *current = process_list;
-    if (pid == -1) {
-        // TODO: actually wait for any child
-        // for now, just waiting on first child
-        while (current != NULL)
-        {
-            if (current->ppid == current_process->pid)
-            {
-                break;
-            }
-            current = current->next;
-        }
-    } else {
-        // Locate the process we're waiting on
-        while (current != NULL)
+    else
+    {
+        if (wait_event_interruptible(&((process_t *)current_process)->child_wait, (result = wait_collect(pid, options, &report, &zombie)) != 0) != 0)
         {
-            if (current->pid == pid)
-            {
-                break;
-            }
-            current = current->next;
+            return -EINTR;
         }
     }
-    if (current == NULL)
+
+    if (result <= 0)
     {
-        serial_printf("Process %d not found\n", pid);
-        *status_int = 0;
-        return -ECHILD;
+        return result;
     }
 
-    ASM_ENABLE_INTERRUPTS;
-    while (!(current->status == TASK_EXITED)) {
-        IRQ0;
-    }
-    ASM_DISABLE_INTERRUPTS;
-    
-    union wait *status_bits = (union wait *)status;
-    if (status_bits != NULL)
+    if (status != NULL)
     {
-        *status_bits = current->exit_status;
+        *(union wait *)status = report;
     }
 
-    // and done! Remove from the process list, and free the memory
-    process_t *prev = process_list;
-    if (prev == current) {
-        process_list = current->next;
-    } else {
-        while (prev->next != current) {
-            prev = prev->next;
+    if (rusage != NULL)
+    {
+        process_usage_t usage = {0};
+        if (zombie != NULL)
+        {
+            process_usage_add(&usage, zombie);
         }
-        prev->next = current->next;
+        usage_to_rusage(&usage, rusage);
     }
 
-    kfree(current);
-    
-    if (pid != -1) {
-        serial_printf("Returning process %d\n", pid);
-        return pid;
-    } else {
-        serial_printf("Returning process %d\n", current->pid);
-        return current->pid;
+    if (zombie != NULL)
+    {
+        process_reap(zombie);
+        serial_printf("Returning process %d\n", (pid_t)result);
     }
+    return result;
 }
 
-extern uint64_t read_rip();
+/**
+ * Charge a timer tick to user or system time of whatever it interrupted.
+ * Called from the timer IRQ, so in_syscall is still accurate.
+ */
+void process_account_tick()
+{
+    process_t *process = (process_t *)current_process;
+    if (process == NULL || process == this_cpu()->idle)
+    {
+        return;
+    }
 
-// 0xffffff8000444012
+    if (process->in_syscall || process->kthread)
+    {
+        process->system_ticks++;
+    }
+    else
+    {
+        process->user_ticks++;
+    }
+}
 
-int64_t kfork()
+/**
+ * Get a process' own resource usage. CPU time is measured at every switch
+ * and split between user and system time by the ticks sampled in each.
+ *
+ * @param process The process
+ * @param usage Set to its usage, not counting its children
+ */
+void process_get_usage(process_t *process, process_usage_t *usage)
 {
-    uint64_t rsp, rbp;
-    ASM_READ_RSP(rsp);
-    ASM_READ_RBP(rbp);
+    uint64_t runtime = process->runtime_ns;
+    if (process == current_process)
+    {
+        runtime += clock_monotonic_ns() - process->switched_in_at;
+    }
 
-    uint64_t rip = read_rip();
-    if (rip == 0)
+    uint64_t ticks = process->user_ticks + process->system_ticks;
+    if (ticks == 0)
     {
+        usage->utime_ns = runtime;
     }
+    else
+    {
+        usage->utime_ns = (uint64_t)((unsigned __int128)runtime * process->user_ticks / ticks);
+    }
+    usage->stime_ns = runtime - usage->utime_ns;
+    usage->nvcsw = process->nvcsw;
+    usage->nivcsw = process->nivcsw;
+    usage->minflt = process->minflt;
+    usage->maxrss_pages = process->maxrss_pages;
+}
 
-    page_directory_t *new_pml4 = clone_page_directory(current_pml4);
+/**
+ * @param who RUSAGE_SELF or RUSAGE_CHILDREN
+ * @param usage Set to the usage
+ *
+ * @return 0 if successful
+ *      -EINVAL if who is unknown
+ *      -EFAULT if usage is NULL
+ */
+int kgetrusage(int who, struct rusage *usage)
+{
+    if (usage == NULL)
+    {
+        return -EFAULT;
+    }
 
-    // Copy the memregions
-    memregion_t *current_old = current_process->memory_regions;
-    memregion_t *new_regions = NULL;
-    memregion_t *new_current = NULL;
-    while (current_old != NULL)
+    if (who == RUSAGE_SELF)
     {
-        memregion_t *new_region = kmalloc(sizeof(memregion_t));
-        new_region->start = current_old->start;
-        new_region->end = current_old->end;
-        new_region->flags = current_old->flags;
-        new_region->next = NULL;
+        process_usage_t self;
+        process_get_usage((process_t *)current_process, &self);
+        usage_to_rusage(&self, usage);
+    }
+    else if (who == RUSAGE_CHILDREN)
+    {
+        usage_to_rusage(&((process_t *)current_process)->children_usage, usage);
+    }
+    else
+    {
+        return -EINVAL;
+    }
+    return 0;
+}
 
-        if (new_regions == NULL)
-        {
-            new_regions = new_region;
-        }
-        else
-        {
-            new_current->next = new_region;
-        }
-        new_current = new_region;
+/**
+ * Get the CPU time used by the current process and its reaped children.
+ *
+ * @param buf Set to the times, in TIMES_HZ units, may be NULL
+ *
+ * @return Time since boot, in TIMES_HZ units
+ */
+int64_t ktimes(struct tms *buf)
+{
+    if (buf != NULL)
+    {
+        process_usage_t self;
+        process_get_usage((process_t *)current_process, &self);
+        process_usage_t *children = &((process_t *)current_process)->children_usage;
+
+        uint64_t ns_per_tick = NSEC_PER_SEC / TIMES_HZ;
+        buf->tms_utime = self.utime_ns / ns_per_tick;
+        buf->tms_stime = self.stime_ns / ns_per_tick;
+        buf->tms_cutime = children->utime_ns / ns_per_tick;
+        buf->tms_cstime = children->stime_ns / ns_per_tick;
+    }
+
+    return clock_monotonic_ns() / (NSEC_PER_SEC / TIMES_HZ);
+}
 
-        current_old = current_old->next;
+// Build a copy of the calling process for fork() or clone(), not yet queued
+// to run. It returns from the syscall with 0. Shares the address space,
+// files and signal handlers as flags say, copying whatever isn't shared.
+static process_t *process_fork(uint64_t flags)
+{
+    address_space_t *vm;
+    if (flags & CLONE_VM)
+    {
+        vm = address_space_get(current_process->vm);
+    }
+    else
+    {
+        // pages borrowed from a template or an executable image become the
+        // clone's own copies
+        page_directory_t *new_pml4 = clone_page_directory(current_pml4);
+        vm = address_space_create(new_pml4, memregions_clone(current_process->vm->regions));
+        vm->brk = current_process->vm->brk;
+        vm->stack_low = current_process->vm->stack_low;
+        vm->mmap_next = current_process->vm->mmap_next;
     }
 
-    process_t *new_process = create_process(0, 0, new_pml4, true, new_regions);
+    process_t *new_process = create_process(0, 0, vm, true);
+    if (new_process == NULL)
+    {
+        address_space_put(vm, false);
+        return NULL;
+    }
     new_process->status = TASK_FORKED;
-    new_process->queue_next = NULL;
     
-    new_process->entry = (void *)rip;
     new_process->syscall_rsp = current_process->syscall_rsp;
     new_process->syscall_registers = current_process->syscall_registers;
-    new_process->syscall_xmm_registers = current_process->syscall_xmm_registers;
+    fpu_sync((process_t *)current_process);
+    memcpy(new_process->fpu_state, current_process->fpu_state, fpu_state_size);
+
+    new_process->fs_base = current_process->fs_base;
 
-    new_process->stack_low = current_process->stack_low;
+    if (!(flags & CLONE_VM))
+    {
+        // the clone has a copy of every page
+        process_rss_add(new_process, current_process->rss_pages);
+    }
 
-    new_process->queued_signals = NULL;
-    new_process->in_signal_handler = false;
-    for (int i = 0; i < SIG_MAX; i++)
+    new_process->signal_mask = current_process->signal_mask;
+    if (flags & CLONE_SIGHAND)
+    {
+        if (current_process->sighand == NULL)
+        {
+            // handlers either installs from now on must apply to both
+            current_process->sighand = sighand_create(NULL);
+        }
+        new_process->sighand = current_process->sighand;
+        __atomic_add_fetch(&new_process->sighand->refcount, 1, __ATOMIC_RELAXED);
+    }
+    else if (current_process->sighand != NULL)
     {
-        new_process->signal_handlers[i].signal_handler = current_process->signal_handlers[i].signal_handler;
+        new_process->sighand = sighand_create(current_process->sighand);
     }
     
-    new_process->file_descriptors = clone_file_descriptors(current_process->file_descriptors);
-    strcpy(new_process->pwd, (const char *)current_process->pwd);
+    file_table_put(new_process->files);
+    if (flags & CLONE_FILES)
+    {
+        new_process->files = file_table_get(current_process->files);
+    }
+    else
+    {
+        new_process->files = file_table_create(clone_file_descriptors(current_process->files->descriptors));
+    }
+    path_ref_put(new_process->pwd);
+    new_process->pwd = path_ref_get(current_process->pwd);
 
-    new_process->ppid = current_process->pid;
+    return new_process;
+}
+
+int64_t kfork()
+{
+    process_t *new_process = process_fork(0);
+    if (new_process == NULL)
+    {
+        return -EAGAIN;
+    }
 
     add_process(new_process);
 
     return new_process->pid;
 }
 
-// TODO: replace with something like binfmt for loading
-int64_t kexecv(regs_t *regs)
+/**
+ * Create a child process that, depending on flags, shares the caller's
+ * address space, files and signal handlers: a thread, given all three.
+ * The child returns 0 from the syscall, on its own stack if one is given.
+ *
+ * CLONE_FS and CLONE_THREAD are accepted but do nothing: children always
+ * start with the caller's working directory and have PIDs of their own,
+ * which their parent reaps with wait4().
+ *
+ * @param flags CLONE_* flags, with the signal to send the parent on exit in
+ *      the low byte
+ * @param stack The child's user stack pointer, 0 for the caller's
+ * @param parent_tid With CLONE_PARENT_SETTID, where to store the child's
+ *      PID in the caller's memory
+ * @param child_tid With CLONE_CHILD_SETTID, where to store the child's PID
+ *      in the child's memory; with CLONE_CHILD_CLEARTID, a word to zero and
+ *      futex_wake() when the child exits, for joining it
+ * @param tls With CLONE_SETTLS, the child's FS base
+ *
+ * @return The child's PID
+ *      -EINVAL for CLONE_SIGHAND without CLONE_VM, a bad exit signal or
+ *          a TLS base outside user space
+ *      -EFAULT if a TID pointer isn't in user space
+ *      -EAGAIN if there are no free PIDs
+ */
+int64_t kclone(uint64_t flags, uint64_t stack, pid_t *parent_tid, pid_t *child_tid, uint64_t tls)
 {
-    int fd = kfopen((char *)regs->rdi, 0, 0);
-    if (fd < 0)
+    int exit_signal = flags & CLONE_SIGNAL_MASK;
+    if (exit_signal >= SIG_MAX || ((flags & CLONE_SIGHAND) && !(flags & CLONE_VM)))
     {
-        return -ENOENT;
+        return -EINVAL;
+    }
+    if ((flags & CLONE_SETTLS) && tls >= VIRT_MEM_OFFSET)
+    {
+        return -EINVAL;
+    }
+    if ((flags & CLONE_PARENT_SETTID) && (parent_tid == NULL || (uint64_t)parent_tid >= VIRT_MEM_OFFSET))
+    {
+        return -EFAULT;
+    }
+    if ((flags & (CLONE_CHILD_SETTID | CLONE_CHILD_CLEARTID)) && (child_tid == NULL || (uint64_t)child_tid >= VIRT_MEM_OFFSET))
+    {
+        return -EFAULT;
     }
 
-    size_t size = file_size_internal((char *)regs->rdi);
-    // if the highest bit is set, it's an error
-    if (size & 0x8000000000000000)
+    process_t *new_process = process_fork(flags);
+    if (new_process == NULL)
     {
-        return -EIO;
+        return -EAGAIN;
     }
+    new_process->exit_signal = exit_signal;
 
-    char *buf = kmalloc(size);
-    int read = kfread(buf, 1, size, fd);
-    if (read < 0)
+    if (stack != 0)
+    {
+        new_process->syscall_rsp = stack;
+        new_process->syscall_registers.rsp = stack;
+    }
+    if (flags & CLONE_SETTLS)
+    {
+        new_process->fs_base = tls;
+    }
+    if (flags & CLONE_CHILD_SETTID)
+    {
+        // written by the child as it starts, into its own address space
+        new_process->set_child_tid = child_tid;
+    }
+    if (flags & CLONE_CHILD_CLEARTID)
     {
-        return -EIO;
+        new_process->clear_child_tid = (uint32_t *)child_tid;
+    }
+    if (flags & CLONE_PARENT_SETTID)
+    {
+        *parent_tid = new_process->pid;
     }
 
-    // get the args
-    char **argv = (char **)regs->rsi;
-    char **envp = (char **)regs->rdx;
+    add_process(new_process);
+
+    return new_process->pid;
+}
+
+/**
+ * Set or read the current process' FS base, its thread pointer.
+ *
+ * @param code ARCH_SET_FS or ARCH_GET_FS
+ * @param addr The new base, or where to store it
+ *
+ * @return 0 if successful
+ *      -EINVAL for other codes, or a base outside user space
+ *      -EFAULT if addr can't be written to
+ */
+int64_t karch_prctl(int code, uint64_t addr)
+{
+    switch (code)
+    {
+    case ARCH_SET_FS:
+        if (addr >= VIRT_MEM_OFFSET)
+        {
+            return -EINVAL;
+        }
+        current_process->fs_base = addr;
+        ASM_WRMSR_ADC(addr, addr >> 32, MSR_FS_BASE);
+        return 0;
+    case ARCH_GET_FS:
+        if (addr == 0 || addr >= VIRT_MEM_OFFSET)
+        {
+            return -EFAULT;
+        }
+        *(uint64_t *)addr = current_process->fs_base;
+        return 0;
+    default:
+        return -EINVAL;
+    }
+}
 
+/**
+ * Set the word to clear and wake when the current process exits, as
+ * CLONE_CHILD_CLEARTID does.
+ *
+ * @param tidptr The word, NULL for none
+ *
+ * @return The caller's PID
+ */
+int64_t kset_tid_address(uint32_t *tidptr)
+{
+    current_process->clear_child_tid = tidptr;
+    return current_process->pid;
+}
 
+// Copy exec()'s argument and environment strings out of the old image,
+// back to back. Returns the copy, to be freed with kfree.
+static char *exec_args_save(char **argv, char **envp, int *argc_out, int *envc_out, uint64_t *size_out)
+{
     int argc = 0;
     int envc = 0;
     uint64_t argv_string_size = 0;
@@ -719,100 +2379,258 @@ int64_t kexecv(regs_t *regs)
             temp_strings += strlen(envp[i]) + 1;
         }
     }
-    temp_strings = temp_strings_start;
 
+    *argc_out = argc;
+    *envc_out = envc;
+    *size_out = argv_string_size;
+    return temp_strings_start;
+}
 
-    page_directory_t *new_directory = clone_page_directory(kernel_pml4);
+// Lay out the saved strings in the new image at stack_loc: the argv and
+// envp arrays, each NULL terminated, the auxiliary vector's auxc type and
+// value pairs, then the strings they point to
+static void exec_args_write(uint64_t stack_loc, char *temp_strings, int argc, int envc, const uint64_t *auxv, uint32_t auxc)
+{
+    uint64_t argv_env_ptr_size = (argc + envc + 2 + auxc * 2) * sizeof(char *);
+    uint64_t string_write_loc = stack_loc + argv_env_ptr_size;
+    uint64_t string_read_loc = (uint64_t)temp_strings;
+    char **argv_env_ptr = (char **)stack_loc;
 
-    for (uint32_t i = 0; i < PROCESS_INITIAL_STACK; i += 0x1000)
+    // copy the strings
+    for (int i = 0; i < argc; i++) {
+        strcpy((char *)string_write_loc, (char *)string_read_loc);
+        *(argv_env_ptr++) = (char *)string_write_loc;
+        // increment the write location and read location
+        string_write_loc += strlen((char *)string_read_loc) + 1;
+        string_read_loc += strlen((char *)string_read_loc) + 1;
+    }
+    *(argv_env_ptr++) = 0;
+    for (int i = 0; i < envc; i++) {
+        strcpy((char *)string_write_loc, (char *)string_read_loc);
+        *(argv_env_ptr++) = (char *)string_write_loc;
+        // increment the write location and read location
+        string_write_loc += strlen((char *)string_read_loc) + 1;
+        string_read_loc += strlen((char *)string_read_loc) + 1;
+    }
+    *(argv_env_ptr++) = 0;
+    memcpy(argv_env_ptr, auxv, auxc * 2 * sizeof(uint64_t));
+}
+
+// Replace the current image with one started from a template, resuming it
+// where it registered itself. Only returns if the arguments don't fit.
+static int64_t exec_template(process_template_t *template, char **argv, char **envp)
+{
+    int argc;
+    int envc;
+    uint64_t strings_size;
+    char *strings = exec_args_save(argv, envp, &argc, &envc, &strings_size);
+
+    uint64_t args_size = (argc + envc + 2) * sizeof(char *) + strings_size;
+    if (args_size > TEMPLATE_ARGS_SIZE)
     {
-        map_page_kmalloc(VIRT_MEM_OFFSET - (i + 0x1000), first_free_page_addr(), false, true, new_directory);
-        memset((void *)(VIRT_MEM_OFFSET - i), 0, 0x1000);
+        kfree(strings);
+        template_put(template);
+        return -E2BIG;
     }
 
-    current_process->stack_low = VIRT_MEM_OFFSET - PROCESS_INITIAL_STACK;
+    process_t *process = (process_t *)current_process;
+    address_space_t *old_vm = process->vm;
+    address_space_t *vm = template_address_space(template);
 
-    elf_info_t info = load_elf64(buf, new_directory);
-    
-    kfclose(fd);
-    kfree(buf);
+    // fresh pages for the arguments; writing them copies any the template
+    // itself had there
+    uint64_t args_pages = PAGE_ALIGN_UP(args_size) / 0x1000;
+    for (uint64_t i = 0; i < args_pages; i++)
+    {
+        map_page_kmalloc(TEMPLATE_ARGS_START + i * 0x1000, first_free_page_addr(), false, true, vm->pml4);
+    }
 
-    if (info.status != 0)
+    process->vm = vm;
+    process->pml4 = vm->pml4;
+    process->rss_pages = 0;
+    process_rss_add(process, template->pages + args_pages);
+
+    // everything else the template had set up when it registered
+    sighand_put(process->sighand);
+    process->sighand = template->sighand != NULL ? sighand_create(template->sighand) : NULL;
+    process->signal_mask = template->signal_mask;
+    process->fs_base = template->fs_base;
+    process->set_child_tid = NULL;
+    process->clear_child_tid = NULL;
+    fpu_release(process);
+    memcpy(process->fpu_state, template->fpu_state, fpu_state_size);
+
+    ASM_SET_CR3(vm->pml4->phys_addr);
+    current_pml4 = vm->pml4;
+    ASM_WRMSR_ADC(process->fs_base, process->fs_base >> 32, MSR_FS_BASE);
+
+    address_space_put(old_vm, false);
+
+    memset((void *)TEMPLATE_ARGS_START, 0, args_pages * 0x1000);
+    exec_args_write(TEMPLATE_ARGS_START, strings, argc, envc, NULL, 0);
+    kfree(strings);
+    if (template->args != NULL)
     {
-        switch_page_directory(current_pml4);
-        free_page_directory(new_directory);
-        kprintf("Failed to load ELF\n");
-        return -ENOEXEC;
+        template->args->argc = argc;
+        template->args->argv = (char **)TEMPLATE_ARGS_START;
+        template->args->envp = (char **)(TEMPLATE_ARGS_START + (argc + 1) * sizeof(char *));
     }
 
-    serial_printf("ELF loaded.\n");
+    serial_printf("Started %s from its template\n", template->path);
+
+    // the interrupt stack is unused during a syscall
+    regs_t *frame = (regs_t *)((uint64_t)process->tss_stack + SYSCALL_STACK_SIZE - sizeof(regs_t));
+    *frame = template->registers;
+    process->in_syscall = false;
+    process->interrupt_frame = frame;
+
+    check_signals(frame);
 
-    current_process->pml4 = new_directory;
+    ASM_DISABLE_INTERRUPTS;
+    interrupt_return(frame);
+}
 
-    current_process->brk_start = PAGE_ALIGN_UP(info.max_addr);
+/**
+ * execve() syscall: replace the current image with a program, loaded by
+ * whichever binary format recognises it (see binfmt.h). The new image
+ * starts with the System V stack layout: argc, the argv and envp arrays,
+ * each NULL terminated, the auxiliary vector, then the strings they point
+ * to. argc, argv and envp are also passed in rdi, rsi and rdx.
+ *
+ * @param regs The syscall's registers: the path in rdi, argv in rsi and
+ *      envp in rdx
+ *
+ * @return Only if it fails: -ENOENT if the program doesn't exist, -ENOEXEC
+ *      if no format recognises it, or the format's error
+ */
+int64_t kexecv(regs_t *regs)
+{
+    // get the args
+    char **argv = (char **)regs->rsi;
+    char **envp = (char **)regs->rdx;
 
-    // clear the signal handlers
-    for (int i = 0; i < SIG_MAX; i++)
+    // a template skips loading the program and initialising it again
+    process_template_t *template = template_find((char *)regs->rdi);
+    if (template != NULL)
     {
-        current_process->signal_handlers[i].signal_handler = NULL;
+        return exec_template(template, argv, envp);
     }
 
-    ASM_SET_CR3(new_directory->phys_addr);
-
-    free_page_directory(current_pml4);
+    binprm_t *bprm = (binprm_t *)kmalloc(sizeof(binprm_t));
+    memset(bprm, 0, sizeof(binprm_t));
+    bprm->path = (char *)regs->rdi;
+    bprm->fd = kfopen((char *)regs->rdi, 0, 0);
+    if (bprm->fd < 0)
+    {
+        kfree(bprm);
+        return -ENOENT;
+    }
 
-    current_pml4 = new_directory;
+    // the open file says what it is and how big, without resolving the
+    // path again
+    if (kfstat(bprm->fd, &bprm->st) < 0)
+    {
+        bprm->st.st_ino = 0;
+        bprm->st.st_size = file_size_internal((char *)regs->rdi);
+    }
 
-    // set up the stack
-    uint64_t argv_env_ptr_size = (argc + envc + 2) * sizeof(char *);
-    uint64_t stack_loc = VIRT_MEM_OFFSET - (argv_env_ptr_size + argv_string_size);
+    int argc;
+    int envc;
+    uint64_t argv_string_size;
+    char *temp_strings = exec_args_save(argv, envp, &argc, &envc, &argv_string_size);
 
-    uint64_t string_write_loc = stack_loc + argv_env_ptr_size;
-    uint64_t string_read_loc = (uint64_t)temp_strings;
-    char **argv_env_ptr = (char **)stack_loc;
+    bprm->pml4 = clone_page_directory(kernel_pml4);
+    bprm->mmap_next = USER_MMAP_BASE + (binfmt_randomize() ? binfmt_random_pages(USER_MMAP_RANDOM_PAGES) * 0x1000 : 0);
 
-    // copy the strings
-    if (argv) {
-        for (int i = 0; i < argc; i++) {
-            strcpy((char *)string_write_loc, (char *)string_read_loc);
-            *(argv_env_ptr++) = (char *)string_write_loc;
-            // increment the write location and read location
-            string_write_loc += strlen((char *)string_read_loc) + 1;
-            string_read_loc += strlen((char *)string_read_loc) + 1;
+    uint64_t stack_pages = 0;
+    for (uint32_t i = 0; i < PROCESS_INITIAL_STACK; i += 0x1000)
+    {
+        uint64_t phys = first_free_page_addr();
+        if (map_page_kmalloc(VIRT_MEM_OFFSET - (i + 0x1000), phys, false, true, bprm->pml4))
+        {
+            memset((void *)(phys + VIRT_MEM_OFFSET), 0, 0x1000);
+            stack_pages++;
         }
     }
-    *(argv_env_ptr++) = 0;
-    if (envp) {
-        for (int i = 0; i < envc; i++) {
-            strcpy((char *)string_write_loc, (char *)string_read_loc);
-            *(argv_env_ptr++) = (char *)string_write_loc;
-            // increment the write location and read location
-            string_write_loc += strlen((char *)string_read_loc) + 1;
-            string_read_loc += strlen((char *)string_read_loc) + 1;
-        }
+
+    int64_t status = binfmt_load(bprm);
+    kfclose(bprm->fd);
+    if (status != 0)
+    {
+        free_page_directory(bprm->pml4);
+        exec_image_refs_put(bprm->images);
+        kfree(temp_strings);
+        kfree(bprm);
+        kprintf("Failed to load %s\n", (char *)regs->rdi);
+        return status;
     }
-    *(argv_env_ptr++) = 0;
 
+    serial_printf("Loaded %s\n", bprm->path);
+
+    // a fresh address space; any other processes sharing the old one keep it
+    address_space_t *old_vm = current_process->vm;
+    address_space_t *vm = address_space_create(bprm->pml4, stack_region(NULL));
+    vm->brk = bprm->brk;
+    vm->stack_low = VIRT_MEM_OFFSET - PROCESS_INITIAL_STACK;
+    vm->images = bprm->images;
+    vm->mmap_next = bprm->mmap_next;
+    current_process->vm = vm;
+    current_process->pml4 = vm->pml4;
+
+    // the old image goes, but the peak it reached still counts
+    current_process->rss_pages = 0;
+    process_rss_add((process_t *)current_process, stack_pages + bprm->pages);
+
+    // reset the signal handlers to default
+    sighand_put(current_process->sighand);
+    current_process->sighand = NULL;
+
+    // and the thread pointer, which loading FS in jump_to_usermode clears
+    current_process->fs_base = 0;
+    current_process->set_child_tid = NULL;
+    current_process->clear_child_tid = NULL;
+
+    // and the FPU
+    fpu_release((process_t *)current_process);
+    fpu_state_reset(current_process->fpu_state);
+
+    ASM_SET_CR3(vm->pml4->phys_addr);
+    current_pml4 = vm->pml4;
+
+    address_space_put(old_vm, false);
+
+    // set up the stack: argc at a 16 byte aligned stack pointer, then the
+    // arrays exec_args_write() lays out
+    uint64_t argv_env_ptr_size = (argc + envc + 2 + bprm->auxc * 2) * sizeof(uint64_t);
+    uint64_t stack_ptr = (VIRT_MEM_OFFSET - (argv_env_ptr_size + argv_string_size) - sizeof(uint64_t)) & ~0xFULL;
+    uint64_t stack_loc = stack_ptr + sizeof(uint64_t);
+
+    *(uint64_t *)stack_ptr = argc;
+    exec_args_write(stack_loc, temp_strings, argc, envc, bprm->auxv, bprm->auxc);
     kfree(temp_strings);
 
+    uint64_t entry = bprm->entry;
+    kfree(bprm);
+
     // jump to the new process
-    jump_to_usermode(info.entry, stack_loc, argc, (char **)(stack_loc), (char **)(stack_loc + (argc + 1) * sizeof(char *)));
+    jump_to_usermode(entry, stack_ptr, argc, (char **)(stack_loc), (char **)(stack_loc + (argc + 1) * sizeof(char *)));
 
     while (1)
         ;
 }
 
 uint64_t kbrk(uint64_t location) {
-    if (location < current_process->brk_start) {
-        return current_process->brk_start;
+    address_space_t *vm = current_process->vm;
+    if (location < vm->brk) {
+        return vm->brk;
     }
 
     serial_printf("Adjusting process brk to 0x%lx\n", location);
 
     location = PAGE_ALIGN_UP(location);
 
-    uint64_t old_brk = current_process->brk_start;
-    current_process->brk_start = location;
+    uint64_t old_brk = vm->brk;
+    vm->brk = location;
 
     // did we cross a page boundary?
     uint64_t old_brk_page = old_brk & 0xFFFFFFFFFFFFF000;
@@ -828,7 +2646,7 @@ uint64_t kbrk(uint64_t location) {
     new_region->flags = 0x7;
 
     // insert into the list, sorted by start address
-    memregion_t *current = current_process->memory_regions;
+    memregion_t *current = vm->regions;
     memregion_t *prev = NULL;
     while (current != NULL) {
         if (current->start > new_region->start) {
@@ -840,13 +2658,15 @@ uint64_t kbrk(uint64_t location) {
     // insert before current
     new_region->next = current;
     if (prev == NULL) {
-        current_process->memory_regions = new_region;
+        vm->regions = new_region;
     } else {
         prev->next = new_region;
     }
 
     for (uint64_t i = old_brk_page; i <= new_brk_page; i += 0x1000) {
-        map_page_kmalloc(i, first_free_page_addr(), false, true, current_process->pml4);
+        if (map_page_kmalloc(i, first_free_page_addr(), false, true, vm->pml4)) {
+            process_rss_add((process_t *)current_process, 1);
+        }
         memset((void *)i, 0, 0x1000);
     }
 
@@ -11,6 +11,7 @@
 #include <memory.h>
 #include <unused.h>
 #include <device.h>
+#include <preempt.h>
 
 ramdisk_t boot_ramdisk;
 device_t ramdisk_device = {0};
@@ -186,9 +187,26 @@ size_t ramdisk_read(void *ptr, size_t size, size_t nmemb, void *file_entry_passe
         bytes_to_read = file->size - file_entry->read_pos;
     }
 
-    memcpy(ptr, (void *)((uint64_t)ramdisk->data + file->file_data + file_entry->read_pos), bytes_to_read);
+    // copy in pieces, with a preemption point between them, so reading a
+    // whole binary doesn't hold up everything else
+    uint64_t copied = 0;
+    while (copied < bytes_to_read)
+    {
+        uint64_t chunk = bytes_to_read - copied;
+        if (chunk > RAMDISK_READ_CHUNK)
+        {
+            chunk = RAMDISK_READ_CHUNK;
+        }
 
-    file_entry->read_pos += bytes_to_read;
+        memcpy((uint8_t *)ptr + copied, (void *)((uint64_t)ramdisk->data + file->file_data + file_entry->read_pos), chunk);
+        file_entry->read_pos += chunk;
+        copied += chunk;
+
+        if (copied < bytes_to_read)
+        {
+            cond_resched();
+        }
+    }
 
     return bytes_to_read;
 }
@@ -287,31 +305,40 @@ int ramdisk_fnctl(int cmd, long arg, void *file_entry, void *device)
 
 int ramdisk_stat(void *file_entry, void *buf, void *device_passed)
 {
-    UNUSED(device_passed);
+    device_t *device = (device_t *)device_passed;
     ramdisk_file_entry_t *entry = (ramdisk_file_entry_t *)file_entry;
     if (entry->file) {
         ramdisk_file_t *file = entry->file;
 
+        // a file's header never moves, so its index makes an inode number,
+        // with 1 left for the root directory
         struct stat *statbuf = (struct stat *)buf;
-        statbuf->st_dev = 0;
-        statbuf->st_ino = 0;
+        statbuf->st_dev = (device->type << 8) | device->id;
+        statbuf->st_ino = (file - boot_ramdisk.files) + 2;
         statbuf->st_mode = file->magic == FILE_ENTRY ? S_IFREG : S_IFDIR;
         statbuf->st_nlink = 1;
         statbuf->st_uid = 0;
         statbuf->st_gid = 0;
         statbuf->st_rdev = 0;
         statbuf->st_size = file->size;
+        // the ramdisk is never written to
+        statbuf->st_atime = 0;
+        statbuf->st_mtime = 0;
+        statbuf->st_ctime = 0;
     } else {
         // root directory
         struct stat *statbuf = (struct stat *)buf;
-        statbuf->st_dev = 0;
-        statbuf->st_ino = 0;
+        statbuf->st_dev = (device->type << 8) | device->id;
+        statbuf->st_ino = 1;
         statbuf->st_mode = S_IFDIR;
         statbuf->st_nlink = 1;
         statbuf->st_uid = 0;
         statbuf->st_gid = 0;
         statbuf->st_rdev = 0;
         statbuf->st_size = boot_ramdisk.hdr->root_ents;
+        statbuf->st_atime = 0;
+        statbuf->st_mtime = 0;
+        statbuf->st_ctime = 0;
     }
 
     return 0;
@@ -369,7 +396,6 @@ device_t *init_ramdisk_device(uint64_t addr)
     strcpy(ramdisk_device.name, "ramdisk");
     ramdisk_device.flags = 0;
     ramdisk_device.data = (void *)&boot_ramdisk;
-    ramdisk_device.next = NULL;
 
     // we need to cast the function pointer to return void *, like a function type taking path, flags, and device_t *, and returning a void *
     ramdisk_device.open = (open_func_t)ramdisk_open;
@@ -0,0 +1,56 @@
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <softirq.h>
+#include <preempt.h>
+#include <system.h>
+#include <errors.h>
+
+softirq_fn_t softirq_handlers[SOFTIRQ_MAX] = {0};
+
+/**
+ * @param nr The SOFTIRQ_* number
+ * @param handler Called at the next preemption point after nr is raised
+ */
+void softirq_register(uint32_t nr, softirq_fn_t handler)
+{
+    kassert_msg(nr < SOFTIRQ_MAX, "Bad softirq number");
+    softirq_handlers[nr] = handler;
+}
+
+/**
+ * Run whatever softirqs are pending on this CPU. Call with interrupts
+ * disabled; the handlers run with them enabled, so an IRQ arriving in the
+ * meantime is serviced and its softirq picked up by the same call. Does
+ * nothing while preemption is disabled, which also keeps an IRQ taken
+ * during a handler from running softirqs itself.
+ */
+void softirq_run()
+{
+    if (preempt_count() != 0)
+    {
+        return;
+    }
+
+    preempt_disable();
+    while (true)
+    {
+        uint32_t pending = 0;
+        asm volatile("xchgl %0, %%gs:%c1" : "+r"(pending) : "i"(offsetof(percpu_t, softirq_pending)) : "memory");
+        if (pending == 0)
+        {
+            break;
+        }
+
+        ASM_ENABLE_INTERRUPTS;
+        for (uint32_t nr = 0; nr < SOFTIRQ_MAX; nr++)
+        {
+            if ((pending & (1U << nr)) && softirq_handlers[nr] != NULL)
+            {
+                softirq_handlers[nr]();
+            }
+        }
+        ASM_DISABLE_INTERRUPTS;
+    }
+    preempt_enable();
+}
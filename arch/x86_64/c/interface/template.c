@@ -0,0 +1,242 @@
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <template.h>
+#include <process.h>
+#include <memory.h>
+#include <filesystem.h>
+#include <fpu.h>
+#include <string.h>
+#include <serial.h>
+#include <sys/errno.h>
+
+// Registered templates, by path
+static list_node_t template_list = LIST_HEAD_INIT(template_list);
+static spinlock_t template_lock = SPINLOCK_INIT("template");
+
+// Find a registered template by its absolute path. Called with
+// template_lock held.
+static process_template_t *template_lookup(const char *path)
+{
+    list_node_t *node;
+    list_for_each(node, &template_list)
+    {
+        process_template_t *template = list_entry(node, process_template_t, node);
+        if (strcmp(template->path, path) == 0)
+        {
+            return template;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Find the template registered for a program.
+ *
+ * @param path The program's path, relative to the working directory if not
+ *      absolute
+ *
+ * @return The template, holding a reference for the caller, or NULL if none
+ *      is registered
+ */
+process_template_t *template_find(const char *path)
+{
+    char *resolved = resolve_path_alloc(path);
+    if (resolved == NULL)
+    {
+        return NULL;
+    }
+
+    spin_lock(&template_lock);
+    process_template_t *template = template_lookup(resolved);
+    if (template != NULL)
+    {
+        template->refcount++;
+    }
+    spin_unlock(&template_lock);
+
+    kfree(resolved);
+    return template;
+}
+
+/**
+ * Drop a reference to a template, freeing it once it's unregistered and no
+ * address space maps its pages any more.
+ *
+ * @param template The template, may be NULL
+ */
+void template_put(process_template_t *template)
+{
+    if (template == NULL)
+    {
+        return;
+    }
+
+    spin_lock(&template_lock);
+    bool last = --template->refcount == 0;
+    spin_unlock(&template_lock);
+    if (!last)
+    {
+        return;
+    }
+
+    serial_printf("Freeing template for %s\n", template->path);
+
+    free_page_directory_deferred(template->pml4);
+    while (template->regions != NULL)
+    {
+        memregion_t *next = template->regions->next;
+        kfree(template->regions);
+        template->regions = next;
+    }
+    fpu_state_free(template->fpu_state);
+    sighand_put(template->sighand);
+    kfree(template->path);
+    kfree(template);
+}
+
+/**
+ * Make an address space for a new image of a template, mapping its pages
+ * copy-on-write.
+ *
+ * @param template The template, whose reference the address space takes over
+ *
+ * @return The address space, holding one reference
+ */
+address_space_t *template_address_space(process_template_t *template)
+{
+    address_space_t *vm = address_space_create(share_page_directory(template->pml4), memregions_clone(template->regions));
+    vm->brk = template->brk;
+    vm->stack_low = template->stack_low;
+    vm->mmap_next = template->mmap_next;
+    vm->template = template;
+    return vm;
+}
+
+/**
+ * template_register() syscall: snapshot the calling process as the template
+ * for a program, replacing any already registered for it. The snapshot
+ * returns 1 from this call in each image started from it.
+ *
+ * @param path The program, which must exist
+ * @param args Where images started from the template find their arguments,
+ *      may be NULL
+ *
+ * @return 0 in the calling process
+ *      -EPERM if the caller isn't root
+ *      -EFAULT if args isn't in user space
+ *      -ENAMETOOLONG if the path is too long
+ *      -ENOENT if the program doesn't exist
+ */
+int64_t ktemplate_register(const char *path, template_args_t *args)
+{
+    process_t *process = (process_t *)current_process;
+    if (process->euid != 0)
+    {
+        return -EPERM;
+    }
+    if (args != NULL && ((uint64_t)args >= VIRT_MEM_OFFSET - sizeof(template_args_t) || ((uint64_t)args & 7)))
+    {
+        return -EFAULT;
+    }
+
+    char *resolved = resolve_path_alloc(path);
+    if (resolved == NULL)
+    {
+        return -ENAMETOOLONG;
+    }
+    struct stat st;
+    if (kstat(resolved, &st) < 0)
+    {
+        kfree(resolved);
+        return -ENOENT;
+    }
+
+    process_template_t *template = (process_template_t *)kmalloc(sizeof(process_template_t));
+    list_init(&template->node);
+    template->path = resolved;
+    template->refcount = 1;
+
+    // a copy, so the caller can carry on changing its own memory
+    template->pml4 = clone_page_directory(process->pml4);
+    template->regions = memregions_clone(process->vm->regions);
+    template->brk = process->vm->brk;
+    template->stack_low = process->vm->stack_low;
+    template->mmap_next = process->vm->mmap_next;
+    template->pages = process->rss_pages;
+
+    // resume where sysret would have returned to, with the syscall
+    // returning 1 rather than 0
+    template->registers = process->syscall_registers;
+    template->registers.rip = process->syscall_registers.rcx;
+    template->registers.rflags = process->syscall_registers.r11;
+    template->registers.rsp = process->syscall_rsp;
+    template->registers.cs = USER_CODE_SELECTOR;
+    template->registers.ss = USER_DATA_SELECTOR;
+    template->registers.int_no = 0;
+    template->registers.err_code = 0;
+    template->registers.rax = 1;
+
+    template->fs_base = process->fs_base;
+    fpu_sync(process);
+    template->fpu_state = fpu_state_alloc();
+    memcpy(template->fpu_state, process->fpu_state, fpu_state_size);
+    template->sighand = process->sighand != NULL ? sighand_create(process->sighand) : NULL;
+    template->signal_mask = process->signal_mask;
+    template->args = args;
+
+    spin_lock(&template_lock);
+    process_template_t *old = template_lookup(template->path);
+    if (old != NULL)
+    {
+        list_remove(&old->node);
+    }
+    list_add_tail(&template_list, &template->node);
+    spin_unlock(&template_lock);
+
+    // images already started from the old one keep it until they're gone
+    template_put(old);
+
+    serial_printf("Registered template for %s, %lu pages\n", template->path, template->pages);
+    return 0;
+}
+
+/**
+ * template_unregister() syscall: stop starting a program from its template.
+ *
+ * @param path The program
+ *
+ * @return 0 if successful
+ *      -EPERM if the caller isn't root
+ *      -ENAMETOOLONG if the path is too long
+ *      -ENOENT if no template is registered for it
+ */
+int64_t ktemplate_unregister(const char *path)
+{
+    if (current_process->euid != 0)
+    {
+        return -EPERM;
+    }
+
+    char *resolved = resolve_path_alloc(path);
+    if (resolved == NULL)
+    {
+        return -ENAMETOOLONG;
+    }
+
+    spin_lock(&template_lock);
+    process_template_t *template = template_lookup(resolved);
+    if (template != NULL)
+    {
+        list_remove(&template->node);
+    }
+    spin_unlock(&template_lock);
+    kfree(resolved);
+
+    if (template == NULL)
+    {
+        return -ENOENT;
+    }
+    template_put(template);
+    return 0;
+}
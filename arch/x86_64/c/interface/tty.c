@@ -8,6 +8,9 @@
 #include <string.h>
 #include <device.h>
 #include <unused.h>
+#include <filesystem.h>
+#include <process.h>
+#include <lib/container.h>
 
 
 /*
@@ -119,38 +122,32 @@ size_t tty_write(const void *ptr, size_t size, size_t nmemb, void *filedes_data,
     return size * nmemb;
 }
 
+// Whether a canonical mode read has a full line to return
+static bool tty_has_line(tty_t *tty) {
+    for (uint16_t i = 0; i < tty->buffer_pos; i++) {
+        if (tty->buffer[i] == '\n') {
+            return true;
+        }
+    }
+    return false;
+}
+
 size_t tty_read(void *ptr, size_t size, size_t nmemb, void *filedes_data, void *device_passed, uint64_t flags) {
     UNUSED(device_passed);
-    UNUSED(flags);
 
     tty_t *tty = ((tty_open_data_t *)filedes_data)->tty;
 
     // read from the tty buffer
     if (tty->termios.c_lflag & ICANON) {
-        bool have_nl = false;
-        for (uint16_t i = 0; i < tty->buffer_pos; i++) {
-            if (tty->buffer[i] == '\n') {
-                have_nl = true;
-                break;
+        if (!tty_has_line(tty)) {
+            if (flags & O_NONBLOCK) {
+                return -EAGAIN;
             }
-        }
 
-        if (!have_nl) {
-            // wait for a newline
-            ASM_ENABLE_INTERRUPTS;
-            while (true) {
-                for (uint16_t i = 0; i < tty->buffer_pos; i++) {
-                    if (tty->buffer[i] == '\n') {
-                        have_nl = true;
-                        break;
-                    }
-                }
-                if (have_nl) {
-                    break;
-                }
-                schedule();
+            // sleep until tty_push() completes a line
+            if (wait_event_interruptible(&tty->read_wait, tty_has_line(tty)) != 0) {
+                return -EINTR;
             }
-            ASM_DISABLE_INTERRUPTS;
         }
 
         // copy the buffer, up to the newline
@@ -187,6 +184,23 @@ size_t tty_read(void *ptr, size_t size, size_t nmemb, void *filedes_data, void *
 }
 
 
+// Draw whatever tty_push() has echoed since last time
+static void tty_echo_work(work_t *work) {
+    tty_t *tty = container_of(work, tty_t, echo_work);
+    while (tty->echo_tail != tty->echo_head) {
+        video_putc(tty->echo_buffer[tty->echo_tail % TTY_ECHO_SIZE]);
+        tty->echo_tail++;
+    }
+}
+
+// Queue a character to be echoed, dropping it if the screen is that far behind
+static void tty_echo(tty_t *tty, char c) {
+    if (tty->echo_head - tty->echo_tail < TTY_ECHO_SIZE) {
+        tty->echo_buffer[tty->echo_head % TTY_ECHO_SIZE] = c;
+        tty->echo_head++;
+    }
+}
+
 void tty_push(tty_t *tty, char c) {
     if (tty->termios.c_iflag & ICRNL) {
         if (c == '\r') {
@@ -197,13 +211,14 @@ void tty_push(tty_t *tty, char c) {
     if (tty->termios.c_lflag & ECHO) {
         if (c == '\b') {
             if (tty->buffer_pos > 0) {
-                video_putc('\b');
-                video_putc(' ');
-                video_putc('\b');
+                tty_echo(tty, '\b');
+                tty_echo(tty, ' ');
+                tty_echo(tty, '\b');
             }
         } else {
-            video_putc(c);
+            tty_echo(tty, c);
         }
+        schedule_work(&tty->echo_work);
     }
 
     if (tty->termios.c_lflag & ICANON) {
@@ -226,6 +241,9 @@ void tty_push(tty_t *tty, char c) {
 
     tty->buffer[tty->buffer_pos] = c;
     tty->buffer_pos++;
+
+    wait_queue_wake(&tty->read_wait);
+    select_wake();
 }
 
 void tty_addchar_internal(char c) {
@@ -283,12 +301,7 @@ int tty_select(void *filedes_data, void *device_passed, int type) {
         // If ICANO is set, we can read if there's a newline
         // Otherwise, we can read if there's anything
         if (tty->termios.c_lflag & ICANON) {
-            for (uint16_t i = 0; i < tty->buffer_pos; i++) {
-                if (tty->buffer[i] == '\n') {
-                    return 1;
-                }
-            }
-            return 0;
+            return tty_has_line(tty);
         } else {
             return tty->buffer_pos > 0;
         }
@@ -325,7 +338,6 @@ device_t *create_tty() {
     strcpy(tty_device->name, "tty");
     tty_device->type = DEVICE_TYPE_TTY;
     tty_device->flags = 0;
-    tty_device->next = NULL;
 
     tty_device->data = (void *)kmalloc(sizeof(tty_t));
 
@@ -352,6 +364,10 @@ device_t *create_tty() {
     memset(tty->buffer, 0, BASE_TTY_LENGTH);
     tty->buffer_size = BASE_TTY_LENGTH;
     tty->id = 0;
+    wait_queue_init(&tty->read_wait);
+    tty->echo_head = 0;
+    tty->echo_tail = 0;
+    work_init(&tty->echo_work, tty_echo_work);
 
     tty->termios.c_iflag = (BRKINT | ICRNL | INPCK | ISTRIP | IXON);
     tty->termios.c_oflag = (OPOST);
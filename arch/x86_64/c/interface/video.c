@@ -863,7 +863,6 @@ device_t *init_fb_device()
     strcpy(fb_device->name, "fb");
     fb_device->flags = 0;
     fb_device->data = NULL;
-    fb_device->next = NULL;
 
     fb_device->open = (open_func_t)fb_open;
     fb_device->read = (read_func_t)fb_read;
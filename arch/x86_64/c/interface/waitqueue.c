@@ -0,0 +1,94 @@
+#include <stdint.h>
+#include <stddef.h>
+
+#include <waitqueue.h>
+#include <process.h>
+
+void wait_queue_init(wait_queue_t *queue)
+{
+    list_init(&queue->waiters);
+    spin_lock_init(&queue->lock, "wait_queue");
+}
+
+void wait_queue_entry_init(wait_queue_entry_t *entry, struct process *process)
+{
+    list_init(&entry->node);
+    entry->process = process;
+}
+
+/**
+ * Put an entry on a wait queue. The caller should block afterward, and
+ * remove the entry once it's running again.
+ *
+ * @param queue The queue to wait on
+ * @param entry The waiter's entry, must not already be on a queue
+ */
+void wait_queue_add(wait_queue_t *queue, wait_queue_entry_t *entry)
+{
+    uint64_t flags;
+    spin_lock_irqsave(&queue->lock, flags);
+    list_add_tail(&queue->waiters, &entry->node);
+    spin_unlock_irqrestore(&queue->lock, flags);
+}
+
+void wait_queue_remove(wait_queue_t *queue, wait_queue_entry_t *entry)
+{
+    uint64_t flags;
+    spin_lock_irqsave(&queue->lock, flags);
+    list_remove(&entry->node);
+    spin_unlock_irqrestore(&queue->lock, flags);
+}
+
+/**
+ * Get ready to sleep on a queue: put the entry on it, if it isn't already,
+ * and mark the current process blocked. Check the condition being waited
+ * for after this, then call process_block() if it's still false.
+ *
+ * @param queue The queue to wait on
+ * @param entry The current process' entry
+ */
+void prepare_to_wait(wait_queue_t *queue, wait_queue_entry_t *entry)
+{
+    uint64_t flags;
+    spin_lock_irqsave(&queue->lock, flags);
+    if (list_empty(&entry->node))
+    {
+        list_add_tail(&queue->waiters, &entry->node);
+    }
+    process_prepare_block();
+    spin_unlock_irqrestore(&queue->lock, flags);
+}
+
+/**
+ * Stop waiting, after the condition came true.
+ *
+ * @param queue The queue waited on
+ * @param entry The current process' entry
+ */
+void finish_wait(wait_queue_t *queue, wait_queue_entry_t *entry)
+{
+    process_cancel_block();
+    wait_queue_remove(queue, entry);
+}
+
+/**
+ * Wake every process waiting on a queue. Woken processes stay on the queue
+ * until they run and remove themselves, so waking twice before they get
+ * there is harmless.
+ *
+ * @param queue The queue to wake
+ */
+void wait_queue_wake(wait_queue_t *queue)
+{
+    uint64_t flags;
+    spin_lock_irqsave(&queue->lock, flags);
+
+    list_node_t *node;
+    list_for_each(node, &queue->waiters)
+    {
+        wait_queue_entry_t *entry = list_entry(node, wait_queue_entry_t, node);
+        process_wake((process_t *)entry->process);
+    }
+
+    spin_unlock_irqrestore(&queue->lock, flags);
+}
@@ -0,0 +1,133 @@
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <workqueue.h>
+#include <process.h>
+#include <preempt.h>
+#include <memory.h>
+#include <serial.h>
+#include <errors.h>
+
+workqueue_t *system_wq = NULL;
+
+void work_init(work_t *work, work_fn_t function)
+{
+    list_init(&work->node);
+    work->function = function;
+}
+
+// Body of a queue's kernel thread: run pending work in order, sleeping
+// whenever there's none
+static int workqueue_worker(void *arg)
+{
+    workqueue_t *queue = (workqueue_t *)arg;
+
+    while (true)
+    {
+        wait_event(&queue->wait, !list_empty(&queue->pending));
+
+        uint64_t flags;
+        spin_lock_irqsave(&queue->lock, flags);
+        while (!list_empty(&queue->pending))
+        {
+            work_t *work = list_first_entry(&queue->pending, work_t, node);
+            // off the list before it runs, so it can queue itself again
+            list_remove(&work->node);
+            queue->executed++;
+            spin_unlock_irqrestore(&queue->lock, flags);
+
+            work->function(work);
+
+            // kernel threads aren't preempted, so let others in between items
+            cond_resched();
+
+            spin_lock_irqsave(&queue->lock, flags);
+        }
+        spin_unlock_irqrestore(&queue->lock, flags);
+    }
+
+    return 0;
+}
+
+/**
+ * Create a work queue, with a kernel thread of its own to run its work.
+ *
+ * @param name For logging, must outlive the queue
+ *
+ * @return The queue
+ */
+workqueue_t *workqueue_create(const char *name)
+{
+    workqueue_t *queue = (workqueue_t *)kmalloc(sizeof(workqueue_t));
+    queue->name = name;
+    list_init(&queue->pending);
+    spin_lock_init(&queue->lock, "workqueue");
+    wait_queue_init(&queue->wait);
+    queue->executed = 0;
+
+    queue->worker = kthread_create(workqueue_worker, queue, name, WORKQUEUE_NICE);
+    kassert_msg(queue->worker != NULL, "No PID for work queue worker");
+
+    return queue;
+}
+
+/**
+ * Queue work to run on a queue's worker. Safe from IRQ handlers.
+ *
+ * @param queue The queue to run it on
+ * @param work The work, which must stay valid until it has run
+ *
+ * @return false if the work was already queued, in which case it still
+ *      runs only once
+ */
+bool queue_work(workqueue_t *queue, work_t *work)
+{
+    uint64_t flags;
+    spin_lock_irqsave(&queue->lock, flags);
+    if (work_pending(work))
+    {
+        spin_unlock_irqrestore(&queue->lock, flags);
+        return false;
+    }
+    list_add_tail(&queue->pending, &work->node);
+    spin_unlock_irqrestore(&queue->lock, flags);
+
+    wait_queue_wake(&queue->wait);
+    return true;
+}
+
+/**
+ * Queue work on the system work queue.
+ *
+ * @param work The work, which must stay valid until it has run
+ *
+ * @return false if the work was already queued
+ */
+bool schedule_work(work_t *work)
+{
+    return queue_work(system_wq, work);
+}
+
+/**
+ * Take work off a queue before it runs. Doesn't wait for it if it's
+ * already running.
+ *
+ * @param queue The queue it was queued on
+ * @param work The work
+ *
+ * @return true if it was queued and now won't run
+ */
+bool cancel_work(workqueue_t *queue, work_t *work)
+{
+    uint64_t flags;
+    spin_lock_irqsave(&queue->lock, flags);
+    bool pending = work_pending(work);
+    list_remove(&work->node);
+    spin_unlock_irqrestore(&queue->lock, flags);
+    return pending;
+}
+
+void workqueue_init()
+{
+    system_wq = workqueue_create("events");
+}
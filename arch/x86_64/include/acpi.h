@@ -0,0 +1,114 @@
+#ifndef _ACPI_H
+#define _ACPI_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include <system.h>
+
+#define ACPI_RSDP_SIGNATURE "RSD PTR "
+#define ACPI_MADT_SIGNATURE "APIC"
+
+#define MADT_TYPE_LAPIC 0
+#define MADT_TYPE_IOAPIC 1
+#define MADT_TYPE_OVERRIDE 2
+#define MADT_TYPE_LAPIC_ADDRESS 5
+
+#define MADT_LAPIC_ENABLED (1 << 0)
+#define MADT_LAPIC_ONLINE_CAPABLE (1 << 1)
+
+// MPS INTI flags on interrupt source overrides
+#define MADT_POLARITY_MASK 0x3
+#define MADT_POLARITY_LOW 0x3
+#define MADT_TRIGGER_MASK 0xC
+#define MADT_TRIGGER_LEVEL 0xC
+
+typedef struct {
+    char signature[8];
+    uint8_t checksum;
+    char oem_id[6];
+    uint8_t revision;
+    uint32_t rsdt_address;
+    // ACPI 2.0+
+    uint32_t length;
+    uint64_t xsdt_address;
+    uint8_t extended_checksum;
+    uint8_t reserved[3];
+} __attribute__((packed)) acpi_rsdp_t;
+
+typedef struct {
+    char signature[4];
+    uint32_t length;
+    uint8_t revision;
+    uint8_t checksum;
+    char oem_id[6];
+    char oem_table_id[8];
+    uint32_t oem_revision;
+    uint32_t creator_id;
+    uint32_t creator_revision;
+} __attribute__((packed)) acpi_header_t;
+
+typedef struct {
+    acpi_header_t header;
+    uint32_t lapic_address;
+    uint32_t flags;
+    uint8_t entries[];
+} __attribute__((packed)) acpi_madt_t;
+
+typedef struct {
+    uint8_t type;
+    uint8_t length;
+} __attribute__((packed)) madt_entry_t;
+
+typedef struct {
+    madt_entry_t entry;
+    uint8_t processor_id;
+    uint8_t apic_id;
+    uint32_t flags;
+} __attribute__((packed)) madt_lapic_t;
+
+typedef struct {
+    madt_entry_t entry;
+    uint8_t ioapic_id;
+    uint8_t reserved;
+    uint32_t address;
+    uint32_t gsi_base;
+} __attribute__((packed)) madt_ioapic_t;
+
+typedef struct {
+    madt_entry_t entry;
+    uint8_t bus;
+    uint8_t source;
+    uint32_t gsi;
+    uint16_t flags;
+} __attribute__((packed)) madt_override_t;
+
+typedef struct {
+    madt_entry_t entry;
+    uint16_t reserved;
+    uint64_t address;
+} __attribute__((packed)) madt_lapic_address_t;
+
+typedef struct {
+    uint32_t gsi;
+    uint16_t flags;
+} irq_override_t;
+
+// What the kernel needs out of the MADT
+typedef struct {
+    uint32_t cpu_count;
+    uint32_t apic_ids[SMP_MAX_CPUS];
+    uint64_t lapic_address;
+    uint64_t ioapic_address; // 0 if there is none
+    uint32_t ioapic_gsi_base;
+    irq_override_t irq_overrides[16]; // where each ISA IRQ ends up
+} madt_info_t;
+
+extern madt_info_t madt_info;
+
+void acpi_set_rsdp(const void *rsdp, size_t size);
+void acpi_init();
+acpi_header_t *acpi_find_table(const char *signature);
+
+#endif
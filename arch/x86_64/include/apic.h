@@ -0,0 +1,67 @@
+#ifndef _APIC_H
+#define _APIC_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define LAPIC_SPURIOUS_VECTOR 0xFF
+
+#define LAPIC_BASE_MSR 0x1B
+#define LAPIC_BASE_ENABLE (1 << 11)
+
+#define LAPIC_REG_ID 0x20
+#define LAPIC_REG_EOI 0xB0
+#define LAPIC_REG_SVR 0xF0
+#define LAPIC_REG_ICR_LOW 0x300
+#define LAPIC_REG_ICR_HIGH 0x310
+#define LAPIC_REG_LVT_TIMER 0x320
+#define LAPIC_REG_TIMER_INIT 0x380
+#define LAPIC_REG_TIMER_CURRENT 0x390
+#define LAPIC_REG_TIMER_DIVIDE 0x3E0
+
+#define LAPIC_SVR_ENABLE (1 << 8)
+#define LAPIC_LVT_MASKED (1 << 16)
+
+#define LAPIC_ICR_INIT (5 << 8)
+#define LAPIC_ICR_STARTUP (6 << 8)
+#define LAPIC_ICR_PENDING (1 << 12)
+#define LAPIC_ICR_ASSERT (1 << 14)
+
+#define IOAPIC_REG_SELECT 0x00
+#define IOAPIC_REG_WINDOW 0x10 // in bytes, the window register is 4 dwords in
+#define IOAPIC_REG_VERSION 0x01
+#define IOAPIC_REG_REDIRECT 0x10 // two 32-bit registers per entry
+
+#define IOAPIC_MASKED (1 << 16)
+#define IOAPIC_LEVEL (1 << 15)
+#define IOAPIC_ACTIVE_LOW (1 << 13)
+
+// Legacy ISA interrupts are delivered on vectors IRQ_BASE_VECTOR + irq,
+// whether they come through the 8259 or the IOAPIC
+#define IRQ_BASE_VECTOR 32
+#define IRQ_LEGACY_COUNT 16
+
+extern volatile uint32_t *lapic;
+extern bool ioapic_enabled;
+
+static inline uint32_t lapic_read(uint32_t reg)
+{
+    return lapic[reg / 4];
+}
+
+static inline void lapic_write(uint32_t reg, uint32_t value)
+{
+    lapic[reg / 4] = value;
+}
+
+bool lapic_present();
+void lapic_enable();
+uint32_t lapic_id();
+void lapic_eoi();
+void lapic_send_ipi(uint32_t apic_id, uint32_t command);
+
+void apic_init();
+void irq_eoi(uint8_t vector);
+void irq_set_mask(uint8_t irq, bool masked);
+
+#endif
@@ -0,0 +1,66 @@
+#ifndef _BINFMT_H
+#define _BINFMT_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <lib/list.h>
+#include <filesystem.h>
+#include <memory.h>
+
+// Executable formats: exec offers the program to each registered format in
+// turn, until one recognises it and loads it into the new address space.
+// A format may load more than the program, like ELF's dynamic linker.
+
+// How much of the start of the file formats get to recognise it by
+#define BINPRM_BUF_SIZE 128
+// Auxiliary vector entries, as type and value pairs, see binprm_aux()
+#define BINPRM_AUXV_MAX 20
+
+// Where ET_DYN programs go, plus a random number of pages below
+// ELF_ET_DYN_RANDOM_PAGES unless the process asked for ADDR_NO_RANDOMIZE
+#define ELF_ET_DYN_BASE 0x555555554000
+#define ELF_ET_DYN_RANDOM_PAGES 0x10000
+
+// personality() flags
+#define ADDR_NO_RANDOMIZE 0x0040000
+#define PERSONALITY_QUERY 0xFFFFFFFF
+
+struct exec_image_ref;
+
+// An exec in progress
+typedef struct binprm {
+    const char *path; // as passed to exec
+    int fd; // the program, open
+    struct stat st; // st_ino is 0 if the file has no identity
+    char buf[BINPRM_BUF_SIZE]; // the start of the file
+    size_t buf_size;
+    page_directory_t *pml4; // the new address space, with its stack mapped
+
+    // filled in by the format
+    uint64_t entry; // where the new image starts running
+    uint64_t brk; // where its heap starts
+    uint64_t mmap_next; // where mmap() hands out addresses from, moved past anything mapped there
+    uint64_t pages; // mapped, for the RSS
+    struct exec_image_ref *images; // borrowed from, for the address space to hold on to
+    uint64_t auxv[BINPRM_AUXV_MAX * 2];
+    uint32_t auxc;
+} binprm_t;
+
+typedef struct binfmt {
+    list_node_t node;
+    const char *name;
+    // Load the program described by bprm. Returns 0 if successful,
+    // -ENOEXEC if it isn't in this format, or another error if it is but
+    // can't be loaded.
+    int64_t (*load)(binprm_t *bprm);
+} binfmt_t;
+
+void register_binfmt(binfmt_t *format);
+int64_t binfmt_load(binprm_t *bprm);
+void binprm_aux(binprm_t *bprm, uint64_t type, uint64_t value);
+bool binfmt_randomize();
+uint64_t binfmt_random_pages(uint64_t range);
+int64_t kpersonality(uint64_t persona);
+
+#endif
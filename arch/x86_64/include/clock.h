@@ -0,0 +1,76 @@
+#ifndef _CLOCK_H
+#define _CLOCK_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+#include <ktimer.h>
+
+#define CLOCK_REALTIME 0
+#define CLOCK_MONOTONIC 1
+
+#define NSEC_PER_SEC 1000000000ULL
+#define NSEC_PER_USEC 1000ULL
+
+#define ITIMER_REAL 0
+#define ITIMER_VIRTUAL 1
+#define ITIMER_PROF 2
+
+#define CMOS_ADDRESS 0x70
+#define CMOS_DATA 0x71
+
+#define RTC_SECONDS 0x00
+#define RTC_MINUTES 0x02
+#define RTC_HOURS 0x04
+#define RTC_DAY 0x07
+#define RTC_MONTH 0x08
+#define RTC_YEAR 0x09
+#define RTC_STATUS_A 0x0A
+#define RTC_STATUS_B 0x0B
+
+#define RTC_UPDATE_IN_PROGRESS 0x80
+#define RTC_24_HOUR 0x02
+#define RTC_BINARY 0x04
+#define RTC_PM 0x80
+
+struct timespec {
+    time_t tv_sec;
+    long tv_nsec;
+};
+
+struct timeval;
+struct itimerval;
+struct process;
+
+// Wakes a process once a duration has passed, for bounding waits. Lives on
+// the waiter's kernel stack; check expired in the wait_event() condition.
+typedef struct timeout {
+    ktimer_t timer;
+    struct process *process;
+    volatile bool expired;
+} timeout_t;
+
+extern uint64_t tsc_khz;
+
+void clock_init();
+uint64_t clock_monotonic_ns();
+uint64_t clock_realtime_ns();
+void clock_delay_us(uint64_t us);
+int clock_sleep_until(uint64_t deadline);
+
+void timeout_start(timeout_t *timeout, uint64_t ns);
+void timeout_cancel(timeout_t *timeout);
+
+void itimer_init(struct process *process);
+void itimer_account(struct process *process);
+
+int kclock_gettime(clockid_t clock, struct timespec *tp);
+int kclock_getres(clockid_t clock, struct timespec *res);
+int kgettimeofday(struct timeval *tv, void *tz);
+int knanosleep(const struct timespec *req, struct timespec *rem);
+int kgetitimer(int which, struct itimerval *value);
+int ksetitimer(int which, const struct itimerval *value, struct itimerval *old_value);
+unsigned int kalarm(unsigned int seconds);
+
+#endif
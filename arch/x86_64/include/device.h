@@ -6,6 +6,8 @@
 #include <stddef.h>
 #include <stdbool.h>
 
+#include <lib/hashtable.h>
+
 #define NAME_MAX 255
 
 typedef struct
@@ -20,6 +22,13 @@ typedef struct
 #define DEVICE_TYPE_FRMEBUF 0x4
 #define DEVICE_TYPE_TTY 0x5
 #define DEVICE_TYPE_PIPE 0x6
+#define DEVICE_TYPE_KHEAP 0x7
+#define DEVICE_TYPE_KLOCK 0x8
+#define DEVICE_TYPE_EXECCACHE 0x9
+#define DEVICE_TYPE_MAX 0xA
+
+// Key of a device in the device table
+#define DEVICE_KEY(type, id) (((uint64_t)(type) << 32) | (uint32_t)(id))
 
 typedef pointer_int_t (*open_func_t)(const char *path, uint64_t flags, void *device_passed);
 typedef size_t (*read_func_t)(void *ptr, size_t size, size_t nmemb, void *filedes_data, void *device_passed, uint64_t flags);
@@ -58,10 +67,11 @@ typedef struct device
 
 	file_size_func_t file_size;
 
-	struct device *next;
+	hash_node_t table_node;
 } device_t;
 
-device_t *register_device();
+device_t *register_device(device_t *device_to_register);
+device_t *device_find(uint32_t type, dev_t id);
 void init_device_device();
 
 #endif
\ No newline at end of file
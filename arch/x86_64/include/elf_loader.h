@@ -2,15 +2,30 @@
 #define _ELF_LOADER_H
 
 #include <stdint.h>
+#include <stdbool.h>
 #include <process.h>
+#include <elf64.h>
 
 typedef struct {
     uint64_t entry;
     uint64_t max_addr;
     int status;
     memregion_t *regions;
+    uint64_t pages; // user pages mapped, for the process' RSS
 } elf_info_t;
 
-elf_info_t load_elf64(char *elf_file, page_directory_t *elf_pml4);
+struct exec_image;
+
+// Whether [offset, offset + length) lies within a file of size bytes. The
+// sum isn't computed, so huge values from a crafted file can't wrap it.
+static inline bool elf_in_file(uint64_t offset, uint64_t length, uint64_t size)
+{
+    return offset <= size && length <= size - offset;
+}
+
+int elf_check_header(Elf64_Ehdr *header);
+elf_info_t load_elf64(char *elf_file, page_directory_t *elf_pml4, uint64_t base);
+struct exec_image *elf_image_find(int fd, const struct stat *st);
+void elf_binfmt_init();
 
 #endif
\ No newline at end of file
@@ -0,0 +1,84 @@
+#ifndef _EXEC_CACHE_H
+#define _EXEC_CACHE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <lib/list.h>
+#include <elf64.h>
+#include <elf_loader.h>
+#include <filesystem.h>
+
+// Executable image cache: exec of a program (or its dynamic linker) it has
+// seen before doesn't read or parse the file again. Each image keeps the
+// program headers and the contents of every page of its loadable segments
+// that comes from the file, prepared once. Exec maps those pages straight
+// into the new address space, read-only ones as they are and writeable ones
+// copy-on-write, so only bss pages and pages the program writes to need
+// fresh memory. A dynamic linker mapping a shared library with mmap()
+// borrows the same pages, so every process using a library shares its text.
+//
+// Images are keyed by file identity (device, inode, size and modification
+// time), so a file that's replaced is loaded afresh. The cache keeps at most
+// EXEC_CACHE_MAX_PAGES pages, dropping the least recently used images no
+// process is running first, and gives its pages back when memory runs low.
+// Statistics are read through /dev/kexeccache.
+
+#define EXEC_CACHE_MAX_PAGES 4096
+// Don't add to the cache with less free memory than this, in pages
+#define EXEC_CACHE_RESERVE_PAGES 4096
+
+typedef struct exec_segment {
+    uint64_t start; // page aligned
+    uint64_t pages;
+    uint64_t file_pages; // leading pages with contents from the file, the rest are bss
+    uint64_t first_frame; // index into the image's frames of its first file page
+    uint32_t flags; // PF_*
+    uint64_t file_start; // where its contents are in the file
+    uint64_t file_end;
+    bool file_aligned; // whether its frames are pages of the file, see exec_image_file_frame()
+} exec_segment_t;
+
+typedef struct exec_image {
+    list_node_t node; // in the cache, least recently used first; empty once evicted
+    char name[64]; // the path it was first run by, for the report
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    time_t mtime;
+    uint64_t refcount; // the cache's, plus one per address space mapping its pages
+    uint64_t hits;
+    uint16_t type; // ET_EXEC, or ET_DYN to be mapped at a base
+    uint64_t entry;
+    uint64_t max_addr;
+    char *interp; // PT_INTERP's dynamic linker, NULL for none
+    uint64_t phdr_addr; // where the program headers appear in memory, 0 if they don't
+    Elf64_Phdr *phdrs;
+    uint16_t phnum;
+    exec_segment_t *segments;
+    uint16_t segment_count;
+    uint64_t *frames; // physical addresses, 0 once given back under memory pressure
+    uint64_t frame_count;
+} exec_image_t;
+
+// An address space's hold on an image whose pages it maps
+typedef struct exec_image_ref {
+    exec_image_t *image;
+    struct exec_image_ref *next;
+} exec_image_ref_t;
+
+typedef void (*exec_cache_emit_t)(const char *str, void *ctx);
+
+exec_image_t *exec_cache_lookup(const struct stat *st);
+exec_image_t *exec_cache_add(const char *name, char *file, size_t size, const struct stat *st);
+elf_info_t exec_image_map(exec_image_t *image, page_directory_t *pml4, uint64_t base);
+uint64_t exec_image_file_frame(exec_image_t *image, uint64_t offset);
+void exec_image_put(exec_image_t *image);
+void exec_image_ref_add(exec_image_ref_t **refs, exec_image_t *image);
+void exec_image_refs_put(exec_image_ref_t *refs);
+uint64_t exec_cache_drop();
+uint64_t exec_cache_reclaim();
+void exec_cache_report(exec_cache_emit_t emit, void *ctx);
+void exec_cache_init();
+
+#endif
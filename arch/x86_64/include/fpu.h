@@ -0,0 +1,50 @@
+#ifndef _FPU_H
+#define _FPU_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define CR0_MP (1 << 1)
+#define CR0_EM (1 << 2)
+#define CR0_TS (1 << 3)
+
+#define CR4_OSFXSR (1 << 9)
+#define CR4_OSXMMEXCPT (1 << 10)
+#define CR4_OSXSAVE (1 << 18)
+
+#define CPUID_1_ECX_XSAVE (1 << 26)
+#define CPUID_1_ECX_AVX (1 << 28)
+#define CPUID_D_1_EAX_XSAVEOPT (1 << 0)
+
+#define XCR0_X87 (1 << 0)
+#define XCR0_SSE (1 << 1)
+#define XCR0_AVX (1 << 2)
+
+// Save areas must be this aligned for XSAVE, FXSAVE only needs 16
+#define FPU_STATE_ALIGN 64
+
+// Device not available, raised by FPU/SSE use while CR0.TS is set
+#define FPU_NM_VECTOR 7
+
+// fpu_cpu of a process whose state isn't live in any CPU's registers
+#define FPU_NO_CPU 0xFFFFFFFF
+
+// State components the kernel saves and restores, 0 when only FXSAVE is
+// available
+extern uint64_t fpu_xfeatures;
+// Size of a process' save area
+extern uint32_t fpu_state_size;
+
+struct process;
+
+void fpu_init();
+void *fpu_state_alloc();
+void fpu_state_free(void *state);
+void fpu_state_reset(void *state);
+bool fpu_state_valid(const void *state);
+void fpu_switch(struct process *prev, struct process *next);
+void fpu_sync(struct process *process);
+void fpu_release(struct process *process);
+void fpu_trap();
+
+#endif
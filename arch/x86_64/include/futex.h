@@ -0,0 +1,46 @@
+#ifndef _FUTEX_H
+#define _FUTEX_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <lib/list.h>
+#include <lock.h>
+
+// Fast userspace mutexes: userspace takes an uncontended lock with an
+// atomic instruction alone, and only calls futex() to sleep on the lock
+// word when it's contended, or to wake a sleeper when releasing it.
+//
+// Waiters are keyed by the physical address of the word, so processes
+// sharing an address space (or just the page) find each other's waiters.
+
+#define FUTEX_WAIT 0
+#define FUTEX_WAKE 1
+// Ignored: every futex is keyed the same way, private or not
+#define FUTEX_PRIVATE_FLAG 128
+#define FUTEX_CMD_MASK (~FUTEX_PRIVATE_FLAG)
+
+// Must be a power of two
+#define FUTEX_HASH_SIZE 64
+
+struct timespec;
+struct process;
+
+typedef struct futex_bucket {
+    spinlock_t lock; // taken with interrupts off, process_wake() can come from a timer
+    list_node_t waiters; // futex_waiter_t, in the order they started waiting
+} futex_bucket_t;
+
+// Lives on the waiter's kernel stack while it sleeps
+typedef struct futex_waiter {
+    list_node_t node; // empty once woken
+    uint64_t key;
+    struct process *process;
+} futex_waiter_t;
+
+void futex_init();
+int futex_wait(uint32_t *uaddr, uint32_t val, const struct timespec *timeout);
+int futex_wake(uint32_t *uaddr, int count);
+int64_t kfutex(uint32_t *uaddr, int op, uint32_t val, const struct timespec *timeout);
+
+#endif
@@ -0,0 +1,63 @@
+#ifndef _HEAP_PROFILE_H
+#define _HEAP_PROFILE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+#include <device.h>
+
+// Whether allocation tracking is on at boot. Can be toggled at runtime by
+// writing "on" / "off" / "reset" to /dev/kheap.
+#define HEAP_PROFILE_DEFAULT false
+
+// Maximum number of live allocations tracked at once, must be a power of two
+#define HEAP_PROFILE_MAX_ALLOCS 4096
+// Maximum number of distinct call sites, must be a power of two
+#define HEAP_PROFILE_MAX_SITES 256
+// Size histogram buckets: [0, 16), [16, 32), ... , [2^(n+3), inf)
+#define HEAP_PROFILE_BUCKETS 18
+
+typedef struct {
+    uint64_t ptr;
+    uint64_t size;
+    uint64_t caller;
+    uint64_t timestamp;
+    void *owner;
+    pid_t pid;
+} heap_profile_alloc_t;
+
+typedef struct {
+    uint64_t caller;
+    uint64_t live_bytes;
+    uint64_t live_count;
+    uint64_t total_count;
+    uint64_t peak_bytes;
+} heap_profile_site_t;
+
+typedef void (*heap_profile_emit_t)(const char *str, void *ctx);
+
+extern volatile bool heap_profile_enabled;
+
+void heap_profile_record_alloc(void *ptr, uint64_t size, uint64_t caller);
+void heap_profile_record_free(void *ptr);
+void heap_profile_set_enabled(bool enabled);
+void heap_profile_reset();
+void heap_profile_report(heap_profile_emit_t emit, void *ctx);
+void heap_profile_report_serial();
+void heap_profile_init();
+
+// Hooks for the allocator; these cost a single branch when profiling is off
+#define HEAP_PROFILE_ALLOC(ptr, size) do { \
+    if (heap_profile_enabled) { \
+        heap_profile_record_alloc((ptr), (size), (uint64_t)__builtin_return_address(0)); \
+    } \
+} while (0)
+
+#define HEAP_PROFILE_FREE(ptr) do { \
+    if (heap_profile_enabled) { \
+        heap_profile_record_free((ptr)); \
+    } \
+} while (0)
+
+#endif
@@ -0,0 +1,47 @@
+#ifndef _KTIMER_H
+#define _KTIMER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <lib/list.h>
+
+// Hierarchical timer wheel. Level 0 has one slot per tick; each level above
+// covers KTIMER_SLOTS times the range of the one below, and its timers are
+// moved down ("cascaded") as their slot comes due. Adding and cancelling are
+// O(1), and a tick only touches the timers that are due plus, every
+// KTIMER_SLOTS ticks, one slot of the level above.
+#define KTIMER_LEVEL_BITS 6
+#define KTIMER_SLOTS (1 << KTIMER_LEVEL_BITS)
+#define KTIMER_SLOT_MASK (KTIMER_SLOTS - 1)
+#define KTIMER_LEVELS 4
+// Timers further out than this sit in the last level and are re-queued
+#define KTIMER_MAX_DELTA ((1ULL << (KTIMER_LEVEL_BITS * KTIMER_LEVELS)) - 1)
+
+// Returned by ktimer_next_expiry() when no timers are pending
+#define KTIMER_NONE UINT64_MAX
+
+struct ktimer;
+typedef void (*ktimer_fn_t)(struct ktimer *timer);
+
+typedef struct ktimer {
+    list_node_t node; // empty while not pending
+    uint64_t expires; // in timer ticks
+    ktimer_fn_t function;
+} ktimer_t;
+
+// Called from the timer softirq, so must not block. Embed
+// the ktimer_t in a larger struct and use container_of to get at its state.
+void ktimer_init(ktimer_t *timer, ktimer_fn_t function);
+void ktimer_add(ktimer_t *timer, uint64_t expires);
+void ktimer_mod(ktimer_t *timer, uint64_t expires);
+bool ktimer_cancel(ktimer_t *timer);
+void ktimer_run(uint64_t now);
+uint64_t ktimer_next_expiry();
+
+static inline bool ktimer_pending(ktimer_t *timer)
+{
+    return !list_empty(&timer->node);
+}
+
+#endif
@@ -0,0 +1,280 @@
+#ifndef _LOCK_H
+#define _LOCK_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <system.h>
+#include <preempt.h>
+
+/*
+ * Spinlocks, ticket locks, reader-writer locks and seqlocks. Holding any of
+ * them disables preemption, so cond_resched() and the syscall return path
+ * won't switch away from a process that holds one. Locks that IRQ handlers
+ * also take must be taken with the _irqsave variants everywhere else.
+ *
+ * Every lock carries a lock_stats_t. Collecting statistics is off by default
+ * and costs one branch per acquire and release while off; it's toggled and
+ * read through /dev/klock. Statistics are kept per lock name rather than per
+ * lock, so all the locks of one kind (every pipe's wait queue, say) add up.
+ */
+
+// Whether lock statistics are collected at boot
+#define LOCK_STATS_DEFAULT false
+
+// Maximum number of distinct lock names tracked, must be a power of two
+#define LOCK_STATS_MAX_CLASSES 128
+
+typedef struct {
+    const char *name;
+    uint64_t acquisitions;
+    uint64_t contentions; // acquisitions that had to wait
+    uint64_t wait_cycles;
+    uint64_t hold_cycles;
+    uint64_t max_hold_cycles;
+} lock_class_t;
+
+typedef struct {
+    const char *name;
+    uint64_t acquired_at; // TSC when last taken, for the hold time
+} lock_stats_t;
+
+#define LOCK_STATS_INIT(lock_name) { (lock_name), 0 }
+
+typedef void (*lock_stats_emit_t)(const char *str, void *ctx);
+
+extern volatile bool lock_stats_enabled;
+
+void lock_stats_acquired(lock_stats_t *stats, uint64_t wait_start);
+void lock_stats_released(lock_stats_t *stats);
+void lock_stats_set_enabled(bool enabled);
+void lock_stats_reset();
+void lock_stats_report(lock_stats_emit_t emit, void *ctx);
+void lock_stats_init();
+
+static inline void lock_stats_init_lock(lock_stats_t *stats, const char *name)
+{
+    stats->name = name;
+    stats->acquired_at = 0;
+}
+
+static inline uint64_t lock_rdtsc()
+{
+    uint32_t low, high;
+    ASM_RDTSC(low, high);
+    return ((uint64_t)high << 32) | low;
+}
+
+// wait_start is 0 for an uncontended acquire
+#define LOCK_STATS_ACQUIRED(stats, wait_start) do { \
+    if (lock_stats_enabled) { \
+        lock_stats_acquired((stats), (wait_start)); \
+    } \
+} while (0)
+
+#define LOCK_STATS_RELEASED(stats) do { \
+    if (lock_stats_enabled) { \
+        lock_stats_released((stats)); \
+    } \
+} while (0)
+
+// Start timing a wait, only once it turns out the lock is contended
+#define LOCK_WAIT_START() (lock_stats_enabled ? lock_rdtsc() | 1 : 1)
+
+#define cpu_relax() asm volatile("pause" ::: "memory")
+
+/* Spinlocks: test and test-and-set, for short sections with little contention */
+
+typedef struct {
+    volatile uint32_t locked;
+    lock_stats_t stats;
+} spinlock_t;
+
+#define SPINLOCK_INIT(lock_name) { 0, LOCK_STATS_INIT(lock_name) }
+
+static inline void spin_lock_init(spinlock_t *lock, const char *name)
+{
+    lock->locked = 0;
+    lock_stats_init_lock(&lock->stats, name);
+}
+
+static inline bool spin_trylock(spinlock_t *lock)
+{
+    preempt_disable();
+    if (__atomic_exchange_n(&lock->locked, 1, __ATOMIC_ACQUIRE) == 0)
+    {
+        LOCK_STATS_ACQUIRED(&lock->stats, 0);
+        return true;
+    }
+    preempt_enable();
+    return false;
+}
+
+static inline void spin_lock(spinlock_t *lock)
+{
+    preempt_disable();
+    uint64_t wait_start = 0;
+    while (__atomic_exchange_n(&lock->locked, 1, __ATOMIC_ACQUIRE) != 0)
+    {
+        if (wait_start == 0)
+        {
+            wait_start = LOCK_WAIT_START();
+        }
+        while (lock->locked)
+        {
+            cpu_relax();
+        }
+    }
+    LOCK_STATS_ACQUIRED(&lock->stats, wait_start);
+}
+
+static inline void spin_unlock(spinlock_t *lock)
+{
+    LOCK_STATS_RELEASED(&lock->stats);
+    __atomic_store_n(&lock->locked, 0, __ATOMIC_RELEASE);
+    preempt_enable();
+}
+
+static inline bool spin_is_locked(spinlock_t *lock)
+{
+    return lock->locked != 0;
+}
+
+#define spin_lock_irqsave(lock, flags) do { \
+    ASM_SAVE_FLAGS_CLI(flags); \
+    spin_lock(lock); \
+} while (0)
+
+#define spin_unlock_irqrestore(lock, flags) do { \
+    spin_unlock(lock); \
+    ASM_RESTORE_FLAGS(flags); \
+} while (0)
+
+/* Ticket locks: waiters get the lock in the order they asked for it */
+
+typedef struct {
+    volatile uint32_t next;
+    volatile uint32_t owner;
+    lock_stats_t stats;
+} ticket_lock_t;
+
+#define TICKET_LOCK_INIT(lock_name) { 0, 0, LOCK_STATS_INIT(lock_name) }
+
+static inline void ticket_lock_init(ticket_lock_t *lock, const char *name)
+{
+    lock->next = 0;
+    lock->owner = 0;
+    lock_stats_init_lock(&lock->stats, name);
+}
+
+static inline void ticket_lock(ticket_lock_t *lock)
+{
+    preempt_disable();
+    uint32_t ticket = __atomic_fetch_add(&lock->next, 1, __ATOMIC_RELAXED);
+    uint64_t wait_start = 0;
+    if (__atomic_load_n(&lock->owner, __ATOMIC_ACQUIRE) != ticket)
+    {
+        wait_start = LOCK_WAIT_START();
+        while (__atomic_load_n(&lock->owner, __ATOMIC_ACQUIRE) != ticket)
+        {
+            cpu_relax();
+        }
+    }
+    LOCK_STATS_ACQUIRED(&lock->stats, wait_start);
+}
+
+static inline void ticket_unlock(ticket_lock_t *lock)
+{
+    LOCK_STATS_RELEASED(&lock->stats);
+    // only the holder writes owner
+    __atomic_store_n(&lock->owner, lock->owner + 1, __ATOMIC_RELEASE);
+    preempt_enable();
+}
+
+#define ticket_lock_irqsave(lock, flags) do { \
+    ASM_SAVE_FLAGS_CLI(flags); \
+    ticket_lock(lock); \
+} while (0)
+
+#define ticket_unlock_irqrestore(lock, flags) do { \
+    ticket_unlock(lock); \
+    ASM_RESTORE_FLAGS(flags); \
+} while (0)
+
+/*
+ * Reader-writer locks, for tables that are read far more often than
+ * changed. A waiting writer holds off new readers, so it can't starve.
+ */
+
+#define RWLOCK_WRITER 0x80000000
+#define RWLOCK_WRITER_WAITING 0x40000000
+#define RWLOCK_READERS 0x3FFFFFFF
+
+typedef struct {
+    volatile uint32_t state; // reader count, plus the writer bits
+    lock_stats_t stats;
+} rwlock_t;
+
+#define RWLOCK_INIT(lock_name) { 0, LOCK_STATS_INIT(lock_name) }
+
+void rwlock_init(rwlock_t *lock, const char *name);
+void read_lock(rwlock_t *lock);
+void read_unlock(rwlock_t *lock);
+void write_lock(rwlock_t *lock);
+void write_unlock(rwlock_t *lock);
+
+/*
+ * Seqlocks, for small data read often and written rarely. Readers don't
+ * write anything shared; they retry if a writer got in while they were
+ * reading:
+ *
+ *     uint32_t seq;
+ *     do {
+ *         seq = read_seqbegin(&lock);
+ *         ... copy the data ...
+ *     } while (read_seqretry(&lock, seq));
+ */
+
+typedef struct {
+    volatile uint32_t sequence; // odd while a write is in progress
+    spinlock_t lock; // serialises writers
+} seqlock_t;
+
+#define SEQLOCK_INIT(lock_name) { 0, SPINLOCK_INIT(lock_name) }
+
+static inline void seqlock_init(seqlock_t *lock, const char *name)
+{
+    lock->sequence = 0;
+    spin_lock_init(&lock->lock, name);
+}
+
+static inline uint32_t read_seqbegin(seqlock_t *lock)
+{
+    uint32_t sequence;
+    while ((sequence = __atomic_load_n(&lock->sequence, __ATOMIC_ACQUIRE)) & 1)
+    {
+        cpu_relax();
+    }
+    return sequence;
+}
+
+static inline bool read_seqretry(seqlock_t *lock, uint32_t sequence)
+{
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return lock->sequence != sequence;
+}
+
+// Readers on the same CPU would spin forever on a writer they interrupted,
+// so writers keep interrupts off
+#define write_seqlock_irqsave(seqlock, flags) do { \
+    spin_lock_irqsave(&(seqlock)->lock, flags); \
+    __atomic_store_n(&(seqlock)->sequence, (seqlock)->sequence + 1, __ATOMIC_RELAXED); \
+    __atomic_thread_fence(__ATOMIC_RELEASE); \
+} while (0)
+
+#define write_sequnlock_irqrestore(seqlock, flags) do { \
+    __atomic_store_n(&(seqlock)->sequence, (seqlock)->sequence + 1, __ATOMIC_RELEASE); \
+    spin_unlock_irqrestore(&(seqlock)->lock, flags); \
+} while (0)
+
+#endif
@@ -4,6 +4,8 @@
 #include <stdint.h>
 #include <stdbool.h>
 
+#include <percpu.h>
+
 #define INIT_HEAP_PAGES 512
 
 typedef struct heap_header
@@ -33,11 +35,12 @@ typedef struct {
     uint64_t pt_entry[512];
 } __attribute__((packed)) page_table_t;
 
-typedef struct {
+typedef struct page_directory {
     uint64_t entries[512];
     uint64_t virt[512]; //virtual addresses of the page tables
     bool is_full[512];
     uint64_t phys_addr;
+    struct page_directory *reclaim_next; // on the reclaim list once its process has exited
 } __attribute__((packed)) page_directory_t;
 
 typedef struct usable_memory_region
@@ -49,6 +52,31 @@ typedef struct usable_memory_region
 
 #define HEAP_MAGIC 0xFEAF2004
 
+// Kernel stacks live in their own area of kernel space, one fixed-size slot
+// per stack. Only the top of each slot is mapped, so the unmapped pages below
+// act as a guard against overflow.
+#define KSTACK_AREA_START 0xFFFFFFFF00000000
+#define KSTACK_SLOT_SIZE 0x10000
+#define KSTACK_MAX_SLOTS 4096
+#define KSTACK_MAX_PAGES ((KSTACK_SLOT_SIZE / 0x1000) - 1)
+
+// Device registers are mapped uncached here, see kmap_mmio()
+#define MMIO_AREA_START 0xFFFFFFFFC0000000
+#define MMIO_AREA_SIZE 0x20000000
+
+#define PAGE_PWT (1 << 3) // write-through
+#define PAGE_PCD (1 << 4) // cache disable
+// Bits the MMU leaves to software, for pages borrowed from a process
+// template (see template.h) or the executable cache (see exec_cache.h).
+// Those own them, so they're never freed with the address space mapping
+// them.
+#define PAGE_TEMPLATE (1 << 9)
+#define PAGE_COW (1 << 10) // read-only until the first write copies it
+
+// Makes supervisor writes honour read-only pages, so the kernel writing
+// to user memory also copies copy-on-write pages
+#define CR0_WP (1 << 16)
+
 void memory_init(uint64_t old_kheap_end, uint64_t mmap_tag_addr, uint64_t framebuffer_tag_addr);
 void *kmalloc(uint64_t size);
 void *kmalloc_a(uint64_t size);
@@ -59,11 +87,20 @@ void kfree_a(void *ptr);
 void heap_dump_serial();
 page_table_entry_t first_free_page();
 uint64_t first_free_page_addr();
+uint64_t page_frame_alloc();
+void page_frame_free(uint64_t phys);
+uint64_t free_page_count();
 bool map_page_kmalloc(uint64_t virt, uint64_t phys, bool is_kernel, bool is_writeable, page_directory_t *pml4_root);
+bool map_page_borrowed(uint64_t virt, uint64_t phys, bool is_writeable, page_directory_t *pml4_root);
 page_directory_t *clone_page_directory(page_directory_t *directory);
+page_directory_t *share_page_directory(page_directory_t *directory);
+bool page_cow_break(uint64_t virt, page_directory_t *pd);
 int64_t heap_free_space();
+int64_t heap_largest_free_block();
 void switch_page_directory(page_directory_t *directory);
 void free_page_directory(page_directory_t *directory);
+void free_page_directory_deferred(page_directory_t *directory);
+void reclaim_init();
 uint64_t virt_to_phys(uint64_t virt, page_directory_t *pd);
 void free_page(uint64_t virt, page_directory_t *pd);
 int memory_set_protection(void *addr, uint64_t length, uint64_t prot);
@@ -73,8 +110,15 @@ uint64_t first_free_n_consecutive_addr(uint32_t n);
 void serial_dump_mappings(page_directory_t *pml4, bool include_kernel);
 bool is_mapped_user(uint64_t virt, page_directory_t *pd);
 bool is_mapped_user_range(uint64_t start, uint64_t length, page_directory_t *pd);
+void *kstack_alloc(uint32_t pages);
+void kstack_free(void *stack, uint32_t pages);
+void *kmap_mmio(uint64_t phys, uint64_t size);
+void kmap_identity(uint64_t phys);
+void kunmap_identity();
 
-extern page_directory_t *current_pml4;
 extern page_directory_t *kernel_pml4;
 
+// Address space the CPU is running in
+#define current_pml4 (percpu()->pml4)
+
 #endif
\ No newline at end of file
@@ -0,0 +1,67 @@
+#ifndef _PERCPU_H
+#define _PERCPU_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <system.h>
+#include <filesystem.h>
+
+// GS base while in the kernel, swapped with KERNEL_GS_BASE by swapgs
+#define MSR_GS_BASE 0xC0000101
+#define MSR_KERNEL_GS_BASE 0xC0000102
+
+// Offsets the entry code in tables.asm uses, checked against percpu_t in smp.c
+#define PERCPU_SELF 0x00
+#define PERCPU_PROCESS 0x08
+#define PERCPU_USER_RSP 0x10
+#define PERCPU_SYSCALL_STACK_TOP 0x18
+
+struct process;
+struct page_directory;
+
+// Event counts for instrumentation. Only the owning CPU writes them, so a
+// plain increment is enough; readers summing across CPUs may see them a
+// little out of date.
+typedef struct {
+    uint64_t syscalls;
+    uint64_t irqs;
+    uint64_t faults;
+    uint64_t context_switches;
+} percpu_stats_t;
+
+// Per-CPU state reached through GS. Lives at the start of each cpu_t.
+typedef struct percpu {
+    struct percpu *self;
+    volatile struct process *process; // current_process
+    uint64_t user_rsp; // user RSP while a syscall is being entered or left
+    uint64_t syscall_stack_top; // top of the current process' syscall_stack
+    struct page_directory *pml4; // current_pml4
+    void *temp_stack; // bottom of the stack exiting processes free themselves on
+    uint32_t preempt_count; // nonzero while this CPU mustn't switch processes
+    uint32_t softirq_pending; // bitmap of SOFTIRQ_* raised by IRQ handlers
+    volatile uint32_t need_resched; // switch processes at the next preemption point, see preempt.h
+    percpu_stats_t stats;
+    char resolution_buffer[PATH_MAX];
+} percpu_t;
+
+/**
+ * @return The per-CPU area of the CPU this code is running on
+ */
+static inline percpu_t *percpu()
+{
+    percpu_t *self;
+    asm volatile("mov %%gs:0, %0" : "=r"(self));
+    return self;
+}
+
+// Bump a counter in percpu_t.stats without a lock prefix or a GS base load
+#define percpu_stat_inc(field) \
+    asm volatile("incq %%gs:%c0" :: "i"(offsetof(percpu_t, stats.field)))
+
+#define percpu_stat_sum(field) percpu_stat_total(offsetof(percpu_t, stats.field))
+
+void percpu_init(percpu_t *area, void *temp_stack);
+uint64_t percpu_stat_total(size_t offset);
+
+#endif
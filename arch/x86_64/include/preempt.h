@@ -0,0 +1,54 @@
+#ifndef _PREEMPT_H
+#define _PREEMPT_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include <percpu.h>
+
+/*
+ * Syscalls run with interrupts enabled. IRQ handlers only do the part that
+ * can't wait (acknowledging the device, grabbing its data) and raise a
+ * softirq for the rest, which runs at the next preemption point: leaving an
+ * IRQ taken from user mode or the idle process, returning from a syscall,
+ * or a cond_resched() call in a long kernel loop. Everything but the hard
+ * handlers therefore runs in process context on this CPU, so kernel code
+ * between preemption points needs no further protection from interrupts.
+ *
+ * preempt_disable() stops preemption points from switching processes or
+ * running softirqs, for short sections that keep per-CPU state in use
+ * across a call that may contain one. They nest.
+ */
+#define preempt_disable() \
+    asm volatile("incl %%gs:%c0" :: "i"(offsetof(percpu_t, preempt_count)) : "memory")
+#define preempt_enable() \
+    asm volatile("decl %%gs:%c0" :: "i"(offsetof(percpu_t, preempt_count)) : "memory")
+
+static inline uint32_t preempt_count()
+{
+    uint32_t count;
+    asm volatile("movl %%gs:%c1, %0" : "=r"(count) : "i"(offsetof(percpu_t, preempt_count)));
+    return count;
+}
+
+/*
+ * need_resched() is set when something more important than the current
+ * process becomes runnable on this CPU, or its time slice runs out. Each
+ * CPU has its own, so one CPU switching can't swallow another's request.
+ */
+static inline bool need_resched()
+{
+    uint32_t resched;
+    asm volatile("movl %%gs:%c1, %0" : "=r"(resched) : "i"(offsetof(percpu_t, need_resched)));
+    return resched != 0;
+}
+
+#define set_need_resched() \
+    asm volatile("movl $1, %%gs:%c0" :: "i"(offsetof(percpu_t, need_resched)) : "memory")
+#define clear_need_resched() \
+    asm volatile("movl $0, %%gs:%c0" :: "i"(offsetof(percpu_t, need_resched)) : "memory")
+
+bool cond_resched();
+
+#endif
@@ -8,19 +8,83 @@
 #include <memory.h>
 #include <system.h>
 #include <filesystem.h>
+#include <lib/hashtable.h>
+#include <lib/list.h>
+#include <waitqueue.h>
+#include <ktimer.h>
+#include <fpu.h>
+#include <workqueue.h>
 
 #define PROCESS_INITIAL_STACK 0x10000
 #define MAX_STACK_SIZE 0x100000
 
+// mmap() hands out addresses upwards from USER_MMAP_BASE, plus a random
+// number of pages below USER_MMAP_RANDOM_PAGES, and never past USER_MMAP_END
+#define USER_MMAP_BASE 0x00007F0000000000
+#define USER_MMAP_RANDOM_PAGES 0x100000
+#define USER_MMAP_END 0x0000800000000000
+
+// PIDs are handed out from [0, PID_MAX), must be a multiple of 64
+#define PID_MAX 32768
+
+// Multilevel feedback scheduler. Level 0 runs first; a process that uses
+// its whole time slice drops a level, one that sleeps before then climbs
+// back up. Lower levels get longer slices.
+#define SCHED_LEVELS 8
+// in scheduler quanta, see timer_set_quantum()
+#define SCHED_TIMESLICE(level) (1 << ((level) / 2))
+// Every process goes back to its base level this often, so nothing starves
+#define SCHED_BOOST_MS 100
+// The highest level a process with the given nice value may reach
+#define SCHED_BASE_LEVEL(nice) (((nice) + 20) * SCHED_LEVELS / 40)
+
+#define NICE_MIN -20
+#define NICE_MAX 19
+
+#define PRIO_PROCESS 0
+#define PRIO_PGRP 1
+#define PRIO_USER 2
+
 #define TASK_RUNNING 0
 #define TASK_STOPPED 1
 #define TASK_INITIAL 2
 #define TASK_FORKED 3
 #define TASK_EXITED 4
 #define TASK_WAITING 5
-
-#define WNOHANG 0b1;
-#define WCONTINUED 0b10;
+#define TASK_BLOCKED 6 // sleeping on a wait queue, skipped by the scheduler
+
+// wait4() options, as newlib and Linux define them
+#define WNOHANG 1
+#define WUNTRACED 2
+#define WCONTINUED 8
+
+// A stop or continue a child's parent hasn't collected with wait4() yet
+#define WAIT_REPORT_NONE 0
+#define WAIT_REPORT_STOPPED 1
+#define WAIT_REPORT_CONTINUED 2
+
+// Orphans are handed to init
+#define INIT_PID 1
+
+// clone() flags, as Linux numbers them. The low byte is the signal the
+// parent gets when the child exits, 0 for none.
+#define CLONE_SIGNAL_MASK 0x000000FF
+#define CLONE_VM 0x00000100
+#define CLONE_FS 0x00000200
+#define CLONE_FILES 0x00000400
+#define CLONE_SIGHAND 0x00000800
+#define CLONE_THREAD 0x00010000
+#define CLONE_SETTLS 0x00080000
+#define CLONE_PARENT_SETTID 0x00100000
+#define CLONE_CHILD_CLEARTID 0x00200000
+#define CLONE_CHILD_SETTID 0x01000000
+
+// arch_prctl() codes
+#define ARCH_SET_FS 0x1002
+#define ARCH_GET_FS 0x1003
+
+// Base of FS, which userspace keeps its thread pointer in
+#define MSR_FS_BASE 0xC0000100
 
 /*
 
@@ -112,39 +176,116 @@ union wait
 
 #define SEGV_MAPERR 1
 
-typedef struct signal {
-    regs_t registers; // return context for when the signal is handled
-
-    int signal_number;
-    int signal_error;
-    int signal_code;
-
-    pid_t sender_pid;
-    uid_t sender_uid;
-
-    void *fault_address;
-
-    regs_t syscall_registers;
-    regs_t interrupt_registers;
-    void *syscall_stack;
-    // The TSS stack is only used during interrupts, which should not re-enable interrupts during the handler.
-    // As such, at present, it need not be copied during a signal call.
-    uint64_t syscall_rsp;
-
-    bool handled;
-    bool was_in_syscall;
-
-    struct signal *next;
-} signal_t;
+// signal_code of SIGCHLD
+#define CLD_EXITED 1
+#define CLD_KILLED 2
+#define CLD_STOPPED 5
+#define CLD_CONTINUED 6
 
+// Signal sets, with newlib's layout: signal n is bit n
 typedef unsigned long sigset_t;
 
+#define SIGNAL_BIT(signum) (1UL << (signum))
+// Can't be caught, ignored or blocked
+#define SIGNAL_UNBLOCKABLE (SIGNAL_BIT(SIGKILL) | SIGNAL_BIT(SIGSTOP))
+
+// sigprocmask() how, as newlib numbers them
+#define SIG_SETMASK 0
+#define SIG_BLOCK 1
+#define SIG_UNBLOCK 2
+
+#define SIG_DFL ((void *)0)
+#define SIG_IGN ((void *)1)
+
+// No SIGCHLD when a child stops or continues
+#define SA_NOCLDSTOP 1
+// Children are reaped as they exit, rather than left for wait4()
+#define SA_NOCLDWAIT 2
+
+// What a handler's second argument points to. Standard signals don't
+// queue: while one is pending, sending it again only replaces this.
+typedef struct siginfo {
+    int si_signo;
+    int si_errno;
+    int si_code;
+    pid_t si_pid;
+    uid_t si_uid;
+    void *si_addr; // the faulting address, for SIGSEGV
+} siginfo_t;
+
 struct sigaction {
-    void (*signal_handler)(int, signal_t *, void *);
+    void (*signal_handler)(int, siginfo_t *, void *);
     sigset_t sa_mask;
     int sa_flags;
 } __attribute__((packed));
 
+// What a handler interrupted, its third argument. rt_sigreturn() resumes
+// from it, so a handler may change where the process carries on.
+typedef struct signal_context {
+    regs_t registers;
+    sigset_t mask; // blocked signals to go back to
+    void *fpu_state; // FPU/SSE/AVX registers, fpu_state_size bytes, NULL to reset them
+} signal_context_t;
+
+// Pushed on the user stack to run a handler, which returns into the
+// trampoline and from there calls rt_sigreturn(). The FPU registers go in
+// a save area just above it, FPU_STATE_ALIGN aligned, so handlers may use
+// them freely.
+typedef struct signal_frame {
+    uint64_t return_address; // the trampoline
+    siginfo_t info;
+    signal_context_t context;
+    uint8_t trampoline[8];
+} signal_frame_t;
+
+// Signal dispositions, shared by processes cloned with CLONE_SIGHAND
+typedef struct sighand {
+    uint64_t refcount; // changed atomically, holders may run on any CPU
+    struct sigaction actions[SIG_MAX];
+} sighand_t;
+
+#define RUSAGE_SELF 0
+#define RUSAGE_CHILDREN -1
+
+struct rusage {
+    struct timeval ru_utime;
+    struct timeval ru_stime;
+    long ru_maxrss; // in KB
+    long ru_ixrss;
+    long ru_idrss;
+    long ru_isrss;
+    long ru_minflt;
+    long ru_majflt;
+    long ru_nswap;
+    long ru_inblock;
+    long ru_oublock;
+    long ru_msgsnd;
+    long ru_msgrcv;
+    long ru_nsignals;
+    long ru_nvcsw;
+    long ru_nivcsw;
+};
+
+// times() counts in these, newlib's CLOCKS_PER_SEC
+#define TIMES_HZ 1000
+
+struct tms {
+    uint64_t tms_utime;
+    uint64_t tms_stime;
+    uint64_t tms_cutime;
+    uint64_t tms_cstime;
+};
+
+// Resource usage of a process, or the total of its reaped children
+typedef struct process_usage {
+    uint64_t utime_ns;
+    uint64_t stime_ns;
+    uint64_t nvcsw;
+    uint64_t nivcsw;
+    uint64_t minflt;
+    uint64_t maxrss_pages;
+} process_usage_t;
+
 typedef struct memregion {
     uint64_t start;
     uint64_t end;
@@ -152,71 +293,197 @@ typedef struct memregion {
     struct memregion *next;
 } memregion_t;
 
+// A user address space: its page tables, and where page faults may map
+// fresh pages. Shared by processes cloned with CLONE_VM; the last one to
+// exit or exec frees it.
+typedef struct address_space {
+    uint64_t refcount; // changed atomically, holders may run on any CPU
+    page_directory_t *pml4;
+    memregion_t *regions;
+    uint64_t brk; // end of the heap
+    uint64_t stack_low;
+    struct process_template *template; // whose pages it maps copy-on-write, see template.h
+    struct exec_image_ref *images; // whose prepared pages it maps, see exec_cache.h
+    uint64_t mmap_next; // where mmap() looks for room next
+} address_space_t;
+
 typedef struct process {
     pid_t pid; // Process ID
     gid_t gid; // Group ID
-    gid_t pgid; // Parent Group ID
+    gid_t pgid; // Process group ID, inherited, see ksetpgid()
     pid_t ppid; // Parent Process ID
     uid_t uid; // User ID
     uid_t euid; // Effective User ID
     uid_t fsuid; // Filesystem User ID
     uid_t egid; // Effective Group ID
     uid_t fsgid; // Filesystem Group ID
-    page_directory_t *pml4;
+    page_directory_t *pml4; // vm->pml4, or kernel_pml4 without a vm
+    address_space_t *vm; // NULL for kernel threads and idle processes
 
-    uint32_t status;
+    volatile uint32_t status;
 
-    void *entry;
+    void *entry; // kthread_fn_t for kernel threads
+    bool kthread; // runs only kernel code, see kthread_create()
+    void *kthread_arg;
+    const char *name; // kernel threads only, for logging
 
-    uint64_t rsp, rbp;
+    uint64_t rsp, rbp; // initial user stack
+    uint64_t kernel_rsp; // saved by switch_to() while switched out
 
     union wait exit_status;
 
-    void *tss_stack;
+    void *tss_stack; // page-backed, see kstack_alloc()
     uint64_t syscall_rsp;
-    void *syscall_stack;
+    void *syscall_stack; // page-backed, see kstack_alloc()
     uint64_t user_rsp;
     bool in_syscall;
-    bool in_signal_handler;
 
     regs_t syscall_registers;
-    regs_t interrupt_registers;
-    xmm_regs_t syscall_xmm_registers;
-    xmm_regs_t interrupt_xmm_registers;
-
-    file_descriptor_t *file_descriptors;
-    char pwd[PATH_MAX];
-
-    signal_t *queued_signals;
-    struct sigaction signal_handlers[SIG_MAX];
-    sigset_t signal_mask;
-
-    uint64_t stack_low;
-    uint64_t brk_start;
-
-    memregion_t *memory_regions;
-
-    struct process *next;
-    struct process *queue_next;
+    regs_t *interrupt_frame; // on tss_stack, from the last interrupt out of user mode
+    void *fpu_state; // FPU/SSE/AVX save area, see fpu.c
+    uint32_t fpu_cpu; // CPU whose registers hold fpu_state, or FPU_NO_CPU
+
+    file_table_t *files;
+    path_ref_t *pwd; // shared with forked children until either changes directory
+
+    sighand_t *sighand; // NULL while all handlers are default and it's not shared
+    sigset_t signal_mask; // blocked, never includes SIGNAL_UNBLOCKABLE
+    volatile sigset_t pending_signals; // sent but not delivered, changed atomically
+    siginfo_t signal_info[SIG_MAX]; // for each pending signal
+
+    uint64_t fs_base; // user thread pointer, see karch_prctl()
+    uint32_t personality; // see kpersonality(), kept across exec
+    pid_t *set_child_tid; // written with the PID as it first runs, see kclone()
+    uint32_t *clear_child_tid; // zeroed and woken as a futex on exit
+
+    hash_node_t pid_node; // entry in the PID table, keyed by pid
+    list_node_t list_node; // entry in process_list
+    struct process *parent;
+    list_node_t children; // list of child processes, linked through sibling
+    list_node_t sibling;
+    list_node_t zombies; // exited children not reaped yet, in the order they exited
+    list_node_t zombie_node; // entry in the parent's zombies
+    work_t reap_work; // frees it once exited, if its parent doesn't wait for it
+    wait_queue_t child_wait; // woken when a child exits, stops or continues
+    uint8_t wait_report; // WAIT_REPORT_*, for the parent's wait4()
+    uint8_t stop_signal; // what stopped it, while TASK_STOPPED
+    uint8_t exit_signal; // sent to the parent on exit, SIGCHLD unless clone() said otherwise
+
+    int8_t nice;
+    uint8_t sched_level; // current feedback level, never above SCHED_BASE_LEVEL(nice)
+    uint32_t timeslice; // ticks left before being demoted
+    list_node_t run_node; // entry in the runqueue, empty while not queued
+    uint32_t cpu; // index of the CPU whose runqueue it goes on
+    volatile bool on_cpu; // running, or still being switched away from
+
+    // interval timers, see ksetitimer(); all in timer ticks
+    // resource accounting, see process_get_usage()
+    uint64_t runtime_ns; // time on a CPU, measured at every switch
+    uint64_t switched_in_at; // clock_monotonic_ns() when it last got a CPU
+    uint64_t user_ticks; // timer ticks that found it in user mode, to split runtime_ns
+    uint64_t system_ticks; // and in the kernel
+    uint64_t nvcsw; // gave up the CPU to sleep, stop or exit
+    uint64_t nivcsw; // preempted, or yielded while still runnable
+    uint64_t minflt; // page faults satisfied by mapping a page
+    uint64_t rss_pages; // user pages mapped
+    uint64_t maxrss_pages;
+    process_usage_t children_usage; // reaped children, and what they reaped
+
+    ktimer_t itimer_real;
+    uint64_t itimer_real_interval;
+    uint64_t itimer_virtual;
+    uint64_t itimer_virtual_interval;
+    uint64_t itimer_prof;
+    uint64_t itimer_prof_interval;
 } process_t;
 
-process_t *create_process(void *entry, uint64_t stack_size, page_directory_t *pml4, bool has_stack, memregion_t *regions);
+// One FIFO per scheduler level, plus a bitmap of the non-empty ones. Every
+// CPU has its own, see cpu_t.
+typedef struct runqueue {
+    list_node_t levels[SCHED_LEVELS];
+    uint32_t bitmap;
+    uint32_t nr_running;
+    ticket_lock_t lock; // other CPUs wake processes onto it and steal from it
+} runqueue_t;
+
+// Body of a kernel thread. Returning exits the thread with that status.
+typedef int (*kthread_fn_t)(void *arg);
+
+process_t *create_process(void *entry, uint64_t stack_size, address_space_t *vm, bool has_stack);
+address_space_t *address_space_create(page_directory_t *pml4, memregion_t *regions);
+address_space_t *address_space_get(address_space_t *vm);
+void address_space_put(address_space_t *vm, bool deferred);
+memregion_t *memregions_clone(memregion_t *regions);
+sighand_t *sighand_create(sighand_t *from);
+void sighand_put(sighand_t *sighand);
 void schedule();
+void preempt_schedule();
+void process_prepare_block();
+void process_cancel_block();
+void process_block();
+void process_wake(process_t *process);
+bool sched_tick();
+int process_yield();
+int process_getpriority(int which, int who);
+int process_setpriority(int which, int who, int prio);
+
 void process_init();
+process_t *process_create_idle(uint32_t cpu, void *stack);
+void process_free_idle(process_t *idle);
+process_t *kthread_create(kthread_fn_t fn, void *arg, const char *name, int8_t nice);
+void runqueue_init(runqueue_t *runqueue);
 void add_process(process_t *process);
+process_t *process_find(pid_t pid);
+int64_t ksetpgid(pid_t pid, pid_t pgid);
+pid_t pid_alloc();
+void pid_free(pid_t pid);
 int64_t kfork();
+int64_t kclone(uint64_t flags, uint64_t stack, pid_t *parent_tid, pid_t *child_tid, uint64_t tls);
+int64_t karch_prctl(int code, uint64_t addr);
+int64_t kset_tid_address(uint32_t *tidptr);
 int64_t kexecv();
 void process_exit(int status);
-int64_t process_wait(pid_t pid, void *status, int options, void *rstatus);
+int64_t process_wait(pid_t pid, void *status, int options, struct rusage *rusage);
 void process_exit_abnormal(union wait status);
 uint64_t kbrk(uint64_t increment);
+int64_t kmmap(uint64_t addr, uint64_t length, uint64_t prot, uint64_t flags, int64_t fd, int64_t offset);
+int64_t kmunmap(uint64_t addr, uint64_t length);
+int64_t kmprotect(uint64_t addr, uint64_t length, uint64_t prot);
 int64_t krt_sigaction(int signum, const struct sigaction *act, struct sigaction *oldact);
-void krt_sigret();
-void signal_process(pid_t pid, signal_t *signal);
+void __attribute__((noreturn)) krt_sigret();
+void signal_process(pid_t pid, const siginfo_t *info);
 int process_kill(pid_t pid, int signal);
-void check_signals(bool is_after_syscall);
+void __attribute__((noreturn)) process_exit_signal(int signum);
+void check_signals(regs_t *regs);
+void check_signals_after_syscall();
+void switch_to(uint64_t *prev_rsp, uint64_t next_rsp);
 int ksigprocmask(int how, const sigset_t *set, sigset_t *oldset);
+void *process_signal_handler(process_t *process, int signum);
+
+// Process running on this CPU
+#define current_process (percpu()->process)
 
-extern volatile process_t *current_process;
+// Whether a process has a signal it hasn't blocked waiting to be delivered,
+// which interruptible sleeps give up for
+static inline bool signal_pending(process_t *process)
+{
+    return (process->pending_signals & ~process->signal_mask) != 0;
+}
+
+void process_account_tick();
+void process_get_usage(process_t *process, process_usage_t *usage);
+int kgetrusage(int who, struct rusage *usage);
+int64_t ktimes(struct tms *buf);
+
+// Account for user pages mapped into (or with a negative count, removed
+// from) a process' address space
+static inline void process_rss_add(process_t *process, int64_t pages)
+{
+    process->rss_pages += pages;
+    if (process->rss_pages > process->maxrss_pages)
+    {
+        process->maxrss_pages = process->rss_pages;
+    }
+}
 
 #endif
\ No newline at end of file
@@ -7,6 +7,9 @@
 #define FILE_ENTRY 0xBAE7
 #define DIR_ENTRY 0x7EAB
 
+// Reads are copied this much at a time, with preemption points in between
+#define RAMDISK_READ_CHUNK 0x10000
+
 typedef struct
 {
     uint16_t magic;
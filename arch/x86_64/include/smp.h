@@ -0,0 +1,58 @@
+#ifndef _SMP_H
+#define _SMP_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <system.h>
+#include <percpu.h>
+#include <tables.h>
+#include <process.h>
+
+// Physical address APs start executing at, must be page aligned and below 1MB
+#define SMP_TRAMPOLINE_ADDR 0x8000
+
+// How long to wait for an AP to report in before giving up on it
+#define SMP_AP_TIMEOUT_US 100000
+
+typedef struct cpu {
+    percpu_t percpu; // must come first, GS points here
+    uint32_t id; // index into cpus
+    uint32_t apic_id;
+    volatile bool online; // running kernel code
+    volatile bool schedulable; // takes processes from the scheduler
+    tss_entry_t *tss;
+    uint16_t tss_selector;
+    void *stack; // bottom of the stack the CPU boots and idles on
+    process_t *idle;
+    process_t *fpu_owner; // last process to load the FPU registers here
+    process_t *switched_from; // until the next process has finished switching in
+    runqueue_t runqueue;
+} cpu_t;
+
+// Layout of smp_trampoline_params in smp.asm
+typedef struct {
+    uint32_t cr3;
+    uint32_t cr4;
+    uint32_t cr0;
+    uint32_t efer;
+    uint64_t stack;
+    uint64_t entry;
+    uint64_t cpu;
+} __attribute__((packed)) smp_trampoline_params_t;
+
+extern cpu_t cpus[SMP_MAX_CPUS];
+extern uint32_t cpu_count;
+
+/**
+ * @return The CPU this code is running on
+ */
+static inline cpu_t *this_cpu()
+{
+    return (cpu_t *)percpu();
+}
+
+void smp_init_bsp();
+void smp_init();
+
+#endif
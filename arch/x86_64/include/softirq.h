@@ -0,0 +1,29 @@
+#ifndef _SOFTIRQ_H
+#define _SOFTIRQ_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <percpu.h>
+
+// Deferred halves of IRQ handlers, run in priority order, see preempt.h
+#define SOFTIRQ_TIMER 0
+#define SOFTIRQ_KEYBOARD 1
+#define SOFTIRQ_MAX 2
+
+typedef void (*softirq_fn_t)();
+
+/**
+ * Mark a softirq pending on this CPU. Safe from hard IRQ handlers.
+ *
+ * @param nr The SOFTIRQ_* to run
+ */
+static inline void softirq_raise(uint32_t nr)
+{
+    asm volatile("orl %0, %%gs:%c1" :: "r"(1U << nr), "i"(offsetof(percpu_t, softirq_pending)) : "memory");
+}
+
+void softirq_register(uint32_t nr, softirq_fn_t handler);
+void softirq_run();
+
+#endif
@@ -5,6 +5,19 @@
 
 #define VIRT_MEM_OFFSET 0xffffff8000000000
 
+// Upper bound on CPUs the kernel will bring up
+#define SMP_MAX_CPUS 16
+
+#define RFLAGS_TF (1 << 8)
+#define RFLAGS_IF (1 << 9)
+#define RFLAGS_DF (1 << 10)
+// Flags user mode may set for itself: CF, PF, AF, ZF, SF, TF, DF, OF and AC
+#define RFLAGS_USER 0x40DD5
+
+// Selectors of user mode, with RPL 3
+#define USER_DATA_SELECTOR 0x2B
+#define USER_CODE_SELECTOR 0x33
+
 #define BOCHS_BREAKPOINT asm volatile("xchgw %bx, %bx");
 
 typedef struct {
@@ -56,12 +69,24 @@ typedef struct {
 // Shouldn't be dangerous, but care be taken when using them
 #define ASM_DISABLE_INTERRUPTS asm volatile("cli");
 #define ASM_ENABLE_INTERRUPTS asm volatile("sti");
+// Disable interrupts, keeping RFLAGS to hand back to ASM_RESTORE_FLAGS
+#define ASM_SAVE_FLAGS_CLI(flags) asm volatile("pushfq; pop %0; cli" : "=r"(flags) :: "memory");
+#define ASM_RESTORE_FLAGS(flags) asm volatile("push %0; popfq" :: "r"(flags) : "memory", "cc");
+#define ASM_HLT asm volatile("hlt");
+// sti only takes effect after the next instruction, so no interrupt is missed in between
+#define ASM_SAFE_HALT asm volatile("sti; hlt");
 
 #define ASM_GET_CR2(reg) asm volatile("mov %%cr2, %0" : "=r"(reg));
 
+#define ASM_GET_CR0(reg) asm volatile("mov %%cr0, %0" : "=r"(reg));
+#define ASM_SET_CR0(reg) asm volatile("mov %0, %%cr0" ::"r"(reg));
+#define ASM_GET_CR4(reg) asm volatile("mov %%cr4, %0" : "=r"(reg));
+#define ASM_SET_CR4(reg) asm volatile("mov %0, %%cr4" ::"r"(reg));
 #define ASM_GET_CR3(reg) asm volatile("mov %%cr3, %0" : "=r"(reg));
 #define ASM_SET_CR3(reg) asm volatile("mov %0, %%cr3" ::"r"(reg));
 
+#define ASM_INVLPG(addr) asm volatile("invlpg (%0)" ::"r"(addr) : "memory");
+
 #define ASM_READ_RSP(reg) asm volatile("mov %%rsp, %0" : "=r"(reg));
 #define ASM_READ_RBP(reg) asm volatile("mov %%rbp, %0" : "=r"(reg));
 
@@ -77,7 +102,15 @@ typedef struct {
 #define ASM_INW(port, val) asm volatile("inw %1, %0" : "=a"(val) : "Nd"(port));
 
 #define ASM_WRMSR_ADC(a, d, c) asm volatile("wrmsr" :: "a"(a), "d"(d), "c"(c));
-#define ASM_RDMSR(msr, reg) asm volatile("rdmsr" : "=a"(reg) : "c"(msr));
+#define ASM_RDMSR(msr, reg) asm volatile("rdmsr" : "=a"(reg) : "c"(msr) : "rdx");
+#define ASM_RDMSR_ADC(a, d, c) asm volatile("rdmsr" : "=a"(a), "=d"(d) : "c"(c));
+
+#define ASM_RDTSC(low, high) asm volatile("rdtsc" : "=a"(low), "=d"(high));
+#define ASM_CPUID(leaf, a, b, c, d) asm volatile("cpuid" : "=a"(a), "=b"(b), "=c"(c), "=d"(d) : "a"(leaf), "c"(0));
+#define ASM_CPUID_SUB(leaf, sub, a, b, c, d) asm volatile("cpuid" : "=a"(a), "=b"(b), "=c"(c), "=d"(d) : "a"(leaf), "c"(sub));
+
+#define ASM_CLTS asm volatile("clts");
+#define ASM_XSETBV(xcr, val) asm volatile("xsetbv" :: "c"(xcr), "a"((uint32_t)(val)), "d"((uint32_t)((val) >> 32)));
 
 #define IRQ0 asm volatile ("int $32")
 
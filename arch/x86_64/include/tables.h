@@ -5,6 +5,12 @@
 #include <stddef.h>
 #include <system.h>
 
+// Kernel code and data, the boot CPU's TSS, then user data and code (the
+// order SYSRET expects). Every other CPU's TSS follows.
+#define GDT_AP_TSS_INDEX 7
+#define GDT_ENTRIES (GDT_AP_TSS_INDEX + 2 * (SMP_MAX_CPUS - 1))
+#define GDT_BSP_TSS_SELECTOR 0x18
+
 typedef struct gdt_entry {
     uint16_t limit_low;
     uint16_t base_low;
@@ -71,15 +77,22 @@ void gdt_init();
 void tss_init();
 void idt_init();
 void tables_init();
+void tables_init_ap(uint16_t tss_selector);
 void register_interrupt_handler(uint8_t n, isr_handler_t handler);
 void tss_set_rsp(uint64_t rsp);
 void gdt_set_entry(int index, uint64_t base, uint64_t limit, uint8_t access, uint8_t granularity, gdt_entry_t *gdt_location);
 void tss_set_rsp0(uint64_t rsp0);
+uint16_t tss_install(uint32_t cpu, tss_entry_t *tss, uint64_t rsp0);
 void regs_dump(regs_t *regs);
 
 extern void load_gdt(uint64_t gdtr);
+extern void load_idt(uint64_t idtr);
+extern void load_tss(uint16_t selector);
 
-extern gdt_entry_t gdt[7];
+extern gdt_entry_t gdt[GDT_ENTRIES];
+extern gdt_ptr_t gdtr;
+extern idtr_t idtr;
+extern tss_entry_t tss;
 
 
 extern void isr0();
@@ -131,7 +144,9 @@ extern void irq12();
 extern void irq13();
 extern void irq14();
 extern void irq15();
+extern void spurious_irq();
 
 extern void __attribute__((noreturn)) jump_to_usermode(uint64_t rip, uint64_t rsp, int argc, char **argv, char **envp);
+extern void __attribute__((noreturn)) interrupt_return(regs_t *frame);
 
 #endif
\ No newline at end of file
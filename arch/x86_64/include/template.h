@@ -0,0 +1,60 @@
+#ifndef _TEMPLATE_H
+#define _TEMPLATE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <lib/list.h>
+#include <lock.h>
+#include <process.h>
+
+// Process templates ("zygotes"): a program that takes long to start can,
+// once it has initialised, register a snapshot of itself for its path with
+// template_register(). From then on exec of that path doesn't read the ELF
+// at all: the new image maps the snapshot's pages copy-on-write and resumes
+// where the snapshot was taken, returning 1 from template_register(), with
+// its own arguments in the caller's template_args_t.
+//
+// The snapshot is a copy taken when registering, so the registering process
+// carries on (and may exit) without affecting it. Only root may register
+// templates, since every exec of the path runs them.
+
+#define SYS_TEMPLATE_REGISTER 500
+#define SYS_TEMPLATE_UNREGISTER 501
+
+// Where a spawn's argument and environment strings go, below the stack
+#define TEMPLATE_ARGS_SIZE 0x10000
+#define TEMPLATE_ARGS_START (VIRT_MEM_OFFSET - MAX_STACK_SIZE - TEMPLATE_ARGS_SIZE)
+
+// Filled in for each spawn, in its copy of the template's memory
+typedef struct template_args {
+    int argc;
+    char **argv;
+    char **envp;
+} template_args_t;
+
+typedef struct process_template {
+    list_node_t node; // in the registry, empty once unregistered
+    char *path; // absolute
+    uint64_t refcount; // the registry's, plus one per address space mapping its pages
+    page_directory_t *pml4; // never loaded, so its pages never change
+    memregion_t *regions;
+    uint64_t brk;
+    uint64_t stack_low;
+    uint64_t mmap_next;
+    uint64_t pages; // resident, counted towards each spawn
+    regs_t registers; // the user context to resume
+    uint64_t fs_base;
+    void *fpu_state;
+    sighand_t *sighand; // NULL if every signal had its default disposition
+    sigset_t signal_mask;
+    template_args_t *args; // user pointer
+} process_template_t;
+
+process_template_t *template_find(const char *path);
+void template_put(process_template_t *template);
+address_space_t *template_address_space(process_template_t *template);
+int64_t ktemplate_register(const char *path, template_args_t *args);
+int64_t ktemplate_unregister(const char *path);
+
+#endif
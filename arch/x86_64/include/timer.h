@@ -0,0 +1,40 @@
+#ifndef _TIMER_H
+#define _TIMER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Tick rate and scheduler quantum used at boot. Both can be changed at
+// runtime with timer_set_frequency() / timer_set_quantum().
+#define TIMER_DEFAULT_HZ 1000
+#define TIMER_DEFAULT_QUANTUM_MS 5
+
+// Longest the idle process sleeps in one go when nothing else is pending
+#define TIMER_IDLE_MAX_MS 1000
+
+#define TIMER_VECTOR 32
+
+#define PIT_FREQUENCY 1193182
+
+#define LAPIC_TIMER_PERIODIC (1 << 17)
+#define LAPIC_TIMER_DIVIDE_16 0x3
+
+#define TIMER_SOURCE_PIT 0
+#define TIMER_SOURCE_LAPIC 1
+
+extern volatile uint64_t timer_ticks;
+extern uint32_t timer_hz;
+extern uint32_t timer_quantum_ticks;
+
+void timer_init();
+void timer_set_frequency(uint32_t hz);
+void timer_set_quantum(uint32_t ms);
+uint64_t timer_ms_to_ticks(uint64_t ms);
+uint64_t timer_ns_to_ticks(uint64_t ns);
+void timer_tick();
+void timer_idle_enter();
+void timer_idle_exit();
+void pit_wait_start(uint32_t ms);
+bool pit_wait_done();
+
+#endif
@@ -8,5 +8,6 @@
 void traceback(size_t depth);
 void serial_traceback(size_t depth, uint64_t *rbp);
 void traceback_init(kernel_info_t *info);
+const char *trace_resolve_symbol(uint64_t rip, uint64_t *offset);
 
 #endif
\ No newline at end of file
@@ -5,6 +5,11 @@
 #include <sys/types.h>
 
 #include <device.h>
+#include <waitqueue.h>
+#include <workqueue.h>
+
+// Echoed input waiting to be drawn, must be a power of two
+#define TTY_ECHO_SIZE 256
 
 #define NCCS 32
 
@@ -30,6 +35,16 @@ typedef struct tty {
 
     struct termios termios;
 
+    wait_queue_t read_wait; // woken when input arrives
+
+    // Drawing to the framebuffer is slow, so input is echoed from a work
+    // item rather than the keyboard softirq. Only tty_push() writes
+    // echo_head and only echo_work writes echo_tail.
+    char echo_buffer[TTY_ECHO_SIZE];
+    volatile uint32_t echo_head;
+    volatile uint32_t echo_tail;
+    work_t echo_work;
+
     struct tty *next;
 } tty_t;
 
@@ -0,0 +1,82 @@
+#ifndef _WAITQUEUE_H
+#define _WAITQUEUE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <system.h>
+#include <lib/list.h>
+#include <lock.h>
+
+struct process;
+
+// A list of processes sleeping until some condition may have changed. The
+// sleeper owns its wait_queue_entry_t (usually on its kernel stack), so one
+// process can wait on several queues at once.
+typedef struct wait_queue {
+    list_node_t waiters;
+    spinlock_t lock;
+} wait_queue_t;
+
+typedef struct wait_queue_entry {
+    list_node_t node;
+    struct process *process;
+} wait_queue_entry_t;
+
+#define WAIT_QUEUE_INIT(name) { LIST_HEAD_INIT((name).waiters), SPINLOCK_INIT("wait_queue") }
+
+void wait_queue_init(wait_queue_t *queue);
+void wait_queue_entry_init(wait_queue_entry_t *entry, struct process *process);
+void wait_queue_add(wait_queue_t *queue, wait_queue_entry_t *entry);
+void wait_queue_remove(wait_queue_t *queue, wait_queue_entry_t *entry);
+void wait_queue_wake(wait_queue_t *queue);
+void prepare_to_wait(wait_queue_t *queue, wait_queue_entry_t *entry);
+void finish_wait(wait_queue_t *queue, wait_queue_entry_t *entry);
+
+/*
+ * Sleep until condition is true, re-checking it every time queue is woken.
+ * Needs <process.h> at the use site.
+ *
+ * prepare_to_wait() marks the process blocked before the condition is
+ * checked, so a wakeup from another CPU or a softirq that lands between the
+ * check and process_block() makes it runnable again rather than being lost.
+ */
+#define wait_event(queue, condition) do { \
+    wait_queue_entry_t __wait_entry; \
+    wait_queue_entry_init(&__wait_entry, (struct process *)current_process); \
+    while (true) { \
+        prepare_to_wait((queue), &__wait_entry); \
+        if (condition) { \
+            break; \
+        } \
+        process_block(); \
+    } \
+    finish_wait((queue), &__wait_entry); \
+} while (0)
+
+/*
+ * As wait_event(), but also gives up when a signal is pending, so the
+ * caller can return -EINTR and let it be delivered. Evaluates to 0 once
+ * condition is true, or -EINTR. Needs <process.h> and <sys/errno.h> at the
+ * use site.
+ */
+#define wait_event_interruptible(queue, condition) ({ \
+    int __wait_status = 0; \
+    wait_queue_entry_t __wait_entry; \
+    wait_queue_entry_init(&__wait_entry, (struct process *)current_process); \
+    while (true) { \
+        prepare_to_wait((queue), &__wait_entry); \
+        if (condition) { \
+            break; \
+        } \
+        if (signal_pending((process_t *)current_process)) { \
+            __wait_status = -EINTR; \
+            break; \
+        } \
+        process_block(); \
+    } \
+    finish_wait((queue), &__wait_entry); \
+    __wait_status; \
+})
+
+#endif
@@ -0,0 +1,57 @@
+#ifndef _WORKQUEUE_H
+#define _WORKQUEUE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <lib/list.h>
+#include <lock.h>
+#include <waitqueue.h>
+
+// Work queues run deferred work in a kernel thread, for anything too slow
+// or too blocking for an IRQ handler or softirq: the handler queues a
+// work_t and returns, and the queue's worker runs it later in process
+// context, where it may allocate, sleep and take its time.
+
+// Priority of workers, ahead of ordinary processes so deferred IRQ work
+// doesn't lag behind them
+#define WORKQUEUE_NICE -10
+
+struct work;
+typedef void (*work_fn_t)(struct work *work);
+
+// Embed in a larger struct and use container_of to get at its state
+typedef struct work {
+    list_node_t node; // empty while not queued
+    work_fn_t function;
+} work_t;
+
+#define WORK_INIT(name, work_function) { LIST_HEAD_INIT((name).node), (work_function) }
+
+struct process;
+
+typedef struct workqueue {
+    const char *name;
+    list_node_t pending;
+    spinlock_t lock; // taken from IRQ handlers, so always with interrupts off
+    wait_queue_t wait; // the worker sleeps here while nothing is pending
+    struct process *worker;
+    uint64_t executed;
+} workqueue_t;
+
+// General purpose queue, for work that doesn't need one of its own
+extern workqueue_t *system_wq;
+
+void work_init(work_t *work, work_fn_t function);
+workqueue_t *workqueue_create(const char *name);
+bool queue_work(workqueue_t *queue, work_t *work);
+bool schedule_work(work_t *work);
+bool cancel_work(workqueue_t *queue, work_t *work);
+void workqueue_init();
+
+static inline bool work_pending(work_t *work)
+{
+    return !list_empty(&work->node);
+}
+
+#endif
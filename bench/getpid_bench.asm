@@ -0,0 +1,108 @@
+[bits 64]
+default rel
+
+; User program that times getpid() in a loop with the TSC, the cost of a
+; syscall that does next to nothing. Prints the average cycles per call
+; over the fastest of several rounds, since a round a timer interrupt or
+; another process lands in is slower, so kernels before and after a change
+; to the syscall path can be compared. Built into the ramdisk as
+; /bin/getpid_bench. TSC counts under QEMU's TCG don't reflect real
+; hardware, so measure with KVM or on a real machine.
+
+%define SYS_WRITE 1
+%define SYS_GETPID 39
+%define SYS_EXIT 60
+
+%define WARMUP_CALLS 1000
+%define ROUNDS 10
+%define CALLS 10000
+
+section .data
+prefix: db "getpid: "
+prefix_len equ $ - prefix
+suffix: db " cycles per call, best of 10 rounds of 10000", 10
+suffix_len equ $ - suffix
+
+section .bss
+digits: resb 20
+digits_end:
+
+section .text
+global _start
+_start:
+    ; get the caches and TLB warm before timing anything
+    mov rbx, WARMUP_CALLS
+.warmup:
+    mov eax, SYS_GETPID
+    syscall
+    dec rbx
+    jnz .warmup
+
+    ; syscall only clobbers RCX and R11, the rest survive it. R13 is the
+    ; fastest round so far, R14 counts the rounds down.
+    mov r13, -1
+    mov r14, ROUNDS
+.round:
+    lfence
+    rdtsc
+    shl rdx, 32
+    or rax, rdx
+    mov r12, rax
+
+    mov rbx, CALLS
+.loop:
+    mov eax, SYS_GETPID
+    syscall
+    dec rbx
+    jnz .loop
+
+    lfence
+    rdtsc
+    shl rdx, 32
+    or rax, rdx
+    sub rax, r12
+    cmp rax, r13
+    cmovb r13, rax
+    dec r14
+    jnz .round
+
+    mov rax, r13
+    xor edx, edx
+    mov rcx, CALLS
+    div rcx
+    mov r12, rax
+
+    mov eax, SYS_WRITE
+    mov edi, 1
+    lea rsi, [prefix]
+    mov edx, prefix_len
+    syscall
+
+    ; the average in decimal, built backwards from the end of the buffer
+    lea rsi, [digits_end]
+    mov rax, r12
+    mov rcx, 10
+.digit:
+    xor edx, edx
+    div rcx
+    add dl, '0'
+    dec rsi
+    mov [rsi], dl
+    test rax, rax
+    jnz .digit
+
+    lea rdx, [digits_end]
+    sub rdx, rsi
+    mov eax, SYS_WRITE
+    mov edi, 1
+    syscall
+
+    mov eax, SYS_WRITE
+    mov edi, 1
+    lea rsi, [suffix]
+    mov edx, suffix_len
+    syscall
+
+    mov eax, SYS_EXIT
+    xor edi, edi
+    syscall
@@ -10,13 +10,20 @@
 #include <unused.h>
 #include <string.h>
 #include <system.h>
+#include <process.h>
+#include <waitqueue.h>
+#include <clock.h>
+#include <preempt.h>
+#include <lock.h>
 
 dev_t next_device_id = 0;
 mount_t *mounts = NULL;
+rwlock_t mounts_lock = RWLOCK_INIT("mounts");
 
 device_t *root_filesystem = NULL;
 
-char resolution_buffer[PATH_MAX];
+// Each CPU resolves paths into its own buffer
+#define resolution_buffer (percpu()->resolution_buffer)
 
 /**
  * Get the depth of a path (for example, /a/b/c has a depth of 3).
@@ -86,8 +93,10 @@ int mount_at(char *path, device_t *device, char *filesystemtype, unsigned long m
     strcpy(mount->path, path);
     mount->mountflags = mountflags;
     mount->filesystem = device;
+    write_lock(&mounts_lock);
     mount->next = mounts;
     mounts = mount;
+    write_unlock(&mounts_lock);
     return 0;
 }
 
@@ -100,15 +109,19 @@ int mount_at(char *path, device_t *device, char *filesystemtype, unsigned long m
  *         .value: The length of the path section that the device is mounted at
  */
 pointer_int_t get_path_device(char *path) {
+    read_lock(&mounts_lock);
     mount_t *current_mount = mounts;
     while (current_mount != NULL) {
         if (strncmp(current_mount->path, path, strlen(current_mount->path)) == 0) {
             if (path[strlen(current_mount->path)] == '/' || path[strlen(current_mount->path)] == '\0') {
-                return (pointer_int_t){current_mount->filesystem, strlen(current_mount->path)};
+                pointer_int_t result = {current_mount->filesystem, strlen(current_mount->path)};
+                read_unlock(&mounts_lock);
+                return result;
             }
         }
         current_mount = current_mount->next;
     }
+    read_unlock(&mounts_lock);
     return (pointer_int_t){root_filesystem, 0};
 }
 
@@ -120,13 +133,17 @@ pointer_int_t get_path_device(char *path) {
  * @return The path that the device is mounted at
  */
 char *device_to_path(device_t *device) {
+    // mounts are never removed, so the path stays valid after unlocking
+    read_lock(&mounts_lock);
     mount_t *current_mount = mounts;
     while (current_mount != NULL) {
         if (current_mount->filesystem == device) {
+            read_unlock(&mounts_lock);
             return current_mount->path;
         }
         current_mount = current_mount->next;
     }
+    read_unlock(&mounts_lock);
     return NULL;
 }
 
@@ -177,6 +194,95 @@ char *abs_path_cleanup(char *path) {
     return (char *)path_addr_start;
 }
 
+/**
+ * Create a new reference-counted path.
+ * 
+ * @param path The path to copy into the reference
+ * 
+ * @return The new path reference, with a reference count of 1
+*/
+path_ref_t *path_ref_create(const char *path) {
+    size_t length = strlen(path);
+    path_ref_t *ref = (path_ref_t *)kmalloc(sizeof(path_ref_t) + length + 1);
+    ref->refcount = 1;
+    ref->length = length;
+    strcpy(ref->path, path);
+    return ref;
+}
+
+/**
+ * Take another reference to a path.
+ * 
+ * @param ref The path reference
+ * 
+ * @return The same path reference
+*/
+path_ref_t *path_ref_get(path_ref_t *ref) {
+    __atomic_add_fetch(&ref->refcount, 1, __ATOMIC_RELAXED);
+    return ref;
+}
+
+/**
+ * Drop a reference to a path, freeing it when the last reference goes.
+ * 
+ * @param ref The path reference
+*/
+void path_ref_put(path_ref_t *ref) {
+    if (ref == NULL) {
+        return;
+    }
+    if (__atomic_sub_fetch(&ref->refcount, 1, __ATOMIC_ACQ_REL) == 0) {
+        kfree(ref);
+    }
+}
+
+/**
+ * Create a file table.
+ * 
+ * @param descriptors The files in it, NULL for none
+ * 
+ * @return The table, holding one reference
+*/
+file_table_t *file_table_create(file_descriptor_t *descriptors) {
+    file_table_t *table = (file_table_t *)kmalloc(sizeof(file_table_t));
+    table->refcount = 1;
+    table->descriptors = descriptors;
+    return table;
+}
+
+/**
+ * Take another reference to a file table.
+ * 
+ * @param table The file table
+ * 
+ * @return The same file table
+*/
+file_table_t *file_table_get(file_table_t *table) {
+    __atomic_add_fetch(&table->refcount, 1, __ATOMIC_RELAXED);
+    return table;
+}
+
+/**
+ * Drop a reference to a file table. The last reference closes every file
+ * in it, so pipe readers and writers see the other end go away.
+ * 
+ * @param table The file table
+*/
+void file_table_put(file_table_t *table) {
+    if (table == NULL || __atomic_sub_fetch(&table->refcount, 1, __ATOMIC_ACQ_REL) != 0) {
+        return;
+    }
+    while (table->descriptors != NULL) {
+        file_descriptor_t *fd = table->descriptors;
+        table->descriptors = fd->next;
+        if (fd->device->close != NULL) {
+            fd->device->close(fd->data, fd->device);
+        }
+        kfree(fd);
+    }
+    kfree(table);
+}
+
 /**
  * Resolve a path to an absolute path.
  * 
@@ -188,10 +294,10 @@ char *resolve_path(char *path) {
     if (path[0] != '/') {
         char *resolved = &resolution_buffer[0];
         // ensure the paths are short enough to fit in the buffer
-        if (strlen((const char *)current_process->pwd) + strlen(path) + 2 > PATH_MAX) {
+        if (current_process->pwd->length + strlen(path) + 2 > PATH_MAX) {
             kpanic("Path too long to resolve\n");
         }
-        strcpy(resolved, (const char *)current_process->pwd);
+        strcpy(resolved, current_process->pwd->path);
         strcat(resolved, "/");
         strcat(resolved, path);
         return resolved;
@@ -203,6 +309,29 @@ char *resolve_path(char *path) {
     return resolution_buffer;
 }
 
+/**
+ * Resolve a path to a cleaned up absolute path, in memory of its own.
+ * 
+ * @param path The path to resolve
+ * 
+ * @return The resolved path, to be freed with kfree, or NULL if it's too long
+*/
+char *resolve_path_alloc(const char *path) {
+    if (current_process->pwd->length + strlen(path) + 2 > PATH_MAX) {
+        return NULL;
+    }
+
+    // the resolution buffer belongs to this CPU, keep it until it's copied
+    preempt_disable();
+    resolve_path((char *)path);
+    abs_path_cleanup(resolution_buffer);
+    char *resolved = (char *)kmalloc(strlen(resolution_buffer) + 1);
+    strcpy(resolved, resolution_buffer);
+    preempt_enable();
+
+    return resolved;
+}
+
 void serial_dump_descriptors(file_descriptor_t *currfd) {
     while (currfd) {
         serial_printf("---------------");
@@ -215,11 +344,11 @@ void serial_dump_descriptors(file_descriptor_t *currfd) {
 }
 
 int add_descriptor(file_descriptor_t *fd) {
-    file_descriptor_t *current = current_process->file_descriptors;
+    file_descriptor_t *current = current_process->files->descriptors;
     if (current == NULL) {
         fd->descriptor_id = 0;
         fd->next = NULL;
-        current_process->file_descriptors = fd;
+        current_process->files->descriptors = fd;
     } else {
         file_descriptor_t *prev = NULL;
         while (current != NULL) {
@@ -253,25 +382,31 @@ int add_descriptor(file_descriptor_t *fd) {
 int kfopen(char *path, int flags, mode_t mode) {
     UNUSED(mode);
 
+    // the resolution buffer belongs to this CPU, keep it until we're done
+    preempt_disable();
     resolve_path(path);
     abs_path_cleanup(resolution_buffer);
-    pointer_int_t resolution = get_path_device((char *)&resolution_buffer);
+    pointer_int_t resolution = get_path_device(resolution_buffer);
     device_t *device = resolution.pointer;
 
     if (device == NULL) {
+        preempt_enable();
         return -ENOENT;
     }
 
     if (device->open == NULL) {
+        preempt_enable();
         return -EOPNOTSUPP;
     }
 
-    pointer_int_t returned = device->open((char *)((uint64_t)&resolution_buffer + resolution.value), flags, device);
+    pointer_int_t returned = device->open(resolution_buffer + resolution.value, flags, device);
     if (returned.value != 0) {
         serial_printf("Error opening file: %d\n", returned.value);
-        serial_printf("Filename of error: %s\n", (char *)((uint64_t)&resolution_buffer));
+        serial_printf("Filename of error: %s\n", resolution_buffer);
+        preempt_enable();
         return returned.value;
     }
+    preempt_enable();
 
     file_descriptor_t *fd = (file_descriptor_t *)kmalloc(sizeof(file_descriptor_t));
     fd->flags = flags;
@@ -289,7 +424,7 @@ int kfopen(char *path, int flags, mode_t mode) {
  * @return 0 if successful, -1 if not
 */
 int kfclose(int fd) {
-    file_descriptor_t *current = current_process->file_descriptors;
+    file_descriptor_t *current = current_process->files->descriptors;
     file_descriptor_t *prev = NULL;
 
     while (current != NULL) {
@@ -298,7 +433,7 @@ int kfclose(int fd) {
                 current->device->close(current->data, current->device);
             }
             if (prev == NULL) {
-                current_process->file_descriptors = current->next;
+                current_process->files->descriptors = current->next;
             } else {
                 prev->next = current->next;
             }
@@ -323,7 +458,7 @@ int kfclose(int fd) {
  * @return The number of elements read
 */
 size_t kfread(void *ptr, size_t size, size_t nmemb, int fd) {
-    file_descriptor_t *current = current_process->file_descriptors;
+    file_descriptor_t *current = current_process->files->descriptors;
 
     while (current != NULL) {
         if (current->descriptor_id == fd) {
@@ -348,7 +483,7 @@ size_t kfread(void *ptr, size_t size, size_t nmemb, int fd) {
  * @return The number of elements written
 */
 size_t kfwrite(void *ptr, size_t size, size_t nmemb, int fd) {
-    file_descriptor_t *current = current_process->file_descriptors;
+    file_descriptor_t *current = current_process->files->descriptors;
     while (current != NULL) {
         if (current->descriptor_id == fd) {
             if (current->device->write == NULL) {
@@ -374,7 +509,7 @@ size_t kfwrite(void *ptr, size_t size, size_t nmemb, int fd) {
  *        -ENAMETOOLONG if the path is too long
  */
 size_t kfgetdents64(int fd, void *ptr, size_t count) {
-    file_descriptor_t *current = current_process->file_descriptors;
+    file_descriptor_t *current = current_process->files->descriptors;
     while (current != NULL) {
         if (current->descriptor_id == fd) {
             if (current->device->getdents64 == NULL) {
@@ -395,7 +530,7 @@ size_t kfgetdents64(int fd, void *ptr, size_t count) {
  * @return The new file descriptor
 */
 int kdup(int oldfd) {
-    file_descriptor_t *current = current_process->file_descriptors;
+    file_descriptor_t *current = current_process->files->descriptors;
     while (current != NULL) {
         if (current->descriptor_id == oldfd) {
             file_descriptor_t *fd = (file_descriptor_t *)kmalloc(sizeof(file_descriptor_t));
@@ -427,7 +562,7 @@ int kdup(int oldfd) {
  * @return The new file descriptor
 */
 int kdup2(int oldfd, int newfd) {
-    file_descriptor_t *current = current_process->file_descriptors;
+    file_descriptor_t *current = current_process->files->descriptors;
     while (current != NULL) {
         if (current->descriptor_id == oldfd) {
             file_descriptor_t *fd = (file_descriptor_t *)kmalloc(sizeof(file_descriptor_t));
@@ -441,13 +576,13 @@ int kdup2(int oldfd, int newfd) {
             fd->descriptor_id = newfd;
 
             // Check if newfd is already open
-            file_descriptor_t *newfd_current = current_process->file_descriptors;
+            file_descriptor_t *newfd_current = current_process->files->descriptors;
             file_descriptor_t *newfd_prev = NULL;
             while (newfd_current != NULL) {
                 if (newfd_current->descriptor_id == newfd) {
                     kfclose(newfd);
                     if (newfd_prev == NULL) {
-                        current_process->file_descriptors = fd;
+                        current_process->files->descriptors = fd;
                         fd->next = newfd_current->next;
                     } else {
                         newfd_prev->next = fd;
@@ -459,7 +594,7 @@ int kdup2(int oldfd, int newfd) {
                         newfd_prev->next = fd;
                         fd->next = newfd_current;
                     } else {
-                        current_process->file_descriptors = fd;
+                        current_process->files->descriptors = fd;
                         fd->next = newfd_current;
                     }
                     break;
@@ -491,7 +626,7 @@ int kdup2(int oldfd, int newfd) {
  *        -EBADF if the file descriptor is invalid
  */
 off_t kflseek(int fd, off_t offset, int whence) {
-    file_descriptor_t *current = current_process->file_descriptors;
+    file_descriptor_t *current = current_process->files->descriptors;
     while (current != NULL) {
         if (current->descriptor_id == fd) {
             if (current->device->lseek == NULL) {
@@ -515,7 +650,7 @@ off_t kflseek(int fd, off_t offset, int whence) {
  *        -EBADF if the file descriptor is invalid
  */
 int kfstat(int fd, struct stat *buf) {
-    file_descriptor_t *current = current_process->file_descriptors;
+    file_descriptor_t *current = current_process->files->descriptors;
     while (current != NULL) {
         if (current->descriptor_id == fd) {
             if (current->device->stat == NULL) {
@@ -591,20 +726,23 @@ file_descriptor_t *clone_file_descriptors(file_descriptor_t *descriptors) {
  */
 size_t file_size_internal(char *path) {
 
+    preempt_disable();
     resolve_path(path);
     abs_path_cleanup(resolution_buffer);
-    pointer_int_t resolution = get_path_device((char *)&resolution_buffer);
+    pointer_int_t resolution = get_path_device(resolution_buffer);
     device_t *device = resolution.pointer;
 
+    size_t size;
     if (device == NULL) {
-        return -ENOENT;
-    }
-
-    if (device->file_size == NULL) {
-        return -EOPNOTSUPP;
+        size = -ENOENT;
+    } else if (device->file_size == NULL) {
+        size = -EOPNOTSUPP;
+    } else {
+        size = device->file_size(resolution_buffer + resolution.value, device);
     }
+    preempt_enable();
 
-    return device->file_size((char *)((uint64_t)&resolution_buffer + resolution.value), device);
+    return size;
 }
 
 /**
@@ -619,7 +757,7 @@ size_t file_size_internal(char *path) {
  *       -EBADF if the file descriptor is invalid
 */
 int kfcntl(int fd, int cmd, long arg) {
-    file_descriptor_t *current = current_process->file_descriptors;
+    file_descriptor_t *current = current_process->files->descriptors;
     while (current != NULL) {
         if (current->descriptor_id == fd) {
             if (current->device->fcntl == NULL) {
@@ -646,6 +784,7 @@ int kfsetpwd(char *new_pwd) {
     }
     
     // relative -> absolute
+    preempt_disable();
     resolve_path(new_pwd);
     // if it doesn't end with a slash, add one
     if (resolution_buffer[strlen(resolution_buffer) - 1] != '/') {
@@ -653,12 +792,16 @@ int kfsetpwd(char *new_pwd) {
 
         // double check the length
         if (strlen(resolution_buffer) > PATH_MAX) {
+            preempt_enable();
             return -ENAMETOOLONG;
         }
     }
     abs_path_cleanup(resolution_buffer);
 
-    strcpy((char *)current_process->pwd, resolution_buffer);
+    path_ref_t *old_pwd = current_process->pwd;
+    current_process->pwd = path_ref_create(resolution_buffer);
+    preempt_enable();
+    path_ref_put(old_pwd);
 
     return 0;
 }
@@ -672,7 +815,7 @@ int kfsetpwd(char *new_pwd) {
  * @return The working directory, or NULL if an error occurred
 */
 char *kfgetpwd(char *buf, size_t size) {
-    if (strlen((const char *)current_process->pwd) > size) {
+    if (current_process->pwd->length > size) {
         serial_printf("getpwd: path too long\n");
         return NULL;
     }
@@ -682,7 +825,7 @@ char *kfgetpwd(char *buf, size_t size) {
         return NULL;
     }
 
-    strcpy(buf, (const char *)current_process->pwd);
+    strcpy(buf, current_process->pwd->path);
 
     serial_printf("getpwd: %s\n", buf);
     serial_printf("Returning 0x%lx\n", (uint64_t)buf);
@@ -690,6 +833,70 @@ char *kfgetpwd(char *buf, size_t size) {
     return buf;
 }
 
+// Woken whenever a device's select() state may have changed
+wait_queue_t select_wait = WAIT_QUEUE_INIT(select_wait);
+
+/**
+ * Wake anything blocked in select(). Devices call this when they become
+ * readable or writable.
+ */
+void select_wake() {
+    wait_queue_wake(&select_wait);
+}
+
+// One pass over the descriptors for kselect()
+static int select_poll(int nfds, fd_set *readfds, fd_set *writefds, fd_set *errorfds) {
+    int ready = 0;
+
+    file_descriptor_t *current = current_process->files->descriptors;
+    for (int i = 0; i < nfds; i++) {
+        if (!current) {
+            break;
+        }
+
+        if (!current->device->select) {
+            current = current->next;
+            continue;
+        }
+
+        if (current->descriptor_id == i) {
+            if (readfds && (readfds->fds_bits[i / NFDBITS] & (1 << (i % NFDBITS)))) {
+                int status = current->device->select(current->data, current->device, SELECT_READ);
+
+                if (status < 0) {
+                    serial_printf("Error in select (device name: %s): %d\n", current->device ? current->device->name : "unknown", status);
+                    return status;
+                } else if (status == 1) {
+                    ready++;
+                }
+            }
+            if (writefds && (writefds->fds_bits[i / NFDBITS] & (1 << (i % NFDBITS)))) {
+                int status = current->device->select(current->data, current->device, SELECT_WRITE);
+
+                if (status < 0) {
+                    serial_printf("Error in select (device name: %s): %d\n", current->device ? current->device->name : "unknown", status);
+                    return status;
+                } else if (status == 1) {
+                    ready++;
+                }
+            }
+            if (errorfds && (errorfds->fds_bits[i / NFDBITS] & (1 << (i % NFDBITS)))) {
+                int status = current->device->select(current->data, current->device, SELECT_ERROR);
+
+                if (status < 0) {
+                    serial_printf("Error in select (device name: %s): %d\n", current->device ? current->device->name : "unknown", status);
+                    return status;
+                } else if (status == 1) {
+                    ready++;
+                }
+            }
+        }
+        current = current->next;
+    }
+
+    return ready;
+}
+
 /**
  * Check whether a set of file descriptors is ready for reading, writing, or has an error.
  * 
@@ -697,71 +904,59 @@ char *kfgetpwd(char *buf, size_t size) {
  * @param readfds The file descriptors to check for reading
  * @param writefds The file descriptors to check for writing
  * @param errorfds The file descriptors to check for errors
- * @param timeout The timeout for the select
+ * @param timeout How long to wait, NULL to wait forever. Updated with the time left.
  * 
- * @return The number of file descriptors ready
+ * @return The number of file descriptors ready, 0 if the timeout expired
+ *      -EINVAL if the timeout is out of range
+ *      -EINTR if a signal arrived first
 */
 int kselect(int nfds, fd_set *readfds, fd_set *writefds, fd_set *errorfds, struct timeval *timeout) {
-    UNUSED(timeout);
-
     int ready = 0;
-    
-    // Wait for one to be ready (ignore timeout for the moment)
-    // Also note file descriptors are in order, but there may be gaps if some are closed
-    ASM_ENABLE_INTERRUPTS;
-    while (ready == 0) {
-        file_descriptor_t *current = current_process->file_descriptors;
-        for (int i = 0; i < nfds; i++) {
-            if (!current) {
-                break;
-            }
 
-            if (!current->device->select) {
-                current = current->next;
-                continue;
-            }
+    if (timeout == NULL) {
+        // Note file descriptors are in order, but there may be gaps if some are closed
+        if (wait_event_interruptible(&select_wait, (ready = select_poll(nfds, readfds, writefds, errorfds)) != 0) != 0) {
+            return -EINTR;
+        }
+        return ready;
+    }
 
-            if (current->descriptor_id == i) {
-                if (readfds && (readfds->fds_bits[i / NFDBITS] & (1 << (i % NFDBITS)))) {
-                    int status = current->device->select(current->data, current->device, SELECT_READ);
+    if (timeout->tv_sec < 0 || timeout->tv_usec < 0 || timeout->tv_usec >= 1000000) {
+        return -EINVAL;
+    }
 
-                    if (status < 0) {
-                        serial_printf("Error in select (device name: %s): %d\n", current->device ? current->device->name : "unknown", status);
-                        return status;
-                    } else if (status == 1) {
-                        ready++;
-                    }
-                }
-                if (writefds && (writefds->fds_bits[i / NFDBITS] & (1 << (i % NFDBITS)))) {
-                    int status = current->device->select(current->data, current->device, SELECT_WRITE);
-
-                    if (status < 0) {
-                        serial_printf("Error in select (device name: %s): %d\n", current->device ? current->device->name : "unknown", status);
-                        return status;
-                    } else if (status == 1) {
-                        ready++;
-                    }
-                }
-                if (errorfds && (errorfds->fds_bits[i / NFDBITS] & (1 << (i % NFDBITS)))) {
-                    int status = current->device->select(current->data, current->device, SELECT_ERROR);
-
-                    if (status < 0) {
-                        serial_printf("Error in select (device name: %s): %d\n", current->device ? current->device->name : "unknown", status);
-                        return status;
-                    } else if (status == 1) {
-                        ready++;
-                    }
-                }
-            }
-            current = current->next;
-        }
-        if (ready == 0) {
-            schedule();
+    uint64_t ns = (uint64_t)timeout->tv_sec * NSEC_PER_SEC + (uint64_t)timeout->tv_usec * NSEC_PER_USEC;
+    uint64_t deadline = clock_monotonic_ns() + ns;
+
+    if (ns == 0) {
+        ready = select_poll(nfds, readfds, writefds, errorfds);
+    } else {
+        timeout_t expiry;
+        timeout_start(&expiry, ns);
+        int status = wait_event_interruptible(&select_wait, (ready = select_poll(nfds, readfds, writefds, errorfds)) != 0 || expiry.expired);
+        timeout_cancel(&expiry);
+        if (status != 0) {
+            return status;
         }
     }
-    ASM_DISABLE_INTERRUPTS;
 
-    // kfree(fds);
+    uint64_t now = clock_monotonic_ns();
+    uint64_t left = deadline > now ? deadline - now : 0;
+    timeout->tv_sec = left / NSEC_PER_SEC;
+    timeout->tv_usec = (left % NSEC_PER_SEC) / NSEC_PER_USEC;
+
+    if (ready == 0) {
+        // nothing became ready, so every set comes back empty
+        if (readfds) {
+            memset(readfds, 0, sizeof(fd_set));
+        }
+        if (writefds) {
+            memset(writefds, 0, sizeof(fd_set));
+        }
+        if (errorfds) {
+            memset(errorfds, 0, sizeof(fd_set));
+        }
+    }
 
     return ready;
 }
@@ -779,7 +974,7 @@ int kselect(int nfds, fd_set *readfds, fd_set *writefds, fd_set *errorfds, struc
  *      -EINVAL if the request is invalid
  */
 int kioctl(int fd, unsigned long request, void *arg) {
-    file_descriptor_t *current = current_process->file_descriptors;
+    file_descriptor_t *current = current_process->files->descriptors;
     while (current != NULL) {
         if (current->descriptor_id == fd) {
             if (current->device->ioctl == NULL) {
@@ -802,11 +997,12 @@ void filesystem_init(device_t *ramdisk_device) {
         kpanic("Ramdisk device not found, boot can't continue\n");
     }
 
-    strcpy((char *)current_process->pwd, "/");
+    path_ref_put(current_process->pwd);
+    current_process->pwd = path_ref_create("/");
 
     // Mount the ramdisk
     mount_at("/mnt/ramdisk", ramdisk_device, "xandisk", 0);
 
     root_filesystem = NULL;
-    current_process->file_descriptors = NULL;
+    current_process->files->descriptors = NULL;
 }
\ No newline at end of file
@@ -131,6 +131,15 @@ typedef struct mount
 	struct mount *next;
 } mount_t;
 
+// Reference-counted absolute path, so processes can share a working
+// directory without each carrying a PATH_MAX buffer
+typedef struct path_ref
+{
+	uint64_t refcount; // changed atomically, holders may run on any CPU
+	size_t length;
+	char path[];
+} path_ref_t;
+
 typedef struct file_descriptor
 {
 	int descriptor_id;
@@ -140,6 +149,13 @@ typedef struct file_descriptor
 	struct file_descriptor *next;
 } file_descriptor_t;
 
+// A process' open files, shared by processes cloned with CLONE_FILES
+typedef struct file_table
+{
+	uint64_t refcount; // changed atomically, holders may run on any CPU
+	file_descriptor_t *descriptors;
+} file_table_t;
+
 struct dirent64
 {
 	ino_t d_ino;		   /* inode number */
@@ -182,6 +198,11 @@ struct timeval {
 	suseconds_t	tv_usec;	/* and microseconds */
 };
 
+struct itimerval {
+	struct timeval	it_interval;	/* reload value */
+	struct timeval	it_value;	/* time until next expiry */
+};
+
 #define PIPE_SIZE 0x1000 * 16 // 16 pages
 
 #define SELECT_READ 0
@@ -209,9 +230,17 @@ off_t kflseek(int fd, off_t offset, int whence);
 int kioctl(int fd, unsigned long request, void *arg);
 int kfstat(int fd, struct stat *buf);
 int kstat(char *path, struct stat *buf);
+char *resolve_path_alloc(const char *path);
 file_descriptor_t *clone_file_descriptors(file_descriptor_t *descriptors);
 int kselect(int nfds, fd_set *readfds, fd_set *writefds, fd_set *errorfds, struct timeval *timeout);
+void select_wake();
 int kdup2(int oldfd, int newfd);
 int add_descriptor(file_descriptor_t *fd);
+path_ref_t *path_ref_create(const char *path);
+path_ref_t *path_ref_get(path_ref_t *ref);
+void path_ref_put(path_ref_t *ref);
+file_table_t *file_table_create(file_descriptor_t *descriptors);
+file_table_t *file_table_get(file_table_t *table);
+void file_table_put(file_table_t *table);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,10 @@
+#ifndef _LIB_CONTAINER_H
+#define _LIB_CONTAINER_H
+
+#include <stddef.h>
+
+// Get the structure that embeds a member, given a pointer to that member
+#define container_of(ptr, type, member) \
+    ((type *)((char *)(ptr) - offsetof(type, member)))
+
+#endif
@@ -0,0 +1,44 @@
+#ifndef _LIB_HASHTABLE_H
+#define _LIB_HASHTABLE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <lib/container.h>
+
+// Intrusive chained hash table keyed by a 64-bit integer. Entries embed a
+// hash_node_t and set its key before insertion. The bucket array is
+// allocated on first insert and doubles / halves to keep roughly one entry
+// per bucket, so a zeroed hashtable_t is a valid empty table.
+typedef struct hash_node
+{
+    struct hash_node *next;
+    uint64_t key;
+} hash_node_t;
+
+typedef struct
+{
+    hash_node_t **buckets;
+    uint64_t bucket_count; // always a power of two, or 0 before first insert
+    uint64_t count;
+} hashtable_t;
+
+#define HASHTABLE_INIT { NULL, 0, 0 }
+#define HASHTABLE_MIN_BUCKETS 16
+
+#define hash_entry(node, type, member) container_of(node, type, member)
+
+static inline uint64_t hash_u64(uint64_t key)
+{
+    // Fibonacci hashing, the top bits are the well-mixed ones
+    return key * 0x9E3779B97F4A7C15ull;
+}
+
+void hashtable_init(hashtable_t *table);
+void hashtable_destroy(hashtable_t *table);
+void hashtable_insert(hashtable_t *table, hash_node_t *node);
+hash_node_t *hashtable_find(hashtable_t *table, uint64_t key);
+hash_node_t *hashtable_find_next(hash_node_t *node);
+bool hashtable_remove(hashtable_t *table, hash_node_t *node);
+
+#endif
@@ -0,0 +1,69 @@
+#ifndef _LIB_LIST_H
+#define _LIB_LIST_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include <lib/container.h>
+
+// Intrusive circular doubly linked list. A list is a list_node_t head that
+// links to itself when empty; entries embed a list_node_t and are recovered
+// with list_entry().
+typedef struct list_node
+{
+    struct list_node *next;
+    struct list_node *prev;
+} list_node_t;
+
+#define LIST_HEAD_INIT(name) { &(name), &(name) }
+
+#define list_entry(node, type, member) container_of(node, type, member)
+#define list_first_entry(head, type, member) list_entry((head)->next, type, member)
+
+#define list_for_each(pos, head) \
+    for ((pos) = (head)->next; (pos) != (head); (pos) = (pos)->next)
+
+// Safe against removal of pos while iterating
+#define list_for_each_safe(pos, tmp, head) \
+    for ((pos) = (head)->next, (tmp) = (pos)->next; (pos) != (head); (pos) = (tmp), (tmp) = (pos)->next)
+
+static inline void list_init(list_node_t *head)
+{
+    head->next = head;
+    head->prev = head;
+}
+
+static inline bool list_empty(const list_node_t *head)
+{
+    return head->next == head;
+}
+
+static inline void list_insert_between(list_node_t *node, list_node_t *prev, list_node_t *next)
+{
+    next->prev = node;
+    node->next = next;
+    node->prev = prev;
+    prev->next = node;
+}
+
+// Insert node at the front of the list
+static inline void list_add(list_node_t *head, list_node_t *node)
+{
+    list_insert_between(node, head, head->next);
+}
+
+// Insert node at the back of the list
+static inline void list_add_tail(list_node_t *head, list_node_t *node)
+{
+    list_insert_between(node, head->prev, head);
+}
+
+// Unlink node from whatever list it's on, leaving it as an empty list
+static inline void list_remove(list_node_t *node)
+{
+    node->prev->next = node->next;
+    node->next->prev = node->prev;
+    list_init(node);
+}
+
+#endif
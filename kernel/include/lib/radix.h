@@ -0,0 +1,35 @@
+#ifndef _LIB_RADIX_H
+#define _LIB_RADIX_H
+
+#include <stdint.h>
+
+// Radix tree mapping 64-bit indices to pointers. Each level resolves
+// RADIX_TREE_BITS of the index, and the tree only grows as tall as the
+// largest index stored needs. Good for dense integer keys like page frame
+// numbers or file offsets. A zeroed radix_tree_t is a valid empty tree.
+#define RADIX_TREE_BITS 6
+#define RADIX_TREE_SLOTS (1 << RADIX_TREE_BITS)
+#define RADIX_TREE_MASK (RADIX_TREE_SLOTS - 1)
+#define RADIX_TREE_MAX_HEIGHT ((64 + RADIX_TREE_BITS - 1) / RADIX_TREE_BITS)
+
+typedef struct radix_node
+{
+    void *slots[RADIX_TREE_SLOTS];
+    uint32_t count;
+} radix_node_t;
+
+typedef struct
+{
+    radix_node_t *root;
+    uint32_t height;
+    uint64_t count;
+} radix_tree_t;
+
+#define RADIX_TREE_INIT { NULL, 0, 0 }
+
+int radix_tree_insert(radix_tree_t *tree, uint64_t index, void *item);
+void *radix_tree_lookup(radix_tree_t *tree, uint64_t index);
+void *radix_tree_delete(radix_tree_t *tree, uint64_t index);
+void radix_tree_destroy(radix_tree_t *tree);
+
+#endif
@@ -0,0 +1,44 @@
+#ifndef _LIB_RBTREE_H
+#define _LIB_RBTREE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <lib/container.h>
+
+// Intrusive red-black tree ordered by a 64-bit key. Entries embed an
+// rb_node_t and set its key before insertion; equal keys are allowed and
+// keep insertion order. A zeroed rbtree_t is a valid empty tree.
+#define RB_RED 0
+#define RB_BLACK 1
+
+typedef struct rb_node
+{
+    struct rb_node *parent;
+    struct rb_node *left;
+    struct rb_node *right;
+    uint64_t key;
+    uint32_t color;
+} rb_node_t;
+
+typedef struct
+{
+    rb_node_t *root;
+    uint64_t count;
+} rbtree_t;
+
+#define RBTREE_INIT { NULL, 0 }
+
+#define rb_entry(node, type, member) container_of(node, type, member)
+
+void rbtree_insert(rbtree_t *tree, rb_node_t *node);
+void rbtree_remove(rbtree_t *tree, rb_node_t *node);
+rb_node_t *rbtree_find(rbtree_t *tree, uint64_t key);
+rb_node_t *rbtree_lower_bound(rbtree_t *tree, uint64_t key);
+rb_node_t *rbtree_floor(rbtree_t *tree, uint64_t key);
+rb_node_t *rbtree_first(rbtree_t *tree);
+rb_node_t *rbtree_last(rbtree_t *tree);
+rb_node_t *rbtree_next(rb_node_t *node);
+rb_node_t *rbtree_prev(rb_node_t *node);
+
+#endif
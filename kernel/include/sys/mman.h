@@ -7,4 +7,11 @@
 #define PROT_NONE 0x0
 #define PROT_ALL (PROT_READ | PROT_WRITE | PROT_EXEC)
 
+#define MAP_SHARED 0x01
+#define MAP_PRIVATE 0x02
+#define MAP_TYPE 0x0f
+#define MAP_FIXED 0x10
+#define MAP_ANONYMOUS 0x20
+#define MAP_FAILED ((void *)-1)
+
 #endif
\ No newline at end of file
@@ -32,6 +32,7 @@ typedef	uint32_t	socklen_t;
 typedef uint16_t sa_family_t;
 
 typedef long suseconds_t;
+typedef int clockid_t;
 
 
 #endif
\ No newline at end of file
@@ -0,0 +1,194 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include <lib/hashtable.h>
+#include <memory.h>
+#include <string.h>
+
+static inline uint64_t hashtable_bucket(hashtable_t *table, uint64_t key)
+{
+    return hash_u64(key) >> (64 - __builtin_ctzll(table->bucket_count));
+}
+
+static void hashtable_resize(hashtable_t *table, uint64_t new_count)
+{
+    hash_node_t **new_buckets = (hash_node_t **)kmalloc(sizeof(hash_node_t *) * new_count);
+    if (new_buckets == NULL)
+    {
+        // keep the old (overloaded but valid) table
+        return;
+    }
+    memset(new_buckets, 0, sizeof(hash_node_t *) * new_count);
+
+    hash_node_t **old_buckets = table->buckets;
+    uint64_t old_count = table->bucket_count;
+
+    table->buckets = new_buckets;
+    table->bucket_count = new_count;
+
+    for (uint64_t i = 0; i < old_count; i++)
+    {
+        // entries sharing a key share a chain, and hashtable_find() relies on
+        // the most recent being first. Pushing onto the new chains reverses
+        // them, so reverse the old chain first.
+        hash_node_t *node = NULL;
+        hash_node_t *rest = old_buckets[i];
+        while (rest != NULL)
+        {
+            hash_node_t *next = rest->next;
+            rest->next = node;
+            node = rest;
+            rest = next;
+        }
+
+        while (node != NULL)
+        {
+            hash_node_t *next = node->next;
+            uint64_t bucket = hashtable_bucket(table, node->key);
+            node->next = new_buckets[bucket];
+            new_buckets[bucket] = node;
+            node = next;
+        }
+    }
+
+    if (old_buckets != NULL)
+    {
+        kfree(old_buckets);
+    }
+}
+
+/**
+ * Initialize an empty hash table. Equivalent to HASHTABLE_INIT.
+ *
+ * @param table The table to initialize
+ */
+void hashtable_init(hashtable_t *table)
+{
+    table->buckets = NULL;
+    table->bucket_count = 0;
+    table->count = 0;
+}
+
+/**
+ * Free a hash table's bucket array. The entries themselves are owned by the
+ * caller and are not touched.
+ *
+ * @param table The table to destroy
+ */
+void hashtable_destroy(hashtable_t *table)
+{
+    if (table->buckets != NULL)
+    {
+        kfree(table->buckets);
+    }
+    hashtable_init(table);
+}
+
+/**
+ * Insert an entry into a hash table. node->key must be set beforehand.
+ *
+ * @param table The table to insert into
+ * @param node The entry's embedded hash node
+ */
+void hashtable_insert(hashtable_t *table, hash_node_t *node)
+{
+    if (table->buckets == NULL)
+    {
+        hashtable_resize(table, HASHTABLE_MIN_BUCKETS);
+    }
+
+    uint64_t bucket = hashtable_bucket(table, node->key);
+    node->next = table->buckets[bucket];
+    table->buckets[bucket] = node;
+    table->count++;
+
+    if (table->count > table->bucket_count)
+    {
+        hashtable_resize(table, table->bucket_count * 2);
+    }
+}
+
+/**
+ * Find an entry in a hash table.
+ *
+ * @param table The table to search
+ * @param key The key to look for
+ *
+ * @return The most recently inserted entry with that key, or NULL
+ */
+hash_node_t *hashtable_find(hashtable_t *table, uint64_t key)
+{
+    if (table->buckets == NULL)
+    {
+        return NULL;
+    }
+
+    hash_node_t *node = table->buckets[hashtable_bucket(table, key)];
+    while (node != NULL)
+    {
+        if (node->key == key)
+        {
+            return node;
+        }
+        node = node->next;
+    }
+    return NULL;
+}
+
+/**
+ * Find the next entry sharing a key with one returned by hashtable_find().
+ *
+ * @param node The previous match
+ *
+ * @return The next entry with the same key, or NULL
+ */
+hash_node_t *hashtable_find_next(hash_node_t *node)
+{
+    uint64_t key = node->key;
+    node = node->next;
+    while (node != NULL)
+    {
+        if (node->key == key)
+        {
+            return node;
+        }
+        node = node->next;
+    }
+    return NULL;
+}
+
+/**
+ * Remove an entry from a hash table.
+ *
+ * @param table The table to remove from
+ * @param node The entry's embedded hash node
+ *
+ * @return true if the entry was in the table
+ */
+bool hashtable_remove(hashtable_t *table, hash_node_t *node)
+{
+    if (table->buckets == NULL)
+    {
+        return false;
+    }
+
+    hash_node_t **link = &table->buckets[hashtable_bucket(table, node->key)];
+    while (*link != NULL)
+    {
+        if (*link == node)
+        {
+            *link = node->next;
+            node->next = NULL;
+            table->count--;
+
+            if (table->bucket_count > HASHTABLE_MIN_BUCKETS && table->count < table->bucket_count / 4)
+            {
+                hashtable_resize(table, table->bucket_count / 2);
+            }
+            return true;
+        }
+        link = &(*link)->next;
+    }
+    return false;
+}
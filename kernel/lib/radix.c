@@ -0,0 +1,278 @@
+#include <stdint.h>
+#include <stddef.h>
+
+#include <lib/radix.h>
+#include <memory.h>
+#include <string.h>
+#include <sys/errno.h>
+
+// Largest index a tree of the given height can hold
+static inline uint64_t radix_tree_max_index(uint32_t height)
+{
+    if (height == 0)
+    {
+        return 0;
+    }
+    if (height * RADIX_TREE_BITS >= 64)
+    {
+        return UINT64_MAX;
+    }
+    return (1ull << (height * RADIX_TREE_BITS)) - 1;
+}
+
+static inline uint32_t radix_tree_slot(uint64_t index, uint32_t level)
+{
+    return (index >> (level * RADIX_TREE_BITS)) & RADIX_TREE_MASK;
+}
+
+static radix_node_t *radix_node_alloc()
+{
+    radix_node_t *node = (radix_node_t *)kmalloc(sizeof(radix_node_t));
+    if (node != NULL)
+    {
+        memset(node, 0, sizeof(radix_node_t));
+    }
+    return node;
+}
+
+static void radix_node_destroy(radix_node_t *node, uint32_t level)
+{
+    if (level > 0)
+    {
+        for (uint32_t i = 0; i < RADIX_TREE_SLOTS; i++)
+        {
+            if (node->slots[i] != NULL)
+            {
+                radix_node_destroy((radix_node_t *)node->slots[i], level - 1);
+            }
+        }
+    }
+    kfree(node);
+}
+
+// Undo the growth of a failed radix_tree_insert(), back to the root and
+// height it started with. The nodes it added above the old root only hold
+// the old root in slot 0 by then.
+static void radix_tree_unwind(radix_tree_t *tree, radix_node_t *old_root, uint32_t old_height)
+{
+    if (old_root == NULL)
+    {
+        kfree(tree->root);
+        tree->root = NULL;
+        tree->height = 0;
+        return;
+    }
+    while (tree->height > old_height)
+    {
+        radix_node_t *new_root = tree->root;
+        tree->root = (radix_node_t *)new_root->slots[0];
+        tree->height--;
+        kfree(new_root);
+    }
+}
+
+/**
+ * Store an item in a radix tree. If a node can't be allocated, the ones
+ * already allocated for the item are freed and the tree is left as it was.
+ *
+ * @param tree The tree to insert into
+ * @param index The index to store the item at
+ * @param item The item, must not be NULL
+ *
+ * @return 0 on success, -EEXIST if the index is taken, or another negative error
+ */
+int radix_tree_insert(radix_tree_t *tree, uint64_t index, void *item)
+{
+    if (item == NULL)
+    {
+        return -EINVAL;
+    }
+
+    uint32_t needed = 1;
+    while (index > radix_tree_max_index(needed))
+    {
+        needed++;
+    }
+
+    radix_node_t *old_root = tree->root;
+    uint32_t old_height = tree->height;
+    if (tree->root == NULL)
+    {
+        tree->root = radix_node_alloc();
+        if (tree->root == NULL)
+        {
+            return -ENOMEM;
+        }
+        tree->height = needed;
+    }
+
+    // grow upward, the existing tree becomes slot 0 of each new root
+    while (tree->height < needed)
+    {
+        radix_node_t *new_root = radix_node_alloc();
+        if (new_root == NULL)
+        {
+            radix_tree_unwind(tree, old_root, old_height);
+            return -ENOMEM;
+        }
+        new_root->slots[0] = tree->root;
+        new_root->count = 1;
+        tree->root = new_root;
+        tree->height++;
+    }
+
+    // the first node allocated on the way down, everything below it is new
+    radix_node_t *added_parent = NULL;
+    uint32_t added_level = 0;
+
+    radix_node_t *node = tree->root;
+    for (uint32_t level = tree->height - 1; level > 0; level--)
+    {
+        uint32_t slot = radix_tree_slot(index, level);
+        if (node->slots[slot] == NULL)
+        {
+            radix_node_t *child = radix_node_alloc();
+            if (child == NULL)
+            {
+                if (added_parent != NULL)
+                {
+                    uint32_t added_slot = radix_tree_slot(index, added_level);
+                    radix_node_destroy((radix_node_t *)added_parent->slots[added_slot], added_level - 1);
+                    added_parent->slots[added_slot] = NULL;
+                    added_parent->count--;
+                }
+                radix_tree_unwind(tree, old_root, old_height);
+                return -ENOMEM;
+            }
+            if (added_parent == NULL)
+            {
+                added_parent = node;
+                added_level = level;
+            }
+            node->slots[slot] = child;
+            node->count++;
+        }
+        node = (radix_node_t *)node->slots[slot];
+    }
+
+    uint32_t slot = radix_tree_slot(index, 0);
+    if (node->slots[slot] != NULL)
+    {
+        return -EEXIST;
+    }
+    node->slots[slot] = item;
+    node->count++;
+    tree->count++;
+
+    return 0;
+}
+
+/**
+ * Look up an item in a radix tree.
+ *
+ * @param tree The tree to search
+ * @param index The index to look up
+ *
+ * @return The item, or NULL if nothing is stored at index
+ */
+void *radix_tree_lookup(radix_tree_t *tree, uint64_t index)
+{
+    if (tree->root == NULL || index > radix_tree_max_index(tree->height))
+    {
+        return NULL;
+    }
+
+    radix_node_t *node = tree->root;
+    for (uint32_t level = tree->height - 1; level > 0; level--)
+    {
+        node = (radix_node_t *)node->slots[radix_tree_slot(index, level)];
+        if (node == NULL)
+        {
+            return NULL;
+        }
+    }
+    return node->slots[radix_tree_slot(index, 0)];
+}
+
+/**
+ * Remove an item from a radix tree, freeing any nodes left empty.
+ *
+ * @param tree The tree to remove from
+ * @param index The index to clear
+ *
+ * @return The item that was removed, or NULL if nothing was stored at index
+ */
+void *radix_tree_delete(radix_tree_t *tree, uint64_t index)
+{
+    if (tree->root == NULL || index > radix_tree_max_index(tree->height))
+    {
+        return NULL;
+    }
+
+    radix_node_t *path[RADIX_TREE_MAX_HEIGHT];
+    radix_node_t *node = tree->root;
+    for (uint32_t level = tree->height - 1; level > 0; level--)
+    {
+        path[level] = node;
+        node = (radix_node_t *)node->slots[radix_tree_slot(index, level)];
+        if (node == NULL)
+        {
+            return NULL;
+        }
+    }
+
+    uint32_t slot = radix_tree_slot(index, 0);
+    void *item = node->slots[slot];
+    if (item == NULL)
+    {
+        return NULL;
+    }
+    node->slots[slot] = NULL;
+    node->count--;
+    tree->count--;
+
+    // free empty nodes on the way back up
+    for (uint32_t level = 1; level < tree->height && node->count == 0; level++)
+    {
+        kfree(node);
+        node = path[level];
+        node->slots[radix_tree_slot(index, level)] = NULL;
+        node->count--;
+    }
+
+    if (tree->root->count == 0)
+    {
+        kfree(tree->root);
+        tree->root = NULL;
+        tree->height = 0;
+        return item;
+    }
+
+    // shrink while everything lives under slot 0 of the root
+    while (tree->height > 1 && tree->root->count == 1 && tree->root->slots[0] != NULL)
+    {
+        radix_node_t *old_root = tree->root;
+        tree->root = (radix_node_t *)old_root->slots[0];
+        tree->height--;
+        kfree(old_root);
+    }
+
+    return item;
+}
+
+/**
+ * Free every node of a radix tree. The stored items are owned by the caller
+ * and are not touched.
+ *
+ * @param tree The tree to destroy
+ */
+void radix_tree_destroy(radix_tree_t *tree)
+{
+    if (tree->root != NULL)
+    {
+        radix_node_destroy(tree->root, tree->height - 1);
+    }
+    tree->root = NULL;
+    tree->height = 0;
+    tree->count = 0;
+}
@@ -0,0 +1,481 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include <lib/rbtree.h>
+
+static void rbtree_rotate_left(rbtree_t *tree, rb_node_t *node)
+{
+    rb_node_t *right = node->right;
+
+    node->right = right->left;
+    if (right->left != NULL)
+    {
+        right->left->parent = node;
+    }
+
+    right->left = node;
+    right->parent = node->parent;
+    if (node->parent == NULL)
+    {
+        tree->root = right;
+    }
+    else if (node == node->parent->left)
+    {
+        node->parent->left = right;
+    }
+    else
+    {
+        node->parent->right = right;
+    }
+    node->parent = right;
+}
+
+static void rbtree_rotate_right(rbtree_t *tree, rb_node_t *node)
+{
+    rb_node_t *left = node->left;
+
+    node->left = left->right;
+    if (left->right != NULL)
+    {
+        left->right->parent = node;
+    }
+
+    left->right = node;
+    left->parent = node->parent;
+    if (node->parent == NULL)
+    {
+        tree->root = left;
+    }
+    else if (node == node->parent->right)
+    {
+        node->parent->right = left;
+    }
+    else
+    {
+        node->parent->left = left;
+    }
+    node->parent = left;
+}
+
+static inline bool rbtree_is_black(rb_node_t *node)
+{
+    // NULL leaves count as black
+    return node == NULL || node->color == RB_BLACK;
+}
+
+/**
+ * Insert an entry into a red-black tree. node->key must be set beforehand.
+ * Entries with equal keys are placed after the existing ones.
+ *
+ * @param tree The tree to insert into
+ * @param node The entry's embedded tree node
+ */
+void rbtree_insert(rbtree_t *tree, rb_node_t *node)
+{
+    rb_node_t *parent = NULL;
+    rb_node_t **link = &tree->root;
+    while (*link != NULL)
+    {
+        parent = *link;
+        if (node->key < parent->key)
+        {
+            link = &parent->left;
+        }
+        else
+        {
+            link = &parent->right;
+        }
+    }
+
+    node->parent = parent;
+    node->left = NULL;
+    node->right = NULL;
+    node->color = RB_RED;
+    *link = node;
+    tree->count++;
+
+    // restore the red-black properties
+    while ((parent = node->parent) != NULL && parent->color == RB_RED)
+    {
+        rb_node_t *grandparent = parent->parent;
+        if (parent == grandparent->left)
+        {
+            rb_node_t *uncle = grandparent->right;
+            if (!rbtree_is_black(uncle))
+            {
+                uncle->color = RB_BLACK;
+                parent->color = RB_BLACK;
+                grandparent->color = RB_RED;
+                node = grandparent;
+                continue;
+            }
+
+            if (node == parent->right)
+            {
+                rbtree_rotate_left(tree, parent);
+                rb_node_t *tmp = parent;
+                parent = node;
+                node = tmp;
+            }
+
+            parent->color = RB_BLACK;
+            grandparent->color = RB_RED;
+            rbtree_rotate_right(tree, grandparent);
+        }
+        else
+        {
+            rb_node_t *uncle = grandparent->left;
+            if (!rbtree_is_black(uncle))
+            {
+                uncle->color = RB_BLACK;
+                parent->color = RB_BLACK;
+                grandparent->color = RB_RED;
+                node = grandparent;
+                continue;
+            }
+
+            if (node == parent->left)
+            {
+                rbtree_rotate_right(tree, parent);
+                rb_node_t *tmp = parent;
+                parent = node;
+                node = tmp;
+            }
+
+            parent->color = RB_BLACK;
+            grandparent->color = RB_RED;
+            rbtree_rotate_left(tree, grandparent);
+        }
+    }
+
+    tree->root->color = RB_BLACK;
+}
+
+static void rbtree_remove_fixup(rbtree_t *tree, rb_node_t *node, rb_node_t *parent)
+{
+    while (rbtree_is_black(node) && node != tree->root)
+    {
+        if (node == parent->left)
+        {
+            rb_node_t *sibling = parent->right;
+            if (sibling->color == RB_RED)
+            {
+                sibling->color = RB_BLACK;
+                parent->color = RB_RED;
+                rbtree_rotate_left(tree, parent);
+                sibling = parent->right;
+            }
+
+            if (rbtree_is_black(sibling->left) && rbtree_is_black(sibling->right))
+            {
+                sibling->color = RB_RED;
+                node = parent;
+                parent = node->parent;
+            }
+            else
+            {
+                if (rbtree_is_black(sibling->right))
+                {
+                    sibling->left->color = RB_BLACK;
+                    sibling->color = RB_RED;
+                    rbtree_rotate_right(tree, sibling);
+                    sibling = parent->right;
+                }
+
+                sibling->color = parent->color;
+                parent->color = RB_BLACK;
+                sibling->right->color = RB_BLACK;
+                rbtree_rotate_left(tree, parent);
+                node = tree->root;
+                break;
+            }
+        }
+        else
+        {
+            rb_node_t *sibling = parent->left;
+            if (sibling->color == RB_RED)
+            {
+                sibling->color = RB_BLACK;
+                parent->color = RB_RED;
+                rbtree_rotate_right(tree, parent);
+                sibling = parent->left;
+            }
+
+            if (rbtree_is_black(sibling->left) && rbtree_is_black(sibling->right))
+            {
+                sibling->color = RB_RED;
+                node = parent;
+                parent = node->parent;
+            }
+            else
+            {
+                if (rbtree_is_black(sibling->left))
+                {
+                    sibling->right->color = RB_BLACK;
+                    sibling->color = RB_RED;
+                    rbtree_rotate_left(tree, sibling);
+                    sibling = parent->left;
+                }
+
+                sibling->color = parent->color;
+                parent->color = RB_BLACK;
+                sibling->left->color = RB_BLACK;
+                rbtree_rotate_right(tree, parent);
+                node = tree->root;
+                break;
+            }
+        }
+    }
+
+    if (node != NULL)
+    {
+        node->color = RB_BLACK;
+    }
+}
+
+/**
+ * Remove an entry from a red-black tree.
+ *
+ * @param tree The tree the entry is in
+ * @param node The entry's embedded tree node
+ */
+void rbtree_remove(rbtree_t *tree, rb_node_t *node)
+{
+    rb_node_t *child;
+    rb_node_t *parent;
+    uint32_t color;
+
+    if (node->left != NULL && node->right != NULL)
+    {
+        // two children, splice the in-order successor into node's place
+        rb_node_t *successor = node->right;
+        while (successor->left != NULL)
+        {
+            successor = successor->left;
+        }
+
+        if (node->parent == NULL)
+        {
+            tree->root = successor;
+        }
+        else if (node->parent->left == node)
+        {
+            node->parent->left = successor;
+        }
+        else
+        {
+            node->parent->right = successor;
+        }
+
+        child = successor->right;
+        parent = successor->parent;
+        color = successor->color;
+
+        if (parent == node)
+        {
+            parent = successor;
+        }
+        else
+        {
+            if (child != NULL)
+            {
+                child->parent = parent;
+            }
+            parent->left = child;
+            successor->right = node->right;
+            node->right->parent = successor;
+        }
+
+        successor->parent = node->parent;
+        successor->color = node->color;
+        successor->left = node->left;
+        node->left->parent = successor;
+    }
+    else
+    {
+        child = node->left != NULL ? node->left : node->right;
+        parent = node->parent;
+        color = node->color;
+
+        if (child != NULL)
+        {
+            child->parent = parent;
+        }
+
+        if (parent == NULL)
+        {
+            tree->root = child;
+        }
+        else if (parent->left == node)
+        {
+            parent->left = child;
+        }
+        else
+        {
+            parent->right = child;
+        }
+    }
+
+    if (color == RB_BLACK)
+    {
+        rbtree_remove_fixup(tree, child, parent);
+    }
+
+    node->parent = NULL;
+    node->left = NULL;
+    node->right = NULL;
+    tree->count--;
+}
+
+/**
+ * Find an entry in a red-black tree.
+ *
+ * @param tree The tree to search
+ * @param key The key to look for
+ *
+ * @return The first entry with that key, or NULL
+ */
+rb_node_t *rbtree_find(rbtree_t *tree, uint64_t key)
+{
+    rb_node_t *node = rbtree_lower_bound(tree, key);
+    if (node != NULL && node->key == key)
+    {
+        return node;
+    }
+    return NULL;
+}
+
+/**
+ * Find the first entry with a key greater than or equal to key.
+ *
+ * @param tree The tree to search
+ * @param key The lower bound
+ *
+ * @return The entry, or NULL if every key is smaller
+ */
+rb_node_t *rbtree_lower_bound(rbtree_t *tree, uint64_t key)
+{
+    rb_node_t *node = tree->root;
+    rb_node_t *best = NULL;
+    while (node != NULL)
+    {
+        if (node->key >= key)
+        {
+            best = node;
+            node = node->left;
+        }
+        else
+        {
+            node = node->right;
+        }
+    }
+    return best;
+}
+
+/**
+ * Find the last entry with a key less than or equal to key.
+ *
+ * @param tree The tree to search
+ * @param key The upper bound
+ *
+ * @return The entry, or NULL if every key is larger
+ */
+rb_node_t *rbtree_floor(rbtree_t *tree, uint64_t key)
+{
+    rb_node_t *node = tree->root;
+    rb_node_t *best = NULL;
+    while (node != NULL)
+    {
+        if (node->key <= key)
+        {
+            best = node;
+            node = node->right;
+        }
+        else
+        {
+            node = node->left;
+        }
+    }
+    return best;
+}
+
+rb_node_t *rbtree_first(rbtree_t *tree)
+{
+    rb_node_t *node = tree->root;
+    if (node == NULL)
+    {
+        return NULL;
+    }
+    while (node->left != NULL)
+    {
+        node = node->left;
+    }
+    return node;
+}
+
+rb_node_t *rbtree_last(rbtree_t *tree)
+{
+    rb_node_t *node = tree->root;
+    if (node == NULL)
+    {
+        return NULL;
+    }
+    while (node->right != NULL)
+    {
+        node = node->right;
+    }
+    return node;
+}
+
+/**
+ * Get the in-order successor of an entry.
+ *
+ * @param node The current entry
+ *
+ * @return The next entry, or NULL if node is the last
+ */
+rb_node_t *rbtree_next(rb_node_t *node)
+{
+    if (node->right != NULL)
+    {
+        node = node->right;
+        while (node->left != NULL)
+        {
+            node = node->left;
+        }
+        return node;
+    }
+
+    while (node->parent != NULL && node == node->parent->right)
+    {
+        node = node->parent;
+    }
+    return node->parent;
+}
+
+/**
+ * Get the in-order predecessor of an entry.
+ *
+ * @param node The current entry
+ *
+ * @return The previous entry, or NULL if node is the first
+ */
+rb_node_t *rbtree_prev(rb_node_t *node)
+{
+    if (node->left != NULL)
+    {
+        node = node->left;
+        while (node->right != NULL)
+        {
+            node = node->right;
+        }
+        return node;
+    }
+
+    while (node->parent != NULL && node == node->parent->left)
+    {
+        node = node->parent;
+    }
+    return node->parent;
+}
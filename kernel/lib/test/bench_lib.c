@@ -0,0 +1,258 @@
+// Host benchmarks for kernel/lib, built and run by "make bench_lib". Times
+// each container against the list walk it replaces, with keys 1..n in a
+// random order like a PID table: inserting every entry and removing it
+// again, and looking entries up.
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <lib/list.h>
+#include <lib/hashtable.h>
+#include <lib/rbtree.h>
+#include <lib/radix.h>
+
+void *kmalloc(uint64_t size)
+{
+    return malloc(size);
+}
+
+void kfree(void *ptr)
+{
+    free(ptr);
+}
+
+typedef struct
+{
+    uint64_t key;
+    list_node_t list_node;
+    hash_node_t hash_node;
+    rb_node_t rb_node;
+} bench_entry_t;
+
+#define BENCH_MAX_ENTRIES 5000
+// Each measurement repeats whole rounds until it has taken this long
+#define BENCH_MIN_NS 200000000ull
+
+static bench_entry_t entries[BENCH_MAX_ENTRIES];
+static uint64_t lookups[BENCH_MAX_ENTRIES];
+
+// Sum of everything looked up, so the lookups can't be optimised away
+static volatile uint64_t bench_sink;
+
+static uint64_t rand_state = 0x2545F4914F6CDD1Dull;
+
+static uint64_t bench_rand()
+{
+    rand_state ^= rand_state << 13;
+    rand_state ^= rand_state >> 7;
+    rand_state ^= rand_state << 17;
+    return rand_state;
+}
+
+static uint64_t bench_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void bench_shuffle(uint64_t *keys, uint64_t n)
+{
+    for (uint64_t i = n - 1; i > 0; i--)
+    {
+        uint64_t j = bench_rand() % (i + 1);
+        uint64_t key = keys[i];
+        keys[i] = keys[j];
+        keys[j] = key;
+    }
+}
+
+static void bench_setup(uint64_t n)
+{
+    uint64_t keys[BENCH_MAX_ENTRIES];
+    for (uint64_t i = 0; i < n; i++)
+    {
+        keys[i] = i + 1;
+    }
+    bench_shuffle(keys, n);
+    for (uint64_t i = 0; i < n; i++)
+    {
+        entries[i].key = keys[i];
+        lookups[i] = keys[i];
+    }
+    bench_shuffle(lookups, n);
+}
+
+static bench_entry_t *list_lookup(list_node_t *head, uint64_t key)
+{
+    list_node_t *pos;
+    list_for_each(pos, head)
+    {
+        bench_entry_t *entry = list_entry(pos, bench_entry_t, list_node);
+        if (entry->key == key)
+        {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+// Fill a container with the n entries, look one up, or remove them all
+// one at a time
+typedef struct
+{
+    const char *name;
+    void (*insert)(uint64_t n);
+    uint64_t (*lookup)(uint64_t key);
+    void (*remove)(uint64_t n);
+} bench_container_t;
+
+static list_node_t bench_list = LIST_HEAD_INIT(bench_list);
+static hashtable_t bench_table = HASHTABLE_INIT;
+static rbtree_t bench_tree = RBTREE_INIT;
+static radix_tree_t bench_radix = {0};
+
+static void list_insert_all(uint64_t n)
+{
+    for (uint64_t i = 0; i < n; i++)
+    {
+        list_add_tail(&bench_list, &entries[i].list_node);
+    }
+}
+
+static uint64_t list_lookup_one(uint64_t key)
+{
+    return list_lookup(&bench_list, key)->key;
+}
+
+static void list_remove_all(uint64_t n)
+{
+    for (uint64_t i = 0; i < n; i++)
+    {
+        list_remove(&entries[i].list_node);
+    }
+}
+
+static void hashtable_insert_all(uint64_t n)
+{
+    for (uint64_t i = 0; i < n; i++)
+    {
+        entries[i].hash_node.key = entries[i].key;
+        hashtable_insert(&bench_table, &entries[i].hash_node);
+    }
+}
+
+static uint64_t hashtable_lookup_one(uint64_t key)
+{
+    return hash_entry(hashtable_find(&bench_table, key), bench_entry_t, hash_node)->key;
+}
+
+static void hashtable_remove_all(uint64_t n)
+{
+    for (uint64_t i = 0; i < n; i++)
+    {
+        hashtable_remove(&bench_table, &entries[i].hash_node);
+    }
+}
+
+static void rbtree_insert_all(uint64_t n)
+{
+    for (uint64_t i = 0; i < n; i++)
+    {
+        entries[i].rb_node.key = entries[i].key;
+        rbtree_insert(&bench_tree, &entries[i].rb_node);
+    }
+}
+
+static uint64_t rbtree_lookup_one(uint64_t key)
+{
+    return rb_entry(rbtree_find(&bench_tree, key), bench_entry_t, rb_node)->key;
+}
+
+static void rbtree_remove_all(uint64_t n)
+{
+    for (uint64_t i = 0; i < n; i++)
+    {
+        rbtree_remove(&bench_tree, &entries[i].rb_node);
+    }
+}
+
+static void radix_insert_all(uint64_t n)
+{
+    for (uint64_t i = 0; i < n; i++)
+    {
+        radix_tree_insert(&bench_radix, entries[i].key, &entries[i]);
+    }
+}
+
+static uint64_t radix_lookup_one(uint64_t key)
+{
+    return ((bench_entry_t *)radix_tree_lookup(&bench_radix, key))->key;
+}
+
+static void radix_remove_all(uint64_t n)
+{
+    for (uint64_t i = 0; i < n; i++)
+    {
+        radix_tree_delete(&bench_radix, entries[i].key);
+    }
+}
+
+static const bench_container_t containers[] = {
+    {"list walk", list_insert_all, list_lookup_one, list_remove_all},
+    {"hashtable", hashtable_insert_all, hashtable_lookup_one, hashtable_remove_all},
+    {"rbtree", rbtree_insert_all, rbtree_lookup_one, rbtree_remove_all},
+    {"radix tree", radix_insert_all, radix_lookup_one, radix_remove_all},
+};
+
+static void bench_container(const bench_container_t *container, uint64_t n)
+{
+    uint64_t churn_ops = 0;
+    uint64_t start = bench_now();
+    uint64_t churn_ns;
+    do
+    {
+        container->insert(n);
+        container->remove(n);
+        churn_ops += n;
+        churn_ns = bench_now() - start;
+    } while (churn_ns < BENCH_MIN_NS);
+
+    container->insert(n);
+    uint64_t lookup_ops = 0;
+    uint64_t sum = 0;
+    start = bench_now();
+    uint64_t lookup_ns;
+    do
+    {
+        for (uint64_t i = 0; i < n; i++)
+        {
+            sum += container->lookup(lookups[i]);
+        }
+        lookup_ops += n;
+        lookup_ns = bench_now() - start;
+    } while (lookup_ns < BENCH_MIN_NS);
+    container->remove(n);
+    bench_sink += sum;
+
+    printf("%-12s %8lu %18.1f %12.1f\n", container->name, n, (double)churn_ns / churn_ops, (double)lookup_ns / lookup_ops);
+}
+
+int main()
+{
+    static const uint64_t sizes[] = {5, 500, 5000};
+
+    printf("%-12s %8s %18s %12s\n", "container", "entries", "insert+remove ns", "lookup ns");
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+    {
+        bench_setup(sizes[i]);
+        for (size_t j = 0; j < sizeof(containers) / sizeof(containers[0]); j++)
+        {
+            bench_container(&containers[j], sizes[i]);
+        }
+    }
+    return 0;
+}
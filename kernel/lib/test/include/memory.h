@@ -0,0 +1,11 @@
+#ifndef _LIB_TEST_MEMORY_H
+#define _LIB_TEST_MEMORY_H
+
+#include <stdint.h>
+
+// Stands in for the kernel's memory.h when kernel/lib is built for the host
+// by test_lib.c, which counts allocations and can make them fail.
+void *kmalloc(uint64_t size);
+void kfree(void *ptr);
+
+#endif
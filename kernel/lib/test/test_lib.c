@@ -0,0 +1,408 @@
+// Host unit tests for kernel/lib, built and run by "make test_lib". The
+// containers are compiled unchanged against include/memory.h, which routes
+// kmalloc() and kfree() here.
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <lib/list.h>
+#include <lib/hashtable.h>
+#include <lib/rbtree.h>
+#include <lib/radix.h>
+#include <sys/errno.h>
+
+static int failures = 0;
+
+#define CHECK(cond) \
+    do \
+    { \
+        if (!(cond)) \
+        { \
+            printf("%s:%d: %s failed\n", __FILE__, __LINE__, #cond); \
+            failures++; \
+        } \
+    } while (0)
+
+// Outstanding kmalloc() blocks, and how many more may succeed, -1 for all
+static int64_t allocated = 0;
+static int64_t allocs_left = -1;
+
+void *kmalloc(uint64_t size)
+{
+    if (allocs_left == 0)
+    {
+        return NULL;
+    }
+    if (allocs_left > 0)
+    {
+        allocs_left--;
+    }
+    allocated++;
+    return malloc(size);
+}
+
+void kfree(void *ptr)
+{
+    allocated--;
+    free(ptr);
+}
+
+// Small deterministic generator, so a failure can be reproduced
+static uint64_t rand_state = 0x2545F4914F6CDD1Dull;
+
+static uint64_t test_rand()
+{
+    rand_state ^= rand_state << 13;
+    rand_state ^= rand_state >> 7;
+    rand_state ^= rand_state << 17;
+    return rand_state;
+}
+
+typedef struct
+{
+    uint64_t value;
+    list_node_t list_node;
+    hash_node_t hash_node;
+    rb_node_t rb_node;
+    bool present;
+} test_entry_t;
+
+#define TEST_ENTRIES 4096
+
+static test_entry_t entries[TEST_ENTRIES];
+
+static void test_list()
+{
+    list_node_t head = LIST_HEAD_INIT(head);
+    CHECK(list_empty(&head));
+
+    for (uint64_t i = 0; i < 8; i++)
+    {
+        entries[i].value = i;
+        list_add_tail(&head, &entries[i].list_node);
+    }
+    list_add(&head, &entries[8].list_node);
+    entries[8].value = 8;
+
+    // 8, 0, 1, ..., 7
+    list_node_t *pos;
+    uint64_t expected[] = {8, 0, 1, 2, 3, 4, 5, 6, 7};
+    uint64_t n = 0;
+    list_for_each(pos, &head)
+    {
+        CHECK(n < 9 && list_entry(pos, test_entry_t, list_node)->value == expected[n]);
+        n++;
+    }
+    CHECK(n == 9);
+
+    // drop the odd ones while walking
+    list_node_t *tmp;
+    list_for_each_safe(pos, tmp, &head)
+    {
+        test_entry_t *entry = list_entry(pos, test_entry_t, list_node);
+        if (entry->value % 2 == 1)
+        {
+            list_remove(pos);
+            CHECK(list_empty(pos));
+        }
+    }
+    n = 0;
+    list_for_each(pos, &head)
+    {
+        CHECK(list_entry(pos, test_entry_t, list_node)->value % 2 == 0);
+        n++;
+    }
+    CHECK(n == 5);
+    CHECK(list_first_entry(&head, test_entry_t, list_node)->value == 8);
+}
+
+static void test_hashtable()
+{
+    hashtable_t table = HASHTABLE_INIT;
+    CHECK(hashtable_find(&table, 1) == NULL);
+
+    for (uint64_t i = 0; i < TEST_ENTRIES; i++)
+    {
+        entries[i].value = i;
+        entries[i].hash_node.key = i;
+        hashtable_insert(&table, &entries[i].hash_node);
+    }
+    CHECK(table.count == TEST_ENTRIES);
+    CHECK(table.bucket_count >= TEST_ENTRIES);
+
+    for (uint64_t i = 0; i < TEST_ENTRIES; i++)
+    {
+        hash_node_t *node = hashtable_find(&table, i);
+        CHECK(node != NULL && hash_entry(node, test_entry_t, hash_node)->value == i);
+    }
+    CHECK(hashtable_find(&table, TEST_ENTRIES) == NULL);
+
+    // removing shrinks the table back down
+    for (uint64_t i = 0; i < TEST_ENTRIES; i++)
+    {
+        CHECK(hashtable_remove(&table, &entries[i].hash_node));
+        CHECK(hashtable_find(&table, i) == NULL);
+    }
+    CHECK(!hashtable_remove(&table, &entries[0].hash_node));
+    CHECK(table.count == 0);
+    CHECK(table.bucket_count == HASHTABLE_MIN_BUCKETS);
+
+    // entries sharing a key come back most recent first, across resizes
+    for (uint64_t i = 0; i < TEST_ENTRIES; i++)
+    {
+        entries[i].value = i;
+        entries[i].hash_node.key = i % 3;
+        hashtable_insert(&table, &entries[i].hash_node);
+    }
+    for (uint64_t key = 0; key < 3; key++)
+    {
+        uint64_t last = UINT64_MAX;
+        uint64_t n = 0;
+        for (hash_node_t *node = hashtable_find(&table, key); node != NULL; node = hashtable_find_next(node))
+        {
+            uint64_t value = hash_entry(node, test_entry_t, hash_node)->value;
+            CHECK(value % 3 == key && value < last);
+            last = value;
+            n++;
+        }
+        CHECK(n == (TEST_ENTRIES - key + 2) / 3);
+    }
+    for (uint64_t i = 0; i < TEST_ENTRIES; i++)
+    {
+        CHECK(hashtable_remove(&table, &entries[i].hash_node));
+    }
+
+    hashtable_destroy(&table);
+    CHECK(table.buckets == NULL);
+}
+
+// Check the red-black properties below node and return its black height,
+// or -1 if they don't hold
+static int rbtree_check(rb_node_t *node, rb_node_t *parent, uint64_t *count)
+{
+    if (node == NULL)
+    {
+        return 1;
+    }
+    (*count)++;
+    if (node->parent != parent)
+    {
+        return -1;
+    }
+    if (node->color == RB_RED && ((node->left != NULL && node->left->color == RB_RED) || (node->right != NULL && node->right->color == RB_RED)))
+    {
+        return -1;
+    }
+    if ((node->left != NULL && node->left->key > node->key) || (node->right != NULL && node->right->key < node->key))
+    {
+        return -1;
+    }
+    int left = rbtree_check(node->left, node, count);
+    int right = rbtree_check(node->right, node, count);
+    if (left < 0 || left != right)
+    {
+        return -1;
+    }
+    return left + (node->color == RB_BLACK ? 1 : 0);
+}
+
+static void rbtree_check_tree(rbtree_t *tree)
+{
+    uint64_t count = 0;
+    CHECK(tree->root == NULL || tree->root->color == RB_BLACK);
+    CHECK(rbtree_check(tree->root, NULL, &count) > 0);
+    CHECK(count == tree->count);
+}
+
+static void test_rbtree()
+{
+    rbtree_t tree = RBTREE_INIT;
+    CHECK(rbtree_first(&tree) == NULL);
+    CHECK(rbtree_find(&tree, 0) == NULL);
+
+    // even keys only, in random order
+    for (uint64_t i = 0; i < TEST_ENTRIES; i++)
+    {
+        entries[i].value = i * 2;
+        entries[i].present = false;
+    }
+    for (uint64_t i = TEST_ENTRIES - 1; i > 0; i--)
+    {
+        uint64_t j = test_rand() % (i + 1);
+        uint64_t value = entries[i].value;
+        entries[i].value = entries[j].value;
+        entries[j].value = value;
+    }
+    for (uint64_t i = 0; i < TEST_ENTRIES; i++)
+    {
+        entries[i].rb_node.key = entries[i].value;
+        rbtree_insert(&tree, &entries[i].rb_node);
+        entries[i].present = true;
+    }
+    rbtree_check_tree(&tree);
+
+    // walks both ways visit every key in order
+    uint64_t n = 0;
+    for (rb_node_t *node = rbtree_first(&tree); node != NULL; node = rbtree_next(node))
+    {
+        CHECK(node->key == n * 2);
+        n++;
+    }
+    CHECK(n == TEST_ENTRIES);
+    for (rb_node_t *node = rbtree_last(&tree); node != NULL; node = rbtree_prev(node))
+    {
+        n--;
+        CHECK(node->key == n * 2);
+    }
+
+    CHECK(rbtree_find(&tree, 10) != NULL && rbtree_find(&tree, 10)->key == 10);
+    CHECK(rbtree_find(&tree, 11) == NULL);
+    CHECK(rbtree_lower_bound(&tree, 11) != NULL && rbtree_lower_bound(&tree, 11)->key == 12);
+    CHECK(rbtree_lower_bound(&tree, 12)->key == 12);
+    CHECK(rbtree_lower_bound(&tree, TEST_ENTRIES * 2) == NULL);
+    CHECK(rbtree_floor(&tree, 11) != NULL && rbtree_floor(&tree, 11)->key == 10);
+    CHECK(rbtree_floor(&tree, 10)->key == 10);
+
+    // remove half at random, keeping the tree balanced throughout
+    for (uint64_t i = 0; i < TEST_ENTRIES / 2; i++)
+    {
+        test_entry_t *entry = &entries[test_rand() % TEST_ENTRIES];
+        if (!entry->present)
+        {
+            continue;
+        }
+        rbtree_remove(&tree, &entry->rb_node);
+        entry->present = false;
+        CHECK(rbtree_find(&tree, entry->value) == NULL);
+        if (i % 64 == 0)
+        {
+            rbtree_check_tree(&tree);
+        }
+    }
+    rbtree_check_tree(&tree);
+    for (uint64_t i = 0; i < TEST_ENTRIES; i++)
+    {
+        if (entries[i].present)
+        {
+            CHECK(rbtree_find(&tree, entries[i].value) == &entries[i].rb_node);
+            rbtree_remove(&tree, &entries[i].rb_node);
+        }
+    }
+    CHECK(tree.root == NULL && tree.count == 0);
+
+    // equal keys keep insertion order
+    for (uint64_t i = 0; i < 64; i++)
+    {
+        entries[i].value = i;
+        entries[i].rb_node.key = i % 4;
+        rbtree_insert(&tree, &entries[i].rb_node);
+    }
+    rbtree_check_tree(&tree);
+    uint64_t last_key = 0;
+    uint64_t last_value[4] = {0};
+    bool seen[4] = {false};
+    for (rb_node_t *node = rbtree_first(&tree); node != NULL; node = rbtree_next(node))
+    {
+        uint64_t value = rb_entry(node, test_entry_t, rb_node)->value;
+        CHECK(node->key >= last_key);
+        CHECK(!seen[node->key] || value > last_value[node->key]);
+        last_key = node->key;
+        last_value[node->key] = value;
+        seen[node->key] = true;
+    }
+    CHECK(rb_entry(rbtree_find(&tree, 2), test_entry_t, rb_node)->value == 2);
+}
+
+static void test_radix()
+{
+    radix_tree_t tree = {0};
+    CHECK(radix_tree_lookup(&tree, 0) == NULL);
+    CHECK(radix_tree_insert(&tree, 0, NULL) == -EINVAL);
+
+    // sparse indices, including ones that need the full height
+    uint64_t indices[] = {0, 1, 63, 64, 4095, 4096, 1ull << 30, (1ull << 40) + 5, UINT64_MAX - 1, UINT64_MAX};
+    uint64_t count = sizeof(indices) / sizeof(indices[0]);
+    for (uint64_t i = 0; i < count; i++)
+    {
+        CHECK(radix_tree_insert(&tree, indices[i], &entries[i]) == 0);
+    }
+    CHECK(tree.count == count);
+    CHECK(tree.height == RADIX_TREE_MAX_HEIGHT);
+    for (uint64_t i = 0; i < count; i++)
+    {
+        CHECK(radix_tree_lookup(&tree, indices[i]) == &entries[i]);
+        CHECK(radix_tree_insert(&tree, indices[i], &entries[i]) == -EEXIST);
+    }
+    CHECK(radix_tree_lookup(&tree, 2) == NULL);
+    CHECK(radix_tree_lookup(&tree, 1ull << 31) == NULL);
+    CHECK(radix_tree_delete(&tree, 2) == NULL);
+
+    // deleting everything but index 1 shrinks it back to one node
+    for (uint64_t i = count - 1; i > 0; i--)
+    {
+        if (indices[i] != 1)
+        {
+            CHECK(radix_tree_delete(&tree, indices[i]) == &entries[i]);
+            CHECK(radix_tree_lookup(&tree, indices[i]) == NULL);
+        }
+    }
+    CHECK(radix_tree_delete(&tree, 0) == &entries[0]);
+    CHECK(tree.height == 1 && tree.count == 1 && allocated == 1);
+    CHECK(radix_tree_delete(&tree, 1) == &entries[1]);
+    CHECK(tree.root == NULL && allocated == 0);
+
+    // a dense run
+    for (uint64_t i = 0; i < TEST_ENTRIES; i++)
+    {
+        CHECK(radix_tree_insert(&tree, i, &entries[i]) == 0);
+    }
+    for (uint64_t i = 0; i < TEST_ENTRIES; i++)
+    {
+        CHECK(radix_tree_lookup(&tree, i) == &entries[i]);
+    }
+    radix_tree_destroy(&tree);
+    CHECK(tree.root == NULL && allocated == 0);
+
+    // running out of memory part way leaves the tree as it was, both when
+    // it's empty and when it has to grow
+    for (int64_t fail_after = 0; fail_after < RADIX_TREE_MAX_HEIGHT; fail_after++)
+    {
+        allocs_left = fail_after;
+        CHECK(radix_tree_insert(&tree, UINT64_MAX, &entries[0]) == -ENOMEM);
+        allocs_left = -1;
+        CHECK(tree.root == NULL && tree.height == 0 && allocated == 0);
+    }
+    CHECK(radix_tree_insert(&tree, 5, &entries[5]) == 0);
+    int64_t before = allocated;
+    for (int64_t fail_after = 0; fail_after < 2 * RADIX_TREE_MAX_HEIGHT - 2; fail_after++)
+    {
+        allocs_left = fail_after;
+        CHECK(radix_tree_insert(&tree, UINT64_MAX, &entries[0]) == -ENOMEM);
+        allocs_left = -1;
+        CHECK(tree.height == 1 && tree.count == 1 && allocated == before);
+        CHECK(radix_tree_lookup(&tree, 5) == &entries[5]);
+    }
+    CHECK(radix_tree_insert(&tree, UINT64_MAX, &entries[0]) == 0);
+    CHECK(radix_tree_lookup(&tree, 5) == &entries[5] && radix_tree_lookup(&tree, UINT64_MAX) == &entries[0]);
+    radix_tree_destroy(&tree);
+    CHECK(allocated == 0);
+}
+
+int main()
+{
+    test_list();
+    test_hashtable();
+    test_rbtree();
+    test_radix();
+    CHECK(allocated == 0);
+
+    if (failures != 0)
+    {
+        printf("kernel/lib: %d checks failed\n", failures);
+        return 1;
+    }
+    printf("kernel/lib: all tests passed\n");
+    return 0;
+}
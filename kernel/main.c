@@ -24,10 +24,30 @@
 #include <tty.h>
 #include <pipe.h>
 #include <multiboot.h>
+#include <heap_profile.h>
+#include <lock.h>
+#include <workqueue.h>
+#include <softirq.h>
+#include <timer.h>
+#include <clock.h>
+#include <acpi.h>
+#include <apic.h>
+#include <smp.h>
+#include <preempt.h>
+#include <fpu.h>
+#include <futex.h>
+#include <exec_cache.h>
 
 void __attribute__((noreturn, force_align_arg_pointer)) kmain(kernel_info_t *info) {
+    // GS has to point at the boot CPU's per-CPU area before anything
+    // touches current_process or current_pml4
+    smp_init_bsp();
+
     multiboot_init(info);
 
+    // user processes get the FPU lazily, the kernel never touches it
+    fpu_init();
+
     info = (kernel_info_t *)((uint64_t)info + VIRT_MEM_OFFSET);
 
     serial_printf("Initializing syscall table...\n");
@@ -39,14 +59,30 @@ void __attribute__((noreturn, force_align_arg_pointer)) kmain(kernel_info_t *inf
 
     process_init();
 
+    serial_printf("Initializing APICs...\n");
+    acpi_init();
+    apic_init();
+
+    serial_printf("Initializing timer...\n");
+    timer_init();
+    clock_init();
+
+    serial_printf("Starting application processors...\n");
+    smp_init();
+
     // Set up filesystem and devices
     filesystem_init(init_ramdisk_device((uint64_t)ramdisk_addr + VIRT_MEM_OFFSET));
     init_device_device();
     init_fb_device();
+    heap_profile_init();
+    lock_stats_init();
+    exec_cache_init();
+    elf_binfmt_init();
     keyboard_install();
     mouse_init();
     tty_init();
     pipe_init();
+    futex_init();
 
     int fd = kfopen("/mnt/ramdisk/bin/init", 0, 0);
     if (fd < 0) {
@@ -60,7 +96,7 @@ void __attribute__((noreturn, force_align_arg_pointer)) kmain(kernel_info_t *inf
         } else {
             page_directory_t *pml4 = clone_page_directory(current_pml4);
 
-            elf_info_t info = load_elf64(buf, pml4);
+            elf_info_t info = load_elf64(buf, pml4, 0);
             kfclose(fd);
 
             if (info.status != 0) {
@@ -69,9 +105,13 @@ void __attribute__((noreturn, force_align_arg_pointer)) kmain(kernel_info_t *inf
                 while (1);
             }
 
-            process_t *new = create_process((void *)info.entry, 0x10000, pml4, false, info.regions);
+            address_space_t *vm = address_space_create(pml4, info.regions);
+            vm->brk = info.max_addr;
+            process_t *new = create_process((void *)info.entry, 0x10000, vm, false);
+            // init leads the first process group, which its children join
+            new->pgid = new->pid;
 
-            new->brk_start = info.max_addr;
+            process_rss_add(new, info.pages);
 
             add_process(new);
 
@@ -80,10 +120,27 @@ void __attribute__((noreturn, force_align_arg_pointer)) kmain(kernel_info_t *inf
         kfree(buf);
     }
 
+    // kernel threads start after init, so that init gets PID 1. Nothing
+    // queues work before interrupts are enabled.
+    workqueue_init();
+    reclaim_init();
+
     enableBackground(true);
 
     ASM_ENABLE_INTERRUPTS;
 
-    // Loop indefinitely
-    while (1);
+    // This is now the idle process, only scheduled when nothing else can run.
+    // Sleep until the next interrupt instead of spinning.
+    while (1)
+    {
+        // a process that blocked in the kernel may have left softirqs
+        // pending, such as work queued for a kernel thread
+        ASM_DISABLE_INTERRUPTS;
+        softirq_run();
+        if (need_resched())
+        {
+            preempt_schedule();
+        }
+        ASM_SAFE_HALT;
+    }
 }
\ No newline at end of file